@@ -17,6 +17,10 @@ static void print_input(user_inp *inp)
 	printf("Input File = %s\n", inp->filename);
 	if(inp->op_flags & LIST_FLAG)
 		printf("list versions = True\n");
+	if(inp->op_flags & STATS_FLAG)
+		printf("show stats = True\n");
+	if(inp->op_flags & UNDELETE_FLAG)
+		printf("undelete = True\n");
 	if(inp->op_flags & DELETE_FLAG)
 		printf("delete version args = %s\n",inp->delete_arg);
 	if(inp->op_flags & VIEW_FLAG)
@@ -33,7 +37,7 @@ static void print_input(user_inp *inp)
  */
 void display_help(void)
 {
-	printf("<USAGE>\n\t\t ./bkcpts -l -d <newest,oldest,all> -v <newest,oldest,N> -r <newest,N> \"FILE\" \n\n");
+	printf("<USAGE>\n\t\t ./bkcpts -l -s -u -d <newest,oldest,all> -v <newest,oldest,N> -r <newest,N> \"FILE\" \n\n");
 	printf("eg ./bkpctl -l <file>\n");
 	printf("=>Only combination supported is with <any option> -l\n");
 	printf("Options:\n");
@@ -41,6 +45,8 @@ void display_help(void)
 	printf("-v [N] : view backup versions\n");
 	printf("-d [newest,oldest,all] : delete backup versions\n");
 	printf("-r [newest,N] : restore backup version\n");
+	printf("-s : show backup stats of the mount holding the file\n");
+	printf("-u : bring back the file (deleted with bkp_unlink=trash) from the trash\n");
 	printf("=> Combination of multiple options not supported except for -l option\n");
 	printf("=> Options that take N as argument implies N = version number\n");
 	printf("=> File is MANDATORY ARGUMENT\n");
@@ -233,7 +239,8 @@ int view_backup_version(int fd, user_inp *input)
 		in_arg->offset = offset;
 		
 		total_bytes_left -= bytes_to_copy;
-		printf("%s", (char*)msg->buff);	
+		/* versions may hold NULs (holes, binary data), write the bytes as they are */
+		fwrite(msg->buff, 1, bytes_to_copy, stdout);
 	}
 
 out:
@@ -319,12 +326,105 @@ out:
 	return num_vers;
 }
 
+/* @brief: get the backup counters of the mount holding the file
+ * and prints them to console
+ */
+int show_stats(int fd)
+{
+	int rc = STATUS_OK;
+	struct bkpfs_stats stats;
+	struct ioctl_args args;
+
+	memset(&stats, 0, sizeof(stats));
+	memset(&args, 0, sizeof(args));
+	args.buff = &stats;
+	args.buff_size = sizeof(stats);
+	rc = ioctl(fd, IOCTL_GET_STATS, &args);
+	if(rc < 0) {
+		printf("ERROR::failed to get backup stats\n");
+		return STATUS_ERR;
+	}
+
+	printf("inline backups   : %llu\n", stats.inline_bkps);
+	printf("deferred backups : %llu\n", stats.deferred_bkps);
+	printf("backup rate      : %llu bytes/sec\n", stats.bkp_rate);
+	printf("uncached bytes   : %llu\n", stats.nocache_bytes);
+	printf("unchanged skips  : %llu\n", stats.unchanged_bkps);
+	printf("chunked bytes    : %llu\n", stats.chunk_bytes);
+	printf("new chunk bytes  : %llu\n", stats.chunk_new_bytes);
+	printf("deduped backups  : %llu\n", stats.dedup_bkps);
+	printf("compressed bytes : %llu -> %llu\n", stats.zip_raw_bytes,
+	       stats.zip_stored_bytes);
+	printf("packed versions  : %llu\n", stats.pack_bkps);
+	printf("inline versions  : %llu\n", stats.pack_inline_bkps);
+	printf("renamed-over     : %llu\n", stats.saved_bkps);
+	printf("trashed files    : %llu (%llu purged)\n", stats.trash_files,
+	       stats.trash_purged);
+	return rc;
+}
+
+/* @brief: bring the deleted file back from the trash of the mount, by
+ * asking its directory
+ */
+int undelete_file(user_inp *input)
+{
+	int rc = STATUS_OK;
+	int fd;
+	char *path, *name;
+	const char *dir;
+	struct undelete_args args;
+
+	path = strdup(input->filename);
+	if (!path)
+		return STATUS_ERR;
+	name = strrchr(path, '/');
+	if (!name) {
+		dir = ".";
+		name = path;
+	} else {
+		*name++ = '\0';
+		dir = (name - 1 == path) ? "/" : path;
+	}
+	if (strlen(name) >= sizeof(args.name)) {
+		printf("ERROR::file name too long: %s\n", name);
+		rc = STATUS_ERR;
+		goto out;
+	}
+	memset(&args, 0, sizeof(args));
+	strcpy(args.name, name);
+
+	fd = open(dir, O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		printf("ERROR::can't open directory: %s\n", dir);
+		rc = STATUS_ERR;
+		goto out;
+	}
+	if (ioctl(fd, IOCTL_UNDELETE, &args) < 0) {
+		if (errno == ENOENT)
+			printf("ERROR::%s is not in the trash\n", input->filename);
+		else if (errno == EEXIST)
+			printf("ERROR::%s exists\n", input->filename);
+		else
+			printf("ERROR::failed to undelete %s (errno=%d)\n",
+			       input->filename, errno);
+		rc = STATUS_ERR;
+	}
+	close(fd);
+out:
+	free(path);
+	return rc;
+}
+
 int handle_input(user_inp *input)
 {
 	/* Handle various option permutation/combination here */
 	int rc = STATUS_OK;
 	int fd, max_vers;
 
+	/* the file is gone, its directory is asked instead */
+	if (input->op_flags & UNDELETE_FLAG)
+		return undelete_file(input);
+
 	/* Open the file and start doing some actual work */
 	fd = open(input->filename, O_RDONLY);
 	if (fd < 0) {
@@ -372,6 +472,12 @@ int handle_input(user_inp *input)
 			goto out;
 	}
 
+	if(input->op_flags & STATS_FLAG) {
+		rc = show_stats(fd);
+		if (rc < 0)
+			goto out;
+	}
+
 out:
 	/* close the file before exiting from this function */
 	close(fd);
@@ -435,6 +541,18 @@ int validate_input_args(user_inp * input)
 			num_opts++;
 		}
 
+		if(input->op_flags & UNDELETE_FLAG) {
+#ifdef MYDEBUG
+			printf("Undelete option passed\n");
+#endif
+			if(num_opts || (input->op_flags & STATS_FLAG)) {
+				printf("ERROR::Option combination not supported\n");
+				status = STATUS_ERR;
+				break;
+			}
+			num_opts++;
+		}
+
 		if(num_opts > 2 || (num_opts == 2 && !(input->op_flags & LIST_FLAG))){
 			printf("ERROR::Option combination not supported\n");
 			status = STATUS_ERR;
@@ -456,7 +574,7 @@ int main(int argc, char *argv[])
 	/*
 	 * References: linux manual - getopt()
 	 */
-	const char* valid_opt = ":lhd:v:r:";
+	const char* valid_opt = ":lsuhd:v:r:";
 
 	while((opt = getopt(argc, argv, valid_opt)) != -1)
 	{
@@ -467,6 +585,16 @@ int main(int argc, char *argv[])
 				input->op_flags |= LIST_FLAG;
 				break;
 
+			/* Show stats */
+			case 's':
+				input->op_flags |= STATS_FLAG;
+				break;
+
+			/* Undelete */
+			case 'u':
+				input->op_flags |= UNDELETE_FLAG;
+				break;
+
 			/* Delete version */
 			case 'd': 
 				/* Empty Statement to make Compiler happy */
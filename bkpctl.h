@@ -33,6 +33,8 @@
 #define VIEW_FLAG			0x2
 #define RESTORE_FLAG		0x4
 #define LIST_FLAG			0x8
+#define STATS_FLAG			0x10
+#define UNDELETE_FLAG		0x20
 
 typedef struct user_ip_t
 {
@@ -0,0 +1,316 @@
+/*
+ * Copyright (c) 1998-2017 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2017 Stony Brook University
+ * Copyright (c) 2003-2017 The Research Foundation of SUNY
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/*
+ * Append fast path of the full backup format (bkp_append).
+ *
+ * When a file was only appended to since its last version, the new
+ * version is the last one plus the appended tail.  Instead of a new full
+ * copy, the tail is appended to the backup file that holds the data of the
+ * last version (the base), and the new version is an empty stub recording
+ * its length and which base it reads from.  A version then is the first
+ * <length> bytes of its base, which is only ever appended to, so the older
+ * versions sharing it stay intact.
+ *
+ * The length and base are kept in the BKPFS_VINFO_XATTR attribute of the
+ * lower backup file.  Versions without it are plain full copies.
+ * When the oldest version is a base, it is renamed over the stub after it
+ * which becomes the base of the remaining stubs: these always read from
+ * max(base_ver, start_ver).
+ */
+
+#include "bkpfs.h"
+
+#define BKPFS_VINFO_XATTR	"user.bkp_vinfo"
+
+#define BKPFS_VINFO_BASE	0x1	/* holds the data of its chain */
+#define BKPFS_VINFO_STUB	0x2	/* data lives in version base_ver */
+
+struct bkpfs_vinfo {
+	u32 flags;
+	s32 base_ver;
+	u64 length;	/* size of the user file at this version */
+};
+
+static int bkpfs_get_vinfo(struct file *file, struct bkpfs_vinfo *vinfo)
+{
+	ssize_t res;
+
+	res = vfs_getxattr(file->f_path.dentry, BKPFS_VINFO_XATTR, vinfo,
+			   sizeof(*vinfo));
+	if (res < 0)
+		return res;
+	if (res != sizeof(*vinfo))
+		return -EINVAL;
+	return 0;
+}
+
+static int bkpfs_set_vinfo(struct file *file, u32 flags, int base_ver,
+			   loff_t length)
+{
+	struct bkpfs_vinfo vinfo = {
+		.flags = flags,
+		.base_ver = base_ver,
+		.length = length,
+	};
+
+	return vfs_setxattr(file->f_path.dentry, BKPFS_VINFO_XATTR, &vinfo,
+			    sizeof(vinfo), 0);
+}
+
+/* @brief: remember that the user file was changed other than by appending.
+ *         pos is where a write started, old_size the size before it.
+ */
+void bkpfs_append_note(struct inode *inode, loff_t pos, loff_t old_size)
+{
+	if (pos < old_size)
+		WRITE_ONCE(BKPFS_I(inode)->bkp_overwritten, 1);
+}
+
+/* @brief: mark the newly copied version as the base of a chain */
+int bkpfs_append_mark_base(struct dentry *dentry, struct file *bkp_file,
+			   int ver, loff_t length)
+{
+	if (!BKPFS_SB(dentry->d_sb)->mnt_opts.bkp_append)
+		return 0;
+	return bkpfs_set_vinfo(bkp_file, BKPFS_VINFO_BASE, ver, length);
+}
+
+/* @brief: open the file holding the data of version ver.
+ * Input :
+ *			start_ver	-> oldest version, base of the stubs whose
+ *					   own base was dropped
+ * Output:	length	-> size of the user file at that version
+ * Return:	opened lower file or ERR_PTR
+ */
+struct file *bkpfs_append_open(struct dentry *dentry, int ver, int start_ver,
+			       loff_t *length)
+{
+	struct bkpfs_vinfo vinfo;
+	struct file *file;
+
+	file = bkpfs_open_version(dentry, ver, O_RDONLY);
+	if (IS_ERR(file))
+		return file;
+
+	if (bkpfs_get_vinfo(file, &vinfo)) {
+		*length = i_size_read(file_inode(file));
+		return file;
+	}
+	*length = vinfo.length;
+	if (!(vinfo.flags & BKPFS_VINFO_STUB))
+		return file;
+
+	fput(file);
+	return bkpfs_open_version(dentry, max(vinfo.base_ver, start_ver),
+				  O_RDONLY);
+}
+
+/* @brief: take the next version by appending the new tail of the user file
+ *         to the base of the last version.
+ * Return:	0, -EAGAIN when a full copy is needed, or -errno
+ */
+int bkpfs_append_backup(struct dentry *dentry)
+{
+	struct inode *inode = d_inode(dentry);
+	struct mnt_opt_info *opts = &BKPFS_SB(dentry->d_sb)->mnt_opts;
+	struct bkpfs_xattr_info xattr;
+	struct bkpfs_vinfo vinfo;
+	struct file *prev, *base, *stub, *src;
+	struct path lower_path;
+	loff_t length, size;
+	ssize_t res;
+	int base_ver, err;
+
+	/* appends from now on are checked against the new version */
+	if (xchg(&BKPFS_I(inode)->bkp_overwritten, 0))
+		return -EAGAIN;
+
+	err = bkpfs_get_xattr_info(dentry, &xattr);
+	if (err < 0)
+		return err;
+	if (xattr.cur_ver == xattr.start_ver)
+		return -EAGAIN;
+
+	prev = bkpfs_open_version(dentry, xattr.cur_ver - 1, O_RDONLY);
+	if (IS_ERR(prev))
+		return -EAGAIN;
+	err = bkpfs_get_vinfo(prev, &vinfo);
+	fput(prev);
+	if (err)
+		return -EAGAIN;
+
+	length = vinfo.length;
+	base_ver = xattr.cur_ver - 1;
+	if (vinfo.flags & BKPFS_VINFO_STUB)
+		base_ver = max(vinfo.base_ver, xattr.start_ver);
+
+	base = bkpfs_open_version(dentry, base_ver, O_WRONLY);
+	if (IS_ERR(base))
+		return -EAGAIN;
+	size = i_size_read(bkpfs_lower_inode(inode));
+	if (i_size_read(file_inode(base)) != length || size < length) {
+		err = -EAGAIN;
+		goto out_base;
+	}
+
+	bkpfs_get_lower_path(dentry, &lower_path);
+	src = dentry_open(&lower_path, O_RDONLY | O_LARGEFILE, current_cred());
+	bkpfs_put_lower_path(dentry, &lower_path);
+	if (IS_ERR(src)) {
+		err = PTR_ERR(src);
+		goto out_base;
+	}
+
+	res = bkpfs_copy_range(dentry->d_sb, src, length, base, length,
+			       size - length);
+	fput(src);
+	if (res != size - length) {
+		err = res < 0 ? res : -EIO;
+		goto out_trunc;
+	}
+
+	stub = bkpfs_open_version(dentry, xattr.cur_ver, O_WRONLY | O_CREAT);
+	if (IS_ERR(stub)) {
+		err = PTR_ERR(stub);
+		goto out_trunc;
+	}
+	err = bkpfs_set_vinfo(stub, BKPFS_VINFO_STUB, base_ver, size);
+	fput(stub);
+	if (err)
+		goto out_trunc;
+	fput(base);
+
+	return bkpfs_update_after_write(dentry, &xattr,
+			opts->maxvers ? opts->maxvers : DEFAULT_MAXVERS);
+
+out_trunc:
+	/* the older versions must not see a torn tail */
+	vfs_truncate(&base->f_path, length);
+out_base:
+	fput(base);
+	if (err != -EAGAIN)
+		WRITE_ONCE(BKPFS_I(inode)->bkp_overwritten, 1);
+	return err;
+}
+
+/* @brief: drop the oldest version ver.  A base still used by the stub after
+ *         it is renamed over that stub instead of being deleted.
+ */
+int bkpfs_append_drop_oldest(struct inode *dir, struct dentry *dentry,
+			     int ver, int cur_ver)
+{
+	struct bkpfs_vinfo vinfo;
+	struct file *file;
+	struct dentry *lower_dir, *old_dentry, *new_dentry;
+	struct path lower_parent_path;
+	char *name;
+	int err;
+
+	if (ver + 1 >= cur_ver)
+		goto delete;
+	file = bkpfs_open_version(dentry, ver + 1, O_RDONLY);
+	if (IS_ERR(file))
+		goto delete;
+	err = bkpfs_get_vinfo(file, &vinfo);
+	fput(file);
+	if (err || !(vinfo.flags & BKPFS_VINFO_STUB) || vinfo.base_ver > ver)
+		goto delete;
+
+	name = kmalloc(NAME_MAX, GFP_KERNEL);
+	if (!name)
+		return -ENOMEM;
+	err = bkpfs_bkp_dir(dentry, &lower_parent_path, 0);
+	if (err)
+		goto out_name;
+	lower_dir = lower_parent_path.dentry;
+
+	bkpfs_bkp_name(dentry, ver, name);
+	old_dentry = bkpfs_get_bkp_dentry(lower_dir, name, false);
+	if (IS_ERR(old_dentry)) {
+		err = PTR_ERR(old_dentry);
+		goto out_path;
+	}
+	bkpfs_bkp_name(dentry, ver + 1, name);
+	new_dentry = bkpfs_get_bkp_dentry(lower_dir, name, false);
+	if (IS_ERR(new_dentry)) {
+		err = PTR_ERR(new_dentry);
+		goto out_old;
+	}
+
+	lock_rename(lower_dir, lower_dir);
+	err = vfs_rename(d_inode(lower_dir), old_dentry, d_inode(lower_dir),
+			 new_dentry, NULL, 0);
+	unlock_rename(lower_dir, lower_dir);
+	dput(new_dentry);
+	if (err)
+		goto out_old;
+
+	/* the moved base now answers for the stub it replaced */
+	file = bkpfs_open_version(dentry, ver + 1, O_RDONLY);
+	if (IS_ERR(file)) {
+		err = PTR_ERR(file);
+		goto out_old;
+	}
+	err = bkpfs_set_vinfo(file, BKPFS_VINFO_BASE, ver + 1, vinfo.length);
+	fput(file);
+
+out_old:
+	dput(old_dentry);
+out_path:
+	path_put(&lower_parent_path);
+out_name:
+	kfree(name);
+	return err;
+
+delete:
+	return delete_backup_file(dir, dentry, ver);
+}
+
+/* @brief: drop the newest version ver.  When it was a stub, the tail it
+ *         appended is cut off its base so the base can be appended to again.
+ */
+int bkpfs_append_drop_newest(struct inode *dir, struct dentry *dentry,
+			     int ver, int start_ver)
+{
+	struct bkpfs_vinfo vinfo;
+	struct file *file, *base;
+	loff_t length;
+	int base_ver, err;
+
+	/* a small version is no stub, nothing to cut */
+	if (bkpfs_small_is(dentry, ver))
+		return delete_backup_file(dir, dentry, ver);
+
+	file = bkpfs_open_version(dentry, ver, O_RDONLY);
+	if (IS_ERR(file))
+		return PTR_ERR(file);
+	err = bkpfs_get_vinfo(file, &vinfo);
+	fput(file);
+
+	err = delete_backup_file(dir, dentry, ver);
+	if (err || ver == start_ver || !(vinfo.flags & BKPFS_VINFO_STUB))
+		return err;
+
+	base_ver = max(vinfo.base_ver, start_ver);
+	file = bkpfs_append_open(dentry, ver - 1, start_ver, &length);
+	if (IS_ERR(file))
+		return 0;
+	fput(file);
+
+	base = bkpfs_open_version(dentry, base_ver, O_WRONLY);
+	if (IS_ERR(base))
+		return 0;
+	if (i_size_read(file_inode(base)) > length)
+		err = vfs_truncate(&base->f_path, length);
+	fput(base);
+	return err;
+}
@@ -0,0 +1,286 @@
+/*
+ * Copyright (c) 1998-2017 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2017 Stony Brook University
+ * Copyright (c) 2003-2017 The Research Foundation of SUNY
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/*
+ * Asynchronous backup pipeline (bkp_mode=async).
+ *
+ * write() only does the lower write and queues the inode's backup job on a
+ * per-mount workqueue; the copy is taken by the worker.  Every inode owns a
+ * single work item, so writes landing while its job is still pending merge
+ * into that job: the worker copies the file as it is when it runs, which
+ * already holds all of them.  Writers are throttled once bkp_queue_depth
+ * jobs are waiting, so the backlog (and the pinned inodes) stays bounded.
+ *
+ * With bkp_quiet_ms the version is not taken per write at all: each write
+ * re-arms a per-inode delayed job, which only runs once the file has been
+ * left alone for the quiet period, or bkp_max_delay_ms after the first
+ * write of the burst so a file written non-stop still gets versions.
+ * Armed inodes are kept on a per-mount list since a delayed job whose
+ * timer did not fire yet is not seen by flush_workqueue().
+ */
+
+#include "bkpfs.h"
+
+/* @brief: take the version a job was queued for and drop its references */
+static void bkpfs_run_backup(struct inode *inode)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(inode);
+	struct dentry *dentry;
+	const struct cred *cred, *old_cred;
+	int err;
+
+	spin_lock(&info->bkp_lock);
+	cred = info->bkp_cred;
+	dentry = info->bkp_dentry;
+	info->bkp_cred = NULL;
+	info->bkp_dentry = NULL;
+	spin_unlock(&info->bkp_lock);
+
+	/* nothing handed over: a run that started after this job's write
+	 * covered it
+	 */
+	if (!cred)
+		goto out;
+
+	/* backups are created with the creds of the writer, as in sync mode */
+	old_cred = override_creds(cred);
+	err = bkpfs_backup_once(dentry);
+	revert_creds(old_cred);
+	if (err < 0)
+		printk(KERN_INFO "ERROR:: async backup of %s failed, err=%d\n",
+		       dentry->d_name.name, err);
+	dput(dentry);
+	put_cred(cred);
+out:
+	iput(inode);
+}
+
+/* @brief: worker taking the backup of one queued inode */
+static void bkpfs_backup_work(struct work_struct *work)
+{
+	struct bkpfs_inode_info *info;
+	struct bkpfs_sb_info *sbi;
+
+	info = container_of(work, struct bkpfs_inode_info, bkp_work);
+	sbi = BKPFS_SB(info->vfs_inode.i_sb);
+
+	/* the job left the queue: let a throttled writer in */
+	atomic_dec(&sbi->bkp_queued);
+	wake_up(&sbi->bkp_waitq);
+
+	bkpfs_run_backup(&info->vfs_inode);
+}
+
+/* @brief: worker taking the version once the file went quiet */
+static void bkpfs_quiet_work(struct work_struct *work)
+{
+	struct bkpfs_inode_info *info;
+	struct bkpfs_sb_info *sbi;
+
+	info = container_of(to_delayed_work(work), struct bkpfs_inode_info,
+			    bkp_dwork);
+	sbi = BKPFS_SB(info->vfs_inode.i_sb);
+
+	/* the burst is over, the next write starts a new one */
+	spin_lock(&sbi->bkp_armed_lock);
+	list_del_init(&info->bkp_armed);
+	spin_unlock(&sbi->bkp_armed_lock);
+
+	bkpfs_run_backup(&info->vfs_inode);
+}
+
+/* @brief: hand the creds of the current writer and the dentry it wrote
+ *         through over to the queued job.  The dentry stays pinned until
+ *         the job ran, so the backup is taken under the name written to.
+ */
+static void bkpfs_set_backup_cred(struct dentry *dentry)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(d_inode(dentry));
+	const struct cred *old_cred = get_current_cred();
+	struct dentry *old_dentry = dget(dentry);
+
+	spin_lock(&info->bkp_lock);
+	swap(info->bkp_cred, old_cred);
+	swap(info->bkp_dentry, old_dentry);
+	spin_unlock(&info->bkp_lock);
+	if (old_cred)
+		put_cred(old_cred);
+	dput(old_dentry);
+}
+
+/* @brief: set up the inode's work item, called from alloc_inode */
+void bkpfs_init_backup_work(struct inode *inode)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(inode);
+
+	INIT_WORK(&info->bkp_work, bkpfs_backup_work);
+	INIT_DELAYED_WORK(&info->bkp_dwork, bkpfs_quiet_work);
+	INIT_LIST_HEAD(&info->bkp_armed);
+	spin_lock_init(&info->bkp_lock);
+	mutex_init(&info->bkp_meta_lock);
+	info->bkp_req_seq = 0;
+	info->bkp_done_seq = 0;
+	info->bkp_running = 0;
+	info->bkp_last_err = 0;
+	init_waitqueue_head(&info->bkp_flight_wq);
+}
+
+/* @brief: create the backup workqueue of the mount */
+int bkpfs_init_backup_wq(struct super_block *sb)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+
+	atomic_set(&sbi->bkp_queued, 0);
+	init_waitqueue_head(&sbi->bkp_waitq);
+	INIT_LIST_HEAD(&sbi->bkp_armed);
+	spin_lock_init(&sbi->bkp_armed_lock);
+	sbi->bkp_wq = alloc_workqueue("bkpfs_bkp", WQ_MEM_RECLAIM, 0);
+	if (!sbi->bkp_wq)
+		return -ENOMEM;
+	return 0;
+}
+
+/* @brief: wait for the queued backups and free the workqueue */
+void bkpfs_destroy_backup_wq(struct super_block *sb)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+
+	if (!sbi || !sbi->bkp_wq)
+		return;
+	destroy_workqueue(sbi->bkp_wq);
+	sbi->bkp_wq = NULL;
+}
+
+/* @brief: queue a backup of the file, merging with its pending job if any.
+ * Input :
+ *			dentry	-> bkpfs dentry of the file just written to
+ * Return:	0 or -errno
+ */
+int bkpfs_queue_backup(struct dentry *dentry)
+{
+	struct inode *inode = d_inode(dentry);
+	struct bkpfs_sb_info *sbi = BKPFS_SB(inode->i_sb);
+	struct bkpfs_inode_info *info = BKPFS_I(inode);
+	int depth;
+	int err;
+
+	if (!sbi->bkp_wq)
+		return -EINVAL;
+
+	/* a job not started yet will copy this write too */
+	if (work_pending(&info->bkp_work))
+		goto set_cred;
+
+	depth = sbi->mnt_opts.bkp_queue_depth ?
+		sbi->mnt_opts.bkp_queue_depth : DEFAULT_BKP_QUEUE_DEPTH;
+	err = wait_event_killable(sbi->bkp_waitq,
+				  atomic_read(&sbi->bkp_queued) < depth);
+	if (err)
+		return err;
+
+set_cred:
+	bkpfs_set_backup_cred(dentry);
+
+	ihold(inode);
+	atomic_inc(&sbi->bkp_queued);
+	if (!queue_work(sbi->bkp_wq, &info->bkp_work)) {
+		/* merged with the job another writer queued meanwhile */
+		atomic_dec(&sbi->bkp_queued);
+		iput(inode);
+	}
+	return 0;
+}
+
+/* @brief: (re)arm the quiet period timer of the file after a write.
+ * Input :
+ *			dentry	-> bkpfs dentry of the file just written to
+ * Return:	0 or -errno
+ */
+int bkpfs_defer_backup(struct dentry *dentry)
+{
+	struct inode *inode = d_inode(dentry);
+	struct bkpfs_sb_info *sbi = BKPFS_SB(inode->i_sb);
+	struct bkpfs_inode_info *info = BKPFS_I(inode);
+	unsigned long quiet, max_delay, delay, deadline, now;
+
+	if (!sbi->bkp_wq)
+		return -EINVAL;
+
+	quiet = msecs_to_jiffies(sbi->mnt_opts.bkp_quiet_ms);
+	max_delay = msecs_to_jiffies(sbi->mnt_opts.bkp_max_delay_ms ?
+				     sbi->mnt_opts.bkp_max_delay_ms :
+				     sbi->mnt_opts.bkp_quiet_ms *
+				     DEFAULT_BKP_MAX_DELAY_FACTOR);
+
+	/* the first write of a burst starts the max delay clock */
+	now = jiffies;
+	spin_lock(&sbi->bkp_armed_lock);
+	if (list_empty(&info->bkp_armed)) {
+		info->bkp_first_dirty = now;
+		list_add_tail(&info->bkp_armed, &sbi->bkp_armed);
+	}
+	deadline = info->bkp_first_dirty + max_delay;
+	spin_unlock(&sbi->bkp_armed_lock);
+
+	delay = quiet;
+	if (time_after(now + delay, deadline))
+		delay = time_after(deadline, now) ? deadline - now : 0;
+
+	bkpfs_set_backup_cred(dentry);
+
+	/* an armed job already holds its reference */
+	ihold(inode);
+	if (mod_delayed_work(sbi->bkp_wq, &info->bkp_dwork, delay))
+		iput(inode);
+	return 0;
+}
+
+/* @brief: wait for the pending backup of inode, if any.  A version still
+ *         waiting for its quiet period is taken right away.
+ */
+void bkpfs_flush_backup(struct inode *inode)
+{
+	if (!BKPFS_SB(inode->i_sb)->bkp_wq)
+		return;
+	flush_delayed_work(&BKPFS_I(inode)->bkp_dwork);
+	flush_work(&BKPFS_I(inode)->bkp_work);
+}
+
+/* @brief: run the queued backups while the mount can still take them,
+ *         their inode references must be gone before the inodes are evicted.
+ */
+void bkpfs_kill_sb(struct super_block *sb)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+	struct bkpfs_inode_info *info;
+
+	if (!sbi || !sbi->bkp_wq)
+		goto out_zip;
+
+	/* versions waiting for a quiet period are not queued yet */
+	spin_lock(&sbi->bkp_armed_lock);
+	while (!list_empty(&sbi->bkp_armed)) {
+		info = list_first_entry(&sbi->bkp_armed,
+					struct bkpfs_inode_info, bkp_armed);
+		list_del_init(&info->bkp_armed);
+		spin_unlock(&sbi->bkp_armed_lock);
+		flush_delayed_work(&info->bkp_dwork);
+		spin_lock(&sbi->bkp_armed_lock);
+	}
+	spin_unlock(&sbi->bkp_armed_lock);
+
+	flush_workqueue(sbi->bkp_wq);
+out_zip:
+	/* recompressions queued by those backups pin inodes and dentries too */
+	if (sbi && sbi->zip_wq)
+		flush_workqueue(sbi->zip_wq);
+	generic_shutdown_super(sb);
+}
@@ -27,6 +27,11 @@
 #include <linux/sched.h>
 #include <linux/xattr.h>
 #include <linux/exportfs.h>
+#include <linux/workqueue.h>
+#include <linux/wait.h>
+#include <linux/cred.h>
+#include <linux/interval_tree.h>
+#include <linux/hashtable.h>
 
 /* the file system name */
 #define BKPFS_NAME "bkpfs"
@@ -66,21 +71,155 @@ extern struct inode *bkpfs_iget(struct super_block *sb,
 extern int bkpfs_interpose(struct dentry *dentry, struct super_block *sb,
 			    struct path *lower_path);
 
+/* defaults of the mount options */
+#define DEFAULT_BKP_THRESHOLD 32
+#define DEFAULT_MAXVERS 10
+
+/* backup formats selected with the bkp_format mount option */
+#define BKP_FORMAT_FULL		0	/* full copy of the file per version */
+#define BKP_FORMAT_UNDO		1	/* pre-images of the overwritten ranges */
+#define BKP_FORMAT_DELTA	2	/* extents written since the last version */
+#define BKP_FORMAT_CHUNK	3	/* manifest of chunks in a per-mount store */
+#define BKP_FORMAT_COMPRESS	4	/* full copy compressed by chunks */
+
+/* delta format: a checkpoint (full copy) every this many versions */
+#define DEFAULT_BKP_CKPT_EVERY	8
+
+/* when the backup copy is taken, selected with the bkp_mode mount option */
+#define BKP_MODE_SYNC		0	/* inside write(), before it returns */
+#define BKP_MODE_ASYNC		1	/* by the per-mount backup workqueue */
+
+/* what makes a version, selected with the bkp_trigger mount option */
+#define BKP_TRIGGER_WRITE	0	/* every write crossing bkp_threshold */
+#define BKP_TRIGGER_CLOSE	1	/* close of a file written since its open */
+#define BKP_TRIGGER_FSYNC	2	/* fsync of a file written since the last one */
+
+/* default bound on backup jobs queued per mount in async mode */
+#define DEFAULT_BKP_QUEUE_DEPTH	64
+
+/* bkp_max_delay_ms defaults to this many quiet periods */
+#define DEFAULT_BKP_MAX_DELAY_FACTOR	10
+
+/* compressed format: codec names, inline codec and when to recompress */
+#define BKPFS_ZIP_ALG_LEN	16
+#define DEFAULT_BKP_COMPRESS	"lz4"
+#define DEFAULT_BKP_RECOMPRESS_AFTER	2
+
+/* small versions: upper bounds of bkp_pack and bkp_pack_inline, default of
+ * the latter
+ */
+#define BKPFS_PACK_MAX		(1024 * 1024)
+#define BKPFS_PACK_INLINE_MAX	2048
+#define DEFAULT_BKP_PACK_INLINE	256
+
+/* what unlink does with the versions, selected with the bkp_unlink mount
+ * option
+ */
+#define BKP_UNLINK_DELETE	0	/* deletes them along with the file */
+#define BKP_UNLINK_TRASH	1	/* moves them to the trash with the file */
+
+/* default of bkp_trash_rate, in files purged per second */
+#define DEFAULT_BKP_TRASH_RATE	256
+
+/* where the versions of a file created are kept, selected with the
+ * bkp_layout mount option
+ */
+#define BKP_LAYOUT_NAME		0	/* next to it, named after it */
+#define BKP_LAYOUT_INODE	1	/* in a directory named by its inode */
+
+/* upper bound of the bkp_copy_threads mount option */
+#define MAX_BKP_COPY_THREADS	64
+
 /* mount options for bkpfs */
 struct mnt_opt_info{
         int maxvers;
         int bkp_threshold;
+        int bkp_format;
+        int bkp_mode;
+        int bkp_queue_depth;
+        int bkp_trigger;
+        unsigned int bkp_quiet_ms;
+        unsigned int bkp_max_delay_ms;
+        u64 bkp_threshold_cum;
+        int bkp_change_pct;
+        int bkp_ckpt_every;
+        int bkp_append;
+        unsigned int bkp_max_write_lat_us;
+        int bkp_copy_threads;
+        int bkp_nocache;
+        int bkp_dedup;
+        char bkp_compress[BKPFS_ZIP_ALG_LEN];
+        char bkp_recompress[BKPFS_ZIP_ALG_LEN];
+        int bkp_recompress_after;
+        unsigned int bkp_pack;
+        unsigned int bkp_pack_inline;
+        int bkp_unlink;
+        unsigned int bkp_trash_grace;
+        unsigned int bkp_trash_rate;
+        int bkp_layout;
+        int bkp_skip_same;
 };
 
 /* file private data */
 struct bkpfs_file_info {
 	struct file *lower_file;
 	const struct vm_operations_struct *lower_vm_ops;
+	atomic_t bkp_dirty;	/* written since the last version (bkp_trigger) */
+};
+
+/* Fields are only ever appended, an older (shorter) value reads back with
+ * the new fields zeroed.
+ */
+struct bkpfs_xattr_info {
+	int start_ver;
+	int cur_ver;
+	int ckpt_ver;	/* delta format: newest checkpoint */
+	int fp_ver;	/* full format: version fp_crc and fp_size are of */
+	u32 fp_crc;	/* crc32c of the content of version fp_ver */
+	u64 fp_size;	/* size of version fp_ver */
+	u64 id_ino;	/* bkp_layout=inode: lower inode naming the versions */
+	u32 id_gen;	/* and its generation */
 };
 
+/* state of the version info cached in bkpfs_inode_info */
+#define BKPFS_VER_UNKNOWN	0	/* not loaded from the xattr yet */
+#define BKPFS_VER_CACHED	1	/* ver holds the xattr value */
+#define BKPFS_VER_NONE		2	/* the file has no version info */
+
 /* bkpfs inode data in memory */
 struct bkpfs_inode_info {
 	struct inode *lower_inode;
+	atomic64_t bkp_changed;		/* bytes written since the last version */
+	struct mutex dt_lock;		/* protects dt_root and dt_valid */
+	struct rb_root_cached dt_root;	/* extents written since the last version */
+	int dt_valid;			/* dt_root saw every write since then */
+	int bkp_overwritten;		/* changed other than by appends since */
+	struct work_struct bkp_work;	/* pending async backup of this file */
+	struct delayed_work bkp_dwork;	/* version waiting for a quiet period */
+	struct list_head bkp_armed;	/* on bkpfs_sb_info.bkp_armed if so */
+	unsigned long bkp_first_dirty;	/* jiffies of the burst's first write */
+	spinlock_t bkp_lock;		/* protects bkp_cred/dentry, zip_cred/dentry, bkp_*_seq */
+	const struct cred *bkp_cred;	/* creds of the writer that queued it */
+	struct dentry *bkp_dentry;	/* pinned dentry it wrote through */
+	struct mutex bkp_meta_lock;	/* serializes updates of the versions */
+	u64 bkp_req_seq;		/* backups asked for so far */
+	u64 bkp_done_seq;		/* requests covered by the last backup */
+	int bkp_running;		/* a backup of the file is being taken */
+	int bkp_last_err;		/* result of the last backup */
+	wait_queue_head_t bkp_flight_wq;	/* waiting for bkp_running to clear */
+	seqlock_t ver_lock;		/* protects ver_state and ver */
+	int ver_state;			/* BKPFS_VER_* */
+	struct bkpfs_xattr_info ver;	/* write-through copy of the xattr */
+	atomic_t bkp_mmap_dirty;	/* stored to through a mapping since */
+	spinlock_t undo_lock;		/* protects undo_pages, undo_cred/dentry */
+	struct list_head undo_pages;	/* pre-images saved by page_mkwrite */
+	int undo_nr_pages;		/* entries on undo_pages */
+	const struct cred *undo_cred;	/* creds writing them out */
+	struct dentry *undo_dentry;	/* pinned dentry they are written to */
+	struct work_struct undo_work;	/* writes undo_pages to the slot */
+	struct work_struct zip_work;	/* recompresses the old versions */
+	const struct cred *zip_cred;	/* creds doing it */
+	struct dentry *zip_dentry;	/* pinned dentry of the versions */
 	struct inode vfs_inode;
 };
 
@@ -90,16 +229,215 @@ struct bkpfs_dentry_info {
 	struct path lower_path;
 };
 
+/* copy offloads of the lower file system (bits of bkpfs_sb_info.caps) */
+#define BKPFS_CAP_CLONE		0	/* extent sharing, ->remap_file_range */
+#define BKPFS_CAP_DIRECT	1	/* ->direct_IO, for bkp_nocache */
+
+/* flags of a copy (copy.c) */
+#define BKPFS_COPY_RESTORE	0x1	/* dst is the user file */
+
+/* fan directories of the chunk store, one per first byte of the hash */
+#define BKPFS_CHUNK_FANS	256
+
 /* bkpfs super-block data in memory */
 struct bkpfs_sb_info {
 	struct super_block *lower_sb;
 	struct mnt_opt_info mnt_opts;
+	unsigned long caps;	/* probed at mount, cleared if found unsupported */
+	struct workqueue_struct *bkp_wq;	/* async backups, AIO completions */
+	atomic_t bkp_queued;		/* jobs on bkp_wq not yet started */
+	wait_queue_head_t bkp_waitq;	/* writers throttled on bkp_queued */
+	struct list_head bkp_armed;	/* inodes with a quiet period running */
+	spinlock_t bkp_armed_lock;	/* protects bkp_armed */
+	u64 bkp_rate;			/* recent backup throughput, bytes/sec */
+	atomic64_t bkp_inline;		/* backups taken by the writer */
+	atomic64_t bkp_deferred;	/* backups handed to bkp_wq */
+	struct workqueue_struct *copy_wq;	/* parallel copy workers */
+	atomic64_t bkp_nocache_bytes;	/* copied around the page cache */
+	atomic64_t bkp_unchanged;	/* backups skipped, same as the newest */
+	struct mutex chunk_locks[BKPFS_CHUNK_FANS];	/* per fan directory */
+	struct path chunk_root;		/* .bkp_store in the lower root */
+	const struct cred *chunk_cred;	/* creds the store is accessed with */
+	struct crypto_shash *chunk_tfm;	/* names the chunks */
+	atomic64_t chunk_bytes;		/* version bytes cut into chunks */
+	atomic64_t chunk_new_bytes;	/* of which stored as new chunks */
+	spinlock_t dedup_lock;		/* protects the dedup_* index */
+	DECLARE_HASHTABLE(dedup_hash, 10);	/* full backups by size */
+	struct list_head dedup_lru;	/* the same, most recently used first */
+	int dedup_nr;			/* entries in the index */
+	atomic64_t bkp_deduped;		/* versions linked to a backup */
+	struct workqueue_struct *zip_wq;	/* background recompression */
+	atomic64_t zip_raw_bytes;	/* version bytes compressed */
+	atomic64_t zip_stored_bytes;	/* what they were stored in */
+	struct mutex pack_lock;		/* serializes updates of the packs */
+	const struct cred *pack_cred;	/* creds the packs are accessed with */
+	atomic64_t pack_bkps;		/* versions appended to a pack */
+	atomic64_t pack_inline_bkps;	/* versions kept in an attribute */
+	atomic64_t bkp_saved;		/* replaced files kept by a rename */
+	struct mutex trash_lock;	/* serializes updates of the trash */
+	struct path trash_root;		/* .bkp_trash in the lower root */
+	const struct cred *trash_cred;	/* creds the trash is accessed with */
+	struct delayed_work trash_work;	/* purges the trash */
+	struct super_block *trash_sb;	/* the mount it purges for */
+	loff_t trash_pos;		/* where the last purge pass stopped */
+	atomic64_t trash_id;		/* names the next file trashed */
+	atomic64_t trash_files;		/* unlinked files moved to the trash */
+	atomic64_t trash_purged;	/* of which purged since */
+	struct path vers_root;		/* .bkp_vers in the lower root */
+	const struct cred *vers_cred;	/* creds it is accessed with */
 };
 
-struct bkpfs_xattr_info {
-	int start_ver;
-	int cur_ver;
-};
+/* backup file helpers (file.c) */
+extern void bkpfs_bkp_name(struct dentry *dentry, int ver, char *buf);
+extern struct dentry* bkpfs_get_bkp_dentry(struct dentry *lower_parent_dir,
+					   const char* name, int is_neg_dentry);
+extern struct file *bkpfs_open_version(struct dentry *dentry, int ver,
+				       int flags);
+extern int delete_backup_file(struct inode* dir, struct dentry *dentry,
+			      int ver);
+extern int bkpfs_drop_versions(struct inode *dir, struct dentry *dentry);
+extern int bkpfs_link_backup(struct dentry *f_dentry, struct dentry *src,
+			     unsigned int num);
+extern int bkpfs_crc_file(struct file *file, loff_t len, u32 *crc);
+extern int bkpfs_update_after_write(struct dentry *dentry,
+				    struct bkpfs_xattr_info *xattr,
+				    int maxvers);
+extern int bkpfs_get_xattr_info(struct dentry *dentry,
+				struct bkpfs_xattr_info* xattr);
+extern int bkpfs_set_xattr_info(struct dentry *dentry,
+				struct bkpfs_xattr_info* xattr);
+
+extern int bkpfs_backup_file(struct dentry *dentry);
+extern int bkpfs_backup_once(struct dentry *dentry);
+extern int bkpfs_request_backup(struct dentry *dentry);
+
+/* async backup pipeline (async.c) */
+extern void bkpfs_init_backup_work(struct inode *inode);
+extern int bkpfs_init_backup_wq(struct super_block *sb);
+extern void bkpfs_destroy_backup_wq(struct super_block *sb);
+extern int bkpfs_queue_backup(struct dentry *dentry);
+extern int bkpfs_defer_backup(struct dentry *dentry);
+extern void bkpfs_flush_backup(struct inode *inode);
+extern void bkpfs_kill_sb(struct super_block *sb);
+
+/* copy engine (copy.c) */
+extern void bkpfs_probe_lower_caps(struct super_block *sb,
+				   struct dentry *lower_root);
+extern ssize_t bkpfs_copy_range(struct super_block *sb, struct file *src,
+				loff_t src_pos, struct file *dst,
+				loff_t dst_pos, loff_t len);
+extern ssize_t bkpfs_copy_restore(struct super_block *sb, struct file *src,
+				  loff_t src_pos, struct file *dst,
+				  loff_t dst_pos, loff_t len);
+extern int bkpfs_init_copy_wq(struct super_block *sb);
+extern void bkpfs_destroy_copy_wq(struct super_block *sb);
+
+/* undo record format (undo.c) */
+extern ssize_t bkpfs_undo_write(struct file *file, const char __user *buf,
+				size_t count, loff_t *ppos);
+extern int bkpfs_undo_seal(struct dentry *dentry, unsigned int maxvers);
+extern int bkpfs_undo_prepare(struct dentry *dentry, loff_t pos, size_t count);
+extern int bkpfs_undo_log(struct dentry *dentry, int slot, loff_t pos,
+			  size_t count);
+extern int bkpfs_undo_truncate(struct dentry *dentry, loff_t new_size);
+extern void bkpfs_undo_init(struct inode *inode);
+extern int bkpfs_undo_save_page(struct file *file, struct page *page,
+				loff_t pos, size_t len);
+extern int bkpfs_undo_flush(struct dentry *dentry);
+extern void bkpfs_undo_forget(struct inode *inode);
+extern ssize_t bkpfs_undo_read(struct dentry *dentry, int ver, int cur_ver,
+			       void *buf, size_t len, loff_t pos);
+extern int bkpfs_undo_size(struct dentry *dentry, int ver, int cur_ver,
+			   loff_t *size);
+extern int bkpfs_undo_restore(struct dentry *dentry, int ver, int cur_ver);
+extern int bkpfs_undo_drop_newest(struct inode *dir, struct dentry *dentry,
+				  int newest, int pending);
+
+/* forward delta format (delta.c) */
+extern void bkpfs_delta_track(struct inode *inode, loff_t pos, loff_t len);
+extern void bkpfs_delta_truncate(struct inode *inode, loff_t new_size);
+extern void bkpfs_delta_invalidate(struct inode *inode);
+extern int bkpfs_delta_backup(struct dentry *dentry);
+extern int bkpfs_delta_drop_oldest(struct inode *dir, struct dentry *dentry,
+				   struct bkpfs_xattr_info *xattr);
+extern int bkpfs_delta_size(struct dentry *dentry, int ver, loff_t *size);
+extern ssize_t bkpfs_delta_read(struct dentry *dentry, int ver, int start_ver,
+				void *buf, size_t len, loff_t pos);
+extern int bkpfs_delta_restore(struct dentry *dentry, int ver, int start_ver);
+
+/* append fast path of the full format (append.c) */
+extern void bkpfs_append_note(struct inode *inode, loff_t pos,
+			      loff_t old_size);
+extern int bkpfs_append_mark_base(struct dentry *dentry, struct file *bkp_file,
+				  int ver, loff_t length);
+extern struct file *bkpfs_append_open(struct dentry *dentry, int ver,
+				      int start_ver, loff_t *length);
+extern int bkpfs_append_backup(struct dentry *dentry);
+extern int bkpfs_append_drop_oldest(struct inode *dir, struct dentry *dentry,
+				    int ver, int cur_ver);
+extern int bkpfs_append_drop_newest(struct inode *dir, struct dentry *dentry,
+				    int ver, int start_ver);
+
+/* content defined chunk store (chunk.c) */
+extern void bkpfs_chunk_init_gear(void);
+extern int bkpfs_chunk_init_sb(struct super_block *sb);
+extern void bkpfs_chunk_put_sb(struct super_block *sb);
+extern int bkpfs_chunk_backup(struct dentry *dentry);
+extern int bkpfs_chunk_drop(struct inode *dir, struct dentry *dentry, int ver);
+extern int bkpfs_chunk_size(struct dentry *dentry, int ver, loff_t *size);
+extern ssize_t bkpfs_chunk_read(struct dentry *dentry, int ver, void *buf,
+				size_t len, loff_t pos);
+extern int bkpfs_chunk_restore(struct dentry *dentry, int ver);
+
+/* whole file dedup of full backups (dedup.c) */
+extern void bkpfs_dedup_init_sb(struct super_block *sb);
+extern void bkpfs_dedup_put_sb(struct super_block *sb);
+extern int bkpfs_dedup_backup(struct dentry *dentry);
+extern void bkpfs_dedup_insert(struct dentry *dentry, int ver, loff_t size);
+extern void bkpfs_dedup_forget(struct super_block *sb,
+			       struct dentry *bkp_dentry);
+
+/* compressed format (compress.c) */
+extern void bkpfs_zip_init(struct inode *inode);
+extern int bkpfs_init_zip_sb(struct super_block *sb);
+extern void bkpfs_destroy_zip_wq(struct super_block *sb);
+extern int bkpfs_zip_backup(struct dentry *dentry);
+extern int bkpfs_zip_size(struct dentry *dentry, int ver, loff_t *size);
+extern ssize_t bkpfs_zip_read(struct dentry *dentry, int ver, void *buf,
+			      size_t len, loff_t pos);
+extern int bkpfs_zip_restore(struct dentry *dentry, int ver);
+
+/* pack files and inline versions of small files (pack.c) */
+extern void bkpfs_pack_init_sb(struct super_block *sb);
+extern void bkpfs_pack_put_sb(struct super_block *sb);
+extern bool bkpfs_small_is(struct dentry *dentry, int ver);
+extern int bkpfs_small_backup(struct dentry *dentry);
+extern int bkpfs_small_drop(struct dentry *dentry, int ver);
+extern int bkpfs_small_size(struct dentry *dentry, int ver, loff_t *size);
+extern ssize_t bkpfs_small_read(struct dentry *dentry, int ver, void *buf,
+				size_t len, loff_t pos);
+extern int bkpfs_small_restore(struct dentry *dentry, int ver);
+extern void bkpfs_small_carry(struct dentry *dentry, struct dentry *from,
+			      struct dentry *to, int start_ver, int cur_ver);
+extern int bkpfs_small_unpack(struct dentry *dentry, int ver);
+
+/* trash of unlinked files and their versions (trash.c) */
+extern int bkpfs_trash_init_sb(struct super_block *sb);
+extern void bkpfs_trash_put_sb(struct super_block *sb);
+extern int bkpfs_trash_file(struct inode *dir, struct dentry *dentry);
+extern long bkpfs_trash_undelete(struct file *file, void __user *arg);
+
+/* version directories keyed by inode (layout.c) */
+extern int bkpfs_layout_init_sb(struct super_block *sb);
+extern void bkpfs_layout_put_sb(struct super_block *sb);
+extern void bkpfs_layout_set_id(struct dentry *dentry,
+				struct bkpfs_xattr_info *xattr);
+extern int bkpfs_bkp_dir(struct dentry *dentry, struct path *dir, int create);
+extern int bkpfs_layout_remove(struct super_block *sb,
+			       struct bkpfs_xattr_info *xattr, int purge);
+
+/* shared writable mappings (mmap.c) */
+extern void bkpfs_mmap_rearm(struct inode *inode);
 
 /*
  * inode to private data
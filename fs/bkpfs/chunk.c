@@ -0,0 +1,783 @@
+/*
+ * Copyright (c) 1998-2017 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2017 Stony Brook University
+ * Copyright (c) 2003-2017 The Research Foundation of SUNY
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/*
+ * Content defined chunk store (bkp_format=chunk).
+ *
+ * A version is cut into chunks where a gear rolling hash of the data has
+ * its top BKPFS_CHUNK_BITS bits clear (8K on average, 2K to 64K), so
+ * inserting or removing bytes only changes the chunks around the edit.
+ * Each chunk is stored once per mount, in .bkp_store/<xx>/<sha256> of the
+ * lower root, whatever file and version it comes from, and counts the
+ * versions using it in its BKPFS_REFS_XATTR attribute.  The version file
+ * itself is a manifest: a header with the size of the user file followed
+ * by the hash and length of its chunks, in file order.
+ *
+ * Dropping a version drops a reference per manifest entry, a chunk goes
+ * away with its last one.  The store is shared by all the users of the
+ * mount and is always accessed with the creds of the mounter.
+ */
+
+#include "bkpfs.h"
+#include <crypto/hash.h>
+#include <crypto/sha.h>
+
+#define BKPFS_CHUNK_MAGIC	0x4b484342	/* "BCHK" */
+#define BKPFS_CHUNK_MIN		(2 * 1024)
+#define BKPFS_CHUNK_MAX		(64 * 1024)
+#define BKPFS_CHUNK_BITS	13		/* 8K on average */
+#define BKPFS_CHUNK_BUF		(256 * 1024)	/* read window of the chunker */
+#define BKPFS_CHUNK_BATCH	64		/* manifest entries per I/O */
+
+#define BKPFS_STORE_NAME	".bkp_store"
+#define BKPFS_REFS_XATTR	"user.bkp_refs"
+
+/* header of a manifest */
+struct bkpfs_chunk_hdr {
+	u32 magic;
+	u32 pad;
+	u64 size;	/* size of the user file at this version */
+	u64 nr;		/* entries following the header */
+};
+
+/* manifest entry, a chunk of the version */
+struct bkpfs_chunk_ent {
+	u8 hash[SHA256_DIGEST_SIZE];
+	u32 len;
+	u32 pad;
+};
+
+/* the chunk last opened by a read, kept while the entries repeat it */
+struct bkpfs_chunk_cache {
+	struct file *file;
+	u8 hash[SHA256_DIGEST_SIZE];
+};
+
+static u64 bkpfs_gear[256];
+
+/* @brief: fill the gear table.  It is the same on every load, the cut
+ *         points of a content must not move between two mounts.
+ */
+void bkpfs_chunk_init_gear(void)
+{
+	u64 x = 0, z;
+	int i;
+
+	/* splitmix64 */
+	for (i = 0; i < ARRAY_SIZE(bkpfs_gear); i++) {
+		x += 0x9e3779b97f4a7c15ULL;
+		z = x;
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		bkpfs_gear[i] = z ^ (z >> 31);
+	}
+}
+
+/* @brief: length of the chunk starting at data, len bytes being available */
+static size_t bkpfs_chunk_cut(const u8 *data, size_t len)
+{
+	u64 h = 0;
+	size_t i;
+
+	if (len <= BKPFS_CHUNK_MIN)
+		return len;
+	len = min_t(size_t, len, BKPFS_CHUNK_MAX);
+	for (i = BKPFS_CHUNK_MIN; i < len; i++) {
+		h = (h << 1) + bkpfs_gear[data[i]];
+		if (!(h >> (64 - BKPFS_CHUNK_BITS)))
+			return i + 1;
+	}
+	return len;
+}
+
+static int bkpfs_chunk_hash(struct bkpfs_sb_info *sbi, const void *data,
+			    size_t len, u8 *hash)
+{
+	SHASH_DESC_ON_STACK(desc, sbi->chunk_tfm);
+	int err;
+
+	desc->tfm = sbi->chunk_tfm;
+	desc->flags = 0;
+	err = crypto_shash_digest(desc, data, len, hash);
+	shash_desc_zero(desc);
+	return err;
+}
+
+/* look name up in dir, creating it with mode when missing and mode is set */
+static struct dentry *bkpfs_store_lookup(struct dentry *dir, const char *name,
+					 umode_t mode, int *created)
+{
+	struct dentry *dentry;
+	int err = 0;
+
+	inode_lock_nested(d_inode(dir), I_MUTEX_PARENT);
+	dentry = lookup_one_len(name, dir, strlen(name));
+	if (IS_ERR(dentry) || d_really_is_positive(dentry))
+		goto out;
+
+	if (!mode)
+		err = -ENOENT;
+	else if (S_ISDIR(mode))
+		err = vfs_mkdir(d_inode(dir), dentry, mode & S_IALLUGO);
+	else
+		err = vfs_create(d_inode(dir), dentry, mode & S_IALLUGO, true);
+	if (err) {
+		dput(dentry);
+		dentry = ERR_PTR(err);
+	} else if (created) {
+		*created = 1;
+	}
+out:
+	inode_unlock(d_inode(dir));
+	return dentry;
+}
+
+/* find the chunk named by hash, creating it when mode is set.  The creds
+ * of the store must be in effect.
+ */
+static struct dentry *bkpfs_chunk_lookup(struct bkpfs_sb_info *sbi,
+					 const u8 *hash, umode_t mode,
+					 int *created)
+{
+	char name[2 * SHA256_DIGEST_SIZE + 1], fan[3];
+	struct dentry *dir, *dentry;
+
+	bin2hex(name, hash, SHA256_DIGEST_SIZE);
+	name[2 * SHA256_DIGEST_SIZE] = '\0';
+	fan[0] = name[0];
+	fan[1] = name[1];
+	fan[2] = '\0';
+
+	dir = bkpfs_store_lookup(sbi->chunk_root.dentry, fan,
+				 mode ? S_IFDIR | 0700 : 0, NULL);
+	if (IS_ERR(dir))
+		return dir;
+	dentry = bkpfs_store_lookup(dir, name, mode, created);
+	dput(dir);
+	return dentry;
+}
+
+static int bkpfs_chunk_get_refs(struct dentry *dentry, u32 *refs)
+{
+	ssize_t res;
+
+	res = vfs_getxattr(dentry, BKPFS_REFS_XATTR, refs, sizeof(*refs));
+	if (res < 0)
+		return res;
+	if (res != sizeof(*refs))
+		return -EINVAL;
+	return 0;
+}
+
+static int bkpfs_chunk_set_refs(struct dentry *dentry, u32 refs)
+{
+	return vfs_setxattr(dentry, BKPFS_REFS_XATTR, &refs, sizeof(refs), 0);
+}
+
+static int bkpfs_chunk_unlink(struct dentry *dentry)
+{
+	struct dentry *dir;
+	int err;
+
+	dir = lock_parent(dentry);
+	err = vfs_unlink(d_inode(dir), dentry, NULL);
+	unlock_dir(dir);
+	return err;
+}
+
+/* updates of the chunks of one fan directory are serialized */
+static struct mutex *bkpfs_chunk_lock(struct bkpfs_sb_info *sbi,
+				      const u8 *hash)
+{
+	return &sbi->chunk_locks[hash[0]];
+}
+
+/* @brief: take a reference on the chunk holding data, storing it first
+ *         when the store does not have it yet.
+ * Return:	0 or -errno
+ */
+static int bkpfs_chunk_ref(struct bkpfs_sb_info *sbi, const u8 *hash,
+			   const void *data, size_t len)
+{
+	const struct cred *old_cred;
+	struct dentry *dentry;
+	struct file *file;
+	struct path path;
+	loff_t pos = 0;
+	ssize_t res;
+	u32 refs;
+	int created = 0;
+	int err;
+
+	old_cred = override_creds(sbi->chunk_cred);
+	mutex_lock(bkpfs_chunk_lock(sbi, hash));
+	dentry = bkpfs_chunk_lookup(sbi, hash, S_IFREG | 0600, &created);
+	if (IS_ERR(dentry)) {
+		err = PTR_ERR(dentry);
+		goto out;
+	}
+
+	if (!created) {
+		err = bkpfs_chunk_get_refs(dentry, &refs);
+		if (!err) {
+			err = bkpfs_chunk_set_refs(dentry, refs + 1);
+			goto out_dput;
+		}
+		/* left behind half written by a crash, store it again */
+		if (err != -ENODATA)
+			goto out_dput;
+	}
+
+	path.mnt = sbi->chunk_root.mnt;
+	path.dentry = dentry;
+	file = dentry_open(&path, O_WRONLY | O_TRUNC | O_LARGEFILE,
+			   current_cred());
+	if (IS_ERR(file)) {
+		err = PTR_ERR(file);
+		goto out_unlink;
+	}
+	res = kernel_write(file, data, len, &pos);
+	fput(file);
+	if (res != len) {
+		err = res < 0 ? res : -EIO;
+		goto out_unlink;
+	}
+	/* the reference count is set last, it marks the chunk complete */
+	err = bkpfs_chunk_set_refs(dentry, 1);
+	if (!err) {
+		atomic64_add(len, &sbi->chunk_new_bytes);
+		goto out_dput;
+	}
+
+out_unlink:
+	bkpfs_chunk_unlink(dentry);
+out_dput:
+	dput(dentry);
+out:
+	mutex_unlock(bkpfs_chunk_lock(sbi, hash));
+	revert_creds(old_cred);
+	return err;
+}
+
+/* @brief: drop a reference on the chunk named by hash */
+static int bkpfs_chunk_unref(struct bkpfs_sb_info *sbi, const u8 *hash)
+{
+	const struct cred *old_cred;
+	struct dentry *dentry;
+	u32 refs;
+	int err;
+
+	old_cred = override_creds(sbi->chunk_cred);
+	mutex_lock(bkpfs_chunk_lock(sbi, hash));
+	dentry = bkpfs_chunk_lookup(sbi, hash, 0, NULL);
+	if (IS_ERR(dentry)) {
+		err = PTR_ERR(dentry);
+		goto out;
+	}
+	err = bkpfs_chunk_get_refs(dentry, &refs);
+	if (!err && refs > 1)
+		err = bkpfs_chunk_set_refs(dentry, refs - 1);
+	else if (!err)
+		err = bkpfs_chunk_unlink(dentry);
+	dput(dentry);
+out:
+	mutex_unlock(bkpfs_chunk_lock(sbi, hash));
+	revert_creds(old_cred);
+	return err;
+}
+
+static struct file *bkpfs_chunk_open(struct bkpfs_sb_info *sbi,
+				     const u8 *hash)
+{
+	const struct cred *old_cred;
+	struct dentry *dentry;
+	struct file *file;
+	struct path path;
+
+	old_cred = override_creds(sbi->chunk_cred);
+	dentry = bkpfs_chunk_lookup(sbi, hash, 0, NULL);
+	if (IS_ERR(dentry)) {
+		file = ERR_CAST(dentry);
+		goto out;
+	}
+	path.mnt = sbi->chunk_root.mnt;
+	path.dentry = dentry;
+	file = dentry_open(&path, O_RDONLY | O_LARGEFILE, current_cred());
+	dput(dentry);
+out:
+	revert_creds(old_cred);
+	return file;
+}
+
+/* @brief: open the chunk named by hash, reusing the one in cache when it
+ *         is the same.  The file stays owned by the cache.
+ */
+static struct file *bkpfs_chunk_get(struct bkpfs_sb_info *sbi,
+				    struct bkpfs_chunk_cache *cache,
+				    const u8 *hash)
+{
+	struct file *file;
+
+	if (cache->file && !memcmp(cache->hash, hash, SHA256_DIGEST_SIZE))
+		return cache->file;
+	file = bkpfs_chunk_open(sbi, hash);
+	if (IS_ERR(file))
+		return file;
+	if (cache->file)
+		fput(cache->file);
+	cache->file = file;
+	memcpy(cache->hash, hash, SHA256_DIGEST_SIZE);
+	return file;
+}
+
+static int bkpfs_chunk_read_hdr(struct file *file, struct bkpfs_chunk_hdr *hdr)
+{
+	loff_t pos = 0;
+	ssize_t res;
+
+	res = kernel_read(file, hdr, sizeof(*hdr), &pos);
+	if (res < 0)
+		return res;
+	if (res != sizeof(*hdr) || hdr->magic != BKPFS_CHUNK_MAGIC)
+		return -EIO;
+	return 0;
+}
+
+/* read up to BKPFS_CHUNK_BATCH entries from entry i on */
+static int bkpfs_chunk_read_ents(struct file *file, struct bkpfs_chunk_hdr *hdr,
+				 u64 i, struct bkpfs_chunk_ent *ents)
+{
+	loff_t pos = sizeof(*hdr) + i * sizeof(*ents);
+	size_t len;
+	ssize_t res;
+	int nr;
+
+	nr = min_t(u64, BKPFS_CHUNK_BATCH, hdr->nr - i);
+	len = nr * sizeof(*ents);
+	res = kernel_read(file, ents, len, &pos);
+	if (res < 0)
+		return res;
+	if (res != len)
+		return -EIO;
+	return nr;
+}
+
+/* append nr entries to the manifest, counting them in hdr once written */
+static int bkpfs_chunk_put_ents(struct file *file, struct bkpfs_chunk_hdr *hdr,
+				struct bkpfs_chunk_ent *ents, int nr)
+{
+	loff_t pos = sizeof(*hdr) + hdr->nr * sizeof(*ents);
+	size_t len = nr * sizeof(*ents);
+	ssize_t res;
+
+	res = kernel_write(file, ents, len, &pos);
+	if (res < 0)
+		return res;
+	if (res != len)
+		return -EIO;
+	hdr->nr += nr;
+	return 0;
+}
+
+static int bkpfs_chunk_write_hdr(struct file *file, struct bkpfs_chunk_hdr *hdr)
+{
+	loff_t pos = 0;
+	ssize_t res;
+
+	res = kernel_write(file, hdr, sizeof(*hdr), &pos);
+	if (res < 0)
+		return res;
+	return res == sizeof(*hdr) ? 0 : -EIO;
+}
+
+/* @brief: drop the references a manifest holds */
+static int bkpfs_chunk_put_manifest(struct bkpfs_sb_info *sbi,
+				    struct file *file)
+{
+	struct bkpfs_chunk_hdr hdr;
+	struct bkpfs_chunk_ent *ents;
+	u64 i;
+	int nr, e, err;
+
+	err = bkpfs_chunk_read_hdr(file, &hdr);
+	if (err)
+		return err;
+	ents = kmalloc_array(BKPFS_CHUNK_BATCH, sizeof(*ents), GFP_KERNEL);
+	if (!ents)
+		return -ENOMEM;
+
+	for (i = 0; i < hdr.nr; i += nr) {
+		nr = bkpfs_chunk_read_ents(file, &hdr, i, ents);
+		if (nr < 0) {
+			err = nr;
+			break;
+		}
+		for (e = 0; e < nr; e++) {
+			/* keep going, a lost reference only leaks space */
+			if (bkpfs_chunk_unref(sbi, ents[e].hash))
+				printk(KERN_INFO "ERROR:: failed to drop chunk %llu of manifest\n",
+				       i + e);
+		}
+	}
+	kfree(ents);
+	return err;
+}
+
+/* @brief: store the current content of the user file as version cur_ver.
+ *         Called with bkp_meta_lock held.
+ * input :
+ *         dentry: dentry of user file created inside the mount
+ * return: err
+ */
+int bkpfs_chunk_backup(struct dentry *dentry)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(dentry->d_sb);
+	struct mnt_opt_info *opts = &sbi->mnt_opts;
+	struct bkpfs_chunk_hdr hdr = { .magic = BKPFS_CHUNK_MAGIC };
+	struct bkpfs_chunk_ent *ents;
+	struct bkpfs_xattr_info xattr;
+	struct file *src, *dst;
+	struct path lower_path;
+	size_t start = 0, fill = 0, cut;
+	loff_t rpos = 0;
+	ssize_t res;
+	int nr = 0, eof = 0;
+	int i, err;
+	u8 *buf;
+
+	if (!sbi->chunk_tfm || !sbi->chunk_root.dentry)
+		return -EINVAL;
+	err = bkpfs_get_xattr_info(dentry, &xattr);
+	if (err < 0)
+		return err;
+
+	buf = kvmalloc(BKPFS_CHUNK_BUF, GFP_KERNEL);
+	ents = kmalloc_array(BKPFS_CHUNK_BATCH, sizeof(*ents), GFP_KERNEL);
+	if (!buf || !ents) {
+		err = -ENOMEM;
+		goto out_free;
+	}
+
+	bkpfs_get_lower_path(dentry, &lower_path);
+	src = dentry_open(&lower_path, O_RDONLY | O_LARGEFILE, current_cred());
+	bkpfs_put_lower_path(dentry, &lower_path);
+	if (IS_ERR(src)) {
+		err = PTR_ERR(src);
+		goto out_free;
+	}
+	dst = bkpfs_open_version(dentry, xattr.cur_ver,
+				 O_WRONLY | O_CREAT | O_TRUNC);
+	if (IS_ERR(dst)) {
+		err = PTR_ERR(dst);
+		goto out_src;
+	}
+
+	/* entries go after the header, which is written once they are all in */
+	for (;;) {
+		/* keep at least a maximal chunk in the window until EOF */
+		if (!eof && fill - start < BKPFS_CHUNK_MAX) {
+			memmove(buf, buf + start, fill - start);
+			fill -= start;
+			start = 0;
+			res = kernel_read(src, buf + fill, BKPFS_CHUNK_BUF - fill,
+					  &rpos);
+			if (res < 0) {
+				err = res;
+				goto out_drop;
+			}
+			eof = !res;
+			fill += res;
+			continue;
+		}
+		if (start == fill)
+			break;
+
+		cut = bkpfs_chunk_cut(buf + start, fill - start);
+		err = bkpfs_chunk_hash(sbi, buf + start, cut, ents[nr].hash);
+		if (!err)
+			err = bkpfs_chunk_ref(sbi, ents[nr].hash, buf + start, cut);
+		if (err)
+			goto out_drop;
+		ents[nr].len = cut;
+		ents[nr].pad = 0;
+		hdr.size += cut;
+		start += cut;
+
+		if (++nr == BKPFS_CHUNK_BATCH) {
+			err = bkpfs_chunk_put_ents(dst, &hdr, ents, nr);
+			if (err)
+				goto out_drop;
+			nr = 0;
+		}
+	}
+	if (nr) {
+		err = bkpfs_chunk_put_ents(dst, &hdr, ents, nr);
+		if (err)
+			goto out_drop;
+		nr = 0;
+	}
+	err = bkpfs_chunk_write_hdr(dst, &hdr);
+	if (err)
+		goto out_drop;
+	fput(dst);
+	fput(src);
+	atomic64_add(hdr.size, &sbi->chunk_bytes);
+
+	pr_debug("INFO::chunk manifest created with num=%d, %llu chunks\n",
+		 xattr.cur_ver, hdr.nr);
+	err = bkpfs_update_after_write(dentry, &xattr,
+			opts->maxvers ? opts->maxvers : DEFAULT_MAXVERS);
+	goto out_free;
+
+out_drop:
+	/* release the chunks taken so far: those not in the manifest yet
+	 * directly, the others through the manifest itself
+	 */
+	for (i = 0; i < nr; i++)
+		bkpfs_chunk_unref(sbi, ents[i].hash);
+	if (!bkpfs_chunk_write_hdr(dst, &hdr))
+		bkpfs_chunk_put_manifest(sbi, dst);
+	fput(dst);
+	delete_backup_file(d_inode(dentry->d_parent), dentry, xattr.cur_ver);
+out_src:
+	fput(src);
+out_free:
+	kfree(ents);
+	kvfree(buf);
+	return err;
+}
+
+/* @brief: drop version ver: release its chunks and delete its manifest */
+int bkpfs_chunk_drop(struct inode *dir, struct dentry *dentry, int ver)
+{
+	struct file *file;
+	int err;
+
+	file = bkpfs_open_version(dentry, ver, O_RDONLY);
+	if (IS_ERR(file))
+		return PTR_ERR(file);
+	err = bkpfs_chunk_put_manifest(BKPFS_SB(dentry->d_sb), file);
+	fput(file);
+	if (err)
+		printk(KERN_INFO "ERROR:: failed to release the chunks of version %d\n",
+		       ver);
+	return delete_backup_file(dir, dentry, ver);
+}
+
+/* @brief: size of the user file at version ver */
+int bkpfs_chunk_size(struct dentry *dentry, int ver, loff_t *size)
+{
+	struct bkpfs_chunk_hdr hdr;
+	struct file *file;
+	int err;
+
+	file = bkpfs_open_version(dentry, ver, O_RDONLY);
+	if (IS_ERR(file))
+		return PTR_ERR(file);
+	err = bkpfs_chunk_read_hdr(file, &hdr);
+	fput(file);
+	if (!err)
+		*size = hdr.size;
+	return err;
+}
+
+/* @brief: read [pos, pos + len) of version ver into buf, from its chunks.
+ * Return:	bytes of the version in that range, or -errno
+ */
+ssize_t bkpfs_chunk_read(struct dentry *dentry, int ver, void *buf,
+			 size_t len, loff_t pos)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(dentry->d_sb);
+	struct bkpfs_chunk_hdr hdr;
+	struct bkpfs_chunk_ent *ents;
+	struct bkpfs_chunk_cache cache = { NULL };
+	struct file *file, *chunk;
+	loff_t off = 0, from, to, cpos;
+	ssize_t res;
+	u64 i;
+	int nr, e;
+	int err;
+
+	file = bkpfs_open_version(dentry, ver, O_RDONLY);
+	if (IS_ERR(file))
+		return PTR_ERR(file);
+	err = bkpfs_chunk_read_hdr(file, &hdr);
+	if (err)
+		goto out;
+	if (pos >= hdr.size) {
+		len = 0;
+		goto out;
+	}
+	len = min_t(loff_t, len, hdr.size - pos);
+
+	ents = kmalloc_array(BKPFS_CHUNK_BATCH, sizeof(*ents), GFP_KERNEL);
+	if (!ents) {
+		err = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < hdr.nr && off < pos + len; i += nr) {
+		nr = bkpfs_chunk_read_ents(file, &hdr, i, ents);
+		if (nr < 0) {
+			err = nr;
+			break;
+		}
+		for (e = 0; e < nr && off < pos + len; off += ents[e].len, e++) {
+			if (off + ents[e].len <= pos)
+				continue;
+			from = max(pos, off);
+			to = min_t(loff_t, pos + len, off + ents[e].len);
+
+			chunk = bkpfs_chunk_get(sbi, &cache, ents[e].hash);
+			if (IS_ERR(chunk)) {
+				err = PTR_ERR(chunk);
+				goto out_ents;
+			}
+			cpos = from - off;
+			res = kernel_read(chunk, buf + (from - pos), to - from,
+					  &cpos);
+			if (res != to - from) {
+				err = res < 0 ? res : -EIO;
+				goto out_ents;
+			}
+		}
+	}
+out_ents:
+	if (cache.file)
+		fput(cache.file);
+	kfree(ents);
+out:
+	fput(file);
+	return err ? err : len;
+}
+
+/* @brief: write version ver back over the user file, chunk by chunk */
+int bkpfs_chunk_restore(struct dentry *dentry, int ver)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(dentry->d_sb);
+	struct inode *inode = d_inode(dentry);
+	struct bkpfs_chunk_hdr hdr;
+	struct bkpfs_chunk_ent *ents;
+	struct bkpfs_chunk_cache cache = { NULL };
+	struct file *file, *chunk, *user_file;
+	struct path lower_path;
+	loff_t off = 0;
+	ssize_t res;
+	u64 i;
+	int nr, e;
+	int err;
+
+	file = bkpfs_open_version(dentry, ver, O_RDONLY);
+	if (IS_ERR(file))
+		return PTR_ERR(file);
+	err = bkpfs_chunk_read_hdr(file, &hdr);
+	if (err)
+		goto out_file;
+	ents = kmalloc_array(BKPFS_CHUNK_BATCH, sizeof(*ents), GFP_KERNEL);
+	if (!ents) {
+		err = -ENOMEM;
+		goto out_file;
+	}
+
+	bkpfs_get_lower_path(dentry, &lower_path);
+	user_file = dentry_open(&lower_path, O_WRONLY | O_LARGEFILE,
+				current_cred());
+	bkpfs_put_lower_path(dentry, &lower_path);
+	if (IS_ERR(user_file)) {
+		err = PTR_ERR(user_file);
+		goto out_ents;
+	}
+
+	inode_lock(inode);
+	err = vfs_truncate(&user_file->f_path, 0);
+	for (i = 0; !err && i < hdr.nr; i += nr) {
+		nr = bkpfs_chunk_read_ents(file, &hdr, i, ents);
+		if (nr < 0) {
+			err = nr;
+			break;
+		}
+		for (e = 0; e < nr; e++) {
+			chunk = bkpfs_chunk_get(sbi, &cache, ents[e].hash);
+			if (IS_ERR(chunk)) {
+				err = PTR_ERR(chunk);
+				break;
+			}
+			res = bkpfs_copy_restore(dentry->d_sb, chunk, 0, user_file,
+						 off, ents[e].len);
+			if (res != ents[e].len) {
+				err = res < 0 ? res : -EIO;
+				break;
+			}
+			off += ents[e].len;
+		}
+	}
+	fsstack_copy_inode_size(inode, bkpfs_lower_inode(inode));
+	fsstack_copy_attr_all(inode, bkpfs_lower_inode(inode));
+	inode_unlock(inode);
+	if (cache.file)
+		fput(cache.file);
+	fput(user_file);
+out_ents:
+	kfree(ents);
+out_file:
+	fput(file);
+	return err;
+}
+
+/* @brief: set up the chunk store of the mount, at mount time */
+int bkpfs_chunk_init_sb(struct super_block *sb)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+	struct path lower_root;
+	struct dentry *store;
+	int err = 0;
+	int i;
+
+	for (i = 0; i < BKPFS_CHUNK_FANS; i++)
+		mutex_init(&sbi->chunk_locks[i]);
+	atomic64_set(&sbi->chunk_bytes, 0);
+	atomic64_set(&sbi->chunk_new_bytes, 0);
+
+	sbi->chunk_tfm = crypto_alloc_shash("sha256", 0, 0);
+	if (IS_ERR(sbi->chunk_tfm)) {
+		err = PTR_ERR(sbi->chunk_tfm);
+		sbi->chunk_tfm = NULL;
+		goto out;
+	}
+	/* chunks are shared between users, they belong to the mounter */
+	sbi->chunk_cred = get_current_cred();
+
+	bkpfs_get_lower_path(sb->s_root, &lower_root);
+	store = bkpfs_store_lookup(lower_root.dentry, BKPFS_STORE_NAME,
+				   S_IFDIR | 0700, NULL);
+	if (IS_ERR(store)) {
+		err = PTR_ERR(store);
+		goto out_root;
+	}
+	sbi->chunk_root.mnt = mntget(lower_root.mnt);
+	sbi->chunk_root.dentry = store;
+out_root:
+	bkpfs_put_lower_path(sb->s_root, &lower_root);
+out:
+	return err;
+}
+
+/* @brief: release the chunk store of the mount */
+void bkpfs_chunk_put_sb(struct super_block *sb)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+
+	if (sbi->chunk_root.dentry)
+		path_put(&sbi->chunk_root);
+	if (sbi->chunk_tfm)
+		crypto_free_shash(sbi->chunk_tfm);
+	if (sbi->chunk_cred)
+		put_cred(sbi->chunk_cred);
+}
@@ -0,0 +1,658 @@
+/*
+ * Copyright (c) 1998-2017 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2017 Stony Brook University
+ * Copyright (c) 2003-2017 The Research Foundation of SUNY
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/*
+ * Compressed backup format (bkp_format=compress).
+ *
+ * A version is the file cut in BKPFS_ZIP_CHUNK pieces, each compressed on
+ * its own with the bkp_compress codec (lz4 by default, cheap enough for
+ * the backup path).  The version file starts with a header naming the
+ * codec, followed by the offset of every compressed chunk in the file and
+ * the end of the last one, then the chunks.  A chunk which would not get
+ * smaller is stored as is, which its stored length tells.  Reading a range
+ * of a version only decompresses the chunks covering it.
+ *
+ * With bkp_recompress, versions which are bkp_recompress_after versions
+ * behind the newest are rewritten in the background with that (slower and
+ * stronger) codec: a per-mount worker writes the new version in an unnamed
+ * file and renames it over the old one, so readers see either.
+ */
+
+#include "bkpfs.h"
+#include <linux/crypto.h>
+
+#define BKPFS_ZIP_MAGIC		0x50495a42	/* "BZIP" */
+#define BKPFS_ZIP_CHUNK		(64 * 1024)
+
+/* header of a compressed version */
+struct bkpfs_zip_hdr {
+	u32 magic;
+	u32 chunk;			/* raw bytes per chunk */
+	u64 size;			/* size of the user file at this version */
+	u64 nr;				/* chunks */
+	char alg[BKPFS_ZIP_ALG_LEN];	/* codec of the chunks */
+};
+
+/* where the chunks of a version start, after the offset table */
+#define BKPFS_ZIP_DATA(nr)	(sizeof(struct bkpfs_zip_hdr) + \
+				 ((nr) + 1) * sizeof(u64))
+
+/* an opened version, with the last chunk it decompressed */
+struct bkpfs_zip_reader {
+	struct file *file;
+	struct bkpfs_zip_hdr hdr;
+	struct crypto_comp *tfm;
+	void *cbuf;			/* chunk as stored */
+	void *rbuf;			/* chunk decompressed */
+	u64 cached;			/* chunk in rbuf, U64_MAX if none */
+	size_t rlen;			/* bytes in rbuf */
+};
+
+/* source of the raw data of a version being written */
+typedef ssize_t (*bkpfs_zip_get_t)(void *src, void *buf, size_t len,
+				   loff_t pos);
+
+static void bkpfs_zip_close(struct bkpfs_zip_reader *zr)
+{
+	if (zr->tfm)
+		crypto_free_comp(zr->tfm);
+	kvfree(zr->rbuf);
+	kvfree(zr->cbuf);
+	if (zr->file)
+		fput(zr->file);
+}
+
+static int bkpfs_zip_open(struct dentry *dentry, int ver,
+			  struct bkpfs_zip_reader *zr)
+{
+	loff_t pos = 0;
+	ssize_t res;
+	int err;
+
+	memset(zr, 0, sizeof(*zr));
+	zr->cached = U64_MAX;
+	zr->file = bkpfs_open_version(dentry, ver, O_RDONLY);
+	if (IS_ERR(zr->file)) {
+		err = PTR_ERR(zr->file);
+		zr->file = NULL;
+		return err;
+	}
+
+	res = kernel_read(zr->file, &zr->hdr, sizeof(zr->hdr), &pos);
+	if (res != sizeof(zr->hdr)) {
+		err = res < 0 ? res : -EIO;
+		goto out_err;
+	}
+	if (zr->hdr.magic != BKPFS_ZIP_MAGIC || !zr->hdr.chunk ||
+	    zr->hdr.chunk > BKPFS_ZIP_CHUNK ||
+	    strnlen(zr->hdr.alg, BKPFS_ZIP_ALG_LEN) == BKPFS_ZIP_ALG_LEN) {
+		err = -EIO;
+		goto out_err;
+	}
+
+	zr->tfm = crypto_alloc_comp(zr->hdr.alg, 0, 0);
+	if (IS_ERR(zr->tfm)) {
+		err = PTR_ERR(zr->tfm);
+		zr->tfm = NULL;
+		goto out_err;
+	}
+	zr->cbuf = kvmalloc(zr->hdr.chunk, GFP_KERNEL);
+	zr->rbuf = kvmalloc(zr->hdr.chunk, GFP_KERNEL);
+	if (!zr->cbuf || !zr->rbuf) {
+		err = -ENOMEM;
+		goto out_err;
+	}
+	return 0;
+
+out_err:
+	bkpfs_zip_close(zr);
+	return err;
+}
+
+/* bring chunk i of the version into zr->rbuf */
+static int bkpfs_zip_load(struct bkpfs_zip_reader *zr, u64 i)
+{
+	unsigned int dlen = zr->hdr.chunk;
+	size_t raw, stored;
+	u64 off[2];
+	loff_t pos;
+	ssize_t res;
+	int err;
+
+	if (zr->cached == i)
+		return 0;
+
+	pos = sizeof(zr->hdr) + i * sizeof(u64);
+	res = kernel_read(zr->file, off, sizeof(off), &pos);
+	if (res != sizeof(off))
+		return res < 0 ? res : -EIO;
+	raw = min_t(u64, zr->hdr.chunk, zr->hdr.size - i * zr->hdr.chunk);
+	stored = off[1] - off[0];
+	if (off[1] < off[0] || stored > raw)
+		return -EIO;
+
+	pos = off[0];
+	res = kernel_read(zr->file, stored == raw ? zr->rbuf : zr->cbuf,
+			  stored, &pos);
+	if (res != stored)
+		return res < 0 ? res : -EIO;
+	if (stored != raw) {
+		err = crypto_comp_decompress(zr->tfm, zr->cbuf, stored,
+					     zr->rbuf, &dlen);
+		if (err)
+			return err;
+		if (dlen != raw)
+			return -EIO;
+	}
+	zr->cached = i;
+	zr->rlen = raw;
+	return 0;
+}
+
+/* @brief: read [pos, pos + len) of an opened version.
+ * Return:	bytes of the version in that range, or -errno
+ */
+static ssize_t bkpfs_zip_pread(void *src, void *buf, size_t len, loff_t pos)
+{
+	struct bkpfs_zip_reader *zr = src;
+	size_t done = 0, n, off;
+	u64 i;
+	int err;
+
+	if (pos >= zr->hdr.size)
+		return 0;
+	len = min_t(loff_t, len, zr->hdr.size - pos);
+
+	while (done < len) {
+		i = div_u64(pos + done, zr->hdr.chunk);
+		off = pos + done - i * zr->hdr.chunk;
+		err = bkpfs_zip_load(zr, i);
+		if (err)
+			return err;
+		n = min(len - done, zr->rlen - off);
+		memcpy(buf + done, zr->rbuf + off, n);
+		done += n;
+	}
+	return done;
+}
+
+/* raw data of a version being taken: the user file */
+static ssize_t bkpfs_zip_get_file(void *src, void *buf, size_t len,
+				  loff_t pos)
+{
+	return kernel_read(src, buf, len, &pos);
+}
+
+/* @brief: write a version of size bytes taken from get into dst,
+ *         compressed with alg.
+ * Return:	stored size of the version or -errno
+ */
+static loff_t bkpfs_zip_write(struct super_block *sb, const char *alg,
+			      bkpfs_zip_get_t get, void *src, loff_t size,
+			      struct file *dst)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+	struct bkpfs_zip_hdr hdr = {
+		.magic = BKPFS_ZIP_MAGIC,
+		.chunk = BKPFS_ZIP_CHUNK,
+	};
+	struct crypto_comp *tfm;
+	void *rbuf = NULL, *cbuf = NULL;
+	unsigned int dlen;
+	size_t len;
+	loff_t wpos, pos;
+	ssize_t res;
+	u64 *off = NULL;
+	u64 nr, i;
+	int err;
+
+	strlcpy(hdr.alg, alg, sizeof(hdr.alg));
+	tfm = crypto_alloc_comp(alg, 0, 0);
+	if (IS_ERR(tfm))
+		return PTR_ERR(tfm);
+
+	nr = DIV_ROUND_UP_ULL(size, BKPFS_ZIP_CHUNK);
+	off = kvmalloc_array(nr + 1, sizeof(*off), GFP_KERNEL);
+	rbuf = kvmalloc(BKPFS_ZIP_CHUNK, GFP_KERNEL);
+	/* room for what some codecs make of incompressible data */
+	cbuf = kvmalloc(2 * BKPFS_ZIP_CHUNK, GFP_KERNEL);
+	if (!off || !rbuf || !cbuf) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	/* the table goes before the chunks, it is written once they are */
+	wpos = BKPFS_ZIP_DATA(nr);
+	for (i = 0; i < nr; i++) {
+		len = min_t(loff_t, BKPFS_ZIP_CHUNK, size - hdr.size);
+		res = get(src, rbuf, len, hdr.size);
+		if (res < 0) {
+			err = res;
+			goto out;
+		}
+		/* the file shrank meanwhile, the version ends here */
+		if (!res)
+			break;
+		len = res;
+
+		/* a chunk which does not shrink is stored as is */
+		dlen = 2 * BKPFS_ZIP_CHUNK;
+		if (crypto_comp_compress(tfm, rbuf, len, cbuf, &dlen) ||
+		    dlen >= len) {
+			memcpy(cbuf, rbuf, len);
+			dlen = len;
+		}
+		off[i] = wpos;
+		res = kernel_write(dst, cbuf, dlen, &wpos);
+		if (res != dlen) {
+			err = res < 0 ? res : -EIO;
+			goto out;
+		}
+		hdr.size += len;
+		if (len < BKPFS_ZIP_CHUNK) {
+			i++;
+			break;
+		}
+	}
+	hdr.nr = i;
+	off[i] = wpos;
+
+	pos = sizeof(hdr);
+	res = kernel_write(dst, off, (i + 1) * sizeof(*off), &pos);
+	if (res == (i + 1) * sizeof(*off)) {
+		pos = 0;
+		res = kernel_write(dst, &hdr, sizeof(hdr), &pos);
+		if (res == sizeof(hdr))
+			res = 0;
+	}
+	if (res) {
+		err = res < 0 ? res : -EIO;
+		goto out;
+	}
+	err = 0;
+	atomic64_add(hdr.size, &sbi->zip_raw_bytes);
+	atomic64_add(wpos - BKPFS_ZIP_DATA(nr), &sbi->zip_stored_bytes);
+out:
+	kvfree(cbuf);
+	kvfree(rbuf);
+	kvfree(off);
+	crypto_free_comp(tfm);
+	return err ? err : wpos;
+}
+
+/* @brief: hand the versions to recompress over to the mount's worker */
+static void bkpfs_zip_queue(struct dentry *dentry)
+{
+	struct inode *inode = d_inode(dentry);
+	struct bkpfs_inode_info *info = BKPFS_I(inode);
+	struct bkpfs_sb_info *sbi = BKPFS_SB(inode->i_sb);
+	const struct cred *cred;
+	struct dentry *pinned;
+
+	if (!sbi->zip_wq)
+		return;
+
+	cred = get_current_cred();
+	pinned = dget(dentry);
+	spin_lock(&info->bkp_lock);
+	swap(info->zip_cred, cred);
+	swap(info->zip_dentry, pinned);
+	spin_unlock(&info->bkp_lock);
+	if (cred)
+		put_cred(cred);
+	dput(pinned);
+
+	ihold(inode);
+	if (!queue_work(sbi->zip_wq, &info->zip_work))
+		iput(inode);
+}
+
+/* @brief: store the current content of the user file as version cur_ver,
+ *         compressed with the bkp_compress codec.  Called with
+ *         bkp_meta_lock held.
+ * input :
+ *         dentry: dentry of user file created inside the mount
+ * return: err
+ */
+int bkpfs_zip_backup(struct dentry *dentry)
+{
+	struct mnt_opt_info *opts = &BKPFS_SB(dentry->d_sb)->mnt_opts;
+	struct bkpfs_xattr_info xattr;
+	struct file *src, *dst;
+	struct path lower_path;
+	loff_t stored;
+	int err;
+
+	err = bkpfs_get_xattr_info(dentry, &xattr);
+	if (err < 0)
+		return err;
+
+	bkpfs_get_lower_path(dentry, &lower_path);
+	src = dentry_open(&lower_path, O_RDONLY | O_LARGEFILE, current_cred());
+	bkpfs_put_lower_path(dentry, &lower_path);
+	if (IS_ERR(src))
+		return PTR_ERR(src);
+	dst = bkpfs_open_version(dentry, xattr.cur_ver,
+				 O_WRONLY | O_CREAT | O_TRUNC);
+	if (IS_ERR(dst)) {
+		err = PTR_ERR(dst);
+		goto out_src;
+	}
+
+	stored = bkpfs_zip_write(dentry->d_sb, opts->bkp_compress,
+				 bkpfs_zip_get_file, src,
+				 i_size_read(file_inode(src)), dst);
+	fput(dst);
+	if (stored < 0) {
+		err = stored;
+		printk(KERN_INFO "ERROR:: compressing version %d failed\n",
+		       xattr.cur_ver);
+		delete_backup_file(d_inode(dentry->d_parent), dentry,
+				   xattr.cur_ver);
+		goto out_src;
+	}
+	pr_debug("INFO::compressed backup created with num=%d, %lld bytes\n",
+		 xattr.cur_ver, stored);
+
+	err = bkpfs_update_after_write(dentry, &xattr,
+			opts->maxvers ? opts->maxvers : DEFAULT_MAXVERS);
+	if (!err)
+		bkpfs_zip_queue(dentry);
+out_src:
+	fput(src);
+	return err;
+}
+
+/* @brief: size of the user file at version ver */
+int bkpfs_zip_size(struct dentry *dentry, int ver, loff_t *size)
+{
+	struct bkpfs_zip_reader zr;
+	int err;
+
+	err = bkpfs_zip_open(dentry, ver, &zr);
+	if (err)
+		return err;
+	*size = zr.hdr.size;
+	bkpfs_zip_close(&zr);
+	return 0;
+}
+
+/* @brief: read [pos, pos + len) of version ver into buf, decompressing
+ *         only the chunks covering it.
+ * Return:	bytes of the version in that range, or -errno
+ */
+ssize_t bkpfs_zip_read(struct dentry *dentry, int ver, void *buf, size_t len,
+		       loff_t pos)
+{
+	struct bkpfs_zip_reader zr;
+	ssize_t res;
+	int err;
+
+	err = bkpfs_zip_open(dentry, ver, &zr);
+	if (err)
+		return err;
+	res = bkpfs_zip_pread(&zr, buf, len, pos);
+	bkpfs_zip_close(&zr);
+	return res;
+}
+
+/* @brief: write version ver back over the user file */
+int bkpfs_zip_restore(struct dentry *dentry, int ver)
+{
+	struct inode *inode = d_inode(dentry);
+	struct bkpfs_zip_reader zr;
+	struct file *user_file;
+	struct path lower_path;
+	loff_t wpos;
+	ssize_t res;
+	u64 i;
+	int err;
+
+	err = bkpfs_zip_open(dentry, ver, &zr);
+	if (err)
+		return err;
+
+	bkpfs_get_lower_path(dentry, &lower_path);
+	user_file = dentry_open(&lower_path, O_WRONLY | O_LARGEFILE,
+				current_cred());
+	bkpfs_put_lower_path(dentry, &lower_path);
+	if (IS_ERR(user_file)) {
+		err = PTR_ERR(user_file);
+		goto out;
+	}
+
+	inode_lock(inode);
+	err = vfs_truncate(&user_file->f_path, 0);
+	for (i = 0; !err && i < zr.hdr.nr; i++) {
+		err = bkpfs_zip_load(&zr, i);
+		if (err)
+			break;
+		wpos = i * zr.hdr.chunk;
+		res = kernel_write(user_file, zr.rbuf, zr.rlen, &wpos);
+		if (res != zr.rlen)
+			err = res < 0 ? res : -EIO;
+	}
+	fsstack_copy_inode_size(inode, bkpfs_lower_inode(inode));
+	fsstack_copy_attr_all(inode, bkpfs_lower_inode(inode));
+	inode_unlock(inode);
+	fput(user_file);
+out:
+	bkpfs_zip_close(&zr);
+	return err;
+}
+
+/* @brief: rewrite version ver with the bkp_recompress codec, unless it
+ *         already is.  The new version is renamed over the old one.
+ */
+static int bkpfs_zip_recompress(struct dentry *dentry, int ver)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(dentry->d_sb);
+	struct bkpfs_inode_info *info = BKPFS_I(d_inode(dentry));
+	struct dentry *lower_dir, *tmp, *old_dentry, *new_dentry;
+	struct path lower_parent_path, tmp_path;
+	struct bkpfs_xattr_info xattr;
+	struct bkpfs_zip_reader zr;
+	struct file *dst;
+	loff_t stored;
+	char *name;
+	int err;
+
+	err = bkpfs_zip_open(dentry, ver, &zr);
+	if (err)
+		return err;
+	if (!strcmp(zr.hdr.alg, sbi->mnt_opts.bkp_recompress))
+		goto out_zr;
+
+	name = kmalloc(NAME_MAX + 1, GFP_KERNEL);
+	if (!name) {
+		err = -ENOMEM;
+		goto out_zr;
+	}
+	err = bkpfs_bkp_dir(dentry, &lower_parent_path, 0);
+	if (err)
+		goto out_name;
+	lower_dir = lower_parent_path.dentry;
+
+	tmp = vfs_tmpfile(lower_dir, file_inode(zr.file)->i_mode, O_RDWR);
+	if (IS_ERR(tmp)) {
+		err = PTR_ERR(tmp);
+		goto out_path;
+	}
+	tmp_path.dentry = tmp;
+	tmp_path.mnt = lower_parent_path.mnt;
+	dst = dentry_open(&tmp_path, O_WRONLY | O_LARGEFILE, current_cred());
+	if (IS_ERR(dst)) {
+		err = PTR_ERR(dst);
+		goto out_tmp;
+	}
+	stored = bkpfs_zip_write(dentry->d_sb, sbi->mnt_opts.bkp_recompress,
+				 bkpfs_zip_pread, &zr, zr.hdr.size, dst);
+	fput(dst);
+	if (stored < 0) {
+		err = stored;
+		goto out_tmp;
+	}
+
+	/* the version may have been dropped while it was rewritten */
+	mutex_lock(&info->bkp_meta_lock);
+	err = bkpfs_get_xattr_info(dentry, &xattr);
+	if (err < 0)
+		goto out_unlock;
+	err = -ENOENT;
+	if (ver < xattr.start_ver || ver >= xattr.cur_ver)
+		goto out_unlock;
+
+	bkpfs_bkp_name(dentry, ver, name);
+	old_dentry = bkpfs_get_bkp_dentry(lower_dir, name, false);
+	if (IS_ERR(old_dentry)) {
+		err = PTR_ERR(old_dentry);
+		goto out_unlock;
+	}
+	/* give the new version a name of its own, then move it over */
+	strlcat(name, ".z", NAME_MAX + 1);
+	new_dentry = bkpfs_get_bkp_dentry(lower_dir, name, true);
+	if (IS_ERR(new_dentry)) {
+		err = PTR_ERR(new_dentry);
+		goto out_old;
+	}
+	inode_lock_nested(d_inode(lower_dir), I_MUTEX_PARENT);
+	if (d_really_is_positive(new_dentry)) {
+		/* left over by a crash, the next pass gets the name */
+		vfs_unlink(d_inode(lower_dir), new_dentry, NULL);
+		err = -EAGAIN;
+	} else {
+		err = vfs_link(tmp, d_inode(lower_dir), new_dentry, NULL);
+	}
+	inode_unlock(d_inode(lower_dir));
+	if (err)
+		goto out_new;
+
+	lock_rename(lower_dir, lower_dir);
+	err = vfs_rename(d_inode(lower_dir), new_dentry, d_inode(lower_dir),
+			 old_dentry, NULL, 0);
+	unlock_rename(lower_dir, lower_dir);
+	if (err) {
+		inode_lock_nested(d_inode(lower_dir), I_MUTEX_PARENT);
+		vfs_unlink(d_inode(lower_dir), new_dentry, NULL);
+		inode_unlock(d_inode(lower_dir));
+	}
+out_new:
+	dput(new_dentry);
+out_old:
+	dput(old_dentry);
+out_unlock:
+	mutex_unlock(&info->bkp_meta_lock);
+out_tmp:
+	dput(tmp);
+out_path:
+	path_put(&lower_parent_path);
+out_name:
+	kfree(name);
+out_zr:
+	bkpfs_zip_close(&zr);
+	return err;
+}
+
+/* @brief: worker recompressing the versions of one file which got old */
+static void bkpfs_zip_work(struct work_struct *work)
+{
+	struct bkpfs_inode_info *info;
+	struct bkpfs_xattr_info xattr;
+	struct inode *inode;
+	struct dentry *dentry;
+	const struct cred *cred, *old_cred;
+	int after, ver, err;
+
+	info = container_of(work, struct bkpfs_inode_info, zip_work);
+	inode = &info->vfs_inode;
+	after = BKPFS_SB(inode->i_sb)->mnt_opts.bkp_recompress_after;
+
+	spin_lock(&info->bkp_lock);
+	cred = info->zip_cred;
+	info->zip_cred = NULL;
+	dentry = info->zip_dentry;
+	info->zip_dentry = NULL;
+	spin_unlock(&info->bkp_lock);
+	if (!cred)
+		goto out;
+
+	old_cred = override_creds(cred);
+	if (bkpfs_get_xattr_info(dentry, &xattr) >= 0) {
+		for (ver = xattr.start_ver; ver < xattr.cur_ver - after; ver++) {
+			err = bkpfs_zip_recompress(dentry, ver);
+			if (err < 0 && err != -ENOENT) {
+				printk(KERN_INFO "ERROR:: recompressing version %d of %s failed, err=%d\n",
+				       ver, dentry->d_name.name, err);
+				break;
+			}
+		}
+	}
+	revert_creds(old_cred);
+	dput(dentry);
+	put_cred(cred);
+out:
+	iput(inode);
+}
+
+/* @brief: set up the recompression work of inode, called from alloc_inode */
+void bkpfs_zip_init(struct inode *inode)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(inode);
+
+	INIT_WORK(&info->zip_work, bkpfs_zip_work);
+	info->zip_cred = NULL;
+	info->zip_dentry = NULL;
+}
+
+/* @brief: check the codecs of the mount and create its recompression
+ *         workqueue when one is asked for.
+ */
+int bkpfs_init_zip_sb(struct super_block *sb)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+	struct mnt_opt_info *opts = &sbi->mnt_opts;
+
+	if (!opts->bkp_compress[0])
+		strlcpy(opts->bkp_compress, DEFAULT_BKP_COMPRESS,
+			sizeof(opts->bkp_compress));
+	if (!crypto_has_comp(opts->bkp_compress, 0, 0)) {
+		printk(KERN_INFO "ERROR:: no %s compression\n",
+		       opts->bkp_compress);
+		return -ENOENT;
+	}
+	if (!opts->bkp_recompress[0])
+		return 0;
+	if (!crypto_has_comp(opts->bkp_recompress, 0, 0)) {
+		printk(KERN_INFO "ERROR:: no %s compression\n",
+		       opts->bkp_recompress);
+		return -ENOENT;
+	}
+	if (!opts->bkp_recompress_after)
+		opts->bkp_recompress_after = DEFAULT_BKP_RECOMPRESS_AFTER;
+
+	/* background work, it must not compete with the backups */
+	sbi->zip_wq = alloc_workqueue("bkpfs_zip", WQ_UNBOUND | WQ_FREEZABLE,
+				      1);
+	if (!sbi->zip_wq)
+		return -ENOMEM;
+	return 0;
+}
+
+/* @brief: wait for the recompressions and free the workqueue */
+void bkpfs_destroy_zip_wq(struct super_block *sb)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+
+	if (!sbi || !sbi->zip_wq)
+		return;
+	destroy_workqueue(sbi->zip_wq);
+	sbi->zip_wq = NULL;
+}
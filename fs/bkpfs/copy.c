@@ -0,0 +1,572 @@
+/*
+ * Copyright (c) 1998-2017 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2017 Stony Brook University
+ * Copyright (c) 2003-2017 The Research Foundation of SUNY
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/*
+ * Copy engine used to move data between a user file and its backups.
+ *
+ * The cheapest method the lower file system offers is used:
+ *   1. clone (reflink) of the whole file, which only shares the extents
+ *   2. copy_file_range, which lets the lower fs copy without bouncing
+ *      the data through our page cache pages, and splices by itself when
+ *      the lower fs has no ->copy_file_range
+ *   3. do_splice_direct, for what copy_file_range refuses
+ * Cloning and direct I/O are probed at mount and switched off for the
+ * mount when found unsupported at runtime, so they are not retried on
+ * every backup.
+ *
+ * With bkp_copy_threads > 1 a copy that can't be cloned and spans several
+ * BKPFS_COPY_CHUNK chunks is split between up to that many workers of the
+ * per-mount copy workqueue.  Each worker takes the next chunk not copied
+ * yet and copies it with positioned I/O, the caller waits for all of them.
+ *
+ * With bkp_nocache the copies stay out of the page cache: the page aligned
+ * part is moved with direct I/O through a small bounce buffer when the
+ * lower fs supports it.  What is copied through the cache otherwise goes
+ * by windows, each dropping the source pages it brought into the cache
+ * and syncing and dropping the destination pages it created, except on a
+ * restore, whose destination is the user file about to be read.  Pages
+ * that were cached before the copy stay, so a backup does not evict the
+ * working set of the program using the file.
+ *
+ * Holes of the source are not copied when the destination range lies past
+ * its end: only the data extents found with SEEK_DATA/SEEK_HOLE are copied
+ * (each preallocated first) and the destination is then extended to the
+ * full length, which leaves the holes unallocated.
+ */
+
+#include "bkpfs.h"
+#include "linux/splice.h"
+#include <linux/pagemap.h>
+
+/* @brief: probe which copy offloads the lower file system implements.
+ *         An unlinked temp file is used so that the regular file ops of
+ *         the lower fs can be looked at without touching the namespace.
+ */
+void bkpfs_probe_lower_caps(struct super_block *sb, struct dentry *lower_root)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+	const struct file_operations *fop;
+	struct dentry *tmp;
+
+	tmp = vfs_tmpfile(lower_root, S_IFREG | 0600, O_RDWR);
+	if (IS_ERR(tmp)) {
+		/* can't tell: try them and let the first failure decide */
+		set_bit(BKPFS_CAP_CLONE, &sbi->caps);
+		set_bit(BKPFS_CAP_DIRECT, &sbi->caps);
+		return;
+	}
+
+	fop = d_inode(tmp)->i_fop;
+	if (fop && fop->remap_file_range)
+		set_bit(BKPFS_CAP_CLONE, &sbi->caps);
+	if (d_inode(tmp)->i_mapping->a_ops->direct_IO)
+		set_bit(BKPFS_CAP_DIRECT, &sbi->caps);
+	dput(tmp);
+
+	pr_debug("bkpfs: lower fs clone=%d direct=%d\n",
+		 test_bit(BKPFS_CAP_CLONE, &sbi->caps),
+		 test_bit(BKPFS_CAP_DIRECT, &sbi->caps));
+}
+
+/* parallel copies are split in chunks of this size */
+#define BKPFS_COPY_CHUNK	(8 << 20)
+
+/* pages of the bounce buffer of a direct copy (1MB) */
+#define BKPFS_DIO_PAGES		256
+
+/* pages looked at per window of a buffered copy with bkp_nocache (4MB) */
+#define BKPFS_NOCACHE_PAGES	1024
+
+/* one parallel copy, shared by the workers doing it */
+struct bkpfs_copy_ctl {
+	struct bkpfs_sb_info *sbi;
+	struct file *src, *dst;
+	loff_t src_pos, dst_pos, len;
+	unsigned int flags;		/* BKPFS_COPY_* */
+	const struct cred *cred;	/* of the caller, waiting for the copy */
+	unsigned long nr_chunks;
+	atomic_long_t next;		/* next chunk to copy */
+	atomic_t running;		/* workers not done yet */
+	struct completion done;
+	spinlock_t lock;		/* protects err and end */
+	int err;
+	loff_t end;			/* copied without a gap up to here */
+};
+
+struct bkpfs_copy_worker {
+	struct work_struct work;
+	struct bkpfs_copy_ctl *ctl;
+};
+
+/* @brief: create the copy workqueue of the mount when parallel copies are on */
+int bkpfs_init_copy_wq(struct super_block *sb)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+
+	if (sbi->mnt_opts.bkp_copy_threads <= 1)
+		return 0;
+	sbi->copy_wq = alloc_workqueue("bkpfs_copy", WQ_UNBOUND | WQ_MEM_RECLAIM,
+				       sbi->mnt_opts.bkp_copy_threads);
+	if (!sbi->copy_wq)
+		return -ENOMEM;
+	return 0;
+}
+
+/* @brief: free the copy workqueue, no copy is running anymore */
+void bkpfs_destroy_copy_wq(struct super_block *sb)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+
+	if (!sbi || !sbi->copy_wq)
+		return;
+	destroy_workqueue(sbi->copy_wq);
+	sbi->copy_wq = NULL;
+}
+
+/* errors meaning the lower fs can't do the operation at all */
+static inline bool bkpfs_copy_unsupported(loff_t err)
+{
+	return err == -EOPNOTSUPP || err == -EXDEV || err == -ENOTTY;
+}
+
+/* direct read (rw = READ) or write of len bytes of the pages of bv at pos */
+static ssize_t bkpfs_direct_rw(struct file *file, int rw, struct bio_vec *bv,
+			       int nr, size_t len, loff_t pos)
+{
+	struct kiocb kiocb;
+	struct iov_iter iter;
+	ssize_t res;
+
+	init_sync_kiocb(&kiocb, file);
+	kiocb.ki_flags |= IOCB_DIRECT;
+	kiocb.ki_pos = pos;
+	iov_iter_bvec(&iter, rw, bv, nr, len);
+	if (rw == READ)
+		return call_read_iter(file, &kiocb, &iter);
+
+	file_start_write(file);
+	res = call_write_iter(file, &kiocb, &iter);
+	file_end_write(file);
+	return res;
+}
+
+/* copy the page aligned head of the range with direct I/O.
+ * Return: bytes copied, the rest is left to the buffered copy
+ */
+static loff_t bkpfs_copy_direct(struct bkpfs_sb_info *sbi, struct file *src,
+				loff_t src_pos, struct file *dst,
+				loff_t dst_pos, loff_t len)
+{
+	struct bio_vec *bv;
+	loff_t copied = 0;
+	ssize_t res = 0;
+	size_t chunk;
+	int i, nr;
+
+	if (!test_bit(BKPFS_CAP_DIRECT, &sbi->caps) ||
+	    !PAGE_ALIGNED(src_pos) || !PAGE_ALIGNED(dst_pos))
+		return 0;
+	len = round_down(len, PAGE_SIZE);
+	if (!len)
+		return 0;
+
+	bv = kcalloc(BKPFS_DIO_PAGES, sizeof(*bv), GFP_KERNEL);
+	if (!bv)
+		return 0;
+	for (nr = 0; nr < BKPFS_DIO_PAGES; nr++) {
+		bv[nr].bv_page = alloc_page(GFP_KERNEL);
+		if (!bv[nr].bv_page)
+			break;
+		bv[nr].bv_len = PAGE_SIZE;
+		bv[nr].bv_offset = 0;
+	}
+
+	while (nr && copied < len) {
+		chunk = min_t(loff_t, (loff_t)nr << PAGE_SHIFT, len - copied);
+		res = bkpfs_direct_rw(src, READ, bv, nr, chunk,
+				      src_pos + copied);
+		if (res <= 0)
+			break;
+		/* the source ended: its unaligned tail goes buffered */
+		if (res < chunk)
+			chunk = round_down(res, PAGE_SIZE);
+		if (!chunk)
+			break;
+		res = bkpfs_direct_rw(dst, WRITE, bv, nr, chunk,
+				      dst_pos + copied);
+		if (res <= 0)
+			break;
+		copied += res;
+		if (res != chunk)
+			break;
+	}
+	if (res == -EINVAL || res == -EOPNOTSUPP || res == -ENOTBLK) {
+		pr_debug("bkpfs: direct I/O not usable on lower fs\n");
+		clear_bit(BKPFS_CAP_DIRECT, &sbi->caps);
+	}
+
+	for (i = 0; i < nr; i++)
+		__free_page(bv[i].bv_page);
+	kfree(bv);
+	return copied;
+}
+
+/* set in cached the pages of [first, first + nr) mapping already holds */
+static void bkpfs_cached_pages(struct address_space *mapping, pgoff_t first,
+			       unsigned long nr, unsigned long *cached)
+{
+	struct page *page;
+	unsigned long i;
+
+	bitmap_zero(cached, nr);
+	for (i = 0; i < nr; i++) {
+		page = find_get_page(mapping, first + i);
+		if (page) {
+			__set_bit(i, cached);
+			put_page(page);
+		}
+	}
+}
+
+/* drop the pages of [first, first + nr) not set in cached, the ones a copy
+ * brought in.  Dirty pages are skipped, dst has to be written back first.
+ */
+static void bkpfs_drop_new_pages(struct address_space *mapping, pgoff_t first,
+				 unsigned long nr, const unsigned long *cached)
+{
+	unsigned long i = 0, end;
+
+	while (i < nr) {
+		i = find_next_zero_bit(cached, nr, i);
+		if (i >= nr)
+			break;
+		end = find_next_bit(cached, nr, i);
+		invalidate_mapping_pages(mapping, first + i, first + end - 1);
+		i = end;
+	}
+}
+
+/* copy with copy_file_range, which does the splice itself when the lower
+ * fs has no ->copy_file_range; only what it refuses (-EXDEV) is spliced here
+ */
+static ssize_t bkpfs_copy_buffered(struct bkpfs_sb_info *sbi, struct file *src,
+				   loff_t src_pos, struct file *dst,
+				   loff_t dst_pos, loff_t len)
+{
+	loff_t copied = 0;
+	loff_t res = 0;
+
+	while (copied < len) {
+		res = vfs_copy_file_range(src, src_pos + copied, dst,
+					  dst_pos + copied, len - copied, 0);
+		if (res <= 0)
+			break;
+		copied += res;
+	}
+	if (copied == len)
+		return len;
+	if (res < 0 && !bkpfs_copy_unsupported(res))
+		return copied ? copied : res;
+
+	/* splice whatever is left */
+	src_pos += copied;
+	dst_pos += copied;
+	res = do_splice_direct(src, &src_pos, dst, &dst_pos, len - copied,
+			       SPLICE_F_MOVE);
+	if (res < 0)
+		return copied ? copied : res;
+	return copied + res;
+}
+
+/* buffered copy which leaves the page cache as it found it: a window at a
+ * time, the pages the copy brought into the cache of src are dropped, and
+ * those of dst written back and dropped unless dst is the user file being
+ * restored, which is read next.  Pages cached before the copy, such as the
+ * working set of the program using the user file, are left alone.
+ */
+static ssize_t bkpfs_copy_nocache(struct bkpfs_sb_info *sbi, struct file *src,
+				  loff_t src_pos, struct file *dst,
+				  loff_t dst_pos, loff_t len, unsigned int flags)
+{
+	DECLARE_BITMAP(src_cached, BKPFS_NOCACHE_PAGES);
+	DECLARE_BITMAP(dst_cached, BKPFS_NOCACHE_PAGES);
+	unsigned long src_nr, dst_nr;
+	pgoff_t src_first, dst_first;
+	loff_t copied = 0, chunk, spos, dpos;
+	ssize_t res = 0;
+
+	while (copied < len) {
+		/* a window never spans more than BKPFS_NOCACHE_PAGES pages */
+		chunk = min_t(loff_t, len - copied,
+			      (loff_t)(BKPFS_NOCACHE_PAGES - 1) << PAGE_SHIFT);
+		spos = src_pos + copied;
+		dpos = dst_pos + copied;
+		src_first = spos >> PAGE_SHIFT;
+		src_nr = ((spos + chunk - 1) >> PAGE_SHIFT) - src_first + 1;
+		dst_first = dpos >> PAGE_SHIFT;
+		dst_nr = ((dpos + chunk - 1) >> PAGE_SHIFT) - dst_first + 1;
+		bkpfs_cached_pages(src->f_mapping, src_first, src_nr,
+				   src_cached);
+		bkpfs_cached_pages(dst->f_mapping, dst_first, dst_nr,
+				   dst_cached);
+
+		res = bkpfs_copy_buffered(sbi, src, spos, dst, dpos, chunk);
+		if (res <= 0)
+			break;
+		bkpfs_drop_new_pages(src->f_mapping, src_first, src_nr,
+				     src_cached);
+		if (!(flags & BKPFS_COPY_RESTORE) &&
+		    !vfs_fsync_range(dst, dpos, dpos + res - 1, 1)) {
+			bkpfs_drop_new_pages(dst->f_mapping, dst_first, dst_nr,
+					     dst_cached);
+			atomic64_add(res, &sbi->bkp_nocache_bytes);
+		}
+		copied += res;
+		if (res != chunk)
+			break;
+	}
+	if (res < 0 && !copied)
+		return res;
+	return copied;
+}
+
+/* copy one range, keeping it out of the page cache with bkp_nocache */
+static ssize_t bkpfs_copy_stream(struct bkpfs_sb_info *sbi, struct file *src,
+				 loff_t src_pos, struct file *dst,
+				 loff_t dst_pos, loff_t len, unsigned int flags)
+{
+	loff_t direct;
+	ssize_t res;
+
+	if (!sbi->mnt_opts.bkp_nocache)
+		return bkpfs_copy_buffered(sbi, src, src_pos, dst, dst_pos, len);
+
+	direct = bkpfs_copy_direct(sbi, src, src_pos, dst, dst_pos, len);
+	atomic64_add(direct, &sbi->bkp_nocache_bytes);
+	if (direct == len)
+		return len;
+
+	res = bkpfs_copy_nocache(sbi, src, src_pos + direct, dst,
+				 dst_pos + direct, len - direct, flags);
+	if (res < 0)
+		return direct ? direct : res;
+	return direct + res;
+}
+
+/* worker of a parallel copy: copy chunks until there are none left */
+static void bkpfs_copy_work(struct work_struct *work)
+{
+	struct bkpfs_copy_worker *w;
+	struct bkpfs_copy_ctl *ctl;
+	const struct cred *old_cred;
+	unsigned long chunk;
+	loff_t off, len;
+	ssize_t res;
+
+	w = container_of(work, struct bkpfs_copy_worker, work);
+	ctl = w->ctl;
+
+	old_cred = override_creds(ctl->cred);
+	for (;;) {
+		chunk = atomic_long_inc_return(&ctl->next) - 1;
+		if (chunk >= ctl->nr_chunks || READ_ONCE(ctl->err))
+			break;
+		off = (loff_t)chunk * BKPFS_COPY_CHUNK;
+		len = min_t(loff_t, BKPFS_COPY_CHUNK, ctl->len - off);
+		res = bkpfs_copy_stream(ctl->sbi, ctl->src, ctl->src_pos + off,
+					ctl->dst, ctl->dst_pos + off, len,
+					ctl->flags);
+		if (res == len)
+			continue;
+
+		/* a short chunk: the source ended (shrunk) there */
+		spin_lock(&ctl->lock);
+		if (res < 0 && !ctl->err)
+			ctl->err = res;
+		else if (res >= 0)
+			ctl->end = min(ctl->end, off + res);
+		spin_unlock(&ctl->lock);
+	}
+	revert_creds(old_cred);
+
+	if (atomic_dec_and_test(&ctl->running))
+		complete(&ctl->done);
+}
+
+/* split the copy between the workers of the copy workqueue and wait */
+static ssize_t bkpfs_copy_parallel(struct bkpfs_sb_info *sbi, struct file *src,
+				   loff_t src_pos, struct file *dst,
+				   loff_t dst_pos, loff_t len, unsigned int flags)
+{
+	struct bkpfs_copy_worker *workers;
+	struct bkpfs_copy_ctl ctl;
+	int i, nr_workers;
+
+	ctl.nr_chunks = DIV_ROUND_UP_ULL(len, BKPFS_COPY_CHUNK);
+	nr_workers = min_t(unsigned long, sbi->mnt_opts.bkp_copy_threads,
+			   ctl.nr_chunks);
+	workers = kmalloc_array(nr_workers, sizeof(*workers), GFP_KERNEL);
+	if (!workers)
+		return bkpfs_copy_stream(sbi, src, src_pos, dst, dst_pos, len,
+					 flags);
+
+	ctl.sbi = sbi;
+	ctl.src = src;
+	ctl.dst = dst;
+	ctl.src_pos = src_pos;
+	ctl.dst_pos = dst_pos;
+	ctl.len = len;
+	ctl.flags = flags;
+	ctl.cred = current_cred();
+	atomic_long_set(&ctl.next, 0);
+	atomic_set(&ctl.running, nr_workers);
+	init_completion(&ctl.done);
+	spin_lock_init(&ctl.lock);
+	ctl.err = 0;
+	ctl.end = len;
+
+	for (i = 0; i < nr_workers; i++) {
+		INIT_WORK(&workers[i].work, bkpfs_copy_work);
+		workers[i].ctl = &ctl;
+		queue_work(sbi->copy_wq, &workers[i].work);
+	}
+	wait_for_completion(&ctl.done);
+	kfree(workers);
+
+	if (ctl.err)
+		return ctl.err;
+	return ctl.end;
+}
+
+/* copy a range holding data */
+static ssize_t bkpfs_copy_data(struct bkpfs_sb_info *sbi, struct file *src,
+			       loff_t src_pos, struct file *dst,
+			       loff_t dst_pos, loff_t len, unsigned int flags)
+{
+	/* big files are copied by several streams at once */
+	if (sbi->copy_wq && len > BKPFS_COPY_CHUNK)
+		return bkpfs_copy_parallel(sbi, src, src_pos, dst, dst_pos, len,
+					   flags);
+
+	return bkpfs_copy_stream(sbi, src, src_pos, dst, dst_pos, len, flags);
+}
+
+/* copy the data extents of the range only, dst is not longer than dst_pos */
+static ssize_t bkpfs_copy_sparse(struct bkpfs_sb_info *sbi, struct file *src,
+				 loff_t src_pos, struct file *dst,
+				 loff_t dst_pos, loff_t len, unsigned int flags)
+{
+	loff_t end, pos, data, hole;
+	ssize_t res;
+	int err;
+
+	/* like a plain copy, stop where the source ends */
+	end = min_t(loff_t, src_pos + len, i_size_read(file_inode(src)));
+	if (end <= src_pos)
+		return 0;
+
+	for (pos = src_pos; pos < end; pos = hole) {
+		data = vfs_llseek(src, pos, SEEK_DATA);
+		if (data == -ENXIO)
+			break;		/* a hole up to the end */
+		if (data < 0) {
+			/* no hole information: copy the rest as it is */
+			res = bkpfs_copy_data(sbi, src, pos, dst,
+					      dst_pos + (pos - src_pos), end - pos,
+					      flags);
+			goto out_res;
+		}
+		if (data >= end)
+			break;
+		hole = vfs_llseek(src, data, SEEK_HOLE);
+		if (hole < 0 || hole > end)
+			hole = end;
+
+		/* one allocation for the extent, keeps the backup contiguous */
+		vfs_fallocate(dst, FALLOC_FL_KEEP_SIZE, dst_pos + (data - src_pos),
+			      hole - data);
+		res = bkpfs_copy_data(sbi, src, data, dst,
+				      dst_pos + (data - src_pos), hole - data,
+				      flags);
+		pos = data;
+		if (res != hole - data)
+			goto out_res;
+	}
+
+	/* the range ended in a hole, which is only a size to set */
+	if (i_size_read(file_inode(dst)) < dst_pos + (end - src_pos)) {
+		err = vfs_truncate(&dst->f_path, dst_pos + (end - src_pos));
+		if (err)
+			return err;
+	}
+	return end - src_pos;
+
+out_res:
+	if (res < 0)
+		return pos > src_pos ? pos - src_pos : res;
+	return pos - src_pos + res;
+}
+
+static ssize_t __bkpfs_copy_range(struct super_block *sb, struct file *src,
+				  loff_t src_pos, struct file *dst,
+				  loff_t dst_pos, loff_t len, unsigned int flags)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+	loff_t res;
+
+	if (len <= 0)
+		return 0;
+
+	/* a whole file going into an empty one can share the extents */
+	if (test_bit(BKPFS_CAP_CLONE, &sbi->caps) && !src_pos && !dst_pos &&
+	    len == i_size_read(file_inode(src)) &&
+	    !i_size_read(file_inode(dst))) {
+		res = vfs_clone_file_range(src, 0, dst, 0, len, 0);
+		if (res == len)
+			return len;
+		if (bkpfs_copy_unsupported(res)) {
+			pr_debug("bkpfs: clone not supported by lower fs\n");
+			clear_bit(BKPFS_CAP_CLONE, &sbi->caps);
+		}
+	}
+
+	/* nothing to overwrite in dst: its holes can be left unwritten */
+	if (dst_pos >= i_size_read(file_inode(dst)))
+		return bkpfs_copy_sparse(sbi, src, src_pos, dst, dst_pos, len,
+					 flags);
+
+	return bkpfs_copy_data(sbi, src, src_pos, dst, dst_pos, len, flags);
+}
+
+/* @brief:	copy len bytes from src at src_pos to dst at dst_pos.
+ * Input :
+ *			sb	-> bkpfs super block, holds the probed capabilities
+ * Return:	bytes copied or -errno
+ */
+ssize_t bkpfs_copy_range(struct super_block *sb, struct file *src,
+			 loff_t src_pos, struct file *dst, loff_t dst_pos,
+			 loff_t len)
+{
+	return __bkpfs_copy_range(sb, src, src_pos, dst, dst_pos, len, 0);
+}
+
+/* @brief:	bkpfs_copy_range into the lower file of the user file, which
+ *		is read right after a restore: with bkp_nocache its pages stay
+ *		in the cache.
+ * Return:	bytes copied or -errno
+ */
+ssize_t bkpfs_copy_restore(struct super_block *sb, struct file *src,
+			   loff_t src_pos, struct file *dst, loff_t dst_pos,
+			   loff_t len)
+{
+	return __bkpfs_copy_range(sb, src, src_pos, dst, dst_pos, len,
+				  BKPFS_COPY_RESTORE);
+}
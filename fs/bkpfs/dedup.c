@@ -0,0 +1,355 @@
+/*
+ * Copyright (c) 1998-2017 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2017 Stony Brook University
+ * Copyright (c) 2003-2017 The Research Foundation of SUNY
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/*
+ * Whole file dedup of full backups (bkp_dedup).
+ *
+ * The mount keeps an index of the recent full backups, hashed by size.
+ * Before a file is copied, the backups of the same size in the index are
+ * compared with it, by crc32c first (computed the first time an entry is
+ * compared) and then byte by byte, and when one holds the same content
+ * the new version is a hard link to it instead of a copy.  Dropping such
+ * a version only drops a link.
+ *
+ * Only backups with the owner and mode the copy would get are linked to,
+ * so a version never ends up readable by someone who could not read it
+ * as a copy.  The index holds a reference on the lower dentry of every
+ * entry and is bounded to BKPFS_DEDUP_MAX entries, the least recently
+ * used going first; deleting a backup removes its entry.
+ */
+
+#include "bkpfs.h"
+
+#define BKPFS_DEDUP_MAX		4096	/* entries in the index of a mount */
+#define BKPFS_DEDUP_TRY		4	/* candidates compared per backup */
+#define BKPFS_DEDUP_BUF		(64 * 1024)
+
+struct bkpfs_dedup_ent {
+	struct hlist_node hash;		/* on bkpfs_sb_info.dedup_hash, by size */
+	struct list_head lru;		/* on bkpfs_sb_info.dedup_lru */
+	loff_t size;
+	u32 crc;
+	int crc_valid;			/* crc was computed */
+	struct path path;		/* lower backup file */
+};
+
+static void bkpfs_dedup_unhash(struct bkpfs_sb_info *sbi,
+			       struct bkpfs_dedup_ent *ent)
+{
+	hash_del(&ent->hash);
+	list_del(&ent->lru);
+	sbi->dedup_nr--;
+}
+
+static void bkpfs_dedup_free(struct bkpfs_dedup_ent *ent)
+{
+	path_put(&ent->path);
+	kfree(ent);
+}
+
+/* the entry still names a backup of its size */
+static bool bkpfs_dedup_live(struct bkpfs_dedup_ent *ent)
+{
+	struct dentry *dentry = ent->path.dentry;
+
+	return !d_unhashed(dentry) && d_really_is_positive(dentry) &&
+	       d_inode(dentry)->i_nlink &&
+	       i_size_read(d_inode(dentry)) == ent->size;
+}
+
+/* the backup can stand for a copy of user_file made with the current creds */
+static bool bkpfs_dedup_owner_ok(struct bkpfs_dedup_ent *ent,
+				 struct file *user_file)
+{
+	struct inode *inode = d_inode(ent->path.dentry);
+
+	return uid_eq(inode->i_uid, current_fsuid()) &&
+	       gid_eq(inode->i_gid, current_fsgid()) &&
+	       inode->i_mode == file_inode(user_file)->i_mode;
+}
+
+/* @brief: tell whether the first len bytes of a and b are the same */
+static int bkpfs_dedup_same(struct file *a, struct file *b, loff_t len)
+{
+	loff_t apos = 0, bpos = 0;
+	ssize_t ares, bres;
+	void *abuf, *bbuf;
+	int same = 0;
+
+	abuf = kmalloc(BKPFS_DEDUP_BUF, GFP_KERNEL);
+	bbuf = kmalloc(BKPFS_DEDUP_BUF, GFP_KERNEL);
+	if (!abuf || !bbuf)
+		goto out;
+
+	while (apos < len) {
+		ares = kernel_read(a, abuf, min_t(loff_t, BKPFS_DEDUP_BUF,
+						  len - apos), &apos);
+		if (ares <= 0)
+			goto out;
+		bres = kernel_read(b, bbuf, ares, &bpos);
+		if (bres != ares || memcmp(abuf, bbuf, ares))
+			goto out;
+	}
+	same = 1;
+out:
+	kfree(bbuf);
+	kfree(abuf);
+	return same;
+}
+
+/* @brief: crc of the backup of an index entry, computed once */
+static int bkpfs_dedup_crc(struct bkpfs_sb_info *sbi, struct path *path,
+			   loff_t size, u32 *crc)
+{
+	struct bkpfs_dedup_ent *ent;
+	struct file *file;
+	int err;
+
+	file = dentry_open(path, O_RDONLY | O_LARGEFILE, current_cred());
+	if (IS_ERR(file))
+		return PTR_ERR(file);
+	err = bkpfs_crc_file(file, size, crc);
+	fput(file);
+	if (err)
+		return err;
+
+	/* the entry may have gone meanwhile, look it up again */
+	spin_lock(&sbi->dedup_lock);
+	hash_for_each_possible(sbi->dedup_hash, ent, hash, size) {
+		if (ent->path.dentry == path->dentry && ent->size == size) {
+			ent->crc = *crc;
+			ent->crc_valid = 1;
+		}
+	}
+	spin_unlock(&sbi->dedup_lock);
+	return 0;
+}
+
+/* @brief: find a backup in the index with the content of user_file.
+ * Output:	found	-> referenced path of that backup
+ * Return:	1 if one was found, 0 if not
+ */
+static int bkpfs_dedup_find(struct bkpfs_sb_info *sbi, struct file *user_file,
+			    loff_t size, struct path *found)
+{
+	struct bkpfs_dedup_ent *ent;
+	struct path cand[BKPFS_DEDUP_TRY];
+	u32 cand_crc[BKPFS_DEDUP_TRY];
+	int cand_valid[BKPFS_DEDUP_TRY];
+	struct file *file;
+	u32 crc, user_crc;
+	int nr = 0, i, user_valid = 0, hit = 0;
+
+	spin_lock(&sbi->dedup_lock);
+	hash_for_each_possible(sbi->dedup_hash, ent, hash, size) {
+		if (ent->size != size || !bkpfs_dedup_live(ent) ||
+		    !bkpfs_dedup_owner_ok(ent, user_file))
+			continue;
+		path_get(&ent->path);
+		cand[nr] = ent->path;
+		cand_crc[nr] = ent->crc;
+		cand_valid[nr] = ent->crc_valid;
+		list_move(&ent->lru, &sbi->dedup_lru);
+		if (++nr == BKPFS_DEDUP_TRY)
+			break;
+	}
+	spin_unlock(&sbi->dedup_lock);
+
+	for (i = 0; i < nr; i++) {
+		if (hit)
+			goto put;
+		if (!user_valid) {
+			if (bkpfs_crc_file(user_file, size, &user_crc))
+				goto put;
+			user_valid = 1;
+		}
+		crc = cand_crc[i];
+		if (!cand_valid[i] && bkpfs_dedup_crc(sbi, &cand[i], size, &crc))
+			goto put;
+		if (crc != user_crc)
+			goto put;
+
+		/* crc32c is no proof, compare the bytes */
+		file = dentry_open(&cand[i], O_RDONLY | O_LARGEFILE,
+				   current_cred());
+		if (IS_ERR(file))
+			goto put;
+		if (bkpfs_dedup_same(user_file, file, size)) {
+			*found = cand[i];
+			hit = 1;
+			fput(file);
+			continue;
+		}
+		fput(file);
+put:
+		path_put(&cand[i]);
+	}
+	return hit;
+}
+
+/* @brief: take the next version as a link to an identical backup.
+ *         Called for full backups with bkp_dedup set.
+ * Return:	0, -EAGAIN when the file must be copied, or -errno
+ */
+int bkpfs_dedup_backup(struct dentry *dentry)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(dentry->d_sb);
+	struct bkpfs_inode_info *info = BKPFS_I(d_inode(dentry));
+	struct mnt_opt_info *opts = &sbi->mnt_opts;
+	struct bkpfs_xattr_info xattr;
+	struct path lower_path, found;
+	struct file *user_file;
+	loff_t size;
+	int err;
+
+	size = i_size_read(bkpfs_lower_inode(d_inode(dentry)));
+	if (!size)
+		return -EAGAIN;
+
+	bkpfs_get_lower_path(dentry, &lower_path);
+	user_file = dentry_open(&lower_path, O_RDONLY | O_LARGEFILE,
+				current_cred());
+	bkpfs_put_lower_path(dentry, &lower_path);
+	if (IS_ERR(user_file))
+		return PTR_ERR(user_file);
+	err = bkpfs_dedup_find(sbi, user_file, size, &found);
+	fput(user_file);
+	if (!err)
+		return -EAGAIN;
+
+	mutex_lock(&info->bkp_meta_lock);
+	err = bkpfs_get_xattr_info(dentry, &xattr);
+	if (err < 0)
+		goto out_unlock;
+	err = bkpfs_link_backup(dentry, found.dentry, xattr.cur_ver);
+	if (err < 0) {
+		/* too many links, another file system under the lower dir... */
+		err = -EAGAIN;
+		goto out_unlock;
+	}
+	pr_debug("INFO::backup file linked with num=%d\n", xattr.cur_ver);
+	atomic64_inc(&sbi->bkp_deduped);
+	err = bkpfs_update_after_write(dentry, &xattr,
+			opts->maxvers ? opts->maxvers : DEFAULT_MAXVERS);
+out_unlock:
+	mutex_unlock(&info->bkp_meta_lock);
+	path_put(&found);
+	return err;
+}
+
+/* @brief: add the full backup just made as version ver to the index */
+void bkpfs_dedup_insert(struct dentry *dentry, int ver, loff_t size)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(dentry->d_sb);
+	struct bkpfs_dedup_ent *ent, *old = NULL;
+	struct dentry *bkp_dentry;
+	struct path lower_parent_path;
+	char *name;
+
+	if (!sbi->mnt_opts.bkp_dedup || !size)
+		return;
+
+	name = kmalloc(NAME_MAX, GFP_KERNEL);
+	ent = kmalloc(sizeof(*ent), GFP_KERNEL);
+	if (!name || !ent)
+		goto out;
+
+	if (bkpfs_bkp_dir(dentry, &lower_parent_path, 0))
+		goto out;
+	bkpfs_bkp_name(dentry, ver, name);
+	bkp_dentry = bkpfs_get_bkp_dentry(lower_parent_path.dentry, name, false);
+	if (IS_ERR(bkp_dentry)) {
+		path_put(&lower_parent_path);
+		goto out;
+	}
+	ent->path.mnt = mntget(lower_parent_path.mnt);
+	ent->path.dentry = bkp_dentry;
+	ent->size = size;
+	ent->crc_valid = 0;
+	path_put(&lower_parent_path);
+
+	spin_lock(&sbi->dedup_lock);
+	hash_add(sbi->dedup_hash, &ent->hash, size);
+	list_add(&ent->lru, &sbi->dedup_lru);
+	if (++sbi->dedup_nr > BKPFS_DEDUP_MAX) {
+		old = list_last_entry(&sbi->dedup_lru, struct bkpfs_dedup_ent,
+				      lru);
+		bkpfs_dedup_unhash(sbi, old);
+	}
+	spin_unlock(&sbi->dedup_lock);
+	ent = NULL;
+
+	if (old)
+		bkpfs_dedup_free(old);
+out:
+	kfree(ent);
+	kfree(name);
+}
+
+/* @brief: drop the index entries of a lower backup about to be deleted,
+ *         so the index does not keep its data alive.
+ */
+void bkpfs_dedup_forget(struct super_block *sb, struct dentry *bkp_dentry)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+	struct bkpfs_dedup_ent *ent;
+	struct hlist_node *tmp;
+	LIST_HEAD(dead);
+	loff_t size;
+
+	if (!sbi->mnt_opts.bkp_dedup || d_really_is_negative(bkp_dentry))
+		return;
+
+	size = i_size_read(d_inode(bkp_dentry));
+	spin_lock(&sbi->dedup_lock);
+	hash_for_each_possible_safe(sbi->dedup_hash, ent, tmp, hash, size) {
+		if (ent->path.dentry != bkp_dentry)
+			continue;
+		bkpfs_dedup_unhash(sbi, ent);
+		list_add(&ent->lru, &dead);
+	}
+	spin_unlock(&sbi->dedup_lock);
+
+	while (!list_empty(&dead)) {
+		ent = list_first_entry(&dead, struct bkpfs_dedup_ent, lru);
+		list_del(&ent->lru);
+		bkpfs_dedup_free(ent);
+	}
+}
+
+/* @brief: set up the dedup index of the mount, from read_super */
+void bkpfs_dedup_init_sb(struct super_block *sb)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+
+	spin_lock_init(&sbi->dedup_lock);
+	hash_init(sbi->dedup_hash);
+	INIT_LIST_HEAD(&sbi->dedup_lru);
+	sbi->dedup_nr = 0;
+}
+
+/* @brief: empty the dedup index, dropping its lower dentries */
+void bkpfs_dedup_put_sb(struct super_block *sb)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+	struct bkpfs_dedup_ent *ent;
+
+	spin_lock(&sbi->dedup_lock);
+	while (!list_empty(&sbi->dedup_lru)) {
+		ent = list_first_entry(&sbi->dedup_lru, struct bkpfs_dedup_ent,
+				       lru);
+		bkpfs_dedup_unhash(sbi, ent);
+		spin_unlock(&sbi->dedup_lock);
+		bkpfs_dedup_free(ent);
+		spin_lock(&sbi->dedup_lock);
+	}
+	spin_unlock(&sbi->dedup_lock);
+}
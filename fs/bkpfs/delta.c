@@ -0,0 +1,685 @@
+/*
+ * Copyright (c) 1998-2017 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2017 Stony Brook University
+ * Copyright (c) 2003-2017 The Research Foundation of SUNY
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/*
+ * Forward delta backup format (bkp_format=delta).
+ *
+ * The extents written since the last version are tracked in an interval
+ * tree hanging off the bkpfs inode.  A version then only stores those
+ * extents (a delta) on top of the previous version, and every
+ * bkp_ckpt_every versions a full copy (a checkpoint) is stored instead so
+ * the chain to replay stays short.  Every version file starts with a
+ * header giving its type and the file size at that version, a delta then
+ * has its extent table followed by the extent data in table order, while
+ * a checkpoint has the file data right after the header.
+ *
+ * Version N is built by taking the nearest checkpoint at or before N and
+ * replaying the deltas up to N.  When the oldest version is dropped, the
+ * next one is folded into it: the delta's extents are patched into the
+ * checkpoint which is then renamed over the delta, so the retention cost
+ * is proportional to the delta and not to the file size.
+ *
+ * A write is tracked before it is issued, so a version taken while it is
+ * in flight (async or debounced backups) can't leave it out, and again once
+ * it landed, for the next version.  Stores through a shared mapping are
+ * tracked by page when they fault into page_mkwrite.  Writes the tracker
+ * could not see (inode evicted, async direct I/O) invalidate it and the
+ * next version is a checkpoint.
+ */
+
+#include "bkpfs.h"
+
+#define BKPFS_DELTA_MAGIC	0x544c4442	/* "BDLT" */
+#define BKPFS_DELTA_CKPT	1
+#define BKPFS_DELTA_DIFF	2
+
+/* header at the start of every version file */
+struct bkpfs_delta_hdr {
+	u32 magic;
+	u32 type;	/* BKPFS_DELTA_CKPT or BKPFS_DELTA_DIFF */
+	u64 size;	/* size of the user file at this version */
+	u32 nr_ext;	/* entries of the extent table (deltas only) */
+	u32 pad;
+};
+
+/* extent table entry of a delta, data follows the table in this order */
+struct bkpfs_delta_ext {
+	u64 off;
+	u64 len;
+};
+
+#define BKPFS_DELTA_DATA	((loff_t)sizeof(struct bkpfs_delta_hdr))
+
+/* free the extents of a tree detached from the inode */
+static void bkpfs_delta_free(struct rb_root_cached *root)
+{
+	struct interval_tree_node *node;
+
+	while ((node = interval_tree_iter_first(root, 0, ULONG_MAX))) {
+		interval_tree_remove(node, root);
+		kfree(node);
+	}
+}
+
+/* @brief: forget the tracked extents, the next version is a checkpoint */
+void bkpfs_delta_invalidate(struct inode *inode)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(inode);
+
+	mutex_lock(&info->dt_lock);
+	bkpfs_delta_free(&info->dt_root);
+	info->dt_valid = 0;
+	mutex_unlock(&info->dt_lock);
+}
+
+/* @brief: record that [pos, pos + len) of inode was written */
+void bkpfs_delta_track(struct inode *inode, loff_t pos, loff_t len)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(inode);
+	struct interval_tree_node *node;
+	unsigned long start, last;
+
+	if (BKPFS_SB(inode->i_sb)->mnt_opts.bkp_format != BKP_FORMAT_DELTA ||
+	    len <= 0)
+		return;
+
+	start = pos;
+	last = pos + len - 1;
+
+	mutex_lock(&info->dt_lock);
+	/* nothing to add to until a version was taken by this inode */
+	if (!info->dt_valid)
+		goto out;
+
+	/* merge with the overlapping and adjacent extents */
+	while ((node = interval_tree_iter_first(&info->dt_root,
+						start ? start - 1 : 0,
+						last + 1))) {
+		start = min(start, node->start);
+		last = max(last, node->last);
+		interval_tree_remove(node, &info->dt_root);
+		kfree(node);
+	}
+
+	node = kmalloc(sizeof(*node), GFP_KERNEL);
+	if (!node) {
+		bkpfs_delta_free(&info->dt_root);
+		info->dt_valid = 0;
+		goto out;
+	}
+	node->start = start;
+	node->last = last;
+	interval_tree_insert(node, &info->dt_root);
+out:
+	mutex_unlock(&info->dt_lock);
+}
+
+/* @brief: a truncate shrinking the file changes the bytes it cuts off, a
+ *         later extension reads them back as zeroes.
+ */
+void bkpfs_delta_truncate(struct inode *inode, loff_t new_size)
+{
+	loff_t old_size = i_size_read(bkpfs_lower_inode(inode));
+
+	if (new_size < old_size)
+		bkpfs_delta_track(inode, new_size, old_size - new_size);
+}
+
+/* read and check the header of a version file */
+static int bkpfs_delta_read_hdr(struct file *file, struct bkpfs_delta_hdr *hdr)
+{
+	loff_t pos = 0;
+	ssize_t res;
+
+	res = kernel_read(file, hdr, sizeof(*hdr), &pos);
+	if (res < 0)
+		return res;
+	if (res != sizeof(*hdr) || hdr->magic != BKPFS_DELTA_MAGIC) {
+		printk(KERN_INFO "ERROR:: bad delta version header\n");
+		return -EIO;
+	}
+	return 0;
+}
+
+/* read the extent table of a delta, caller frees it */
+static int bkpfs_delta_read_ext(struct file *file, struct bkpfs_delta_hdr *hdr,
+				struct bkpfs_delta_ext **ext)
+{
+	size_t len = hdr->nr_ext * sizeof(struct bkpfs_delta_ext);
+	loff_t pos = BKPFS_DELTA_DATA;
+	ssize_t res;
+
+	*ext = NULL;
+	if (!hdr->nr_ext)
+		return 0;
+	*ext = kvmalloc(len, GFP_KERNEL);
+	if (!*ext)
+		return -ENOMEM;
+	res = kernel_read(file, *ext, len, &pos);
+	if (res != len) {
+		kvfree(*ext);
+		*ext = NULL;
+		return res < 0 ? res : -EIO;
+	}
+	return 0;
+}
+
+/* open the lower user file */
+static struct file *bkpfs_delta_open_lower(struct dentry *dentry, int flags)
+{
+	struct path lower_path;
+	struct file *lower_file;
+
+	bkpfs_get_lower_path(dentry, &lower_path);
+	lower_file = dentry_open(&lower_path, flags | O_LARGEFILE,
+				 current_cred());
+	bkpfs_put_lower_path(dentry, &lower_path);
+	return lower_file;
+}
+
+/* write a version: header, then a checkpoint or the detached extents */
+static int bkpfs_delta_write(struct dentry *dentry, struct file *src,
+			     struct file *dst, struct rb_root_cached *root,
+			     int ckpt)
+{
+	struct bkpfs_delta_hdr hdr;
+	struct bkpfs_delta_ext *ext = NULL;
+	struct interval_tree_node *node;
+	loff_t size, pos, data;
+	ssize_t res;
+	u32 nr = 0, i;
+	int err = 0;
+
+	size = i_size_read(file_inode(src));
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = BKPFS_DELTA_MAGIC;
+	hdr.size = size;
+
+	if (ckpt) {
+		hdr.type = BKPFS_DELTA_CKPT;
+		data = BKPFS_DELTA_DATA;
+		res = bkpfs_copy_range(dentry->d_sb, src, 0, dst, data, size);
+		if (res != size)
+			return res < 0 ? res : -EIO;
+		data += size;
+		goto write_hdr;
+	}
+
+	/* extents past the current size were cut off by a truncate since */
+	for (node = interval_tree_iter_first(root, 0, ULONG_MAX); node;
+	     node = interval_tree_iter_next(node, 0, ULONG_MAX))
+		if (node->start < size)
+			nr++;
+
+	hdr.type = BKPFS_DELTA_DIFF;
+	hdr.nr_ext = nr;
+	if (nr) {
+		ext = kvmalloc_array(nr, sizeof(*ext), GFP_KERNEL);
+		if (!ext)
+			return -ENOMEM;
+	}
+	i = 0;
+	for (node = interval_tree_iter_first(root, 0, ULONG_MAX); node;
+	     node = interval_tree_iter_next(node, 0, ULONG_MAX)) {
+		if (node->start >= size)
+			continue;
+		ext[i].off = node->start;
+		ext[i].len = min_t(loff_t, node->last + 1, size) - node->start;
+		i++;
+	}
+
+	pos = BKPFS_DELTA_DATA;
+	if (nr) {
+		res = kernel_write(dst, ext, nr * sizeof(*ext), &pos);
+		if (res != nr * sizeof(*ext)) {
+			err = res < 0 ? res : -EIO;
+			goto out;
+		}
+	}
+	data = pos;
+	for (i = 0; i < nr; i++) {
+		res = bkpfs_copy_range(dentry->d_sb, src, ext[i].off, dst,
+				       data, ext[i].len);
+		if (res != ext[i].len) {
+			err = res < 0 ? res : -EIO;
+			goto out;
+		}
+		data += ext[i].len;
+	}
+
+write_hdr:
+	/* a slot left over by a failed attempt may be longer */
+	if (i_size_read(file_inode(dst)) > data) {
+		err = vfs_truncate(&dst->f_path, data);
+		if (err)
+			goto out;
+	}
+	pos = 0;
+	res = kernel_write(dst, &hdr, sizeof(hdr), &pos);
+	if (res != sizeof(hdr))
+		err = res < 0 ? res : -EIO;
+out:
+	kvfree(ext);
+	return err;
+}
+
+/* @brief: take the next version of the user file in delta format.
+ * input :
+ *         dentry: dentry of user file created inside the mount
+ * return: err
+ */
+int bkpfs_delta_backup(struct dentry *dentry)
+{
+	struct inode *inode = d_inode(dentry);
+	struct bkpfs_inode_info *info = BKPFS_I(inode);
+	struct mnt_opt_info *opts = &BKPFS_SB(dentry->d_sb)->mnt_opts;
+	struct rb_root_cached root = RB_ROOT_CACHED;
+	struct bkpfs_xattr_info xattr;
+	struct file *src, *dst;
+	unsigned int maxvers, every;
+	int valid, ckpt, err;
+
+	maxvers = opts->maxvers ? opts->maxvers : DEFAULT_MAXVERS;
+	every = opts->bkp_ckpt_every ? opts->bkp_ckpt_every :
+		DEFAULT_BKP_CKPT_EVERY;
+
+	err = bkpfs_get_xattr_info(dentry, &xattr);
+	if (err < 0)
+		return err;
+
+	/* writes from now on go to the next version.  Stores through a
+	 * mapping fault into page_mkwrite again and wait for the swap.
+	 */
+	mutex_lock(&info->dt_lock);
+	bkpfs_mmap_rearm(inode);
+	valid = info->dt_valid;
+	root = info->dt_root;
+	info->dt_root = RB_ROOT_CACHED;
+	info->dt_valid = 1;
+	mutex_unlock(&info->dt_lock);
+
+	ckpt = !valid || xattr.cur_ver == xattr.start_ver ||
+	       xattr.ckpt_ver < xattr.start_ver ||
+	       xattr.cur_ver - xattr.ckpt_ver >= every;
+
+	src = bkpfs_delta_open_lower(dentry, O_RDONLY);
+	if (IS_ERR(src)) {
+		err = PTR_ERR(src);
+		goto out;
+	}
+	dst = bkpfs_open_version(dentry, xattr.cur_ver, O_WRONLY | O_CREAT);
+	if (IS_ERR(dst)) {
+		err = PTR_ERR(dst);
+		goto out_src;
+	}
+
+	err = bkpfs_delta_write(dentry, src, dst, &root, ckpt);
+	fput(dst);
+	if (err < 0) {
+		printk(KERN_INFO "ERROR:: Failed writing delta version %d\n",
+		       xattr.cur_ver);
+		goto out_src;
+	}
+
+	if (ckpt)
+		xattr.ckpt_ver = xattr.cur_ver;
+	err = bkpfs_update_after_write(dentry, &xattr, maxvers);
+
+out_src:
+	fput(src);
+out:
+	/* the extents of a version that failed are lost */
+	if (err < 0)
+		bkpfs_delta_invalidate(inode);
+	bkpfs_delta_free(&root);
+	return err;
+}
+
+/* @brief: drop version ver, the oldest one, by folding it into ver + 1
+ *         unless that one is a checkpoint itself.
+ */
+static int bkpfs_delta_fold(struct dentry *dentry, int ver)
+{
+	struct bkpfs_delta_hdr hdr, next_hdr;
+	struct bkpfs_delta_ext *ext = NULL;
+	struct file *file, *next;
+	struct dentry *lower_dir, *old_dentry, *new_dentry;
+	struct path lower_parent_path;
+	char *name;
+	loff_t data;
+	ssize_t res;
+	u32 i;
+	int err;
+
+	next = bkpfs_open_version(dentry, ver + 1, O_RDONLY);
+	if (IS_ERR(next))
+		return PTR_ERR(next);
+	err = bkpfs_delta_read_hdr(next, &next_hdr);
+	if (err)
+		goto out_next;
+	if (next_hdr.type == BKPFS_DELTA_CKPT) {
+		err = 1;	/* nothing to fold, just delete */
+		goto out_next;
+	}
+	err = bkpfs_delta_read_ext(next, &next_hdr, &ext);
+	if (err)
+		goto out_next;
+
+	file = bkpfs_open_version(dentry, ver, O_RDWR);
+	if (IS_ERR(file)) {
+		err = PTR_ERR(file);
+		goto out_ext;
+	}
+	err = bkpfs_delta_read_hdr(file, &hdr);
+	if (err)
+		goto out_file;
+	if (hdr.type != BKPFS_DELTA_CKPT) {
+		printk(KERN_INFO "ERROR:: oldest delta version is not a checkpoint\n");
+		err = -EIO;
+		goto out_file;
+	}
+
+	/* cut or extend to the size of the next version, then patch */
+	err = vfs_truncate(&file->f_path, BKPFS_DELTA_DATA + next_hdr.size);
+	if (err)
+		goto out_file;
+	data = BKPFS_DELTA_DATA + next_hdr.nr_ext * sizeof(*ext);
+	for (i = 0; i < next_hdr.nr_ext; i++) {
+		res = bkpfs_copy_range(dentry->d_sb, next, data, file,
+				       BKPFS_DELTA_DATA + ext[i].off,
+				       ext[i].len);
+		if (res != ext[i].len) {
+			err = res < 0 ? res : -EIO;
+			goto out_file;
+		}
+		data += ext[i].len;
+	}
+	hdr.size = next_hdr.size;
+	data = 0;
+	res = kernel_write(file, &hdr, sizeof(hdr), &data);
+	if (res != sizeof(hdr)) {
+		err = res < 0 ? res : -EIO;
+		goto out_file;
+	}
+	fput(file);
+	fput(next);
+	kvfree(ext);
+
+	/* the patched checkpoint takes the place of the delta */
+	name = kmalloc(NAME_MAX, GFP_KERNEL);
+	if (!name)
+		return -ENOMEM;
+	err = bkpfs_bkp_dir(dentry, &lower_parent_path, 0);
+	if (err)
+		goto out_name;
+	lower_dir = lower_parent_path.dentry;
+
+	bkpfs_bkp_name(dentry, ver, name);
+	old_dentry = bkpfs_get_bkp_dentry(lower_dir, name, false);
+	if (IS_ERR(old_dentry)) {
+		err = PTR_ERR(old_dentry);
+		goto out_path;
+	}
+	bkpfs_bkp_name(dentry, ver + 1, name);
+	new_dentry = bkpfs_get_bkp_dentry(lower_dir, name, false);
+	if (IS_ERR(new_dentry)) {
+		err = PTR_ERR(new_dentry);
+		goto out_old;
+	}
+
+	lock_rename(lower_dir, lower_dir);
+	err = vfs_rename(d_inode(lower_dir), old_dentry, d_inode(lower_dir),
+			 new_dentry, NULL, 0);
+	unlock_rename(lower_dir, lower_dir);
+
+	dput(new_dentry);
+out_old:
+	dput(old_dentry);
+out_path:
+	path_put(&lower_parent_path);
+out_name:
+	kfree(name);
+	return err;
+
+out_file:
+	fput(file);
+out_ext:
+	kvfree(ext);
+out_next:
+	fput(next);
+	return err;
+}
+
+/* @brief: drop the oldest version xattr->start_ver, keeping the versions
+ *         after it readable.  xattr->start_ver is left to the caller.
+ */
+int bkpfs_delta_drop_oldest(struct inode *dir, struct dentry *dentry,
+			    struct bkpfs_xattr_info *xattr)
+{
+	int ver = xattr->start_ver;
+	int err = 1;
+
+	if (ver + 1 < xattr->cur_ver) {
+		err = bkpfs_delta_fold(dentry, ver);
+		if (err < 0)
+			return err;
+	}
+	/* folded: the checkpoint now lives in the next slot */
+	if (!err) {
+		if (xattr->ckpt_ver < ver + 1)
+			xattr->ckpt_ver = ver + 1;
+		return 0;
+	}
+	return delete_backup_file(dir, dentry, ver);
+}
+
+/* @brief: size of the user file at version ver */
+int bkpfs_delta_size(struct dentry *dentry, int ver, loff_t *size)
+{
+	struct bkpfs_delta_hdr hdr;
+	struct file *file;
+	int err;
+
+	file = bkpfs_open_version(dentry, ver, O_RDONLY);
+	if (IS_ERR(file))
+		return PTR_ERR(file);
+	err = bkpfs_delta_read_hdr(file, &hdr);
+	if (!err)
+		*size = hdr.size;
+	fput(file);
+	return err;
+}
+
+/* @brief: read [pos, pos + len) of version ver into buf.
+ * Input :
+ *			start_ver	-> oldest version, the chain can't go further
+ * Return:	bytes read (0 past the end of the version) or -errno
+ */
+ssize_t bkpfs_delta_read(struct dentry *dentry, int ver, int start_ver,
+			 void *buf, size_t len, loff_t pos)
+{
+	struct bkpfs_delta_hdr *hdr;
+	struct bkpfs_delta_ext *ext;
+	struct file **files;
+	loff_t data, from, to, rpos;
+	ssize_t res = 0;
+	int nr = ver - start_ver + 1;
+	int i, c, e;
+
+	if (nr <= 0)
+		return -ENOENT;
+	files = kcalloc(nr, sizeof(*files), GFP_KERNEL);
+	hdr = kcalloc(nr, sizeof(*hdr), GFP_KERNEL);
+	if (!files || !hdr) {
+		res = -ENOMEM;
+		goto out;
+	}
+
+	/* walk back to the checkpoint the chain starts from */
+	for (c = nr - 1; c >= 0; c--) {
+		files[c] = bkpfs_open_version(dentry, start_ver + c, O_RDONLY);
+		if (IS_ERR(files[c])) {
+			res = PTR_ERR(files[c]);
+			files[c] = NULL;
+			goto out;
+		}
+		res = bkpfs_delta_read_hdr(files[c], &hdr[c]);
+		if (res)
+			goto out;
+		if (hdr[c].type == BKPFS_DELTA_CKPT)
+			break;
+	}
+	if (c < 0) {
+		printk(KERN_INFO "ERROR:: no checkpoint for delta version %d\n", ver);
+		res = -EIO;
+		goto out;
+	}
+
+	if (pos >= hdr[nr - 1].size) {
+		res = 0;
+		goto out;
+	}
+	len = min_t(loff_t, len, hdr[nr - 1].size - pos);
+	memset(buf, 0, len);
+
+	if (pos < hdr[c].size) {
+		rpos = BKPFS_DELTA_DATA + pos;
+		res = kernel_read(files[c], buf,
+				  min_t(loff_t, len, hdr[c].size - pos), &rpos);
+		if (res < 0)
+			goto out;
+	}
+
+	for (i = c + 1; i < nr; i++) {
+		/* what a smaller version cut off reads back as zeroes */
+		if (hdr[i].size < pos + len)
+			memset(buf + max_t(loff_t, hdr[i].size - pos, 0), 0,
+			       pos + len - max_t(loff_t, hdr[i].size, pos));
+
+		res = bkpfs_delta_read_ext(files[i], &hdr[i], &ext);
+		if (res)
+			goto out;
+		data = BKPFS_DELTA_DATA + hdr[i].nr_ext * sizeof(*ext);
+		for (e = 0; e < hdr[i].nr_ext; e++) {
+			from = max_t(loff_t, ext[e].off, pos);
+			to = min_t(loff_t, ext[e].off + ext[e].len, pos + len);
+			if (from < to) {
+				rpos = data + from - ext[e].off;
+				res = kernel_read(files[i], buf + from - pos,
+						  to - from, &rpos);
+				if (res < 0)
+					break;
+			}
+			data += ext[e].len;
+		}
+		kvfree(ext);
+		if (res < 0)
+			goto out;
+	}
+	res = len;
+
+out:
+	if (files) {
+		for (i = 0; i < nr; i++)
+			if (files[i])
+				fput(files[i]);
+	}
+	kfree(files);
+	kfree(hdr);
+	return res;
+}
+
+/* @brief: replace the content of the user file with version ver.
+ *         The checkpoint is copied and the deltas applied on the lower
+ *         file directly, so no window of the version is read twice.
+ */
+int bkpfs_delta_restore(struct dentry *dentry, int ver, int start_ver)
+{
+	struct inode *inode = d_inode(dentry);
+	struct bkpfs_delta_hdr hdr;
+	struct bkpfs_delta_ext *ext;
+	struct file *user_file, *file;
+	loff_t data;
+	ssize_t res;
+	int c, i, e, err;
+
+	/* find the checkpoint the chain starts from */
+	for (c = ver; c >= start_ver; c--) {
+		file = bkpfs_open_version(dentry, c, O_RDONLY);
+		if (IS_ERR(file))
+			return PTR_ERR(file);
+		err = bkpfs_delta_read_hdr(file, &hdr);
+		fput(file);
+		if (err)
+			return err;
+		if (hdr.type == BKPFS_DELTA_CKPT)
+			break;
+	}
+	if (c < start_ver)
+		return -EIO;
+
+	user_file = bkpfs_delta_open_lower(dentry, O_WRONLY);
+	if (IS_ERR(user_file))
+		return PTR_ERR(user_file);
+
+	inode_lock(inode);
+	for (i = c; i <= ver; i++) {
+		file = bkpfs_open_version(dentry, i, O_RDONLY);
+		if (IS_ERR(file)) {
+			err = PTR_ERR(file);
+			goto out;
+		}
+		err = bkpfs_delta_read_hdr(file, &hdr);
+		if (!err)
+			err = vfs_truncate(&user_file->f_path, hdr.size);
+		if (err)
+			goto out_file;
+
+		if (hdr.type == BKPFS_DELTA_CKPT) {
+			res = bkpfs_copy_restore(dentry->d_sb, file,
+						 BKPFS_DELTA_DATA, user_file, 0,
+						 hdr.size);
+			if (res != hdr.size)
+				err = res < 0 ? res : -EIO;
+			goto out_file;
+		}
+
+		err = bkpfs_delta_read_ext(file, &hdr, &ext);
+		if (err)
+			goto out_file;
+		data = BKPFS_DELTA_DATA + hdr.nr_ext * sizeof(*ext);
+		for (e = 0; e < hdr.nr_ext; e++) {
+			res = bkpfs_copy_restore(dentry->d_sb, file, data,
+						 user_file, ext[e].off,
+						 ext[e].len);
+			if (res != ext[e].len) {
+				err = res < 0 ? res : -EIO;
+				break;
+			}
+			data += ext[e].len;
+		}
+		kvfree(ext);
+out_file:
+		fput(file);
+		if (err)
+			goto out;
+	}
+
+out:
+	fsstack_copy_inode_size(inode, bkpfs_lower_inode(inode));
+	fsstack_copy_attr_all(inode, bkpfs_lower_inode(inode));
+	inode_unlock(inode);
+	fput(user_file);
+
+	/* the whole file changed under the tracker */
+	bkpfs_delta_invalidate(inode);
+	return err;
+}
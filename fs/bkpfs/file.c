@@ -12,15 +12,32 @@
 #include "bkpfs.h"
 #include "linux/splice.h"
 #include "linux/bkp_shared.h"
+#include <linux/crc32c.h>
 
-#define DEFAULT_BKP_THRESHOLD 32
-#define DEFAULT_MAXVERS 10
 #define BKP_MAX_FILENAME 230
 
-/* new apis used for creating backups */
-extern struct dentry* bkpfs_get_bkp_dentry(struct dentry *lower_parent_dir, const char* name, int is_neg_dentry);
-extern int bkpfs_get_xattr_info(struct dentry *dentry, struct bkpfs_xattr_info* xattr);
-extern int bkpfs_set_xattr_info(struct dentry *dentry, struct bkpfs_xattr_info* xattr);
+/* @brief: build the name of the backup file holding version ver of the
+ *         user file, in the directory given by bkpfs_bkp_dir. buf must be
+ *         able to hold NAME_MAX bytes.
+ */
+void bkpfs_bkp_name(struct dentry *dentry, int ver, char *buf)
+{
+	struct bkpfs_xattr_info xattr;
+
+	/* a directory of its own holds nothing but the versions */
+	if (d_really_is_positive(dentry) &&
+	    bkpfs_get_xattr_info(dentry, &xattr) >= 0 && xattr.id_ino)
+		sprintf(buf, "%d", ver);
+	else
+		sprintf(buf, ".bkp_%s.%d", dentry->d_name.name, ver);
+}
+
+/* does the lower directory dir of backups of dentry hold the file too? */
+static bool bkpfs_bkp_dir_is_parent(struct dentry *dentry, struct path *dir)
+{
+	return d_inode(dir->dentry) ==
+	       bkpfs_lower_inode(d_inode(dentry->d_parent));
+}
 
 static ssize_t bkpfs_read(struct file *file, char __user *buf,
 			   size_t count, loff_t *ppos)
@@ -41,7 +58,8 @@ static ssize_t bkpfs_read(struct file *file, char __user *buf,
 
 
 /* @brief:This function will create an inode for the negative dentry 
- * passed direclty as an argument
+ * passed direclty as an argument. dir, if set, is the upper directory
+ * of the lower one it is in.
  */
 static int bkpfs_create_bkp_inode(struct inode* dir, struct dentry *bkp_dentry,
                          umode_t mode, bool want_excl)
@@ -54,8 +72,10 @@ static int bkpfs_create_bkp_inode(struct inode* dir, struct dentry *bkp_dentry,
 	if (err) 
 		goto out;
 
-	fsstack_copy_attr_times(dir, parent_dentry->d_inode);
-	fsstack_copy_inode_size(dir, parent_dentry->d_inode);
+	if (dir) {
+		fsstack_copy_attr_times(dir, parent_dentry->d_inode);
+		fsstack_copy_inode_size(dir, parent_dentry->d_inode);
+	}
 
 out:
 	unlock_dir(parent_dentry);
@@ -63,88 +83,131 @@ out:
 	
 }
 
-/* @brief: 	This function will create the positive backup dentry and populate 
- * 	   	   	the path structure for the same.
+/* @brief: 	create an unnamed backup file in the lower directory of the
+ * 			backups of the user file and open it for writing. The data is copied into
+ * 			it before it gets a name (and a version number), so the copy
+ * 			holds neither the parent directory nor the version state.
  * Input : 
  * 			f_dentry -> upper dentry for user file
- * 	   		bkp_path -> To be populated by the funct if evrything succeeds
- * 	   		num      -> Backup file num to be created
- * Return: 	err
+ * Return: 	opened lower file or ERR_PTR, -EOPNOTSUPP if the lower fs
+ * 			has no O_TMPFILE
  */
-static ssize_t bkpfs_create_backup(struct dentry *f_dentry, struct dentry **bkp_dentry, unsigned int num)
+static struct file *bkpfs_create_tmp_backup(struct dentry *f_dentry)
 {
-	int err = 0;
-	const char *fname;
-	char *bkp_fname;
-	struct dentry *lower_parent_dentry;
-	struct inode *dir;
+	struct dentry *tmp_dentry;
+	struct path lower_parent_path, tmp_path;
+	struct file *tmp_file;
+	int err;
 
-	fname = f_dentry->d_name.name;
-	if(strlen(fname) > BKP_MAX_FILENAME){
+	if(strlen(f_dentry->d_name.name) > BKP_MAX_FILENAME){
 		printk(KERN_INFO "ERROR::Input file name too large to create backup file\n");
-		err = -ENAMETOOLONG;
-		goto out;
+		return ERR_PTR(-ENAMETOOLONG);
 	}
 
-	bkp_fname = kmalloc(NAME_MAX, GFP_KERNEL);
-	if(!bkp_fname){
-		err = -ENOMEM;
+	err = bkpfs_bkp_dir(f_dentry, &lower_parent_path, 1);
+	if (err)
+		return ERR_PTR(err);
+
+	tmp_dentry = vfs_tmpfile(lower_parent_path.dentry,
+				 d_inode(f_dentry)->i_mode, O_RDWR);
+	if (IS_ERR(tmp_dentry)) {
+		tmp_file = ERR_CAST(tmp_dentry);
 		goto out;
 	}
 
-	sprintf(bkp_fname,".bkp_%s.%d",fname, num);
+	tmp_path.dentry = tmp_dentry;
+	tmp_path.mnt = mntget(lower_parent_path.mnt);
+	tmp_file = dentry_open(&tmp_path, O_LARGEFILE | O_WRONLY, current_cred());
+	path_put(&tmp_path);
+
+out:
+	path_put(&lower_parent_path);
+	return tmp_file;
+}
+
+/* @brief: 	give the backup file made by bkpfs_create_tmp_backup (or an
+ * 			identical backup, see dedup.c) the name of version num. Only
+ * 			this link takes the lower directory of the backups.
+ * Input : 
+ * 			f_dentry -> upper dentry for user file
+ * 			src      -> lower dentry of the filled in backup file
+ * 			num      -> Backup file num to be created
+ * Return: 	err
+ */
+int bkpfs_link_backup(struct dentry *f_dentry, struct dentry *src,
+		      unsigned int num)
+{
+	int err = 0;
+	char *bkp_fname;
+	struct dentry *bkp_dentry, *p_dentry;
+	struct path lower_parent_path;
+
+	bkp_fname = kmalloc(NAME_MAX, GFP_KERNEL);
+	if(!bkp_fname)
+		return -ENOMEM;
+
+	bkpfs_bkp_name(f_dentry, num, bkp_fname);
 	printk(KERN_INFO "Create_Backup::backup file=%s\n", bkp_fname);
-	
-	/* Get lower parent dentry of the file for which the backup is to be created
- 	 * This is required to create the backup file in that directory directly on 
- 	 * the lower file system. BKPFS doesn't need to know about bkp file dentries.
- 	 */
-
-	lower_parent_dentry = BKPFS_D(f_dentry->d_parent)->lower_path.dentry;
-	*bkp_dentry = bkpfs_get_bkp_dentry(lower_parent_dentry, bkp_fname, true); 
- 
-	/* Get Upper inode and newly created negative dentry to populate with inode*/
-	dir = d_inode(f_dentry->d_parent); 
-
-	/* Pass the mode of inode of the file passed by the user instead of hardcoding */
-	err = bkpfs_create_bkp_inode(dir, *bkp_dentry, f_dentry->d_inode->i_mode, false);
+
+	err = bkpfs_bkp_dir(f_dentry, &lower_parent_path, 1);
 	if (err)
 		goto free;
-	
+	bkp_dentry = bkpfs_get_bkp_dentry(lower_parent_path.dentry, bkp_fname,
+					  true);
+	if (IS_ERR(bkp_dentry)) {
+		err = PTR_ERR(bkp_dentry);
+		goto out_path;
+	}
+
+	p_dentry = lock_parent(bkp_dentry);
+	err = vfs_link(src, d_inode(p_dentry), bkp_dentry, NULL);
+	if (!err && bkpfs_bkp_dir_is_parent(f_dentry, &lower_parent_path))
+		fsstack_copy_attr_times(d_inode(f_dentry->d_parent), d_inode(p_dentry));
+	unlock_dir(p_dentry);
+	dput(bkp_dentry);
+
+out_path:
+	path_put(&lower_parent_path);
 free:
 	kfree(bkp_fname);
-out:
-	return err;	
+	return err;
 }
 
-static int delete_backup_file(struct inode* dir, struct dentry *dentry, int ver)
+int delete_backup_file(struct inode* dir, struct dentry *dentry, int ver)
 {
 	int err = 0;
 	struct dentry *p_dentry, *bkp_dentry;
-	struct dentry *lower_parent_dentry;
+	struct path lower_parent_path;
 	struct inode *parent_dir_inode;
 	char *bkp_fname;
-	const char *fname;
 
-	fname = dentry->d_name.name;
+	/* small versions have no backup file */
+	if (bkpfs_small_is(dentry, ver))
+		return bkpfs_small_drop(dentry, ver);
+
 	bkp_fname =(char*)kmalloc(NAME_MAX, GFP_KERNEL);
 	if(!bkp_fname){
 		err = -ENOMEM;
 		goto exit;
 	}
 
-	sprintf(bkp_fname,".bkp_%s.%d",fname, ver);
+	bkpfs_bkp_name(dentry, ver, bkp_fname);
 	//printk(KERN_INFO "Delete backup file=%s\n", bkp_fname);
 
-	lower_parent_dentry = BKPFS_D(dentry->d_parent)->lower_path.dentry;
-	bkp_dentry = bkpfs_get_bkp_dentry(lower_parent_dentry, bkp_fname, false);	
+	err = bkpfs_bkp_dir(dentry, &lower_parent_path, 0);
+	if (err)
+		goto free;
+	bkp_dentry = bkpfs_get_bkp_dentry(lower_parent_path.dentry, bkp_fname,
+					  false);
 	if(IS_ERR(bkp_dentry)) {
 		printk(KERN_INFO "ERROR::Couldn't find dentry for bkp file with vers num=%d\n",ver);
 		err = PTR_ERR(bkp_dentry);
-		goto out;
+		goto out_path;
 	}
 
-	dget(bkp_dentry);
+	/* the dedup index must not keep the data around */
+	bkpfs_dedup_forget(dentry->d_sb, bkp_dentry);
+
 	p_dentry = lock_parent(bkp_dentry);
 	parent_dir_inode = d_inode(p_dentry);
 
@@ -153,45 +216,76 @@ static int delete_backup_file(struct inode* dir, struct dentry *dentry, int ver)
 		goto out;
 	
 	//printk(KERN_INFO "Deletion of file successfull\n");
-	fsstack_copy_attr_times(dir, parent_dir_inode);
-	fsstack_copy_inode_size(dir, parent_dir_inode);
+	if (bkpfs_bkp_dir_is_parent(dentry, &lower_parent_path)) {
+		fsstack_copy_attr_times(dir, parent_dir_inode);
+		fsstack_copy_inode_size(dir, parent_dir_inode);
+	}
 
 	d_drop(bkp_dentry); /* this is needed, else LTP fails (VFS won't do it) */
 
 out:
 	unlock_dir(p_dentry);
 	dput(bkp_dentry);
+out_path:
+	path_put(&lower_parent_path);
+free:
 	kfree(bkp_fname);
 exit:
 	return err;
 
 }
 
-int bkpfs_cleanup_on_delete(struct inode *dir, struct dentry *dentry)
+/* @brief: delete every backup version of the user file, with bkp_meta_lock
+ *         held.  The version info itself is left as it was.
+ */
+int bkpfs_drop_versions(struct inode *dir, struct dentry *dentry)
 {
 	int err = 0;
-	struct bkpfs_xattr_info *xattr;
+	struct bkpfs_xattr_info xattr;
 	int s_ver, l_ver, ver;
 
-	xattr = kmalloc(sizeof(struct bkpfs_xattr_info), GFP_KERNEL);
-	err = bkpfs_get_xattr_info(dentry, xattr); 
+	err = bkpfs_get_xattr_info(dentry, &xattr); 
 	if(err < 0)
-		goto out;
+		return err;
 	else
 		err = 0;
 
-	s_ver = xattr->start_ver;
-	l_ver = xattr->cur_ver - 1;
+	s_ver = xattr.start_ver;
+	l_ver = xattr.cur_ver - 1;
 
 	for(ver = s_ver; ver <= l_ver; ver++) {
-		err = delete_backup_file(dir, dentry, ver);
+		if (BKPFS_SB(dentry->d_sb)->mnt_opts.bkp_format == BKP_FORMAT_CHUNK)
+			err = bkpfs_chunk_drop(dir, dentry, ver);
+		else
+			err = delete_backup_file(dir, dentry, ver);
 		if(err < 0){
 			// Don't break. Try to delete next version
 			printk(KERN_INFO "ERROR:: failed while deleting backup number %d\n", ver-s_ver+1);
 		}
 	}
+
+	/* undo records logged since the newest version live in the next slot */
+	if (BKPFS_SB(dentry->d_sb)->mnt_opts.bkp_format == BKP_FORMAT_UNDO)
+		delete_backup_file(dir, dentry, l_ver + 1);
+
+	/* an emptied directory of versions (bkp_layout=inode) goes too */
+	bkpfs_layout_remove(dentry->d_sb, &xattr, 0);
+	return err;
+}
+
+int bkpfs_cleanup_on_delete(struct inode *dir, struct dentry *dentry)
+{
+	struct bkpfs_xattr_info xattr;
+	int err = 0;
+
+	mutex_lock(&BKPFS_I(d_inode(dentry))->bkp_meta_lock);
+	/* versions kept by id are those of the other links too */
+	if (bkpfs_lower_inode(d_inode(dentry))->i_nlink > 1 &&
+	    bkpfs_get_xattr_info(dentry, &xattr) >= 0 && xattr.id_ino)
+		goto out;
+	err = bkpfs_drop_versions(dir, dentry);
 out:
-	kfree(xattr);
+	mutex_unlock(&BKPFS_I(d_inode(dentry))->bkp_meta_lock);
 	return err;
 }
 
@@ -202,7 +296,7 @@ out:
  * 			xattr: ptr to xattr info used for tracking bkp versions
  * return:	err 
  */
-static int bkpfs_update_after_write(struct dentry *dentry, struct bkpfs_xattr_info *xattr, int maxvers)
+int bkpfs_update_after_write(struct dentry *dentry, struct bkpfs_xattr_info *xattr, int maxvers)
 {
 	int err = 0;
 	int cur_ver, start_ver;
@@ -216,7 +310,16 @@ static int bkpfs_update_after_write(struct dentry *dentry, struct bkpfs_xattr_in
 		fname = dentry->d_name.name;	
 		dir = d_inode(dentry->d_parent);
 
- 		err = delete_backup_file(dir, dentry, start_ver);
+		/* deltas after the oldest version still need its data */
+		if (BKPFS_SB(dentry->d_sb)->mnt_opts.bkp_format == BKP_FORMAT_DELTA)
+			err = bkpfs_delta_drop_oldest(dir, dentry, xattr);
+		else if (BKPFS_SB(dentry->d_sb)->mnt_opts.bkp_format == BKP_FORMAT_FULL)
+			err = bkpfs_append_drop_oldest(dir, dentry, start_ver,
+						       cur_ver + 1);
+		else if (BKPFS_SB(dentry->d_sb)->mnt_opts.bkp_format == BKP_FORMAT_CHUNK)
+			err = bkpfs_chunk_drop(dir, dentry, start_ver);
+		else
+			err = delete_backup_file(dir, dentry, start_ver);
 		if(err < 0){
 			printk(KERN_INFO "ERROR:: Failed while deleting backup version=%d\n", start_ver);
 			goto out;
@@ -237,125 +340,562 @@ out:
 
 }
 
-static ssize_t bkpfs_write(struct file *file, const char __user *buf,
-			    size_t count, loff_t *ppos)
+/* copies smaller than this mostly measure the fixed cost of a backup */
+#define BKPFS_RATE_MIN_SAMPLE	(64 * 1024)
+
+/* @brief: fold the throughput of a backup which copied bytes in ns into the
+ *         moving average of the mount (weight 1/8 for the new sample).
+ */
+static void bkpfs_account_backup(struct super_block *sb, u64 bytes, u64 ns)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+	u64 us, rate, old;
+
+	if (bytes < BKPFS_RATE_MIN_SAMPLE)
+		return;
+	us = max_t(u64, div_u64(ns, NSEC_PER_USEC), 1);
+	rate = div64_u64(bytes, us) * USEC_PER_SEC;
+
+	/* racing updates only lose a sample */
+	old = READ_ONCE(sbi->bkp_rate);
+	if (old)
+		rate = old - (old >> 3) + (rate >> 3);
+	WRITE_ONCE(sbi->bkp_rate, rate);
+}
+
+/* @brief: tell whether a backup of inode would take longer than the write
+ *         latency budget of the mount, going by its size and bkp_rate.
+ *         Until a rate was measured, backups are taken inline.
+ */
+static bool bkpfs_over_budget(struct inode *inode)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(inode->i_sb);
+	u64 rate = READ_ONCE(sbi->bkp_rate);
+	u64 budget;
+
+	if (!sbi->mnt_opts.bkp_max_write_lat_us || !rate)
+		return false;
+	/* bytes a backup can copy within the budget */
+	budget = mul_u64_u32_div(rate, sbi->mnt_opts.bkp_max_write_lat_us,
+				 USEC_PER_SEC);
+	return i_size_read(inode) > budget;
+}
+
+/* @brief: copy the backup counters of the mount to the buffer of arg.
+ *         Counters are only ever added at the end of struct bkpfs_stats,
+ *         a caller built with fewer of them gets the ones it knows.
+ * Return:	bytes copied or -errno
+ */
+static long bkpfs_get_stats(struct super_block *sb,
+			    struct ioctl_args __user *arg)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+	struct bkpfs_stats stats;
+	struct ioctl_args karg;
+	unsigned int size;
+
+	if (!arg || copy_from_user(&karg, arg, sizeof(karg)))
+		return -EFAULT;
+	if (karg.buff_size < BKPFS_STATS_MIN_SIZE) {
+		printk(KERN_INFO "ERROR:: stats buffer of %u bytes too small\n",
+		       karg.buff_size);
+		return -EINVAL;
+	}
+	size = min_t(unsigned int, karg.buff_size, sizeof(stats));
+
+	memset(&stats, 0, sizeof(stats));
+	stats.inline_bkps = atomic64_read(&sbi->bkp_inline);
+	stats.deferred_bkps = atomic64_read(&sbi->bkp_deferred);
+	stats.bkp_rate = READ_ONCE(sbi->bkp_rate);
+	stats.nocache_bytes = atomic64_read(&sbi->bkp_nocache_bytes);
+	stats.unchanged_bkps = atomic64_read(&sbi->bkp_unchanged);
+	stats.chunk_bytes = atomic64_read(&sbi->chunk_bytes);
+	stats.chunk_new_bytes = atomic64_read(&sbi->chunk_new_bytes);
+	stats.dedup_bkps = atomic64_read(&sbi->bkp_deduped);
+	stats.zip_raw_bytes = atomic64_read(&sbi->zip_raw_bytes);
+	stats.zip_stored_bytes = atomic64_read(&sbi->zip_stored_bytes);
+	stats.pack_bkps = atomic64_read(&sbi->pack_bkps);
+	stats.pack_inline_bkps = atomic64_read(&sbi->pack_inline_bkps);
+	stats.saved_bkps = atomic64_read(&sbi->bkp_saved);
+	stats.trash_files = atomic64_read(&sbi->trash_files);
+	stats.trash_purged = atomic64_read(&sbi->trash_purged);
+	if (copy_to_user(karg.buff, &stats, size))
+		return -EFAULT;
+	return size;
+}
+
+/* buffer size used to checksum a file */
+#define BKPFS_CRC_BUF	(64 * 1024)
+
+/* @brief: crc32c of the first len bytes of file */
+int bkpfs_crc_file(struct file *file, loff_t len, u32 *crc)
+{
+	loff_t pos = 0;
+	ssize_t res;
+	void *buf;
+	int err = 0;
+
+	buf = kmalloc(BKPFS_CRC_BUF, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	*crc = ~0;
+	while (pos < len) {
+		res = kernel_read(file, buf, min_t(loff_t, BKPFS_CRC_BUF,
+						   len - pos), &pos);
+		if (res <= 0) {
+			err = res ? res : -EIO;
+			break;
+		}
+		*crc = crc32c(*crc, buf, res);
+	}
+	kfree(buf);
+	return err;
+}
+
+/* @brief: tell whether the user file still has the content of its newest
+ *         version, going by size and crc32c.  Only files of the same size
+ *         as that version are checksummed; the checksum of the version is
+ *         computed the first time it is needed and kept in the version info.
+ * Return: 1 if so, 0 if not or not known
+ */
+static int bkpfs_same_as_newest(struct dentry *dentry)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(d_inode(dentry));
+	struct bkpfs_xattr_info xattr;
+	struct file *file;
+	struct path lower_path;
+	loff_t size, length;
+	u32 crc;
+	int newest, err;
+
+	if (bkpfs_get_xattr_info(dentry, &xattr) < 0 ||
+	    xattr.cur_ver == xattr.start_ver)
+		return 0;
+	newest = xattr.cur_ver - 1;
+	size = i_size_read(bkpfs_lower_inode(d_inode(dentry)));
+
+	if (xattr.fp_ver != newest) {
+		file = bkpfs_append_open(dentry, newest, xattr.start_ver,
+					 &length);
+		if (IS_ERR(file))
+			return 0;
+		err = length == size ? bkpfs_crc_file(file, length, &crc) : 1;
+		fput(file);
+		if (err)
+			return 0;
+
+		/* keep it, the next rewrite of the same size can use it */
+		mutex_lock(&info->bkp_meta_lock);
+		if (bkpfs_get_xattr_info(dentry, &xattr) >= 0 &&
+		    xattr.cur_ver - 1 == newest) {
+			xattr.fp_ver = newest;
+			xattr.fp_crc = crc;
+			xattr.fp_size = length;
+			bkpfs_set_xattr_info(dentry, &xattr);
+		}
+		mutex_unlock(&info->bkp_meta_lock);
+	}
+	if (xattr.fp_ver != newest || xattr.fp_size != size)
+		return 0;
+
+	bkpfs_get_lower_path(dentry, &lower_path);
+	file = dentry_open(&lower_path, O_RDONLY | O_LARGEFILE, current_cred());
+	bkpfs_put_lower_path(dentry, &lower_path);
+	if (IS_ERR(file))
+		return 0;
+	err = bkpfs_crc_file(file, size, &crc);
+	fput(file);
+	return !err && crc == xattr.fp_crc;
+}
+
+/* @brief: take a full copy of the current content of the user file as the
+ *         next backup version and apply the retention policy.
+ * input :
+ *         dentry: dentry of user file created inside the mount
+ * return: err
+ */
+int bkpfs_backup_file(struct dentry *dentry)
 {
 	int err = 0;							// err to return status
-	unsigned int bkp_threshold;				// Threshold for creating backup
 	unsigned int maxvers;					// Max Versions of backup supported
-	struct file *lower_file;				// lower file for user file
 	struct file *user_file, *bkp_file;		// file* for bkp file and user file used in splice
-	struct path lower_parent_path,lower_path;	// path for parent dir and user file 
-	struct path bkp_path;					// bkp_path
-	struct dentry *bkp_dentry;				// dentry for bkp_file
-	struct dentry *dentry, *p_dentry; 		// dentry for user file and parent dir
-	struct vfsmount *lower_parent_mnt;		// mnt of lower_parent 
+	struct path lower_path;					// path for user file 
+	struct bkpfs_inode_info *info;			// holds the version state lock
 	struct mnt_opt_info * opts; 			// Used to get mount options 
-	struct bkpfs_xattr_info *xattr;			// ptr to xattr information for the user file
+	struct bkpfs_xattr_info xattr;			// xattr information for the user file
 	loff_t inpos=0, outpos=0; 				// Used to passs to splice_direct
 	loff_t size;							// Size of file used while copying
-	loff_t bytes_written;					// Total bytes written to orig user file
-	
-	opts  = &BKPFS_SB(file->f_inode->i_sb)->mnt_opts;
-	dentry = file->f_path.dentry;
-	p_dentry = dget_parent(dentry);
-
-	/* Populate data passed during mount options */
-	maxvers = opts->maxvers ? opts->maxvers : DEFAULT_MAXVERS;
-	bkp_threshold = opts->bkp_threshold ? opts->bkp_threshold : DEFAULT_BKP_THRESHOLD;
+	ssize_t copied;							// Bytes copied into the backup file
+	int locked = 0;							// bkp_meta_lock is held
+	ktime_t start;							// Start of the copy, for bkp_rate
+
+	opts  = &BKPFS_SB(dentry->d_sb)->mnt_opts;
+	info = BKPFS_I(d_inode(dentry));
+	/* deltas and appended tails are small, written under the lock */
+	if (opts->bkp_format == BKP_FORMAT_DELTA) {
+		mutex_lock(&info->bkp_meta_lock);
+		err = bkpfs_delta_backup(dentry);
+		mutex_unlock(&info->bkp_meta_lock);
+		return err;
+	}
+	/* only the chunks the store does not have yet are written */
+	if (opts->bkp_format == BKP_FORMAT_CHUNK) {
+		bkpfs_mmap_rearm(d_inode(dentry));
+		mutex_lock(&info->bkp_meta_lock);
+		err = bkpfs_chunk_backup(dentry);
+		mutex_unlock(&info->bkp_meta_lock);
+		return err;
+	}
+	if (opts->bkp_format == BKP_FORMAT_COMPRESS) {
+		bkpfs_mmap_rearm(d_inode(dentry));
+		mutex_lock(&info->bkp_meta_lock);
+		err = bkpfs_zip_backup(dentry);
+		mutex_unlock(&info->bkp_meta_lock);
+		return err;
+	}
+	/* stores through a mapping during the copy dirty the next version */
+	bkpfs_mmap_rearm(d_inode(dentry));
 
-	printk(KERN_INFO "max Versions=%d, bkp_threshold=%d\n",maxvers, bkp_threshold);
-	printk(KERN_INFO "BEFORE_WRITE::filename=%s, parent dir=%s, count=%ld, offset=%lld\n", \
-				dentry->d_name.name, p_dentry->d_name.name, count, *ppos);
-	
-	lower_file = bkpfs_lower_file(file);
-	bytes_written = vfs_write(lower_file, buf, count, ppos);
-	if (bytes_written < 0) {
-		printk(KERN_INFO "ERROR:: VFS write failed\n");
-		err = bytes_written;
-		goto exit;
-	}	
-	/* update our inode times+sizes upon a successful lower write */
-	fsstack_copy_inode_size(d_inode(dentry),
-				file_inode(lower_file));
-	fsstack_copy_attr_times(d_inode(dentry),
-				file_inode(lower_file));
-	
-	printk(KERN_INFO "AFTER_WRITE::filename=%s, parent dir=%s, count=%ld, offset=%lld\n", \
-				dentry->d_name.name, p_dentry->d_name.name, count, *ppos);
-	
-	/* if threshold is not reached or no backups needed, then don't 
-	 * create backup just return from here.
+	/* rewriting the same bytes does not push a version out, at the cost
+	 * of reading the file (and the newest version once) to find out
 	 */
-	if(count < bkp_threshold || maxvers == 0)
-		goto exit;
-
-
-	/* Allocate the xattr_info and fetch its value from xtended attributes */
-	xattr = kmalloc(sizeof(struct bkpfs_xattr_info), GFP_KERNEL);
-
-	err = bkpfs_get_xattr_info(dentry, xattr);
-	if(err < 0)
-		goto out_free;
-	else
+	if (opts->bkp_skip_same && bkpfs_same_as_newest(dentry)) {
+		atomic64_inc(&BKPFS_SB(dentry->d_sb)->bkp_unchanged);
+		return 0;
+	}
+	/* small files go inline or to the pack of their directory */
+	if (opts->bkp_pack) {
+		mutex_lock(&info->bkp_meta_lock);
+		err = bkpfs_small_backup(dentry);
+		mutex_unlock(&info->bkp_meta_lock);
+		if (err != -EAGAIN)
+			return err;
 		err = 0;
-	printk(KERN_INFO "start version=%d, curr version=%d\n", xattr->start_ver, xattr->cur_ver);
-	
-	err = bkpfs_create_backup(dentry, &bkp_dentry, xattr->cur_ver);
-	if(err < 0) {
-		printk(KERN_INFO "ERROR:: bkpfs_create_backup failed\n");
-		goto out_free;
 	}
-	printk(KERN_INFO "INFO::backup file created with num=%d\n", xattr->cur_ver);
-	
-	/* Get lower parent and user file path structs */
-	bkpfs_get_lower_path(p_dentry, &lower_parent_path);
-	bkpfs_get_lower_path(dentry, &lower_path); 
-	lower_parent_mnt = lower_parent_path.mnt;
-
-	/* We should now open the backup file in write mode and start copying the data. 
- 	 * By this time there should be a positive dentry created for the backup file
- 	 * Populate the path for the bkp dentry.  	
- 	 */ 	
-	bkp_path.dentry = bkp_dentry;
-	bkp_path.mnt = mntget(lower_parent_mnt);
-	
-	bkp_file = dentry_open(&bkp_path, O_LARGEFILE | O_WRONLY, current_cred());
-	if(IS_ERR(bkp_file)){
-		printk(KERN_INFO "ERROR::Failed to open bkp_file\n");
-		goto out_put_path;
+	if (opts->bkp_append) {
+		mutex_lock(&info->bkp_meta_lock);
+		err = bkpfs_append_backup(dentry);
+		mutex_unlock(&info->bkp_meta_lock);
+		if (err != -EAGAIN)
+			return err;
+		err = 0;
 	}
+	/* content already backed up, by this file or another, is linked to */
+	if (opts->bkp_dedup) {
+		err = bkpfs_dedup_backup(dentry);
+		if (err != -EAGAIN)
+			return err;
+		err = 0;
+	}
+	maxvers = opts->maxvers ? opts->maxvers : DEFAULT_MAXVERS;
 
+	bkpfs_get_lower_path(dentry, &lower_path); 
 	user_file = dentry_open(&lower_path, O_RDONLY, current_cred());
 	if(IS_ERR(user_file)){
 		printk(KERN_INFO "ERROR::Failed to open user_file\n");
-		goto out_put_file;
+		err = PTR_ERR(user_file);
+		goto out_put_path;
 	}  	
 
+	bkp_file = bkpfs_create_tmp_backup(dentry);
+	if (PTR_ERR(bkp_file) == -EOPNOTSUPP) {
+		/* no unnamed files in the lower fs: create the version up front
+		 * and keep the version state locked over the copy.
+		 */
+		mutex_lock(&info->bkp_meta_lock);
+		locked = 1;
+		err = bkpfs_get_xattr_info(dentry, &xattr);
+		if(err < 0)
+			goto out_unlock;
+		bkp_file = bkpfs_open_version(dentry, xattr.cur_ver,
+					      O_WRONLY | O_CREAT);
+	}
+	if(IS_ERR(bkp_file)){
+		printk(KERN_INFO "ERROR::Failed to open bkp_file\n");
+		err = PTR_ERR(bkp_file);
+		goto out_unlock;
+	}
+
 	size = i_size_read(dentry->d_inode);
-	err = do_splice_direct(user_file, &inpos, bkp_file, &outpos, size, SPLICE_F_MOVE);
-	if(err < 0) {
-		printk(KERN_INFO "ERROR:: Failed inside do_splice_direct\n");	
-		goto out_put_file1;
+	start = ktime_get();
+	copied = bkpfs_copy_range(dentry->d_sb, user_file, inpos, bkp_file, outpos, size);
+	if(copied < 0) {
+		err = copied;
+		printk(KERN_INFO "ERROR:: Failed inside bkpfs_copy_range\n");	
+		goto out_put_file;
 	}
+	bkpfs_account_backup(dentry->d_sb, copied,
+			     ktime_to_ns(ktime_sub(ktime_get(), start)));
+
+	if (!locked) {
+		mutex_lock(&info->bkp_meta_lock);
+		locked = 1;
+		err = bkpfs_get_xattr_info(dentry, &xattr);
+		if(err < 0)
+			goto out_put_file;
+		err = bkpfs_link_backup(dentry, bkp_file->f_path.dentry,
+					 xattr.cur_ver);
+		if(err < 0) {
+			printk(KERN_INFO "ERROR:: bkpfs_link_backup failed\n");
+			goto out_put_file;
+		}
+	}
+	pr_debug("INFO::backup file created with num=%d\n", xattr.cur_ver);
+	bkpfs_dedup_insert(dentry, xattr.cur_ver, copied);
 	
+	/* a full copy can be appended to by the next versions */
+	err = bkpfs_append_mark_base(dentry, bkp_file, xattr.cur_ver, copied);
+	if(err < 0)
+		printk(KERN_INFO "ERROR:: Failed marking append base\n");
+
 	/* if backup was successfully created, update control info */
-	err = bkpfs_update_after_write(dentry, xattr, maxvers);
+	err = bkpfs_update_after_write(dentry, &xattr, maxvers);
 	if(err < 0)
 		printk(KERN_INFO "ERROR:: Failed update after write\n");
 
-out_put_file1:
-	fput(user_file);
 out_put_file:
 	fput(bkp_file);
+out_unlock:
+	if (locked)
+		mutex_unlock(&info->bkp_meta_lock);
+	fput(user_file);
 out_put_path:
 	bkpfs_put_lower_path(dentry, &lower_path);
-	bkpfs_put_lower_path(p_dentry, &lower_parent_path);
-out_free:
-	kfree(xattr);
+	return err;
+}
+
+/* @brief: take a version of the file, at most one at a time per inode.
+ *         Concurrent callers do not each copy the file: while a backup is
+ *         being taken the others wait for it, and the first one to find it
+ *         done takes a single new backup covering all of them. A caller
+ *         whose request came in before a backup started is covered by it,
+ *         since its write was already in the file, and gets its result.
+ * input :
+ *         dentry: dentry of user file created inside the mount
+ * return: err
+ */
+int bkpfs_backup_once(struct dentry *dentry)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(d_inode(dentry));
+	struct mnt_opt_info *opts = &BKPFS_SB(dentry->d_sb)->mnt_opts;
+	u64 seq, upto;
+	s64 changed;
+	int err;
+
+	spin_lock(&info->bkp_lock);
+	seq = ++info->bkp_req_seq;
+	while (info->bkp_running) {
+		spin_unlock(&info->bkp_lock);
+		err = wait_event_killable(info->bkp_flight_wq,
+					  !READ_ONCE(info->bkp_running));
+		if (err)
+			return err;
+		spin_lock(&info->bkp_lock);
+	}
+	if (info->bkp_done_seq >= seq) {
+		/* piggy-back on the backup that ran meanwhile */
+		err = info->bkp_last_err;
+		spin_unlock(&info->bkp_lock);
+		return err;
+	}
+	info->bkp_running = 1;
+	upto = info->bkp_req_seq;
+	spin_unlock(&info->bkp_lock);
+
+	/* bytes counted from now on go to the next version */
+	changed = atomic64_read(&info->bkp_changed);
+
+	/* undo records are already there, only the slot has to be sealed */
+	if (opts->bkp_format == BKP_FORMAT_UNDO)
+		err = bkpfs_undo_seal(dentry, opts->maxvers ?
+				      opts->maxvers : DEFAULT_MAXVERS);
+	else
+		err = bkpfs_backup_file(dentry);
+	if (err >= 0)
+		atomic64_sub(changed, &info->bkp_changed);
+
+	spin_lock(&info->bkp_lock);
+	info->bkp_running = 0;
+	info->bkp_done_seq = upto;
+	info->bkp_last_err = err;
+	spin_unlock(&info->bkp_lock);
+	wake_up_all(&info->bkp_flight_wq);
+	return err;
+}
+
+/* @brief: take a version of the file now, the way the mount is set up to.
+ *         Used by the write path and by the close/fsync triggers.
+ * input :
+ *         dentry: dentry of user file created inside the mount
+ * return: err
+ */
+int bkpfs_request_backup(struct dentry *dentry)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(dentry->d_sb);
+	struct mnt_opt_info *opts = &sbi->mnt_opts;
+	unsigned int maxvers = opts->maxvers ? opts->maxvers : DEFAULT_MAXVERS;
+
+	if (maxvers == 0)
+		return 0;
+	/* large files go to the background rather than stall the writer */
+	if (opts->bkp_mode == BKP_MODE_ASYNC ||
+	    bkpfs_over_budget(d_inode(dentry))) {
+		atomic64_inc(&sbi->bkp_deferred);
+		return bkpfs_queue_backup(dentry);
+	}
+	atomic64_inc(&sbi->bkp_inline);
+	return bkpfs_backup_once(dentry);
+}
+
+/* @brief: account a write of count bytes and tell whether the change since
+ *         the last version is now large enough for a new one.  The count
+ *         is only dropped once the version is taken, see bkpfs_backup_once.
+ * input :
+ *         bkp_threshold: per write threshold, used when no cumulative
+ *                        threshold was given at mount
+ * return: 1 if a version is due, 0 otherwise
+ */
+static int bkpfs_version_due(struct inode *inode, size_t count,
+			     unsigned int bkp_threshold)
+{
+	struct mnt_opt_info *opts = &BKPFS_SB(inode->i_sb)->mnt_opts;
+	struct bkpfs_inode_info *info = BKPFS_I(inode);
+	loff_t size = i_size_read(inode);
+	s64 changed;
+
+	if (!opts->bkp_threshold_cum && !opts->bkp_change_pct)
+		return count >= bkp_threshold;
+
+	changed = atomic64_add_return(count, &info->bkp_changed);
+	if (!changed)
+		return 0;
+	if (opts->bkp_threshold_cum && changed >= opts->bkp_threshold_cum)
+		return 1;
+	/* an empty file has no size to take a percentage of */
+	if (opts->bkp_change_pct && size &&
+	    changed * 100 >= (s64)opts->bkp_change_pct * size)
+		return 1;
+	return 0;
+}
+
+/* @brief: take the version a write made due, the way the mount is set up
+ *         to: right away, once the file is closed or synced, or once it
+ *         went quiet.
+ * input :
+ *         due: the change since the last version is large enough
+ * return: err
+ */
+static int bkpfs_version_after_write(struct file *file, int due)
+{
+	struct mnt_opt_info *opts = &BKPFS_SB(file_inode(file)->i_sb)->mnt_opts;
+	unsigned int maxvers = opts->maxvers ? opts->maxvers : DEFAULT_MAXVERS;
+
+	/* if threshold is not reached or no backups needed, then don't 
+	 * create backup just return from here.
+	 */
+	if(!due || maxvers == 0)
+		return 0;
+
+	/* the version is taken when the file is closed or synced */
+	if (opts->bkp_trigger != BKP_TRIGGER_WRITE) {
+		atomic_set(&BKPFS_F(file)->bkp_dirty, 1);
+		return 0;
+	}
+
+	/* bkp_quiet_ms: one version once the burst of writes is over */
+	if (opts->bkp_quiet_ms)
+		return bkpfs_defer_backup(file->f_path.dentry);
+
+	return bkpfs_request_backup(file->f_path.dentry);
+}
+
+/* @brief: bookkeeping after written bytes landed at pos in the lower file,
+ *         shared by write(), write_iter() and queued async writes.
+ * input :
+ *         old_size: size of the user file before the write
+ * return: err
+ */
+static int bkpfs_write_done(struct file *file, loff_t pos, ssize_t written,
+			    loff_t old_size)
+{
+	struct inode *inode = file_inode(file);
+	struct file *lower_file = bkpfs_lower_file(file);
+	struct mnt_opt_info *opts = &BKPFS_SB(inode->i_sb)->mnt_opts;
+	unsigned int bkp_threshold;
+
+	bkp_threshold = opts->bkp_threshold ? opts->bkp_threshold : DEFAULT_BKP_THRESHOLD;
+
+	/* update our inode times+sizes upon a successful lower write */
+	fsstack_copy_inode_size(inode, file_inode(lower_file));
+	fsstack_copy_attr_times(inode, file_inode(lower_file));
+	/* tracked before the write too: a version taken in between copied the
+	 * extent before it landed, so the next one needs it again
+	 */
+	bkpfs_delta_track(inode, pos, written);
+	bkpfs_append_note(inode, pos, old_size);
+
+	return bkpfs_version_after_write(file,
+			bkpfs_version_due(inode, written, bkp_threshold));
+}
+
+static ssize_t bkpfs_write(struct file *file, const char __user *buf,
+			    size_t count, loff_t *ppos)
+{
+	int err = 0;							// err to return status
+	int due;								// Enough changed for a new version
+	loff_t old_size;						// Size of user file before the write
+	unsigned int bkp_threshold;				// Threshold for creating backup
+	unsigned int maxvers;					// Max Versions of backup supported
+	struct file *lower_file;				// lower file for user file
+	struct dentry *dentry; 					// dentry for user file
+	struct mnt_opt_info * opts; 			// Used to get mount options 
+	loff_t bytes_written;					// Total bytes written to orig user file
+	
+	opts  = &BKPFS_SB(file->f_inode->i_sb)->mnt_opts;
+	dentry = file->f_path.dentry;
+
+	/* Populate data passed during mount options */
+	maxvers = opts->maxvers ? opts->maxvers : DEFAULT_MAXVERS;
+	bkp_threshold = opts->bkp_threshold ? opts->bkp_threshold : DEFAULT_BKP_THRESHOLD;
+
+	pr_debug("max Versions=%d, bkp_threshold=%d\n",maxvers, bkp_threshold);
+	pr_debug("BEFORE_WRITE::filename=%s, count=%ld, offset=%lld\n", \
+				dentry->d_name.name, count, *ppos);
+	
+	/* undo format saves the pre-image of every write, not only of the
+	 * ones crossing the threshold, so it takes over the whole write.
+	 */
+	if (opts->bkp_format == BKP_FORMAT_UNDO && maxvers) {
+		bytes_written = bkpfs_undo_write(file, buf, count, ppos);
+		if (bytes_written < 0)
+			goto exit;
+		due = bkpfs_version_due(d_inode(dentry), bytes_written,
+					bkp_threshold);
+		err = bkpfs_version_after_write(file, due);
+		goto exit;
+	}
+
+	lower_file = bkpfs_lower_file(file);
+	old_size = i_size_read(file_inode(lower_file));
+	bkpfs_delta_track(file_inode(file), (file->f_flags & O_APPEND) ?
+			  old_size : *ppos, count);
+	bytes_written = vfs_write(lower_file, buf, count, ppos);
+	if (bytes_written < 0) {
+		printk(KERN_INFO "ERROR:: VFS write failed\n");
+		err = bytes_written;
+		goto exit;
+	}	
+	
+	pr_debug("AFTER_WRITE::filename=%s, count=%ld, offset=%lld\n", \
+				dentry->d_name.name, count, *ppos);
+	err = bkpfs_write_done(file, *ppos - bytes_written, bytes_written,
+			       old_size);
+
 exit:
-	dput(p_dentry);
-	printk(KERN_INFO "exit bkpfs_write with bytes_written=%lld\n", bytes_written);
+	pr_debug("exit bkpfs_write with bytes_written=%lld\n", bytes_written);
+	if(bytes_written < 0)
+		return bytes_written;
 	if(err < 0)
 		return err;
 	else
@@ -433,21 +973,19 @@ static long bkpfs_get_version_info(struct file *file, int* s_ver, int* l_ver)
 {
 	int err = 0;
 	struct dentry *dentry;	
-	struct bkpfs_xattr_info *xattr;
+	struct bkpfs_xattr_info xattr;
 
 	dentry = file->f_path.dentry;
-	xattr = kmalloc(sizeof(struct bkpfs_xattr_info), GFP_KERNEL);
-	err = bkpfs_get_xattr_info(dentry, xattr); 
+	err = bkpfs_get_xattr_info(dentry, &xattr); 
 	if(err < 0)
 		goto out;
 	else
 		err = 0;
 
-	(*s_ver) = xattr->start_ver;
-	(*l_ver) = xattr->cur_ver - 1;
+	(*s_ver) = xattr.start_ver;
+	(*l_ver) = xattr.cur_ver - 1;
 	
 out:
-	kfree(xattr);
 	return err;
 }
 
@@ -486,96 +1024,141 @@ out:
 
 }
 
-struct file* open_backup_file(struct file *file, int flags, int ver, char *bkp_fname)
+/* @brief:	open the lower backup file holding version ver of the user file.
+ *			With O_CREAT in flags a missing backup file is created first.
+ * Return:	opened lower file or ERR_PTR
+ */
+struct file *bkpfs_open_version(struct dentry *dentry, int ver, int flags)
 {
-	long err = 0;
-	struct dentry *bkp_dentry, *dentry, *p_dentry;
-	struct dentry *lower_parent_dentry;
-	struct path lower_parent_path,lower_path;
-	struct path bkp_path;
-	struct file* bkp_file;
-	struct vfsmount *lower_parent_mnt;
-	const char *fname;
-	UDBG;
-
-	dentry = file->f_path.dentry;
-	p_dentry = dget_parent(dentry);
+	int err = 0;
+	char *bkp_fname;
+	struct dentry *bkp_dentry;
+	struct path lower_parent_path, bkp_path;
+	struct inode *dir = NULL;
+	struct file *bkp_file;
 
-	fname = dentry->d_name.name;
+	bkp_fname = kmalloc(NAME_MAX, GFP_KERNEL);
+	if (!bkp_fname)
+		return ERR_PTR(-ENOMEM);
+	bkpfs_bkp_name(dentry, ver, bkp_fname);
 
-	sprintf(bkp_fname,".bkp_%s.%d",fname, ver);
-	printk(KERN_INFO "Read backup file=%s\n", bkp_fname);
+	err = bkpfs_bkp_dir(dentry, &lower_parent_path, flags & O_CREAT);
+	if (err) {
+		kfree(bkp_fname);
+		return ERR_PTR(err);
+	}
 
-	lower_parent_dentry = BKPFS_D(dentry->d_parent)->lower_path.dentry;
-	bkp_dentry = bkpfs_get_bkp_dentry(lower_parent_dentry, bkp_fname, false);	
-	if(IS_ERR(bkp_dentry)) {
-		printk(KERN_INFO "Couldn't find dentry for backup file with version num=%d\n",ver);
-		err = PTR_ERR(bkp_dentry);
+	bkp_dentry = bkpfs_get_bkp_dentry(lower_parent_path.dentry, bkp_fname,
+					  flags & O_CREAT);
+	if (IS_ERR(bkp_dentry)) {
+		bkp_file = ERR_CAST(bkp_dentry);
 		goto out;
 	}
 
-	/* Get lower parent and user file path structs */
-	bkpfs_get_lower_path(p_dentry, &lower_parent_path);
-	bkpfs_get_lower_path(dentry, &lower_path); 
-	lower_parent_mnt = lower_parent_path.mnt;
+	if (d_really_is_negative(bkp_dentry)) {
+		if (bkpfs_bkp_dir_is_parent(dentry, &lower_parent_path))
+			dir = d_inode(dentry->d_parent);
+		err = bkpfs_create_bkp_inode(dir, bkp_dentry,
+					     d_inode(dentry)->i_mode, false);
+		if (err && err != -EEXIST) {
+			dput(bkp_dentry);
+			bkp_file = ERR_PTR(err);
+			goto out;
+		}
+	}
 
-	/* We should now open the backup file in write mode and start copying the data. 
- 	 * By this time there should be a positive dentry created for the backup file
- 	 * Populate the path for the bkp dentry.  	
- 	 */ 	
 	bkp_path.dentry = bkp_dentry;
-	bkp_path.mnt = mntget(lower_parent_mnt);
-
-	bkp_file = dentry_open(&bkp_path, flags, current_cred());
-	if(IS_ERR(bkp_file)){
-		printk(KERN_INFO "ERROR::Failed to open bkp_file\n");
-		err = PTR_ERR(bkp_file);
-		goto out1;
-	}
+	bkp_path.mnt = mntget(lower_parent_path.mnt);
+	bkp_file = dentry_open(&bkp_path, (flags & ~O_CREAT) | O_LARGEFILE,
+			       current_cred());
+	path_put(&bkp_path);
 
-out1:
-	bkpfs_put_lower_path(dentry, &lower_path);
-	bkpfs_put_lower_path(p_dentry, &lower_parent_path);
 out:
-	 dput(p_dentry);
-	if(err < 0)
-		return ERR_PTR(err);
+	path_put(&lower_parent_path);
+	kfree(bkp_fname);
 	return bkp_file;
-	
 }
 
 static long read_backup_version(struct file *file, struct ioctl_args *karg, int ver, loff_t pos)
 {
 	long err = 0, res;
 	struct file* bkp_file;
-	char *bkp_fname;
 	void *buff;
+	int s_ver, l_ver;
+	int format;
+	bool small;
+	loff_t length;
 	
 	printk(KERN_INFO "INFO::read_backup_version=%d at offset=%lld\n", ver, pos);
 	buff = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if(!buff)
+		return -ENOMEM;
 	
-	if(!access_ok(VERIFY_WRITE, karg->buff, karg->buff_size))
+	if(karg->buff_size > PAGE_SIZE ||
+	   !access_ok(VERIFY_WRITE, karg->buff, karg->buff_size))
 	{   
 		printk(KERN_WARNING "No write access to buffer region\n");
 		err = -EFAULT;
 		goto out;
 	}
-	
-	bkp_fname =(char*)kmalloc(NAME_MAX, GFP_KERNEL);
-	if(!bkp_fname){
-		err = -ENOMEM;
-		goto out1;
+
+	/* undo versions are rebuilt from the current file and the records,
+	 * delta versions from their checkpoint and the deltas after it,
+	 * chunk versions from the store, compressed ones from the chunks
+	 * covering the range, small ones from their attribute or pack.
+	 */
+	format = BKPFS_SB(file->f_inode->i_sb)->mnt_opts.bkp_format;
+	small = bkpfs_small_is(file->f_path.dentry, ver);
+	if (format == BKP_FORMAT_UNDO || format == BKP_FORMAT_DELTA ||
+	    format == BKP_FORMAT_CHUNK || format == BKP_FORMAT_COMPRESS ||
+	    small) {
+		err = bkpfs_get_version_info(file, &s_ver, &l_ver);
+		if (err < 0)
+			goto out;
+		if (small)
+			res = bkpfs_small_read(file->f_path.dentry, ver, buff,
+					       karg->buff_size, pos);
+		else if (format == BKP_FORMAT_UNDO)
+			res = bkpfs_undo_read(file->f_path.dentry, ver, l_ver + 1,
+					      buff, karg->buff_size, pos);
+		else if (format == BKP_FORMAT_CHUNK)
+			res = bkpfs_chunk_read(file->f_path.dentry, ver, buff,
+					       karg->buff_size, pos);
+		else if (format == BKP_FORMAT_COMPRESS)
+			res = bkpfs_zip_read(file->f_path.dentry, ver, buff,
+					     karg->buff_size, pos);
+		else
+			res = bkpfs_delta_read(file->f_path.dentry, ver, s_ver,
+					       buff, karg->buff_size, pos);
+		if (res < 0) {
+			err = res;
+			goto out;
+		}
+		if (res != karg->buff_size) {
+			err = -EIO;
+			goto out;
+		}
+		if (copy_to_user(karg->buff, buff, karg->buff_size))
+			err = -EFAULT;
+		goto out;
 	}
+	
+	err = bkpfs_get_version_info(file, &s_ver, &l_ver);
+	if (err < 0)
+		goto out;
 
-	bkp_file = open_backup_file(file, O_RDONLY, ver, bkp_fname);
+	bkp_file = bkpfs_append_open(file->f_path.dentry, ver, s_ver, &length);
 	if(IS_ERR(bkp_file)){
 		printk(KERN_INFO "ERROR::Failed to open bkp_file\n");
 		err = PTR_ERR(bkp_file);
-		goto out1;
+		goto out;
 	}
 	
 	/* read the backup data in internal buffer first and then copy it to user buf*/
-	res = kernel_read(bkp_file, buff, karg->buff_size, &pos);
+	res = 0;
+	if (pos < length)
+		res = kernel_read(bkp_file, buff,
+				  min_t(loff_t, karg->buff_size, length - pos), &pos);
 	if(res != karg->buff_size) {
 		printk("Read succeeded partially with # bytes read =%ld\n",res);
 		err = -EIO;
@@ -591,8 +1174,6 @@ static long read_backup_version(struct file *file, struct ioctl_args *karg, int
 
 out2: 
 	fput(bkp_file);
-out1:
-	kfree(bkp_fname);
 out:
 	kfree(buff);
 	return err;
@@ -641,15 +1222,17 @@ static long bkpfs_view_backup(struct file *file, struct ioctl_args *arg)
 	version = in_arg->version;
 	offset = in_arg->offset;
 	printk(KERN_INFO "INFO::View version=%d from off=%llu\n", version, offset);
-	
+
+	/* retention or a delete must not drop the version being read */
+	mutex_lock(&BKPFS_I(file_inode(file))->bkp_meta_lock);
 	err = bkpfs_get_version_info(file, &s_ver, &l_ver);
 	if(err < 0)
-		goto out;
+		goto out_unlock;
 
 	if(l_ver - s_ver < 0) {
 		printk(KERN_INFO "No backups exists\n");
 		err = -ENOENT;
-		goto out;
+		goto out_unlock;
 	}
 
 	switch(version) {
@@ -666,11 +1249,13 @@ static long bkpfs_view_backup(struct file *file, struct ioctl_args *arg)
 			/* Any valid version number less than number of versions present */
 			if(version < 0 || version  > l_ver - s_ver + 1) {
 				err = -EINVAL;
-				goto out;
+				goto out_unlock;
 			}
 			err = read_backup_version(file, karg, version+s_ver-1, offset);
 	}
 
+out_unlock:
+	mutex_unlock(&BKPFS_I(file_inode(file))->bkp_meta_lock);
 out:
 	if(in_arg)
 		kfree(in_arg);
@@ -724,21 +1309,34 @@ static long bkpfs_delete_backup(struct file *file, struct ioctl_args *arg)
 	dentry = file->f_path.dentry;
 	dir = d_inode(dentry->d_parent);
 
-	err = bkpfs_get_version_info(file, &s_ver, &l_ver);	
+	mutex_lock(&BKPFS_I(d_inode(dentry))->bkp_meta_lock);
+	err = bkpfs_get_xattr_info(dentry, &xattr);
 	if(err < 0)
-		goto out;
+		goto out_unlock;
+	s_ver = xattr.start_ver;
+	l_ver = xattr.cur_ver - 1;
 	
 	if(l_ver - s_ver < 0) {
 		printk(KERN_INFO "No backups exists\n");
 		err = -ENOENT;
-		goto out;
+		goto out_unlock;
 	}
 
 	switch(version) {
 		case -1:
 			/* Delete oldest backup version for this file */ 
 			printk(KERN_INFO "deleting oldest backup version\n");
-			err = delete_backup_file(dir, dentry, s_ver);
+			if (BKPFS_SB(dir->i_sb)->mnt_opts.bkp_format == BKP_FORMAT_DELTA)
+				err = bkpfs_delta_drop_oldest(dir, dentry, &xattr);
+			else if (BKPFS_SB(dir->i_sb)->mnt_opts.bkp_format == BKP_FORMAT_FULL)
+				err = bkpfs_append_drop_oldest(dir, dentry, s_ver,
+							       l_ver + 1);
+			else if (BKPFS_SB(dir->i_sb)->mnt_opts.bkp_format == BKP_FORMAT_CHUNK)
+				err = bkpfs_chunk_drop(dir, dentry, s_ver);
+			else
+				err = delete_backup_file(dir, dentry, s_ver);
+			if (err < 0)
+				goto out_unlock;
 			xattr.start_ver = s_ver+1;
 			xattr.cur_ver = l_ver+1;
 			err = bkpfs_set_xattr_info(dentry, &xattr);
@@ -747,23 +1345,41 @@ static long bkpfs_delete_backup(struct file *file, struct ioctl_args *arg)
 		case 0:
 			/* Delete the latest backup version for this file */	
 			printk(KERN_INFO "deleting newest backup version\n");
-			err = delete_backup_file(dir, dentry, l_ver);
+			if (BKPFS_SB(dir->i_sb)->mnt_opts.bkp_format == BKP_FORMAT_UNDO)
+				err = bkpfs_undo_drop_newest(dir, dentry, l_ver, l_ver + 1);
+			else if (BKPFS_SB(dir->i_sb)->mnt_opts.bkp_format == BKP_FORMAT_FULL)
+				err = bkpfs_append_drop_newest(dir, dentry, l_ver, s_ver);
+			else if (BKPFS_SB(dir->i_sb)->mnt_opts.bkp_format == BKP_FORMAT_CHUNK)
+				err = bkpfs_chunk_drop(dir, dentry, l_ver);
+			else
+				err = delete_backup_file(dir, dentry, l_ver);
+			/* the next delta would miss the extents of this one */
+			bkpfs_delta_invalidate(d_inode(dentry));
 			xattr.start_ver = s_ver;
 			xattr.cur_ver = l_ver;
+			/* its number is taken again by the next version */
+			xattr.fp_ver = 0;
 			err = bkpfs_set_xattr_info(dentry, &xattr);
 			break;
 		
 		case 1:
 			/* Delete all backup versions for this file */
 			for(ver = s_ver; ver <= l_ver; ver++) {
-				err = delete_backup_file(dir, dentry, ver);
+				if (BKPFS_SB(dir->i_sb)->mnt_opts.bkp_format == BKP_FORMAT_CHUNK)
+					err = bkpfs_chunk_drop(dir, dentry, ver);
+				else
+					err = delete_backup_file(dir, dentry, ver);
 				if(err < 0){
 					// Don't break. Try to delete next version
 					printk(KERN_INFO "ERROR:: failed while deleting backup number %d\n", ver-s_ver+1);
 				}
 			}
+			if (BKPFS_SB(dir->i_sb)->mnt_opts.bkp_format == BKP_FORMAT_UNDO)
+				delete_backup_file(dir, dentry, l_ver + 1);
 			xattr.start_ver = 1;
 			xattr.cur_ver = 1;
+			xattr.ckpt_ver = 0;
+			xattr.fp_ver = 0;
 			err = bkpfs_set_xattr_info(dentry, &xattr);
 			break;
 
@@ -773,6 +1389,8 @@ static long bkpfs_delete_backup(struct file *file, struct ioctl_args *arg)
 			printk(KERN_INFO "ERROR::delete called with invalid args\n");
 	}
 
+out_unlock:
+	mutex_unlock(&BKPFS_I(d_inode(dentry))->bkp_meta_lock);
 out:
 	if(in_arg)
 		kfree(in_arg);
@@ -792,7 +1410,6 @@ static long bkpfs_restore_backup(struct file *file, struct ioctl_args *arg)
 	struct path lower_path;
 	struct inode *inode;
 	struct dentry *dentry;
-	char *bkp_fname;
 	int s_ver, l_ver, version;
 	loff_t inpos = 0, outpos = 0;
 	loff_t size, new_size;
@@ -829,13 +1446,15 @@ static long bkpfs_restore_backup(struct file *file, struct ioctl_args *arg)
 	karg->in_arg = in_arg;
 	version = in_arg->version;
 
+	/* the version restored from must stay until it is copied back */
+	mutex_lock(&BKPFS_I(file_inode(file))->bkp_meta_lock);
 	err = bkpfs_get_version_info(file, &s_ver, &l_ver);	
 	if(err < 0)
-		goto out;
+		goto out_unlock;
 
 	if(version < 0 || (l_ver < s_ver) || (version > l_ver - s_ver + 1)) {
 		err = -ENOENT;
-		goto out;
+		goto out_unlock;
 	}
 
 	if(version == 0) 					// newest
@@ -843,17 +1462,33 @@ static long bkpfs_restore_backup(struct file *file, struct ioctl_args *arg)
 	else
 		version = s_ver + version - 1;	// "N"
 
-	bkp_fname =(char*)kmalloc(NAME_MAX, GFP_KERNEL);
-	if(!bkp_fname){
-		err = -ENOMEM;
-		goto out;
+	/* undo versions are rolled back in place from the current file */
+	if (BKPFS_SB(file->f_inode->i_sb)->mnt_opts.bkp_format == BKP_FORMAT_UNDO) {
+		err = bkpfs_undo_restore(file->f_path.dentry, version, l_ver + 1);
+		goto out_unlock;
+	}
+	if (BKPFS_SB(file->f_inode->i_sb)->mnt_opts.bkp_format == BKP_FORMAT_DELTA) {
+		err = bkpfs_delta_restore(file->f_path.dentry, version, s_ver);
+		goto out_unlock;
+	}
+	if (BKPFS_SB(file->f_inode->i_sb)->mnt_opts.bkp_format == BKP_FORMAT_CHUNK) {
+		err = bkpfs_chunk_restore(file->f_path.dentry, version);
+		goto out_unlock;
+	}
+	if (BKPFS_SB(file->f_inode->i_sb)->mnt_opts.bkp_format == BKP_FORMAT_COMPRESS) {
+		err = bkpfs_zip_restore(file->f_path.dentry, version);
+		goto out_unlock;
+	}
+	if (bkpfs_small_is(file->f_path.dentry, version)) {
+		err = bkpfs_small_restore(file->f_path.dentry, version);
+		goto out_unlock;
 	}
 
-	bkp_file = open_backup_file(file, O_RDONLY, version, bkp_fname);
+	bkp_file = bkpfs_append_open(file->f_path.dentry, version, s_ver, &size);
 	if(IS_ERR(bkp_file)){
 		printk(KERN_INFO "ERROR::Failed to open bkp_file\n");
 		err = PTR_ERR(bkp_file);
-		goto out;
+		goto out_unlock;
 	}
 	
 	dentry = file->f_path.dentry;
@@ -866,12 +1501,13 @@ static long bkpfs_restore_backup(struct file *file, struct ioctl_args *arg)
 		goto put_file;
 	}  	
 	
-	size = i_size_read(bkp_file->f_path.dentry->d_inode);
 	printk("size of backup data to be restored=%lld\n", size);
+	/* the restored content is no longer an append to the last version */
+	WRITE_ONCE(BKPFS_I(inode)->bkp_overwritten, 1);
 	
-	new_size = do_splice_direct(bkp_file, &inpos, user_file, &outpos, size, SPLICE_F_MOVE);
+	new_size = bkpfs_copy_restore(inode->i_sb, bkp_file, inpos, user_file, outpos, size);
 	if(new_size < 0) {
-		printk(KERN_INFO "ERROR:: Failed inside do_splice_direct\n");	
+		printk(KERN_INFO "ERROR:: Failed inside bkpfs_copy_range\n");	
 		err = new_size;
 	}
 	else
@@ -892,9 +1528,9 @@ static long bkpfs_restore_backup(struct file *file, struct ioctl_args *arg)
 put_file:
 	fput(bkp_file);
 	bkpfs_put_lower_path(dentry, &lower_path);
+out_unlock:
+	mutex_unlock(&BKPFS_I(file_inode(file))->bkp_meta_lock);
 out:
-	if(bkp_fname)
-		kfree(bkp_fname);
 	if(in_arg)
 		kfree(in_arg);
 	if(karg)
@@ -907,11 +1543,9 @@ static long bkpfs_get_file_size(struct file *file, struct ioctl_args *arg)
 {
 	long err = 0;
 	struct ioctl_args *karg;
-	struct dentry *dentry, *lower_parent_dentry;
-	struct dentry *bkp_dentry;
-	const char *fname;
-	char *bkp_fname;
-	long long size;
+	struct dentry *dentry;
+	struct file *bkp_file;
+	loff_t size;
 	int version, s_ver, l_ver;
 
 	if(!arg) {
@@ -944,13 +1578,7 @@ static long bkpfs_get_file_size(struct file *file, struct ioctl_args *arg)
 	}
 	
 	dentry = file->f_path.dentry;
-	fname = dentry->d_name.name;
 
-	bkp_fname =(char*)kmalloc(NAME_MAX, GFP_KERNEL);
-	if(!bkp_fname){
-		err = -ENOMEM;
-		goto out;
-	}
 	
 	err = bkpfs_get_version_info(file, &s_ver, &l_ver);		
 	if(err < 0)
@@ -977,17 +1605,46 @@ static long bkpfs_get_file_size(struct file *file, struct ioctl_args *arg)
 			version = version + s_ver - 1;
 	}
 
-	sprintf(bkp_fname,".bkp_%s.%d",fname, version);
-	
-	lower_parent_dentry = BKPFS_D(dentry->d_parent)->lower_path.dentry;
-	bkp_dentry = bkpfs_get_bkp_dentry(lower_parent_dentry, bkp_fname, false);	
-	if(IS_ERR(bkp_dentry)) {
-		printk(KERN_INFO "Couldn't find dentry for backup file with version num=%d\n",version);
-		err = PTR_ERR(bkp_dentry);
-		goto out;
+	if (BKPFS_SB(dentry->d_sb)->mnt_opts.bkp_format == BKP_FORMAT_UNDO) {
+		err = bkpfs_undo_size(dentry, version, l_ver + 1, &size);
+		if (err < 0)
+			goto out;
+		goto copy_size;
+	}
+	if (BKPFS_SB(dentry->d_sb)->mnt_opts.bkp_format == BKP_FORMAT_DELTA) {
+		err = bkpfs_delta_size(dentry, version, &size);
+		if (err < 0)
+			goto out;
+		goto copy_size;
+	}
+	if (BKPFS_SB(dentry->d_sb)->mnt_opts.bkp_format == BKP_FORMAT_CHUNK) {
+		err = bkpfs_chunk_size(dentry, version, &size);
+		if (err < 0)
+			goto out;
+		goto copy_size;
+	}
+	if (BKPFS_SB(dentry->d_sb)->mnt_opts.bkp_format == BKP_FORMAT_COMPRESS) {
+		err = bkpfs_zip_size(dentry, version, &size);
+		if (err < 0)
+			goto out;
+		goto copy_size;
+	}
+	if (bkpfs_small_is(dentry, version)) {
+		err = bkpfs_small_size(dentry, version, &size);
+		if (err < 0)
+			goto out;
+		goto copy_size;
 	}
 
-	size = d_inode(bkp_dentry)->i_size;	
+	/* appended versions are a prefix of a longer backup file */
+	bkp_file = bkpfs_append_open(dentry, version, s_ver, &size);
+	if(IS_ERR(bkp_file)) {
+		printk(KERN_INFO "ERROR::Couldn't find backup file with version num=%d\n",version);
+		err = PTR_ERR(bkp_file);
+		goto out;
+	}
+	fput(bkp_file);
+copy_size:
 	if(copy_to_user(karg->buff, &size, karg->buff_size))
 	{
 		printk(KERN_WARNING "copy of data to buffer failed. Check permissions\n");
@@ -996,8 +1653,6 @@ static long bkpfs_get_file_size(struct file *file, struct ioctl_args *arg)
 	}
 
 out:
-	if(bkp_fname)
-		kfree(bkp_fname);
 	if(karg)
 		kfree(karg);
 	return err;
@@ -1009,12 +1664,33 @@ static long bkpfs_handle_ioctl(struct file *file, unsigned int cmd, void *arg)
 	int s_ver, l_ver;
 	int val;
 
+	/* the one ioctl of directories, it names an entry of the directory */
+	if (cmd == IOCTL_UNDELETE) {
+		pr_debug("INFO::undelete requested\n");
+		if (!S_ISDIR(file_inode(file)->i_mode))
+			err = -ENOTDIR;
+		else
+			err = bkpfs_trash_undelete(file, arg);
+		goto out;
+	}
+
 	if(S_ISDIR(file->f_path.dentry->d_inode->i_mode)) {
 		printk(KERN_INFO "ERROR::ioctl on directory\n");
 		err = -EISDIR;
 		goto out;
 	}
 
+	/* versions still being taken by the async pipeline are part of the
+	 * history the user sees, wait for them.
+	 */
+	bkpfs_flush_backup(file_inode(file));
+	if (BKPFS_SB(file_inode(file)->i_sb)->mnt_opts.bkp_format ==
+	    BKP_FORMAT_UNDO) {
+		err = bkpfs_undo_flush(file->f_path.dentry);
+		if (err < 0)
+			goto out;
+	}
+
 	switch(cmd) {
 		case IOCTL_GET_MAX_VERS:
 			printk(KERN_INFO "INFO::max version number requested\n");
@@ -1062,6 +1738,13 @@ static long bkpfs_handle_ioctl(struct file *file, unsigned int cmd, void *arg)
 
 			break;
 
+		case IOCTL_GET_STATS:
+			/* Counters of the whole mount, the file only names it */
+			pr_debug("INFO::backup stats requested\n");
+			err = bkpfs_get_stats(file_inode(file)->i_sb,
+					      (struct ioctl_args *)arg);
+			break;
+
 		case IOCTL_GET_FILE_SIZE:
 			/* Get total size of the backup file and return to user */
 			printk(KERN_INFO "INFO::size of version file requested\n");
@@ -1239,6 +1922,14 @@ static int bkpfs_flush(struct file *file, fl_owner_t id)
 		err = lower_file->f_op->flush(lower_file, id);
 	}
 
+	/* bkp_trigger=close: one version for everything written through
+	 * this file, taken on the first close after the writes.
+	 */
+	if (!err && BKPFS_SB(file_inode(file)->i_sb)->mnt_opts.bkp_trigger ==
+			BKP_TRIGGER_CLOSE &&
+	    atomic_xchg(&BKPFS_F(file)->bkp_dirty, 0))
+		err = bkpfs_request_backup(file->f_path.dentry);
+
 	return err;
 }
 
@@ -1246,7 +1937,22 @@ static int bkpfs_flush(struct file *file, fl_owner_t id)
 static int bkpfs_file_release(struct inode *inode, struct file *file)
 {
 	struct file *lower_file;
+	int err;
 	UDBG;
+	/* this open of the file is gone (its last close or unmap), the stores
+	 * made through any mapping of the inode since the last version become
+	 * one.  Other opens may still map it, their later stores go to the next.
+	 */
+	if (atomic_xchg(&BKPFS_I(inode)->bkp_mmap_dirty, 0)) {
+		err = bkpfs_request_backup(file->f_path.dentry);
+		if (err < 0) {
+			/* still owed, by the next msync, fsync or release */
+			atomic_set(&BKPFS_I(inode)->bkp_mmap_dirty, 1);
+			printk(KERN_INFO "ERROR:: backup of mapped stores failed, err=%d\n",
+			       err);
+		}
+	}
+
 	lower_file = bkpfs_lower_file(file);
 	if (lower_file) {
 		bkpfs_set_lower_file(file, NULL);
@@ -1260,7 +1966,7 @@ static int bkpfs_file_release(struct inode *inode, struct file *file)
 static int bkpfs_fsync(struct file *file, loff_t start, loff_t end,
 			int datasync)
 {
-	int err;
+	int err, mapped, written;
 	struct file *lower_file;
 	struct path lower_path;
 	struct dentry *dentry = file->f_path.dentry;
@@ -1273,6 +1979,25 @@ static int bkpfs_fsync(struct file *file, loff_t start, loff_t end,
 	bkpfs_get_lower_path(dentry, &lower_path);
 	err = vfs_fsync_range(lower_file, start, end, datasync);
 	bkpfs_put_lower_path(dentry, &lower_path);
+	if (err)
+		goto out;
+
+	/* bkp_trigger=fsync: the synced state becomes a version.  Stores
+	 * through a mapping are only seen here (msync) or on release.  The
+	 * flag is tested and cleared at once, of two racing fsyncs only one
+	 * finds it set and cuts the version.
+	 */
+	mapped = atomic_xchg(&BKPFS_I(d_inode(dentry))->bkp_mmap_dirty, 0);
+	written = BKPFS_SB(dentry->d_sb)->mnt_opts.bkp_trigger == BKP_TRIGGER_FSYNC &&
+		  atomic_xchg(&BKPFS_F(file)->bkp_dirty, 0);
+	if (!mapped && !written)
+		goto out;
+	err = bkpfs_request_backup(dentry);
+	/* still owed, by the next msync, fsync or release */
+	if (err < 0 && mapped)
+		atomic_set(&BKPFS_I(d_inode(dentry))->bkp_mmap_dirty, 1);
+	if (err < 0 && written)
+		atomic_set(&BKPFS_F(file)->bkp_dirty, 1);
 out:
 	return err;
 }
@@ -1290,6 +2015,23 @@ static int bkpfs_fasync(int fd, struct file *file, int flag)
 	return err;
 }
 
+/* @brief: llseek of regular files.  Where the data and holes are is only
+ *         known by the lower file, SEEK_DATA/SEEK_HOLE are asked to it and
+ *         the result becomes the position of the upper file.
+ */
+static loff_t bkpfs_llseek(struct file *file, loff_t offset, int whence)
+{
+	loff_t pos;
+
+	if (whence != SEEK_DATA && whence != SEEK_HOLE)
+		return generic_file_llseek(file, offset, whence);
+
+	pos = vfs_llseek(bkpfs_lower_file(file), offset, whence);
+	if (pos < 0)
+		return pos;
+	return vfs_setpos(file, pos, file_inode(file)->i_sb->s_maxbytes);
+}
+
 /*
  * Bkpfs cannot use generic_file_llseek as ->llseek, because it would
  * only set the offset of the upper file.  So we have to implement our
@@ -1342,14 +2084,110 @@ out:
 	return err;
 }
 
+/* an async write queued on the lower file on behalf of a bkpfs one */
+struct bkpfs_aio_req {
+	struct kiocb iocb;		/* submitted to the lower file */
+	struct kiocb *orig_iocb;	/* of the bkpfs file, completed last */
+	loff_t pos;			/* where the write starts */
+	loff_t old_size;		/* size of the file before the write */
+	long res, res2;			/* result from the lower file */
+	struct work_struct work;
+};
+
+/* @brief: finish a queued write in process context: do the bookkeeping a
+ *         synchronous write does and take the version it made due, then
+ *         complete the caller's iocb, so the version is there by the time
+ *         the completion is reaped, as it is when write() returns.
+ */
+static void bkpfs_aio_work(struct work_struct *work)
+{
+	struct bkpfs_aio_req *req = container_of(work, struct bkpfs_aio_req,
+						 work);
+	struct kiocb *orig_iocb = req->orig_iocb;
+	struct file *file = orig_iocb->ki_filp;
+	const struct cred *old_cred;
+	int err;
+
+	if (req->res > 0) {
+		/* backups are created with the creds the file was opened with */
+		old_cred = override_creds(file->f_cred);
+		err = bkpfs_write_done(file, req->pos, req->res, req->old_size);
+		revert_creds(old_cred);
+		if (err < 0)
+			printk(KERN_INFO "ERROR:: backup after async write of %s failed, err=%d\n",
+			       file->f_path.dentry->d_name.name, err);
+	}
+
+	fput(req->iocb.ki_filp);
+	orig_iocb->ki_complete(orig_iocb, req->res, req->res2);
+	kfree(req);
+}
+
+/* @brief: lower completion of a queued write, may run in interrupt context */
+static void bkpfs_aio_complete(struct kiocb *iocb, long res, long res2)
+{
+	struct bkpfs_aio_req *req = container_of(iocb, struct bkpfs_aio_req,
+						 iocb);
+
+	req->res = res;
+	req->res2 = res2;
+	INIT_WORK(&req->work, bkpfs_aio_work);
+	queue_work(BKPFS_SB(file_inode(req->orig_iocb->ki_filp)->i_sb)->bkp_wq,
+		   &req->work);
+}
+
+/* @brief: submit an async write to the lower file through its own kiocb,
+ *         so that its completion comes back to bkpfs first.
+ * Return:	bytes written, -EIOCBQUEUED, or -errno
+ */
+static ssize_t bkpfs_aio_write(struct kiocb *iocb, struct iov_iter *iter,
+			       struct file *lower_file, loff_t old_size)
+{
+	struct bkpfs_aio_req *req;
+	ssize_t res;
+
+	req = kmalloc(sizeof(*req), GFP_KERNEL);
+	if (!req)
+		return -ENOMEM;
+
+	/* fields the lower fs may look at and the caller did not set start
+	 * out as those of a synchronous write
+	 */
+	init_sync_kiocb(&req->iocb, get_file(lower_file));
+	req->iocb.ki_pos = iocb->ki_pos;
+	req->iocb.ki_flags = iocb->ki_flags;
+	req->iocb.ki_hint = iocb->ki_hint;
+	req->iocb.ki_ioprio = iocb->ki_ioprio;
+	req->iocb.ki_complete = bkpfs_aio_complete;
+	req->orig_iocb = iocb;
+	req->pos = (iocb->ki_flags & IOCB_APPEND) ? old_size : iocb->ki_pos;
+	req->old_size = old_size;
+
+	res = lower_file->f_op->write_iter(&req->iocb, iter);
+	if (res == -EIOCBQUEUED)
+		return res;
+
+	/* done without queueing: the caller completes it */
+	iocb->ki_pos = req->iocb.ki_pos;
+	fput(lower_file);
+	kfree(req);
+	return res;
+}
+
 /*
- * Bkpfs write_iter, redirect modified iocb to lower write_iter
+ * Bkpfs write_iter, redirect modified iocb to lower write_iter.
+ * Writes through it (writev, pwritev, AIO, kernel writers) are versioned
+ * like write(); for a queued async write that happens on its completion.
  */
 ssize_t
 bkpfs_write_iter(struct kiocb *iocb, struct iov_iter *iter)
 {
-	int err;
+	ssize_t err;
+	int undo, werr;
 	struct file *file = iocb->ki_filp, *lower_file;
+	struct inode *inode = file_inode(file);
+	struct mnt_opt_info *opts = &BKPFS_SB(inode->i_sb)->mnt_opts;
+	loff_t old_size, pos;
 	UDBG;
 
 	lower_file = bkpfs_lower_file(file);
@@ -1358,24 +2196,49 @@ bkpfs_write_iter(struct kiocb *iocb, struct iov_iter *iter)
 		goto out;
 	}
 
+	/* the pre-image has to be saved before the write is submitted */
+	undo = opts->bkp_format == BKP_FORMAT_UNDO;
+	if (undo)
+		inode_lock(inode);
+	old_size = i_size_read(file_inode(lower_file));
+	pos = (iocb->ki_flags & IOCB_APPEND) ? old_size : iocb->ki_pos;
+	if (undo) {
+		err = bkpfs_undo_prepare(file->f_path.dentry, pos,
+					 iov_iter_count(iter));
+		if (err < 0)
+			goto out_unlock;
+	}
+	bkpfs_delta_track(inode, pos, iov_iter_count(iter));
+
+	if (!is_sync_kiocb(iocb)) {
+		err = bkpfs_aio_write(iocb, iter, lower_file, old_size);
+		goto out_unlock;
+	}
+
 	get_file(lower_file); /* prevent lower_file from being released */
 	iocb->ki_filp = lower_file;
 	err = lower_file->f_op->write_iter(iocb, iter);
 	iocb->ki_filp = file;
 	fput(lower_file);
-	/* update upper inode times/sizes as needed */
-	if (err >= 0 || err == -EIOCBQUEUED) {
-		fsstack_copy_inode_size(d_inode(file->f_path.dentry),
-					file_inode(lower_file));
-		fsstack_copy_attr_times(d_inode(file->f_path.dentry),
-					file_inode(lower_file));
+
+out_unlock:
+	if (undo)
+		inode_unlock(inode);
+	/* the bookkeeping of a queued write is done on its completion */
+	if (err > 0) {
+		werr = bkpfs_write_done(file, iocb->ki_pos - err, err, old_size);
+		if (werr < 0)
+			err = werr;
+	} else if (err == -EIOCBQUEUED) {
+		fsstack_copy_inode_size(inode, file_inode(lower_file));
+		fsstack_copy_attr_times(inode, file_inode(lower_file));
 	}
 out:
 	return err;
 }
 
 const struct file_operations bkpfs_main_fops = {
-	.llseek		= generic_file_llseek,
+	.llseek		= bkpfs_llseek,
 	.read		= bkpfs_read,
 	.write		= bkpfs_write,
 	.unlocked_ioctl	= bkpfs_unlocked_ioctl,
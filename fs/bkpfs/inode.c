@@ -12,6 +12,8 @@
 #include "bkpfs.h"
 
 static int bkpfs_init_xattr_info(struct dentry *dentry);
+static void bkpfs_ver_store(struct inode *inode, int state,
+			    struct bkpfs_xattr_info *info);
 extern int  bkpfs_cleanup_on_delete(struct inode *dir, struct dentry *dentry);
 
 static int bkpfs_create(struct inode *dir, struct dentry *dentry,
@@ -95,9 +97,27 @@ static int bkpfs_unlink(struct inode *dir, struct dentry *dentry)
 	struct path lower_path;
 	UDBG;	
 
-	/* Delete any backups associated with this file */
-	if(!S_ISDIR(d_inode(dentry)->i_mode))
+	/* Delete any backups associated with this file, once a backup
+	 * still queued for it has been taken and can't recreate one.
+	 */
+	if(!S_ISDIR(d_inode(dentry)->i_mode)) {
+		bkpfs_flush_backup(d_inode(dentry));
+		/* or moved to the trash along with the file, if it can be */
+		if (BKPFS_SB(dir->i_sb)->mnt_opts.bkp_unlink == BKP_UNLINK_TRASH) {
+			err = bkpfs_trash_file(dir, dentry);
+			if (!err) {
+				/* still open, it has no history any more */
+				bkpfs_ver_store(d_inode(dentry), BKPFS_VER_NONE,
+						NULL);
+				clear_nlink(d_inode(dentry));
+				d_inode(dentry)->i_ctime = dir->i_ctime;
+				d_drop(dentry);
+			}
+			if (err != -EAGAIN)
+				return err;
+		}
 		err = bkpfs_cleanup_on_delete(dir, dentry);
+	}
 
 	bkpfs_get_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
@@ -247,6 +267,224 @@ out:
 	return err;
 }
 
+/* no backup of inode is queued or being taken */
+static bool bkpfs_backup_idle(struct inode *inode)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(inode);
+
+	return !READ_ONCE(info->bkp_running) &&
+	       !work_pending(&info->bkp_work) &&
+	       !delayed_work_pending(&info->bkp_dwork);
+}
+
+/* @brief: bkpfs_set_xattr_info for callers holding the inode lock, which
+ *         the setxattr of the upper inode takes.
+ */
+static int bkpfs_set_xattr_info_locked(struct dentry *dentry,
+				       struct bkpfs_xattr_info *info)
+{
+	struct path lower_path;
+	int err;
+
+	bkpfs_get_lower_path(dentry, &lower_path);
+	err = vfs_setxattr(lower_path.dentry, BKPFS_XATTR_NAME, info,
+			   sizeof(*info), XATTR_REPLACE);
+	bkpfs_put_lower_path(dentry, &lower_path);
+	if (err)
+		bkpfs_ver_store(d_inode(dentry), BKPFS_VER_UNKNOWN, NULL);
+	else
+		bkpfs_ver_store(d_inode(dentry), BKPFS_VER_CACHED, info);
+	return err;
+}
+
+/* @brief: does renaming old_dentry over new_dentry save a new content of
+ *         the replaced file (write a temporary, rename it over)?  Then the
+ *         replaced lower inode is kept as its next version instead of being
+ *         destroyed.  On success the version state of both files is locked,
+ *         room is made for the new version, the versions of the temporary
+ *         are dropped and dst/src hold the version info of both files.
+ */
+static bool bkpfs_save_begin(struct dentry *old_dentry,
+			     struct dentry *new_dentry,
+			     struct bkpfs_xattr_info *dst,
+			     struct bkpfs_xattr_info *src)
+{
+	struct mnt_opt_info *opts = &BKPFS_SB(old_dentry->d_sb)->mnt_opts;
+	struct inode *src_inode = d_inode(old_dentry);
+	struct inode *dst_inode = d_inode(new_dentry);
+	struct inode *lower_dst;
+	int maxvers;
+
+	/* only a full backup is the plain old content */
+	if (opts->bkp_format != BKP_FORMAT_FULL || !dst_inode ||
+	    src_inode == dst_inode || !S_ISREG(src_inode->i_mode) ||
+	    !S_ISREG(dst_inode->i_mode))
+		return false;
+	/* writers or other links of the replaced file would change the version */
+	lower_dst = bkpfs_lower_inode(dst_inode);
+	if (atomic_read(&lower_dst->i_writecount) > 0 || lower_dst->i_nlink > 1)
+		return false;
+	/* the version info moves to the lower inode of the temporary */
+	if (inode_permission(bkpfs_lower_inode(src_inode), MAY_WRITE))
+		return false;
+	if (!bkpfs_backup_idle(src_inode) || !bkpfs_backup_idle(dst_inode))
+		return false;
+
+	/* a backup holding these goes on to take the inode locks the VFS
+	 * holds over the rename, so never wait for them
+	 */
+	if (!mutex_trylock(&BKPFS_I(src_inode)->bkp_meta_lock))
+		return false;
+	if (!mutex_trylock(&BKPFS_I(dst_inode)->bkp_meta_lock))
+		goto out_src;
+	if (bkpfs_get_xattr_info(new_dentry, dst) < 0 ||
+	    bkpfs_get_xattr_info(old_dentry, src) < 0)
+		goto out_dst;
+
+	maxvers = opts->maxvers ? opts->maxvers : DEFAULT_MAXVERS;
+	if (dst->cur_ver - dst->start_ver >= maxvers) {
+		if (bkpfs_append_drop_oldest(d_inode(new_dentry->d_parent),
+					     new_dentry, dst->start_ver,
+					     dst->cur_ver + 1))
+			goto out_dst;
+		dst->start_ver++;
+	}
+
+	/* the history of the temporary goes away with its name */
+	bkpfs_drop_versions(d_inode(old_dentry->d_parent), old_dentry);
+	src->start_ver = src->cur_ver;
+	return true;
+
+out_dst:
+	mutex_unlock(&BKPFS_I(dst_inode)->bkp_meta_lock);
+out_src:
+	mutex_unlock(&BKPFS_I(src_inode)->bkp_meta_lock);
+	return false;
+}
+
+/* @brief: the lower half of a save of a file without an id: the replaced
+ *         file is renamed to version ver of its name, then the temporary
+ *         to the name.  Called under lock_rename of the lower directories.
+ */
+static int bkpfs_save_rename(struct dentry *lower_old_dir_dentry,
+			     struct dentry *lower_old_dentry,
+			     struct dentry *lower_new_dir_dentry,
+			     struct dentry *lower_new_dentry,
+			     struct dentry *new_dentry, int ver)
+{
+	struct inode *lower_new_dir = d_inode(lower_new_dir_dentry);
+	struct dentry *slot, *target;
+	char *name;
+	int err;
+
+	name = kmalloc(NAME_MAX, GFP_KERNEL);
+	if (!name)
+		return -ENOMEM;
+	bkpfs_bkp_name(new_dentry, ver, name);
+	slot = lookup_one_len(name, lower_new_dir_dentry, strlen(name));
+	kfree(name);
+	if (IS_ERR(slot))
+		return PTR_ERR(slot);
+	err = -EEXIST;
+	if (d_really_is_negative(slot))
+		err = vfs_rename(lower_new_dir, lower_new_dentry, lower_new_dir,
+				 slot, NULL, 0);
+	dput(slot);
+	if (err)
+		return err;
+
+	target = lookup_one_len(new_dentry->d_name.name, lower_new_dir_dentry,
+				new_dentry->d_name.len);
+	if (IS_ERR(target)) {
+		err = PTR_ERR(target);
+		printk(KERN_INFO "ERROR:: %s was left as version %d\n",
+		       new_dentry->d_name.name, ver);
+		return err;
+	}
+	err = vfs_rename(d_inode(lower_old_dir_dentry), lower_old_dentry,
+			 lower_new_dir, target, NULL, 0);
+	if (err)
+		/* put the replaced file back */
+		vfs_rename(lower_new_dir, lower_new_dentry, lower_new_dir,
+			   target, NULL, 0);
+	dput(target);
+	return err;
+}
+
+/* @brief: the versions of a file with an id are not in its directory, so
+ *         the replaced file is first linked in as version ver, then the
+ *         temporary is renamed over it as usual.
+ */
+static int bkpfs_save_link(struct dentry *new_dentry, int ver)
+{
+	struct dentry *slot, *p_dentry;
+	struct path vers, lower_path;
+	char *name;
+	int err;
+
+	name = kmalloc(NAME_MAX, GFP_KERNEL);
+	if (!name)
+		return -ENOMEM;
+	err = bkpfs_bkp_dir(new_dentry, &vers, 1);
+	if (err)
+		goto out;
+	bkpfs_bkp_name(new_dentry, ver, name);
+	slot = bkpfs_get_bkp_dentry(vers.dentry, name, true);
+	if (IS_ERR(slot)) {
+		err = PTR_ERR(slot);
+		goto out_vers;
+	}
+
+	bkpfs_get_lower_path(new_dentry, &lower_path);
+	p_dentry = lock_parent(slot);
+	err = -EEXIST;
+	if (d_really_is_negative(slot))
+		err = vfs_link(lower_path.dentry, d_inode(p_dentry), slot, NULL);
+	unlock_dir(p_dentry);
+	bkpfs_put_lower_path(new_dentry, &lower_path);
+	dput(slot);
+out_vers:
+	path_put(&vers);
+out:
+	kfree(name);
+	return err;
+}
+
+/* @brief: finish a save started by bkpfs_save_begin, which failed unless
+ *         err is 0.  The lower dentries still are those of the upper ones.
+ */
+static void bkpfs_save_end(struct dentry *old_dentry, struct dentry *new_dentry,
+			   struct bkpfs_xattr_info *dst,
+			   struct bkpfs_xattr_info *src, int err)
+{
+	struct path lower_old_path, lower_new_path;
+
+	if (!err) {
+		/* the lower inode of new_dentry now is version cur_ver */
+		bkpfs_get_lower_path(old_dentry, &lower_old_path);
+		bkpfs_get_lower_path(new_dentry, &lower_new_path);
+		bkpfs_small_carry(new_dentry, lower_new_path.dentry,
+				  lower_old_path.dentry, dst->start_ver,
+				  dst->cur_ver);
+		bkpfs_put_lower_path(new_dentry, &lower_new_path);
+		bkpfs_put_lower_path(old_dentry, &lower_old_path);
+
+		/* whoever still has the replaced file open reads a backup */
+		bkpfs_ver_store(d_inode(new_dentry), BKPFS_VER_NONE, NULL);
+		dst->cur_ver++;
+		if (bkpfs_set_xattr_info_locked(old_dentry, dst))
+			printk(KERN_INFO "ERROR:: failed to move the versions of %s\n",
+			       new_dentry->d_name.name);
+		else
+			atomic64_inc(&BKPFS_SB(old_dentry->d_sb)->bkp_saved);
+	} else {
+		bkpfs_set_xattr_info_locked(new_dentry, dst);
+		bkpfs_set_xattr_info_locked(old_dentry, src);
+	}
+	mutex_unlock(&BKPFS_I(d_inode(new_dentry))->bkp_meta_lock);
+	mutex_unlock(&BKPFS_I(d_inode(old_dentry))->bkp_meta_lock);
+}
+
 /*
  * The locking rules in bkpfs_rename are complex.  We could use a simpler
  * superblock-level name-space lock for renames and copy-ups.
@@ -262,11 +500,26 @@ static int bkpfs_rename(struct inode *old_dir, struct dentry *old_dentry,
 	struct dentry *lower_new_dir_dentry = NULL;
 	struct dentry *trap = NULL;
 	struct path lower_old_path, lower_new_path;
+	struct bkpfs_xattr_info dst_xattr, src_xattr;
+	bool save;
 	UDBG;	
 
 	if (flags)
 		return -EINVAL;
 
+	/* an editor saving the file: keep what it replaces as a version */
+	save = bkpfs_save_begin(old_dentry, new_dentry, &dst_xattr, &src_xattr);
+	if (save && dst_xattr.id_ino) {
+		err = bkpfs_save_link(new_dentry, dst_xattr.cur_ver);
+		if (err) {
+			/* the rename itself must not fail for it */
+			bkpfs_save_end(old_dentry, new_dentry, &dst_xattr,
+				       &src_xattr, err);
+			save = false;
+			err = 0;
+		}
+	}
+
 	bkpfs_get_lower_path(old_dentry, &lower_old_path);
 	bkpfs_get_lower_path(new_dentry, &lower_new_path);
 	lower_old_dentry = lower_old_path.dentry;
@@ -286,9 +539,14 @@ static int bkpfs_rename(struct inode *old_dir, struct dentry *old_dentry,
 		goto out;
 	}
 
-	err = vfs_rename(d_inode(lower_old_dir_dentry), lower_old_dentry,
-			 d_inode(lower_new_dir_dentry), lower_new_dentry,
-			 NULL, 0);
+	if (save && !dst_xattr.id_ino)
+		err = bkpfs_save_rename(lower_old_dir_dentry, lower_old_dentry,
+					lower_new_dir_dentry, lower_new_dentry,
+					new_dentry, dst_xattr.cur_ver);
+	else
+		err = vfs_rename(d_inode(lower_old_dir_dentry), lower_old_dentry,
+				 d_inode(lower_new_dir_dentry), lower_new_dentry,
+				 NULL, 0);
 	if (err)
 		goto out;
 
@@ -303,6 +561,11 @@ static int bkpfs_rename(struct inode *old_dir, struct dentry *old_dentry,
 
 out:
 	unlock_rename(lower_old_dir_dentry, lower_new_dir_dentry);
+	if (save && err && dst_xattr.id_ino)
+		delete_backup_file(new_dir, new_dentry, dst_xattr.cur_ver);
+	if (save)
+		bkpfs_save_end(old_dentry, new_dentry, &dst_xattr, &src_xattr,
+			       err);
 	dput(lower_old_dir_dentry);
 	dput(lower_new_dir_dentry);
 	bkpfs_put_lower_path(old_dentry, &lower_old_path);
@@ -422,6 +685,13 @@ static int bkpfs_setattr(struct dentry *dentry, struct iattr *ia)
 		err = inode_newsize_ok(inode, ia->ia_size);
 		if (err)
 			goto out;
+		/* undo format must save the tail before it is cut off */
+		err = bkpfs_undo_truncate(dentry, ia->ia_size);
+		if (err)
+			goto out;
+		bkpfs_delta_truncate(inode, ia->ia_size);
+		bkpfs_append_note(inode, ia->ia_size,
+				  i_size_read(bkpfs_lower_inode(inode)));
 		truncate_setsize(inode, ia->ia_size);
 	}
 
@@ -496,6 +766,9 @@ bkpfs_setxattr(struct dentry *dentry, struct inode *inode, const char *name,
 		goto out;
 	}
 	err = vfs_setxattr(lower_dentry, name, value, size, flags);
+	/* set by hand: reload the version info on the next access */
+	if (!strcmp(name, BKPFS_XATTR_NAME))
+		bkpfs_ver_store(inode, BKPFS_VER_UNKNOWN, NULL);
 	if (err)
 		goto out;
 	fsstack_copy_attr_all(d_inode(dentry),
@@ -573,6 +846,8 @@ bkpfs_removexattr(struct dentry *dentry, struct inode *inode, const char *name)
 		goto out;
 	}
 	err = vfs_removexattr(lower_dentry, name);
+	if (!strcmp(name, BKPFS_XATTR_NAME))
+		bkpfs_ver_store(inode, BKPFS_VER_UNKNOWN, NULL);
 	if (err)
 		goto out;
 	fsstack_copy_attr_all(d_inode(dentry), lower_inode);
@@ -589,22 +864,62 @@ static int bkpfs_init_xattr_info(struct dentry* dentry)
 	struct bkpfs_xattr_info *info; 
 	
 	size = sizeof(struct bkpfs_xattr_info);
-	info = kmalloc(size, GFP_KERNEL);
+	info = kzalloc(size, GFP_KERNEL);
+	if (!info)
+		return -ENOMEM;
 
 	info->start_ver = 1;
 	info->cur_ver = 1;
+	bkpfs_layout_set_id(dentry, info);
 
 	printk(KERN_INFO "initialising xattr info for file\n");
 	
 	err = vfs_setxattr(dentry, BKPFS_XATTR_NAME, (void*)info, size, flags);
 	if(err)
 		printk(KERN_INFO "Cannot initialise xattr_info\n");
+	else
+		bkpfs_ver_store(d_inode(dentry), BKPFS_VER_CACHED, info);
 		
 	kfree(info);
 	return err;
 }
 
-/* Wrappers over setxattr and getxattr to manipulate backup persistent control info */
+/* @brief: replace the cached version info of inode. info may be NULL
+ *         unless state is BKPFS_VER_CACHED.
+ */
+static void bkpfs_ver_store(struct inode *inode, int state,
+			    struct bkpfs_xattr_info *info)
+{
+	struct bkpfs_inode_info *bi = BKPFS_I(inode);
+
+	write_seqlock(&bi->ver_lock);
+	bi->ver_state = state;
+	if (info)
+		bi->ver = *info;
+	write_sequnlock(&bi->ver_lock);
+}
+
+/* @brief: install what was just read from the xattr, unless the cache was
+ *         filled meanwhile (by a writer, whose value is newer).
+ */
+static void bkpfs_ver_load(struct inode *inode, int state,
+			   struct bkpfs_xattr_info *info)
+{
+	struct bkpfs_inode_info *bi = BKPFS_I(inode);
+
+	write_seqlock(&bi->ver_lock);
+	if (bi->ver_state == BKPFS_VER_UNKNOWN) {
+		bi->ver_state = state;
+		if (info)
+			bi->ver = *info;
+	}
+	write_sequnlock(&bi->ver_lock);
+}
+
+/* Wrappers over setxattr and getxattr to manipulate backup persistent control info.
+ * The value is cached in the inode and written through, so reading it costs
+ * no xattr I/O once the inode is loaded.
+ */
 int bkpfs_set_xattr_info(struct dentry *dentry, struct bkpfs_xattr_info *info)
 {
 	int err = 0;
@@ -612,6 +927,10 @@ int bkpfs_set_xattr_info(struct dentry *dentry, struct bkpfs_xattr_info *info)
 	int flags = XATTR_REPLACE;
 	
 	err = vfs_setxattr(dentry, BKPFS_XATTR_NAME, (void*)info, info_size, flags);
+	if (err)
+		bkpfs_ver_store(d_inode(dentry), BKPFS_VER_UNKNOWN, NULL);
+	else
+		bkpfs_ver_store(d_inode(dentry), BKPFS_VER_CACHED, info);
 	return err;
 }
 
@@ -619,19 +938,40 @@ int bkpfs_get_xattr_info(struct dentry *dentry, struct bkpfs_xattr_info *info)
 {
 	int err = 0, res;
 	int info_size = sizeof(struct bkpfs_xattr_info);
+	struct bkpfs_inode_info *bi = BKPFS_I(d_inode(dentry));
+	unsigned int seq;
+	int state;
+
+	do {
+		seq = read_seqbegin(&bi->ver_lock);
+		state = bi->ver_state;
+		*info = bi->ver;
+	} while (read_seqretry(&bi->ver_lock, seq));
+	if (state == BKPFS_VER_CACHED)
+		return info_size;
+	if (state == BKPFS_VER_NONE)
+		return -ENODATA;
 	
 	/* extra check to catch bugs related to EAs earlier. May not be required */
 	res = vfs_getxattr(dentry, BKPFS_XATTR_NAME, NULL, 0);
  	if(res < 0) {
-		printk(KERN_INFO "File doesn't contain %s attribute", BKPFS_XATTR_NAME);
+		pr_debug("File doesn't contain %s attribute\n", BKPFS_XATTR_NAME);
+		/* files created outside of bkpfs are never versioned */
+		if (res == -ENODATA)
+			bkpfs_ver_load(d_inode(dentry), BKPFS_VER_NONE, NULL);
 		return res;
 	}
-	if(res != info_size) {
+	/* accept values written before fields were appended */
+	if(res > info_size ||
+	   res < offsetofend(struct bkpfs_xattr_info, cur_ver)) {
 		printk(KERN_INFO "ERROR::attr size mismatch\n");
-		return res;
+		return -EINVAL;
 	}
 
-	err = vfs_getxattr(dentry, BKPFS_XATTR_NAME, (void*)info, info_size);
+	memset(info, 0, info_size);
+	err = vfs_getxattr(dentry, BKPFS_XATTR_NAME, (void*)info, res);
+	if (err == res)
+		bkpfs_ver_load(d_inode(dentry), BKPFS_VER_CACHED, info);
 	return err;
 }
 
@@ -0,0 +1,321 @@
+/*
+ * Copyright (c) 1998-2017 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2017 Stony Brook University
+ * Copyright (c) 2003-2017 The Research Foundation of SUNY
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/*
+ * Version directories keyed by inode (bkp_layout=inode).
+ *
+ * By default the versions of a file are .bkp_<name>.<ver> next to it, so
+ * they stay behind when the file is renamed.  A file created with
+ * bkp_layout=inode instead records the number and generation of its lower
+ * inode, its id, in the version info, and its versions are <ver> in
+ * .bkp_vers/<xx>/<ino>-<gen> of the lower root, <xx> being the low byte
+ * of the inode number.  A rename then moves one directory entry and the
+ * history follows the file anywhere in the mount.  The id never changes,
+ * except that a file saved over another one (see bkpfs_rename) takes the
+ * id and the history of the file it replaces.
+ *
+ * The layout is that of the version info: files created before keep their
+ * versions by name, whatever the mount options.  .bkp_vers and the fan
+ * directories belong to the mounter; the directory of a file is given to
+ * the owner of the file, writable by whoever may write it, as the backups
+ * are made with the creds of the writer.  Small versions are only kept
+ * inline, a pack is shared by a directory (see pack.c).
+ */
+
+#include "bkpfs.h"
+
+#define BKPFS_VERS_NAME		".bkp_vers"
+#define BKPFS_LAYOUT_BATCH	16	/* entries read from a directory at once */
+#define BKPFS_LAYOUT_NAME_LEN	32	/* holds "<ino>-<gen>", "<ver>.z" */
+
+/* a batch of entries read from the directory of a file */
+struct bkpfs_layout_ctx {
+	struct dir_context ctx;
+	int nr;
+	char name[BKPFS_LAYOUT_BATCH][BKPFS_LAYOUT_NAME_LEN];
+};
+
+static int bkpfs_layout_fill(struct dir_context *ctx, const char *name,
+			     int namelen, loff_t offset, u64 ino,
+			     unsigned int d_type)
+{
+	struct bkpfs_layout_ctx *lc;
+
+	lc = container_of(ctx, struct bkpfs_layout_ctx, ctx);
+	/* stops the walk, the entry is read again by the next batch */
+	if (lc->nr == BKPFS_LAYOUT_BATCH)
+		return -ENOSPC;
+	/* versions never start with a dot, "." and ".." do */
+	if (namelen >= BKPFS_LAYOUT_NAME_LEN || name[0] == '.')
+		return 0;
+	memcpy(lc->name[lc->nr], name, namelen);
+	lc->name[lc->nr][namelen] = '\0';
+	lc->nr++;
+	return 0;
+}
+
+/* mode of the directory of a file: whoever may write the file makes its
+ * backups
+ */
+static umode_t bkpfs_layout_mode(struct inode *owner)
+{
+	umode_t mode = S_IRWXU;
+
+	if (owner->i_mode & S_IWGRP)
+		mode |= S_IRWXG;
+	if (owner->i_mode & S_IWOTH)
+		mode |= S_IRWXO;
+	return mode;
+}
+
+/* look name up in dir.  With create it is made a directory when missing,
+ * given to owner if set.  The creds of the mounter must be in effect.
+ */
+static struct dentry *bkpfs_layout_lookup(struct dentry *dir, const char *name,
+					  int create, struct inode *owner)
+{
+	struct iattr attr;
+	struct dentry *dentry;
+	int err = 0;
+
+	inode_lock_nested(d_inode(dir), I_MUTEX_PARENT);
+	dentry = lookup_one_len(name, dir, strlen(name));
+	if (IS_ERR(dentry) || d_really_is_positive(dentry))
+		goto out;
+
+	err = -ENOENT;
+	if (!create)
+		goto out_dput;
+	err = vfs_mkdir(d_inode(dir), dentry,
+			owner ? bkpfs_layout_mode(owner) : 0700);
+	if (err || !owner)
+		goto out_dput;
+
+	attr.ia_valid = ATTR_UID | ATTR_GID;
+	attr.ia_uid = owner->i_uid;
+	attr.ia_gid = owner->i_gid;
+	inode_lock(d_inode(dentry));
+	err = notify_change(dentry, &attr, NULL);
+	inode_unlock(d_inode(dentry));
+	if (err)
+		vfs_rmdir(d_inode(dir), dentry);
+
+out_dput:
+	if (err) {
+		dput(dentry);
+		dentry = ERR_PTR(err);
+	}
+out:
+	inode_unlock(d_inode(dir));
+	return dentry;
+}
+
+static void bkpfs_layout_names(struct bkpfs_xattr_info *xattr, char *fan,
+			       char *name)
+{
+	snprintf(fan, 3, "%02x", (unsigned int)(xattr->id_ino & 0xff));
+	snprintf(name, BKPFS_LAYOUT_NAME_LEN, "%llx-%x", xattr->id_ino,
+		 xattr->id_gen);
+}
+
+/* @brief: give the version info of a file being created the id of its
+ *         lower inode, with bkp_layout=inode.
+ */
+void bkpfs_layout_set_id(struct dentry *dentry, struct bkpfs_xattr_info *xattr)
+{
+	struct inode *lower_inode = bkpfs_lower_inode(d_inode(dentry));
+
+	if (BKPFS_SB(dentry->d_sb)->mnt_opts.bkp_layout != BKP_LAYOUT_INODE)
+		return;
+	xattr->id_ino = lower_inode->i_ino;
+	xattr->id_gen = lower_inode->i_generation;
+}
+
+/* @brief: the lower directory holding the backups of the user file, with
+ *         a reference dropped by path_put.  It is the lower parent unless
+ *         the file has an id, whose directory is made when missing if
+ *         create is set.
+ * Return:	0 or -errno, -ENOENT when the directory is missing
+ */
+int bkpfs_bkp_dir(struct dentry *dentry, struct path *dir, int create)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(dentry->d_sb);
+	struct bkpfs_xattr_info xattr;
+	char fan[3], name[BKPFS_LAYOUT_NAME_LEN];
+	struct dentry *p_dentry, *fan_dentry, *vers;
+	const struct cred *old_cred;
+	struct inode *owner = NULL;
+
+	if (d_really_is_negative(dentry) ||
+	    bkpfs_get_xattr_info(dentry, &xattr) < 0 || !xattr.id_ino) {
+		p_dentry = dget_parent(dentry);
+		bkpfs_get_lower_path(p_dentry, dir);
+		dput(p_dentry);
+		return 0;
+	}
+	if (!sbi->vers_root.dentry)
+		return -ENOENT;
+
+	if (create)
+		owner = bkpfs_lower_inode(d_inode(dentry));
+	bkpfs_layout_names(&xattr, fan, name);
+	old_cred = override_creds(sbi->vers_cred);
+	fan_dentry = bkpfs_layout_lookup(sbi->vers_root.dentry, fan, create,
+					 NULL);
+	if (IS_ERR(fan_dentry)) {
+		vers = fan_dentry;
+		goto out;
+	}
+	vers = bkpfs_layout_lookup(fan_dentry, name, create, owner);
+	dput(fan_dentry);
+out:
+	revert_creds(old_cred);
+	if (IS_ERR(vers))
+		return PTR_ERR(vers);
+	dir->mnt = mntget(sbi->vers_root.mnt);
+	dir->dentry = vers;
+	return 0;
+}
+
+/* @brief: unlink what is left in the directory dir of a file */
+static int bkpfs_layout_purge(struct super_block *sb, struct path *dir)
+{
+	struct bkpfs_layout_ctx lc = { .ctx.actor = bkpfs_layout_fill };
+	struct dentry *dentry;
+	struct file *file;
+	int done = 0, nr, i, err;
+
+	/* each batch reads the directory again, until a batch frees nothing */
+	do {
+		file = dentry_open(dir, O_RDONLY | O_DIRECTORY, current_cred());
+		if (IS_ERR(file))
+			return PTR_ERR(file);
+		lc.nr = 0;
+		err = iterate_dir(file, &lc.ctx);
+		fput(file);
+		if (err)
+			return err;
+
+		nr = 0;
+		for (i = 0; i < lc.nr; i++) {
+			dentry = bkpfs_get_bkp_dentry(dir->dentry, lc.name[i],
+						      false);
+			if (IS_ERR(dentry))
+				continue;
+			/* the dedup index must not keep the data around */
+			bkpfs_dedup_forget(sb, dentry);
+			inode_lock_nested(d_inode(dir->dentry), I_MUTEX_PARENT);
+			if (!vfs_unlink(d_inode(dir->dentry), dentry, NULL))
+				nr++;
+			inode_unlock(d_inode(dir->dentry));
+			dput(dentry);
+		}
+		done += nr;
+	} while (nr);
+	return done;
+}
+
+/* @brief: remove the directory of the file whose version info is xattr,
+ *         if it has an id.  With purge, what is left in it goes first,
+ *         otherwise a directory still in use stays.
+ * Return:	entries unlinked or -errno
+ */
+int bkpfs_layout_remove(struct super_block *sb, struct bkpfs_xattr_info *xattr,
+			int purge)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+	char fan[3], name[BKPFS_LAYOUT_NAME_LEN];
+	struct dentry *fan_dentry, *vers;
+	const struct cred *old_cred;
+	struct path dir;
+	int err = 0;
+
+	if (!xattr->id_ino || !sbi->vers_root.dentry)
+		return 0;
+
+	bkpfs_layout_names(xattr, fan, name);
+	old_cred = override_creds(sbi->vers_cred);
+	fan_dentry = bkpfs_layout_lookup(sbi->vers_root.dentry, fan, 0, NULL);
+	if (IS_ERR(fan_dentry)) {
+		err = PTR_ERR(fan_dentry);
+		goto out;
+	}
+
+	if (purge) {
+		vers = bkpfs_get_bkp_dentry(fan_dentry, name, false);
+		if (IS_ERR(vers)) {
+			err = PTR_ERR(vers);
+			goto out_fan;
+		}
+		dir.mnt = sbi->vers_root.mnt;
+		dir.dentry = vers;
+		err = bkpfs_layout_purge(sb, &dir);
+		dput(vers);
+		if (err < 0)
+			goto out_fan;
+	}
+
+	inode_lock_nested(d_inode(fan_dentry), I_MUTEX_PARENT);
+	vers = lookup_one_len(name, fan_dentry, strlen(name));
+	if (!IS_ERR(vers)) {
+		if (d_really_is_positive(vers))
+			vfs_rmdir(d_inode(fan_dentry), vers);
+		dput(vers);
+	}
+	inode_unlock(d_inode(fan_dentry));
+out_fan:
+	dput(fan_dentry);
+out:
+	revert_creds(old_cred);
+	return err == -ENOENT ? 0 : err;
+}
+
+/* @brief: set up the version directories of the mount, at mount time.
+ *         Without bkp_layout=inode they are only looked for, files of an
+ *         earlier mount may have an id.
+ */
+int bkpfs_layout_init_sb(struct super_block *sb)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+	struct path lower_root;
+	struct dentry *vers;
+	int err = 0;
+
+	/* the directories hold everyone's versions, they belong to the mounter */
+	sbi->vers_cred = get_current_cred();
+
+	bkpfs_get_lower_path(sb->s_root, &lower_root);
+	vers = bkpfs_layout_lookup(lower_root.dentry, BKPFS_VERS_NAME,
+				   sbi->mnt_opts.bkp_layout == BKP_LAYOUT_INODE,
+				   NULL);
+	if (IS_ERR(vers)) {
+		err = PTR_ERR(vers);
+		if (err == -ENOENT)
+			err = 0;
+		goto out;
+	}
+	sbi->vers_root.mnt = mntget(lower_root.mnt);
+	sbi->vers_root.dentry = vers;
+out:
+	bkpfs_put_lower_path(sb->s_root, &lower_root);
+	return err;
+}
+
+/* @brief: release the version directories of the mount */
+void bkpfs_layout_put_sb(struct super_block *sb)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+
+	if (sbi->vers_root.dentry)
+		path_put(&sbi->vers_root);
+	if (sbi->vers_cred)
+		put_cred(sbi->vers_cred);
+}
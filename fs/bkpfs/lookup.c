@@ -206,41 +206,30 @@ int bkpfs_interpose(struct dentry *dentry, struct super_block *sb,
 	return PTR_ERR(ret_dentry);
 }
 
+/* @brief: look up the backup file name inside the lower directory.
+ *         The returned dentry is referenced and must be dput by the caller.
+ *         If is_neg_dentry is set a negative dentry is returned as well so
+ *         that the caller can create the backup file on it, otherwise a
+ *         missing backup file is reported as -ENOENT.
+ */
 struct dentry* bkpfs_get_bkp_dentry(struct dentry* lower_dir_dentry , const char* name, int is_neg_dentry)
 {
-	int err = 0;
 	struct dentry *ret_dentry;
-	struct qstr this;
 	UDBG;
 
-	/* now start the actual lookup procedure */
-	this.name = name;
-	this.len = strlen(name);
-	this.hash = full_name_hash(lower_dir_dentry, this.name, this.len);
-	ret_dentry = d_lookup(lower_dir_dentry, &this);
-	/*
-	 * If the intent is to create a file, then don't return an error, so
-	 * the VFS will continue the process of making this negative dentry
-	 * into a positive one.
-	 */
-
-	if (ret_dentry == NULL && !is_neg_dentry){
-		err = -ENOENT;
+	/* lookup_one_len also goes to the disk when the dentry is not cached */
+	inode_lock_nested(d_inode(lower_dir_dentry), I_MUTEX_PARENT);
+	ret_dentry = lookup_one_len(name, lower_dir_dentry, strlen(name));
+	inode_unlock(d_inode(lower_dir_dentry));
+	if (IS_ERR(ret_dentry))
 		goto out;
-	}
 
-	if(is_neg_dentry){
-		ret_dentry = d_alloc(lower_dir_dentry, &this);
-		if (!ret_dentry) {
-			err = -ENOMEM;
-			goto out;
-		}
-		d_add(ret_dentry, NULL); /* instantiate and hash */
+	if (d_really_is_negative(ret_dentry) && !is_neg_dentry) {
+		dput(ret_dentry);
+		ret_dentry = ERR_PTR(-ENOENT);
 	}
 
 out:
-	if (err)
-		return ERR_PTR(err);
 	return ret_dentry;
 }
 
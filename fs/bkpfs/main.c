@@ -55,6 +55,11 @@ static int bkpfs_read_super(struct super_block *sb, void *raw_data, int silent)
 	atomic_inc(&lower_sb->s_active);
 	bkpfs_set_lower_super(sb, lower_sb);
 
+	/* find out how backups can be copied on the lower file system */
+	bkpfs_probe_lower_caps(sb, lower_path.dentry);
+	bkpfs_dedup_init_sb(sb);
+	bkpfs_pack_init_sb(sb);
+
 	/* inherit maxbytes from lower file system */
 	sb->s_maxbytes = lower_sb->s_maxbytes;
 
@@ -126,12 +131,60 @@ out:
 enum { 
 	bkpfs_opt_maxvers,
 	bkpfs_opt_bkp_threshold,
+	bkpfs_opt_bkp_format,
+	bkpfs_opt_bkp_mode,
+	bkpfs_opt_bkp_queue_depth,
+	bkpfs_opt_bkp_trigger,
+	bkpfs_opt_bkp_quiet_ms,
+	bkpfs_opt_bkp_max_delay_ms,
+	bkpfs_opt_bkp_threshold_cum,
+	bkpfs_opt_bkp_change_pct,
+	bkpfs_opt_bkp_ckpt_every,
+	bkpfs_opt_bkp_append,
+	bkpfs_opt_bkp_max_write_lat_us,
+	bkpfs_opt_bkp_copy_threads,
+	bkpfs_opt_bkp_nocache,
+	bkpfs_opt_bkp_dedup,
+	bkpfs_opt_bkp_compress,
+	bkpfs_opt_bkp_recompress,
+	bkpfs_opt_bkp_recompress_after,
+	bkpfs_opt_bkp_pack,
+	bkpfs_opt_bkp_pack_inline,
+	bkpfs_opt_bkp_unlink,
+	bkpfs_opt_bkp_trash_grace,
+	bkpfs_opt_bkp_trash_rate,
+	bkpfs_opt_bkp_layout,
+	bkpfs_opt_bkp_skip_same,
 	bkpfs_opt_err	
 };
 
 static const match_table_t tokens = {
 	{bkpfs_opt_maxvers, "maxvers=%d"},
 	{bkpfs_opt_bkp_threshold, "bkp_threshold=%u"},
+	{bkpfs_opt_bkp_format, "bkp_format=%s"},
+	{bkpfs_opt_bkp_mode, "bkp_mode=%s"},
+	{bkpfs_opt_bkp_queue_depth, "bkp_queue_depth=%u"},
+	{bkpfs_opt_bkp_trigger, "bkp_trigger=%s"},
+	{bkpfs_opt_bkp_quiet_ms, "bkp_quiet_ms=%u"},
+	{bkpfs_opt_bkp_max_delay_ms, "bkp_max_delay_ms=%u"},
+	{bkpfs_opt_bkp_threshold_cum, "bkp_threshold_cum=%u"},
+	{bkpfs_opt_bkp_change_pct, "bkp_change_pct=%u"},
+	{bkpfs_opt_bkp_ckpt_every, "bkp_ckpt_every=%u"},
+	{bkpfs_opt_bkp_append, "bkp_append"},
+	{bkpfs_opt_bkp_max_write_lat_us, "bkp_max_write_lat_us=%u"},
+	{bkpfs_opt_bkp_copy_threads, "bkp_copy_threads=%u"},
+	{bkpfs_opt_bkp_nocache, "bkp_nocache"},
+	{bkpfs_opt_bkp_dedup, "bkp_dedup"},
+	{bkpfs_opt_bkp_compress, "bkp_compress=%s"},
+	{bkpfs_opt_bkp_recompress, "bkp_recompress=%s"},
+	{bkpfs_opt_bkp_recompress_after, "bkp_recompress_after=%u"},
+	{bkpfs_opt_bkp_pack, "bkp_pack=%u"},
+	{bkpfs_opt_bkp_pack_inline, "bkp_pack_inline=%u"},
+	{bkpfs_opt_bkp_unlink, "bkp_unlink=%s"},
+	{bkpfs_opt_bkp_trash_grace, "bkp_trash_grace=%u"},
+	{bkpfs_opt_bkp_trash_rate, "bkp_trash_rate=%u"},
+	{bkpfs_opt_bkp_layout, "bkp_layout=%s"},
+	{bkpfs_opt_bkp_skip_same, "bkp_skip_same"},
 	{bkpfs_opt_err, NULL}
 };
 
@@ -144,6 +197,21 @@ static int bkpfs_parse_options(char* options, struct mnt_opt_info * m_opts)
 	int token;
 	char *maxvers_src;
 	char *bkp_threshold_src;
+	char *format;
+	char *mode;
+	char *trigger;
+	char *unlink;
+	char *layout;
+	int msecs;
+	int pct;
+	int every;
+	int usecs;
+	int depth;
+	int threads;
+	int after;
+	int bytes;
+	int secs;
+	int rate;
 
 	while ((p = strsep(&options, ",")) != NULL) {
 		if (!*p)
@@ -164,6 +232,211 @@ static int bkpfs_parse_options(char* options, struct mnt_opt_info * m_opts)
 
 				//printk(KERN_INFO "OPTIONS:: bkp_threshold=%d\n", m_opts->bkp_threshold);
 				break;				
+			case bkpfs_opt_bkp_format:
+				format = match_strdup(&args[0]);
+				if (!format)
+					return -ENOMEM;
+				if (!strcmp(format, "full"))
+					m_opts->bkp_format = BKP_FORMAT_FULL;
+				else if (!strcmp(format, "undo"))
+					m_opts->bkp_format = BKP_FORMAT_UNDO;
+				else if (!strcmp(format, "delta"))
+					m_opts->bkp_format = BKP_FORMAT_DELTA;
+				else if (!strcmp(format, "chunk"))
+					m_opts->bkp_format = BKP_FORMAT_CHUNK;
+				else if (!strcmp(format, "compress"))
+					m_opts->bkp_format = BKP_FORMAT_COMPRESS;
+				else {
+					printk(KERN_INFO "ERROR:: Unrecognised bkp_format=%s\n", format);
+					rc = -EINVAL;
+				}
+				kfree(format);
+				break;
+			case bkpfs_opt_bkp_mode:
+				mode = match_strdup(&args[0]);
+				if (!mode)
+					return -ENOMEM;
+				if (!strcmp(mode, "sync"))
+					m_opts->bkp_mode = BKP_MODE_SYNC;
+				else if (!strcmp(mode, "async"))
+					m_opts->bkp_mode = BKP_MODE_ASYNC;
+				else {
+					printk(KERN_INFO "ERROR:: Unrecognised bkp_mode=%s\n", mode);
+					rc = -EINVAL;
+				}
+				kfree(mode);
+				break;
+			case bkpfs_opt_bkp_queue_depth:
+				if (match_int(&args[0], &depth) || depth <= 0) {
+					printk(KERN_INFO "ERROR:: Invalid bkp_queue_depth\n");
+					rc = -EINVAL;
+					break;
+				}
+				m_opts->bkp_queue_depth = depth;
+				break;
+			case bkpfs_opt_bkp_trigger:
+				trigger = match_strdup(&args[0]);
+				if (!trigger)
+					return -ENOMEM;
+				if (!strcmp(trigger, "write"))
+					m_opts->bkp_trigger = BKP_TRIGGER_WRITE;
+				else if (!strcmp(trigger, "close"))
+					m_opts->bkp_trigger = BKP_TRIGGER_CLOSE;
+				else if (!strcmp(trigger, "fsync"))
+					m_opts->bkp_trigger = BKP_TRIGGER_FSYNC;
+				else {
+					printk(KERN_INFO "ERROR:: Unrecognised bkp_trigger=%s\n", trigger);
+					rc = -EINVAL;
+				}
+				kfree(trigger);
+				break;
+			case bkpfs_opt_bkp_quiet_ms:
+			case bkpfs_opt_bkp_max_delay_ms:
+				if (match_int(&args[0], &msecs) || msecs < 0) {
+					printk(KERN_INFO "ERROR:: Invalid delay in ms\n");
+					rc = -EINVAL;
+					break;
+				}
+				if (token == bkpfs_opt_bkp_quiet_ms)
+					m_opts->bkp_quiet_ms = msecs;
+				else
+					m_opts->bkp_max_delay_ms = msecs;
+				break;
+			case bkpfs_opt_bkp_threshold_cum:
+				if (match_u64(&args[0], &m_opts->bkp_threshold_cum)) {
+					printk(KERN_INFO "ERROR:: Invalid bkp_threshold_cum\n");
+					rc = -EINVAL;
+				}
+				break;
+			case bkpfs_opt_bkp_change_pct:
+				if (match_int(&args[0], &pct) || pct < 0 || pct > 100) {
+					printk(KERN_INFO "ERROR:: Invalid bkp_change_pct\n");
+					rc = -EINVAL;
+					break;
+				}
+				m_opts->bkp_change_pct = pct;
+				break;
+			case bkpfs_opt_bkp_ckpt_every:
+				if (match_int(&args[0], &every) || every <= 0) {
+					printk(KERN_INFO "ERROR:: Invalid bkp_ckpt_every\n");
+					rc = -EINVAL;
+					break;
+				}
+				m_opts->bkp_ckpt_every = every;
+				break;
+			case bkpfs_opt_bkp_append:
+				m_opts->bkp_append = 1;
+				break;
+			case bkpfs_opt_bkp_max_write_lat_us:
+				if (match_int(&args[0], &usecs) || usecs <= 0) {
+					printk(KERN_INFO "ERROR:: Invalid bkp_max_write_lat_us\n");
+					rc = -EINVAL;
+					break;
+				}
+				m_opts->bkp_max_write_lat_us = usecs;
+				break;
+			case bkpfs_opt_bkp_copy_threads:
+				if (match_int(&args[0], &threads) || threads <= 0 ||
+				    threads > MAX_BKP_COPY_THREADS) {
+					printk(KERN_INFO "ERROR:: Invalid bkp_copy_threads\n");
+					rc = -EINVAL;
+					break;
+				}
+				m_opts->bkp_copy_threads = threads;
+				break;
+			case bkpfs_opt_bkp_nocache:
+				m_opts->bkp_nocache = 1;
+				break;
+			case bkpfs_opt_bkp_dedup:
+				m_opts->bkp_dedup = 1;
+				break;
+			case bkpfs_opt_bkp_compress:
+				if (match_strlcpy(m_opts->bkp_compress, &args[0],
+						  BKPFS_ZIP_ALG_LEN) >= BKPFS_ZIP_ALG_LEN) {
+					printk(KERN_INFO "ERROR:: Invalid bkp_compress\n");
+					rc = -EINVAL;
+				}
+				break;
+			case bkpfs_opt_bkp_recompress:
+				if (match_strlcpy(m_opts->bkp_recompress, &args[0],
+						  BKPFS_ZIP_ALG_LEN) >= BKPFS_ZIP_ALG_LEN) {
+					printk(KERN_INFO "ERROR:: Invalid bkp_recompress\n");
+					rc = -EINVAL;
+				}
+				break;
+			case bkpfs_opt_bkp_recompress_after:
+				if (match_int(&args[0], &after) || after <= 0) {
+					printk(KERN_INFO "ERROR:: Invalid bkp_recompress_after\n");
+					rc = -EINVAL;
+					break;
+				}
+				m_opts->bkp_recompress_after = after;
+				break;
+			case bkpfs_opt_bkp_pack:
+				if (match_int(&args[0], &bytes) || bytes < 0 ||
+				    bytes > BKPFS_PACK_MAX) {
+					printk(KERN_INFO "ERROR:: Invalid bkp_pack\n");
+					rc = -EINVAL;
+					break;
+				}
+				m_opts->bkp_pack = bytes;
+				break;
+			case bkpfs_opt_bkp_pack_inline:
+				if (match_int(&args[0], &bytes) || bytes < 0 ||
+				    bytes > BKPFS_PACK_INLINE_MAX) {
+					printk(KERN_INFO "ERROR:: Invalid bkp_pack_inline\n");
+					rc = -EINVAL;
+					break;
+				}
+				m_opts->bkp_pack_inline = bytes;
+				break;
+			case bkpfs_opt_bkp_unlink:
+				unlink = match_strdup(&args[0]);
+				if (!unlink)
+					return -ENOMEM;
+				if (!strcmp(unlink, "delete"))
+					m_opts->bkp_unlink = BKP_UNLINK_DELETE;
+				else if (!strcmp(unlink, "trash"))
+					m_opts->bkp_unlink = BKP_UNLINK_TRASH;
+				else {
+					printk(KERN_INFO "ERROR:: Unrecognised bkp_unlink=%s\n", unlink);
+					rc = -EINVAL;
+				}
+				kfree(unlink);
+				break;
+			case bkpfs_opt_bkp_trash_grace:
+				if (match_int(&args[0], &secs) || secs < 0) {
+					printk(KERN_INFO "ERROR:: Invalid bkp_trash_grace\n");
+					rc = -EINVAL;
+					break;
+				}
+				m_opts->bkp_trash_grace = secs;
+				break;
+			case bkpfs_opt_bkp_trash_rate:
+				if (match_int(&args[0], &rate) || rate <= 0) {
+					printk(KERN_INFO "ERROR:: Invalid bkp_trash_rate\n");
+					rc = -EINVAL;
+					break;
+				}
+				m_opts->bkp_trash_rate = rate;
+				break;
+			case bkpfs_opt_bkp_layout:
+				layout = match_strdup(&args[0]);
+				if (!layout)
+					return -ENOMEM;
+				if (!strcmp(layout, "name"))
+					m_opts->bkp_layout = BKP_LAYOUT_NAME;
+				else if (!strcmp(layout, "inode"))
+					m_opts->bkp_layout = BKP_LAYOUT_INODE;
+				else {
+					printk(KERN_INFO "ERROR:: Unrecognised bkp_layout=%s\n", layout);
+					rc = -EINVAL;
+				}
+				kfree(layout);
+				break;
+			case bkpfs_opt_bkp_skip_same:
+				m_opts->bkp_skip_same = 1;
+				break;
 			default:
 				printk(KERN_INFO "Unrecognised option passed\n");
 		}
@@ -172,6 +445,50 @@ static int bkpfs_parse_options(char* options, struct mnt_opt_info * m_opts)
 	return rc;
 }
 
+/* @brief: reject options which don't go together.
+ * Return:	0 or -EINVAL
+ */
+static int bkpfs_check_options(struct mnt_opt_info *m_opts)
+{
+	/* undo records must be logged before the write, they can't be queued */
+	if (m_opts->bkp_mode == BKP_MODE_ASYNC &&
+	    m_opts->bkp_format == BKP_FORMAT_UNDO) {
+		printk(KERN_INFO "ERROR:: bkp_mode=async can't be used with bkp_format=undo\n");
+		return -EINVAL;
+	}
+	/* quiet periods only apply to the per write trigger */
+	if (m_opts->bkp_quiet_ms && m_opts->bkp_trigger != BKP_TRIGGER_WRITE) {
+		printk(KERN_INFO "ERROR:: bkp_quiet_ms needs bkp_trigger=write\n");
+		return -EINVAL;
+	}
+	/* undo seals don't copy, there is nothing to budget */
+	if (m_opts->bkp_max_write_lat_us &&
+	    m_opts->bkp_format == BKP_FORMAT_UNDO) {
+		printk(KERN_INFO "ERROR:: bkp_max_write_lat_us can't be used with bkp_format=undo\n");
+		return -EINVAL;
+	}
+	/* appended bases and the other formats are written to after the
+	 * copy, a backup shared between files must never be
+	 */
+	if (m_opts->bkp_dedup &&
+	    (m_opts->bkp_format != BKP_FORMAT_FULL || m_opts->bkp_append)) {
+		printk(KERN_INFO "ERROR:: bkp_dedup needs bkp_format=full without bkp_append\n");
+		return -EINVAL;
+	}
+	/* the other formats have no version files of their own to save */
+	if (m_opts->bkp_pack && m_opts->bkp_format != BKP_FORMAT_FULL) {
+		printk(KERN_INFO "ERROR:: bkp_pack needs bkp_format=full\n");
+		return -EINVAL;
+	}
+	/* chunk references are only released by dropping the manifests */
+	if (m_opts->bkp_unlink == BKP_UNLINK_TRASH &&
+	    m_opts->bkp_format == BKP_FORMAT_CHUNK) {
+		printk(KERN_INFO "ERROR:: bkp_unlink=trash can't be used with bkp_format=chunk\n");
+		return -EINVAL;
+	}
+	return 0;
+}
+
 struct dentry *bkpfs_mount(struct file_system_type *fs_type, int flags,
 			    const char *dev_name, void *raw_data)
 {
@@ -179,29 +496,90 @@ struct dentry *bkpfs_mount(struct file_system_type *fs_type, int flags,
 	void *lower_path_name = (void *) dev_name;
 	struct dentry *dentry;
 	struct bkpfs_sb_info *sbi;
+	struct super_block *sb;
 	UDBG;
 
 	dentry = mount_nodev(fs_type, flags, lower_path_name,
 			   bkpfs_read_super);
+	if (IS_ERR(dentry))
+		return dentry;
 
 	sbi = BKPFS_SB(dentry->d_sb);
 
+	/* 0 is a valid bkp_pack_inline, set the default before parsing */
+	sbi->mnt_opts.bkp_pack_inline = DEFAULT_BKP_PACK_INLINE;
+
 	/* Parse mount option set by user during the mount */	
 	rc = bkpfs_parse_options(raw_data, &(sbi->mnt_opts));
 	if (rc) {
 		printk(KERN_INFO  "Error parsing mount options\n");
-		return ERR_PTR(rc);
+		goto out_kill;
+	}
+
+	rc = bkpfs_check_options(&sbi->mnt_opts);
+	if (rc)
+		goto out_kill;
+
+	/* queued AIO writes are finished there too, whatever the options */
+	rc = bkpfs_init_backup_wq(dentry->d_sb);
+	if (rc) {
+		printk(KERN_INFO "ERROR:: failed to create the backup workqueue\n");
+		goto out_kill;
+	}
+
+	rc = bkpfs_init_copy_wq(dentry->d_sb);
+	if (rc) {
+		printk(KERN_INFO "ERROR:: failed to create the copy workqueue\n");
+		goto out_kill;
+	}
+
+	if (sbi->mnt_opts.bkp_format == BKP_FORMAT_CHUNK) {
+		rc = bkpfs_chunk_init_sb(dentry->d_sb);
+		if (rc) {
+			printk(KERN_INFO "ERROR:: failed to set up the chunk store\n");
+			goto out_kill;
+		}
+	}
+
+	if (sbi->mnt_opts.bkp_format == BKP_FORMAT_COMPRESS) {
+		rc = bkpfs_init_zip_sb(dentry->d_sb);
+		if (rc) {
+			printk(KERN_INFO "ERROR:: failed to set up compression\n");
+			goto out_kill;
+		}
+	}
+
+	/* files of any mount may have an id, not only of a bkp_layout=inode one */
+	rc = bkpfs_layout_init_sb(dentry->d_sb);
+	if (rc) {
+		printk(KERN_INFO "ERROR:: failed to set up the version directories\n");
+		goto out_kill;
+	}
+
+	if (sbi->mnt_opts.bkp_unlink == BKP_UNLINK_TRASH) {
+		rc = bkpfs_trash_init_sb(dentry->d_sb);
+		if (rc) {
+			printk(KERN_INFO "ERROR:: failed to set up the trash\n");
+			goto out_kill;
+		}
 	}
 
 	return dentry;
 
+out_kill:
+	/* s_umount is still held from mount_nodev */
+	sb = dentry->d_sb;
+	dput(dentry);
+	deactivate_locked_super(sb);
+	return ERR_PTR(rc);
+
 }
 
 static struct file_system_type bkpfs_fs_type = {
 	.owner		= THIS_MODULE,
 	.name		= BKPFS_NAME,
 	.mount		= bkpfs_mount,
-	.kill_sb	= generic_shutdown_super,
+	.kill_sb	= bkpfs_kill_sb,
 	.fs_flags	= 0,
 };
 MODULE_ALIAS_FS(BKPFS_NAME);
@@ -212,6 +590,8 @@ static int __init init_bkpfs_fs(void)
 
 	pr_info("Registering bkpfs " BKPFS_VERSION "\n");
 
+	bkpfs_chunk_init_gear();
+
 	err = bkpfs_init_inode_cache();
 	if (err)
 		goto out;
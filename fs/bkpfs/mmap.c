@@ -42,6 +42,43 @@ static int bkpfs_fault(struct vm_fault *vmf)
 	return err;
 }
 
+/* @brief: write protect the shared mappings of inode, so the next store
+ *         through any of them goes through page_mkwrite again.  Called when
+ *         a version is taken: stores from then on belong to the next one.
+ */
+void bkpfs_mmap_rearm(struct inode *inode)
+{
+	atomic_set(&BKPFS_I(inode)->bkp_mmap_dirty, 0);
+	if (mapping_writably_mapped(inode->i_mapping))
+		unmap_mapping_range(inode->i_mapping, 0, 0, 0);
+}
+
+/* @brief: account for the page of file a store through a shared mapping is
+ *         about to land in.  mmap_sem is held here, so the inode lock can't
+ *         be taken and nothing is written to the backups yet: the version
+ *         is taken on msync() or when the file is released.
+ */
+static int bkpfs_mmap_note(struct file *file, struct page *page)
+{
+	struct inode *inode = file_inode(file);
+	loff_t pos = page_offset(page);
+	loff_t size = i_size_read(inode);
+	size_t len;
+	int err = 0;
+
+	atomic_set(&BKPFS_I(inode)->bkp_mmap_dirty, 1);
+	if (pos >= size)
+		return 0;
+	len = min_t(loff_t, PAGE_SIZE, size - pos);
+
+	/* only the dirtied pages go into the next delta */
+	bkpfs_delta_track(inode, pos, len);
+	bkpfs_append_note(inode, pos, size);
+	if (BKPFS_SB(inode->i_sb)->mnt_opts.bkp_format == BKP_FORMAT_UNDO)
+		err = bkpfs_undo_save_page(file, page, pos, len);
+	return err;
+}
+
 static int bkpfs_page_mkwrite(struct vm_fault *vmf)
 {
 	int err = 0;
@@ -54,6 +91,11 @@ static int bkpfs_page_mkwrite(struct vm_fault *vmf)
 	file = lower_vma.vm_file;
 	lower_vm_ops = BKPFS_F(file)->lower_vm_ops;
 	BUG_ON(!lower_vm_ops);
+
+	err = bkpfs_mmap_note(file, vmf->page);
+	if (err)
+		return vmf_error(err);
+
 	if (!lower_vm_ops->page_mkwrite)
 		goto out;
 
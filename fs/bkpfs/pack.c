@@ -0,0 +1,906 @@
+/*
+ * Copyright (c) 1998-2017 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2017 Stony Brook University
+ * Copyright (c) 2003-2017 The Research Foundation of SUNY
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/*
+ * Pack files and inline versions of small files (bkp_pack).
+ *
+ * With bkp_format=full, a version of at most bkp_pack bytes gets no backup
+ * file of its own.  Up to bkp_pack_inline bytes, its data is kept in the
+ * "user.bkp_small.<ver>" attribute of the lower user file, next to the
+ * version info.  Bigger ones are appended as a record to .bkp_pack, one
+ * append-only file per lower directory, and the attribute only holds where
+ * the record is.  A record names its owner (lower inode number and
+ * generation) and version, so the pack can be walked without the files.
+ *
+ * Dropping a packed version flags its record dead and counts it in the
+ * BKPFS_PACK_XATTR attribute of the pack.  Once dead records make up half
+ * of it, the live ones are copied to a new pack renamed over the old one.
+ * Each pack carries a generation, bumped by compaction: an offset stored
+ * for an older generation is found again by walking the new pack, and
+ * stored back by the next reader.
+ *
+ * Packs are shared by the users of a directory and, like the chunk store,
+ * always accessed with the creds of the mounter.  Files whose versions are
+ * kept by inode (bkp_layout=inode, see layout.c) only get inline versions.
+ */
+
+#include "bkpfs.h"
+#include <linux/random.h>
+
+#define BKPFS_PACK_NAME		".bkp_pack"
+#define BKPFS_PACK_NEW_NAME	".bkp_pack.new"
+#define BKPFS_PACK_XATTR	"user.bkp_pack"
+#define BKPFS_SMALL_XATTR	"user.bkp_small.%d"
+
+#define BKPFS_PACK_MAGIC	0x4b434150	/* "PACK" */
+#define BKPFS_PACK_DEAD		0x1		/* version was dropped */
+#define BKPFS_PACK_COMPACT_MIN	(64 * 1024)	/* dead bytes worth a rewrite */
+
+#define BKPFS_SMALL_INLINE	1	/* data follows the bkpfs_small */
+#define BKPFS_SMALL_PACKED	2	/* data is a record of the pack */
+
+/* attribute of a pack */
+struct bkpfs_pack_info {
+	u32 gen;	/* bumped by each compaction */
+	u32 pad;
+	u64 dead;	/* bytes of dead records */
+};
+
+/* header of a record, its data follows */
+struct bkpfs_pack_rec {
+	u32 magic;
+	u32 flags;
+	u64 ino;	/* lower inode of the user file */
+	u32 igen;	/* and its generation */
+	s32 ver;
+	u64 len;
+};
+
+/* attribute of a small version */
+struct bkpfs_small {
+	u32 kind;
+	u32 gen;	/* packed: generation of the pack off is in */
+	u64 size;	/* size of the user file at this version */
+	u64 off;	/* packed: offset of the record */
+};
+
+/* room kept in front of the data, for either header */
+#define BKPFS_SMALL_HDR	max(sizeof(struct bkpfs_pack_rec), \
+			    sizeof(struct bkpfs_small))
+
+static void bkpfs_small_name(int ver, char *buf, size_t len)
+{
+	snprintf(buf, len, BKPFS_SMALL_XATTR, ver);
+}
+
+/* @brief: the small version attribute of version ver, inline data included.
+ * Return:	kmalloc'ed attribute or ERR_PTR
+ */
+static struct bkpfs_small *bkpfs_small_get(struct dentry *dentry, int ver)
+{
+	struct bkpfs_small *sm;
+	struct path lower_path;
+	char name[XATTR_NAME_MAX + 1];
+	ssize_t res;
+
+	sm = kmalloc(sizeof(*sm) + BKPFS_PACK_INLINE_MAX, GFP_KERNEL);
+	if (!sm)
+		return ERR_PTR(-ENOMEM);
+	bkpfs_small_name(ver, name, sizeof(name));
+	bkpfs_get_lower_path(dentry, &lower_path);
+	res = vfs_getxattr(lower_path.dentry, name, sm,
+			   sizeof(*sm) + BKPFS_PACK_INLINE_MAX);
+	bkpfs_put_lower_path(dentry, &lower_path);
+	if (res >= 0 &&
+	    (res < sizeof(*sm) ||
+	     (sm->kind == BKPFS_SMALL_INLINE && res != sizeof(*sm) + sm->size)))
+		res = -EINVAL;
+	if (res < 0) {
+		kfree(sm);
+		return ERR_PTR(res);
+	}
+	return sm;
+}
+
+static int bkpfs_small_set(struct dentry *dentry, int ver,
+			   struct bkpfs_small *sm, size_t len)
+{
+	struct path lower_path;
+	char name[XATTR_NAME_MAX + 1];
+	int err;
+
+	bkpfs_small_name(ver, name, sizeof(name));
+	bkpfs_get_lower_path(dentry, &lower_path);
+	err = vfs_setxattr(lower_path.dentry, name, sm, len, 0);
+	bkpfs_put_lower_path(dentry, &lower_path);
+	return err;
+}
+
+/* @brief: is version ver of the user file a small version */
+bool bkpfs_small_is(struct dentry *dentry, int ver)
+{
+	struct path lower_path;
+	char name[XATTR_NAME_MAX + 1];
+	ssize_t res;
+
+	if (BKPFS_SB(dentry->d_sb)->mnt_opts.bkp_format != BKP_FORMAT_FULL)
+		return false;
+	bkpfs_small_name(ver, name, sizeof(name));
+	bkpfs_get_lower_path(dentry, &lower_path);
+	res = vfs_getxattr(lower_path.dentry, name, NULL, 0);
+	bkpfs_put_lower_path(dentry, &lower_path);
+	return res > 0;
+}
+
+/* the creds of the packs must be in effect for the helpers below */
+
+static int bkpfs_pack_get_info(struct file *pack, struct bkpfs_pack_info *pi)
+{
+	ssize_t res;
+
+	res = vfs_getxattr(pack->f_path.dentry, BKPFS_PACK_XATTR, pi,
+			   sizeof(*pi));
+	if (res < 0)
+		return res;
+	if (res != sizeof(*pi))
+		return -EINVAL;
+	return 0;
+}
+
+static int bkpfs_pack_set_info(struct dentry *dentry,
+			       struct bkpfs_pack_info *pi)
+{
+	return vfs_setxattr(dentry, BKPFS_PACK_XATTR, pi, sizeof(*pi), 0);
+}
+
+/* @brief: open the pack of the directory of the user file dentry, creating
+ *         it when O_CREAT is in flags, with pack_lock held.
+ */
+static struct file *bkpfs_pack_open(struct dentry *dentry, int flags)
+{
+	struct dentry *p_dentry, *lower_dir, *pack;
+	struct path lower_parent_path, path;
+	struct bkpfs_pack_info pi;
+	struct file *file;
+	int err = 0;
+
+	p_dentry = dget_parent(dentry);
+	bkpfs_get_lower_path(p_dentry, &lower_parent_path);
+	lower_dir = lower_parent_path.dentry;
+
+	pack = bkpfs_get_bkp_dentry(lower_dir, BKPFS_PACK_NAME,
+				    flags & O_CREAT);
+	if (IS_ERR(pack)) {
+		file = ERR_CAST(pack);
+		goto out;
+	}
+	if (d_really_is_negative(pack)) {
+		inode_lock_nested(d_inode(lower_dir), I_MUTEX_PARENT);
+		err = vfs_create(d_inode(lower_dir), pack, S_IFREG | 0600, true);
+		inode_unlock(d_inode(lower_dir));
+		if (!err) {
+			/* offsets stored for an earlier pack must not match */
+			pi.gen = get_random_u32();
+			pi.pad = 0;
+			pi.dead = 0;
+			err = bkpfs_pack_set_info(pack, &pi);
+		}
+		if (err) {
+			file = ERR_PTR(err);
+			goto out_dput;
+		}
+	}
+	path.mnt = lower_parent_path.mnt;
+	path.dentry = pack;
+	file = dentry_open(&path, (flags & ~O_CREAT) | O_LARGEFILE,
+			   current_cred());
+out_dput:
+	dput(pack);
+out:
+	bkpfs_put_lower_path(p_dentry, &lower_parent_path);
+	dput(p_dentry);
+	return file;
+}
+
+static int bkpfs_pack_read_rec(struct file *pack, loff_t off,
+			       struct bkpfs_pack_rec *rec)
+{
+	ssize_t res;
+
+	res = kernel_read(pack, rec, sizeof(*rec), &off);
+	if (res < 0)
+		return res;
+	if (res != sizeof(*rec) || rec->magic != BKPFS_PACK_MAGIC)
+		return -EIO;
+	return 0;
+}
+
+static bool bkpfs_pack_match(struct bkpfs_pack_rec *rec,
+			     struct inode *lower_inode, int ver,
+			     struct bkpfs_small *sm)
+{
+	return !(rec->flags & BKPFS_PACK_DEAD) &&
+	       rec->ino == lower_inode->i_ino &&
+	       rec->igen == lower_inode->i_generation &&
+	       rec->ver == ver && rec->len == sm->size;
+}
+
+/* @brief: find the live record of version ver of lower_inode in pack.
+ *         sm->off is trusted while the pack is of generation sm->gen.
+ *         Otherwise the pack was compacted since, it is walked from the
+ *         start and sm->gen, sm->off are updated, setting *moved.
+ * Return:	0 or -errno, -ENOENT when the pack has no such record
+ */
+static int bkpfs_pack_find(struct file *pack, struct inode *lower_inode,
+			   int ver, struct bkpfs_small *sm,
+			   struct bkpfs_pack_rec *rec, int *moved)
+{
+	struct bkpfs_pack_info pi;
+	loff_t off, size;
+	int err;
+
+	err = bkpfs_pack_get_info(pack, &pi);
+	if (err)
+		return err;
+	if (sm->gen == pi.gen) {
+		err = bkpfs_pack_read_rec(pack, sm->off, rec);
+		if (!err && !bkpfs_pack_match(rec, lower_inode, ver, sm))
+			err = -ENOENT;
+		return err;
+	}
+
+	/* a record torn by a crash ends the walk */
+	size = i_size_read(file_inode(pack));
+	for (off = 0; off + sizeof(*rec) <= size; off += sizeof(*rec) + rec->len) {
+		if (bkpfs_pack_read_rec(pack, off, rec))
+			break;
+		if (bkpfs_pack_match(rec, lower_inode, ver, sm)) {
+			sm->gen = pi.gen;
+			sm->off = off;
+			*moved = 1;
+			return 0;
+		}
+	}
+	return -ENOENT;
+}
+
+/* @brief: append the record built in front of len bytes of data at rec to
+ *         the pack of the directory of dentry, and tell where in sm.
+ */
+static int bkpfs_pack_append(struct dentry *dentry, struct bkpfs_pack_rec *rec,
+			     size_t len, struct bkpfs_small *sm)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(dentry->d_sb);
+	const struct cred *old_cred;
+	struct bkpfs_pack_info pi;
+	struct file *pack;
+	loff_t off, pos;
+	ssize_t res;
+	int err;
+
+	old_cred = override_creds(sbi->pack_cred);
+	mutex_lock(&sbi->pack_lock);
+	pack = bkpfs_pack_open(dentry, O_RDWR | O_CREAT);
+	if (IS_ERR(pack)) {
+		err = PTR_ERR(pack);
+		goto out;
+	}
+	err = bkpfs_pack_get_info(pack, &pi);
+	if (err)
+		goto out_fput;
+
+	off = pos = i_size_read(file_inode(pack));
+	res = kernel_write(pack, rec, sizeof(*rec) + len, &pos);
+	if (res != sizeof(*rec) + len) {
+		err = res < 0 ? res : -EIO;
+		/* the next record must start right after the last good one */
+		vfs_truncate(&pack->f_path, off);
+		goto out_fput;
+	}
+	sm->gen = pi.gen;
+	sm->off = off;
+out_fput:
+	fput(pack);
+out:
+	mutex_unlock(&sbi->pack_lock);
+	revert_creds(old_cred);
+	return err;
+}
+
+/* @brief: rewrite the pack with its live records only.  Called with
+ *         pack_lock held, pi being the attribute of pack.
+ */
+static int bkpfs_pack_compact(struct super_block *sb, struct file *pack,
+			      struct bkpfs_pack_info *pi)
+{
+	struct dentry *lower_dir, *tmp, *new_dentry;
+	struct bkpfs_pack_rec rec;
+	struct path tmp_path;
+	struct file *dst;
+	loff_t off, wpos = 0, size;
+	ssize_t res;
+	int err = 0;
+
+	lower_dir = dget_parent(pack->f_path.dentry);
+	tmp = vfs_tmpfile(lower_dir, S_IFREG | 0600, O_RDWR);
+	if (IS_ERR(tmp)) {
+		err = PTR_ERR(tmp);
+		goto out_dir;
+	}
+	tmp_path.dentry = tmp;
+	tmp_path.mnt = pack->f_path.mnt;
+	dst = dentry_open(&tmp_path, O_WRONLY | O_LARGEFILE, current_cred());
+	if (IS_ERR(dst)) {
+		err = PTR_ERR(dst);
+		goto out_tmp;
+	}
+	size = i_size_read(file_inode(pack));
+	for (off = 0; off + sizeof(rec) <= size; off += sizeof(rec) + rec.len) {
+		if (bkpfs_pack_read_rec(pack, off, &rec))
+			break;
+		if (rec.flags & BKPFS_PACK_DEAD)
+			continue;
+		res = bkpfs_copy_range(sb, pack, off, dst, wpos,
+				       sizeof(rec) + rec.len);
+		if (res != sizeof(rec) + rec.len) {
+			err = res < 0 ? res : -EIO;
+			break;
+		}
+		wpos += res;
+	}
+	fput(dst);
+	if (err)
+		goto out_tmp;
+
+	pi->gen++;
+	pi->dead = 0;
+	err = bkpfs_pack_set_info(tmp, pi);
+	if (err)
+		goto out_tmp;
+
+	/* give the new pack a name of its own, then move it over */
+	new_dentry = bkpfs_get_bkp_dentry(lower_dir, BKPFS_PACK_NEW_NAME, true);
+	if (IS_ERR(new_dentry)) {
+		err = PTR_ERR(new_dentry);
+		goto out_tmp;
+	}
+	inode_lock_nested(d_inode(lower_dir), I_MUTEX_PARENT);
+	if (d_really_is_positive(new_dentry)) {
+		/* left over by a crash, the next compaction gets the name */
+		vfs_unlink(d_inode(lower_dir), new_dentry, NULL);
+		err = -EAGAIN;
+	} else {
+		err = vfs_link(tmp, d_inode(lower_dir), new_dentry, NULL);
+	}
+	inode_unlock(d_inode(lower_dir));
+	if (err)
+		goto out_new;
+
+	lock_rename(lower_dir, lower_dir);
+	err = vfs_rename(d_inode(lower_dir), new_dentry, d_inode(lower_dir),
+			 pack->f_path.dentry, NULL, 0);
+	unlock_rename(lower_dir, lower_dir);
+	if (err) {
+		inode_lock_nested(d_inode(lower_dir), I_MUTEX_PARENT);
+		vfs_unlink(d_inode(lower_dir), new_dentry, NULL);
+		inode_unlock(d_inode(lower_dir));
+	}
+out_new:
+	dput(new_dentry);
+out_tmp:
+	dput(tmp);
+out_dir:
+	dput(lower_dir);
+	return err;
+}
+
+/* @brief: flag the record of version ver dead, compacting the pack when
+ *         enough of it is.
+ */
+static int bkpfs_pack_kill(struct dentry *dentry, int ver,
+			   struct bkpfs_small *sm)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(dentry->d_sb);
+	struct inode *lower_inode = bkpfs_lower_inode(d_inode(dentry));
+	const struct cred *old_cred;
+	struct bkpfs_pack_info pi;
+	struct bkpfs_pack_rec rec;
+	struct file *pack;
+	loff_t pos;
+	ssize_t res;
+	u32 flags;
+	int moved = 0;
+	int err;
+
+	old_cred = override_creds(sbi->pack_cred);
+	mutex_lock(&sbi->pack_lock);
+	pack = bkpfs_pack_open(dentry, O_RDWR);
+	if (IS_ERR(pack)) {
+		err = PTR_ERR(pack);
+		goto out;
+	}
+	err = bkpfs_pack_find(pack, lower_inode, ver, sm, &rec, &moved);
+	if (err)
+		goto out_fput;
+
+	flags = rec.flags | BKPFS_PACK_DEAD;
+	pos = sm->off + offsetof(struct bkpfs_pack_rec, flags);
+	res = kernel_write(pack, &flags, sizeof(flags), &pos);
+	if (res != sizeof(flags)) {
+		err = res < 0 ? res : -EIO;
+		goto out_fput;
+	}
+	err = bkpfs_pack_get_info(pack, &pi);
+	if (err)
+		goto out_fput;
+	pi.dead += sizeof(rec) + rec.len;
+	err = bkpfs_pack_set_info(pack->f_path.dentry, &pi);
+	if (err)
+		goto out_fput;
+
+	if (pi.dead >= BKPFS_PACK_COMPACT_MIN &&
+	    pi.dead * 2 >= i_size_read(file_inode(pack))) {
+		/* the record is dead already, compaction is best effort */
+		if (bkpfs_pack_compact(dentry->d_sb, pack, &pi))
+			printk(KERN_INFO "ERROR:: failed to compact a pack\n");
+	}
+out_fput:
+	fput(pack);
+out:
+	mutex_unlock(&sbi->pack_lock);
+	revert_creds(old_cred);
+	return err;
+}
+
+/* @brief: give the record of version ver of the lower inode from to the
+ *         lower inode to, storing where it is in sm.
+ */
+static int bkpfs_pack_chown(struct dentry *dentry, struct inode *from,
+			    struct inode *to, int ver, struct bkpfs_small *sm)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(dentry->d_sb);
+	const struct cred *old_cred;
+	struct bkpfs_pack_rec rec;
+	struct file *pack;
+	loff_t pos;
+	ssize_t res;
+	int moved = 0;
+	int err;
+
+	old_cred = override_creds(sbi->pack_cred);
+	mutex_lock(&sbi->pack_lock);
+	pack = bkpfs_pack_open(dentry, O_RDWR);
+	if (IS_ERR(pack)) {
+		err = PTR_ERR(pack);
+		goto out;
+	}
+	err = bkpfs_pack_find(pack, from, ver, sm, &rec, &moved);
+	if (err)
+		goto out_fput;
+	rec.ino = to->i_ino;
+	rec.igen = to->i_generation;
+	pos = sm->off;
+	res = kernel_write(pack, &rec, sizeof(rec), &pos);
+	if (res != sizeof(rec))
+		err = res < 0 ? res : -EIO;
+out_fput:
+	fput(pack);
+out:
+	mutex_unlock(&sbi->pack_lock);
+	revert_creds(old_cred);
+	return err;
+}
+
+/* @brief: store the new place of a record found by walking the pack, unless
+ *         the version changed meanwhile.
+ */
+static void bkpfs_small_moved(struct dentry *dentry, int ver,
+			      struct bkpfs_small *moved)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(d_inode(dentry));
+	struct bkpfs_small *sm;
+
+	mutex_lock(&info->bkp_meta_lock);
+	sm = bkpfs_small_get(dentry, ver);
+	if (IS_ERR(sm))
+		goto out;
+	if (sm->kind == BKPFS_SMALL_PACKED && sm->size == moved->size &&
+	    sm->gen != moved->gen)
+		bkpfs_small_set(dentry, ver, moved, sizeof(*moved));
+	kfree(sm);
+out:
+	mutex_unlock(&info->bkp_meta_lock);
+}
+
+/* @brief: read len bytes at pos of packed version ver into buf */
+static int bkpfs_pack_pread(struct dentry *dentry, int ver,
+			    struct bkpfs_small *sm, void *buf, size_t len,
+			    loff_t pos)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(dentry->d_sb);
+	struct inode *lower_inode = bkpfs_lower_inode(d_inode(dentry));
+	const struct cred *old_cred;
+	struct bkpfs_pack_rec rec;
+	struct file *pack;
+	ssize_t res;
+	int moved = 0;
+	int err;
+
+	old_cred = override_creds(sbi->pack_cred);
+	pack = bkpfs_pack_open(dentry, O_RDONLY);
+	if (IS_ERR(pack)) {
+		err = PTR_ERR(pack);
+		goto out;
+	}
+	err = bkpfs_pack_find(pack, lower_inode, ver, sm, &rec, &moved);
+	if (err)
+		goto out_fput;
+	pos += sm->off + sizeof(rec);
+	res = kernel_read(pack, buf, len, &pos);
+	if (res != len)
+		err = res < 0 ? res : -EIO;
+out_fput:
+	fput(pack);
+out:
+	revert_creds(old_cred);
+	if (!err && moved)
+		bkpfs_small_moved(dentry, ver, sm);
+	return err;
+}
+
+/* @brief: store the current content of the user file as version cur_ver,
+ *         inline or in the pack.  Called with bkp_meta_lock held.
+ * input :
+ *         dentry: dentry of user file created inside the mount
+ * return: err, -EAGAIN when the file is too big for it
+ */
+int bkpfs_small_backup(struct dentry *dentry)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(dentry->d_sb);
+	struct mnt_opt_info *opts = &sbi->mnt_opts;
+	struct inode *lower_inode = bkpfs_lower_inode(d_inode(dentry));
+	struct bkpfs_xattr_info xattr;
+	struct bkpfs_pack_rec *rec;
+	struct bkpfs_small *sm, packed;
+	struct file *user_file;
+	struct path lower_path;
+	loff_t pos = 0;
+	ssize_t len;
+	u8 *buf, *data;
+	int err;
+
+	if (i_size_read(lower_inode) > opts->bkp_pack)
+		return -EAGAIN;
+	err = bkpfs_get_xattr_info(dentry, &xattr);
+	if (err < 0)
+		return err;
+	/* the versions of a file with an id follow it, a pack would not */
+	if (xattr.id_ino && i_size_read(lower_inode) > opts->bkp_pack_inline)
+		return -EAGAIN;
+
+	/* one byte more than fits tells the file grew meanwhile */
+	buf = kvmalloc(BKPFS_SMALL_HDR + opts->bkp_pack + 1, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+	data = buf + BKPFS_SMALL_HDR;
+
+	bkpfs_get_lower_path(dentry, &lower_path);
+	user_file = dentry_open(&lower_path, O_RDONLY | O_LARGEFILE,
+				current_cred());
+	bkpfs_put_lower_path(dentry, &lower_path);
+	if (IS_ERR(user_file)) {
+		err = PTR_ERR(user_file);
+		goto out;
+	}
+	len = kernel_read(user_file, data, opts->bkp_pack + 1, &pos);
+	fput(user_file);
+	if (len < 0) {
+		err = len;
+		goto out;
+	}
+	if (len > opts->bkp_pack) {
+		err = -EAGAIN;
+		goto out;
+	}
+
+	if (len <= opts->bkp_pack_inline) {
+		sm = (struct bkpfs_small *)(data - sizeof(*sm));
+		sm->kind = BKPFS_SMALL_INLINE;
+		sm->gen = 0;
+		sm->size = len;
+		sm->off = 0;
+		err = bkpfs_small_set(dentry, xattr.cur_ver, sm,
+				      sizeof(*sm) + len);
+		if (!err) {
+			atomic64_inc(&sbi->pack_inline_bkps);
+			goto done;
+		}
+		/* no room left next to the other attributes, pack it */
+		if (err != -E2BIG && err != -ENOSPC && err != -ERANGE)
+			goto out;
+	}
+	if (xattr.id_ino) {
+		err = -EAGAIN;
+		goto out;
+	}
+
+	rec = (struct bkpfs_pack_rec *)(data - sizeof(*rec));
+	rec->magic = BKPFS_PACK_MAGIC;
+	rec->flags = 0;
+	rec->ino = lower_inode->i_ino;
+	rec->igen = lower_inode->i_generation;
+	rec->ver = xattr.cur_ver;
+	rec->len = len;
+	packed.kind = BKPFS_SMALL_PACKED;
+	packed.size = len;
+	err = bkpfs_pack_append(dentry, rec, len, &packed);
+	if (err)
+		goto out;
+	err = bkpfs_small_set(dentry, xattr.cur_ver, &packed, sizeof(packed));
+	if (err) {
+		bkpfs_pack_kill(dentry, xattr.cur_ver, &packed);
+		goto out;
+	}
+	atomic64_inc(&sbi->pack_bkps);
+
+done:
+	pr_debug("INFO::small version created with num=%d\n", xattr.cur_ver);
+	err = bkpfs_update_after_write(dentry, &xattr,
+			opts->maxvers ? opts->maxvers : DEFAULT_MAXVERS);
+out:
+	kvfree(buf);
+	return err;
+}
+
+/* @brief: drop small version ver, called with bkp_meta_lock held */
+int bkpfs_small_drop(struct dentry *dentry, int ver)
+{
+	struct bkpfs_small *sm;
+	struct path lower_path;
+	char name[XATTR_NAME_MAX + 1];
+	int err;
+
+	sm = bkpfs_small_get(dentry, ver);
+	if (IS_ERR(sm))
+		return PTR_ERR(sm);
+	/* a record the pack lost is nothing to reclaim */
+	if (sm->kind == BKPFS_SMALL_PACKED) {
+		err = bkpfs_pack_kill(dentry, ver, sm);
+		if (err && err != -ENOENT)
+			printk(KERN_INFO "ERROR:: failed to release packed version %d\n",
+			       ver);
+	}
+	kfree(sm);
+
+	bkpfs_small_name(ver, name, sizeof(name));
+	bkpfs_get_lower_path(dentry, &lower_path);
+	err = vfs_removexattr(lower_path.dentry, name);
+	bkpfs_put_lower_path(dentry, &lower_path);
+	return err;
+}
+
+/* @brief: size of the user file at small version ver */
+int bkpfs_small_size(struct dentry *dentry, int ver, loff_t *size)
+{
+	struct bkpfs_small *sm;
+
+	sm = bkpfs_small_get(dentry, ver);
+	if (IS_ERR(sm))
+		return PTR_ERR(sm);
+	*size = sm->size;
+	kfree(sm);
+	return 0;
+}
+
+/* @brief: read [pos, pos + len) of small version ver into buf.
+ * Return:	bytes of the version in that range, or -errno
+ */
+ssize_t bkpfs_small_read(struct dentry *dentry, int ver, void *buf,
+			 size_t len, loff_t pos)
+{
+	struct bkpfs_small *sm;
+	int err = 0;
+
+	sm = bkpfs_small_get(dentry, ver);
+	if (IS_ERR(sm))
+		return PTR_ERR(sm);
+	if (pos >= sm->size) {
+		len = 0;
+		goto out;
+	}
+	len = min_t(loff_t, len, sm->size - pos);
+	if (sm->kind == BKPFS_SMALL_INLINE)
+		memcpy(buf, (u8 *)(sm + 1) + pos, len);
+	else
+		err = bkpfs_pack_pread(dentry, ver, sm, buf, len, pos);
+out:
+	kfree(sm);
+	return err ? err : len;
+}
+
+/* @brief: write small version ver back over the user file */
+int bkpfs_small_restore(struct dentry *dentry, int ver)
+{
+	struct inode *inode = d_inode(dentry);
+	struct bkpfs_small *sm;
+	struct file *user_file;
+	struct path lower_path;
+	loff_t size, wpos = 0;
+	ssize_t res;
+	void *buf;
+	int err;
+
+	err = bkpfs_small_size(dentry, ver, &size);
+	if (err)
+		return err;
+	buf = kvmalloc(max_t(loff_t, size, 1), GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+	res = bkpfs_small_read(dentry, ver, buf, size, 0);
+	if (res != size) {
+		err = res < 0 ? res : -EIO;
+		goto out;
+	}
+
+	bkpfs_get_lower_path(dentry, &lower_path);
+	user_file = dentry_open(&lower_path, O_WRONLY | O_LARGEFILE,
+				current_cred());
+	bkpfs_put_lower_path(dentry, &lower_path);
+	if (IS_ERR(user_file)) {
+		err = PTR_ERR(user_file);
+		goto out;
+	}
+
+	/* the restored content is no longer an append to the last version */
+	WRITE_ONCE(BKPFS_I(inode)->bkp_overwritten, 1);
+	inode_lock(inode);
+	err = vfs_truncate(&user_file->f_path, 0);
+	if (!err) {
+		res = kernel_write(user_file, buf, size, &wpos);
+		if (res != size)
+			err = res < 0 ? res : -EIO;
+	}
+	fsstack_copy_inode_size(inode, bkpfs_lower_inode(inode));
+	fsstack_copy_attr_all(inode, bkpfs_lower_inode(inode));
+	inode_unlock(inode);
+	fput(user_file);
+out:
+	kvfree(buf);
+	return err;
+}
+
+/* @brief: give packed version ver a backup file of its own, for a file
+ *         leaving the directory of its pack.  Inline versions go along
+ *         with the file and are left as they are.  Called with
+ *         bkp_meta_lock held.
+ */
+int bkpfs_small_unpack(struct dentry *dentry, int ver)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(dentry->d_sb);
+	struct inode *lower_inode = bkpfs_lower_inode(d_inode(dentry));
+	const struct cred *old_cred;
+	struct bkpfs_pack_rec rec;
+	struct bkpfs_small *sm;
+	struct file *pack, *bkp_file;
+	loff_t pos;
+	ssize_t res;
+	void *buf;
+	int moved = 0;
+	int err;
+
+	sm = bkpfs_small_get(dentry, ver);
+	if (IS_ERR(sm))
+		return PTR_ERR(sm);
+	err = 0;
+	if (sm->kind != BKPFS_SMALL_PACKED)
+		goto out;
+	buf = kvmalloc(max_t(u64, sm->size, 1), GFP_KERNEL);
+	if (!buf) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	/* not bkpfs_pack_pread, the new place of a moved record is of no use */
+	old_cred = override_creds(sbi->pack_cred);
+	pack = bkpfs_pack_open(dentry, O_RDONLY);
+	if (IS_ERR(pack)) {
+		err = PTR_ERR(pack);
+		revert_creds(old_cred);
+		goto out_free;
+	}
+	err = bkpfs_pack_find(pack, lower_inode, ver, sm, &rec, &moved);
+	if (!err) {
+		pos = sm->off + sizeof(rec);
+		res = kernel_read(pack, buf, sm->size, &pos);
+		if (res != sm->size)
+			err = res < 0 ? res : -EIO;
+	}
+	fput(pack);
+	revert_creds(old_cred);
+	if (err)
+		goto out_free;
+
+	bkp_file = bkpfs_open_version(dentry, ver, O_CREAT | O_WRONLY | O_TRUNC);
+	if (IS_ERR(bkp_file)) {
+		err = PTR_ERR(bkp_file);
+		goto out_free;
+	}
+	pos = 0;
+	res = kernel_write(bkp_file, buf, sm->size, &pos);
+	fput(bkp_file);
+	if (res != sm->size) {
+		err = res < 0 ? res : -EIO;
+		goto out_free;
+	}
+	/* the backup file is only read once the attribute is gone */
+	err = bkpfs_small_drop(dentry, ver);
+out_free:
+	kvfree(buf);
+out:
+	kfree(sm);
+	return err;
+}
+
+/* @brief: hand the small versions start_ver..cur_ver - 1 of the lower file
+ *         from over to the lower file to, which took its name.  dentry is
+ *         the upper dentry of that name, its directory holds the pack.
+ */
+void bkpfs_small_carry(struct dentry *dentry, struct dentry *from,
+		       struct dentry *to, int start_ver, int cur_ver)
+{
+	struct bkpfs_small *sm;
+	char name[XATTR_NAME_MAX + 1];
+	ssize_t res;
+	int ver;
+
+	sm = kmalloc(sizeof(*sm) + BKPFS_PACK_INLINE_MAX, GFP_KERNEL);
+	if (!sm)
+		return;
+	for (ver = start_ver; ver < cur_ver; ver++) {
+		bkpfs_small_name(ver, name, sizeof(name));
+		res = vfs_getxattr(from, name, sm,
+				   sizeof(*sm) + BKPFS_PACK_INLINE_MAX);
+		if (res < (ssize_t)sizeof(*sm))
+			continue;
+		if (sm->kind == BKPFS_SMALL_PACKED &&
+		    bkpfs_pack_chown(dentry, d_inode(from), d_inode(to), ver, sm))
+			printk(KERN_INFO "ERROR:: failed to move packed version %d\n",
+			       ver);
+		if (vfs_setxattr(to, name, sm, res, 0))
+			printk(KERN_INFO "ERROR:: failed to move small version %d\n",
+			       ver);
+		vfs_removexattr(from, name);
+	}
+	kfree(sm);
+}
+
+/* @brief: set up the packs of the mount, at mount time.  Versions packed
+ *         by an earlier mount must be readable whatever the options.
+ */
+void bkpfs_pack_init_sb(struct super_block *sb)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+
+	mutex_init(&sbi->pack_lock);
+	atomic64_set(&sbi->pack_bkps, 0);
+	atomic64_set(&sbi->pack_inline_bkps, 0);
+	/* packs are shared between users, they belong to the mounter */
+	sbi->pack_cred = get_current_cred();
+}
+
+/* @brief: release the packs of the mount */
+void bkpfs_pack_put_sb(struct super_block *sb)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+
+	if (sbi->pack_cred)
+		put_cred(sbi->pack_cred);
+}
@@ -28,6 +28,16 @@ static void bkpfs_put_super(struct super_block *sb)
 	if (!spd)
 		return;
 
+	/* kill_sb already ran the queued backups */
+	bkpfs_destroy_backup_wq(sb);
+	bkpfs_destroy_copy_wq(sb);
+	bkpfs_destroy_zip_wq(sb);
+	bkpfs_chunk_put_sb(sb);
+	bkpfs_dedup_put_sb(sb);
+	bkpfs_pack_put_sb(sb);
+	bkpfs_trash_put_sb(sb);
+	bkpfs_layout_put_sb(sb);
+
 	/* decrement lower super references */
 	s = bkpfs_lower_super(sb);
 	bkpfs_set_lower_super(sb, NULL);
@@ -87,6 +97,9 @@ static void bkpfs_evict_inode(struct inode *inode)
 	UDBG;
 	truncate_inode_pages(&inode->i_data, 0);
 	clear_inode(inode);
+	/* the delta tracker and saved pages do not survive the inode */
+	bkpfs_delta_invalidate(inode);
+	bkpfs_undo_forget(inode);
 	/*
 	 * Decrement a reference to a lower_inode, which was incremented
 	 * by our read_inode when it was created initially.
@@ -106,6 +119,15 @@ static struct inode *bkpfs_alloc_inode(struct super_block *sb)
 
 	/* memset everything up to the inode to 0 */
 	memset(i, 0, offsetof(struct bkpfs_inode_info, vfs_inode));
+	bkpfs_init_backup_work(&i->vfs_inode);
+	bkpfs_undo_init(&i->vfs_inode);
+	bkpfs_zip_init(&i->vfs_inode);
+	mutex_init(&i->dt_lock);
+	seqlock_init(&i->ver_lock);
+	i->ver_state = BKPFS_VER_UNKNOWN;
+	/* what happened before the inode was loaded is not known */
+	i->bkp_overwritten = 1;
+	i->dt_root = RB_ROOT_CACHED;
 
         atomic64_set(&i->vfs_inode.i_version, 1);
 	return &i->vfs_inode;
@@ -173,6 +195,63 @@ static int bkpfs_show_options(struct seq_file *m, struct dentry *root)
 		seq_printf(m, ",backup threshold(Bytes)=%d", mnt_opts->bkp_threshold);
 		printk(KERN_INFO "backup_threshold=%d\n", mnt_opts->bkp_threshold);
 	}
+	if (mnt_opts->bkp_format == BKP_FORMAT_UNDO)
+		seq_printf(m, ",bkp_format=undo");
+	if (mnt_opts->bkp_format == BKP_FORMAT_CHUNK)
+		seq_printf(m, ",bkp_format=chunk");
+	if (mnt_opts->bkp_format == BKP_FORMAT_COMPRESS)
+		seq_printf(m, ",bkp_format=compress,bkp_compress=%s",
+			   mnt_opts->bkp_compress);
+	if (mnt_opts->bkp_format == BKP_FORMAT_COMPRESS &&
+	    mnt_opts->bkp_recompress[0])
+		seq_printf(m, ",bkp_recompress=%s,bkp_recompress_after=%d",
+			   mnt_opts->bkp_recompress,
+			   mnt_opts->bkp_recompress_after);
+	if (mnt_opts->bkp_pack)
+		seq_printf(m, ",bkp_pack=%u,bkp_pack_inline=%u",
+			   mnt_opts->bkp_pack, mnt_opts->bkp_pack_inline);
+	if (mnt_opts->bkp_unlink == BKP_UNLINK_TRASH)
+		seq_printf(m, ",bkp_unlink=trash,bkp_trash_grace=%u,bkp_trash_rate=%u",
+			   mnt_opts->bkp_trash_grace,
+			   mnt_opts->bkp_trash_rate ?
+			   mnt_opts->bkp_trash_rate : DEFAULT_BKP_TRASH_RATE);
+	if (mnt_opts->bkp_layout == BKP_LAYOUT_INODE)
+		seq_printf(m, ",bkp_layout=inode");
+	if (mnt_opts->bkp_format == BKP_FORMAT_DELTA)
+		seq_printf(m, ",bkp_format=delta,bkp_ckpt_every=%d",
+			   mnt_opts->bkp_ckpt_every ?
+			   mnt_opts->bkp_ckpt_every : DEFAULT_BKP_CKPT_EVERY);
+	if (mnt_opts->bkp_append)
+		seq_printf(m, ",bkp_append");
+	if (mnt_opts->bkp_mode == BKP_MODE_ASYNC)
+		seq_printf(m, ",bkp_mode=async,bkp_queue_depth=%d",
+			   mnt_opts->bkp_queue_depth ?
+			   mnt_opts->bkp_queue_depth : DEFAULT_BKP_QUEUE_DEPTH);
+	if (mnt_opts->bkp_trigger == BKP_TRIGGER_CLOSE)
+		seq_printf(m, ",bkp_trigger=close");
+	else if (mnt_opts->bkp_trigger == BKP_TRIGGER_FSYNC)
+		seq_printf(m, ",bkp_trigger=fsync");
+	if (mnt_opts->bkp_threshold_cum)
+		seq_printf(m, ",bkp_threshold_cum=%llu", mnt_opts->bkp_threshold_cum);
+	if (mnt_opts->bkp_change_pct)
+		seq_printf(m, ",bkp_change_pct=%d", mnt_opts->bkp_change_pct);
+	if (mnt_opts->bkp_max_write_lat_us)
+		seq_printf(m, ",bkp_max_write_lat_us=%u",
+			   mnt_opts->bkp_max_write_lat_us);
+	if (mnt_opts->bkp_nocache)
+		seq_printf(m, ",bkp_nocache");
+	if (mnt_opts->bkp_dedup)
+		seq_printf(m, ",bkp_dedup");
+	if (mnt_opts->bkp_skip_same)
+		seq_printf(m, ",bkp_skip_same");
+	if (mnt_opts->bkp_copy_threads > 1)
+		seq_printf(m, ",bkp_copy_threads=%d", mnt_opts->bkp_copy_threads);
+	if (mnt_opts->bkp_quiet_ms)
+		seq_printf(m, ",bkp_quiet_ms=%u,bkp_max_delay_ms=%u",
+			   mnt_opts->bkp_quiet_ms,
+			   mnt_opts->bkp_max_delay_ms ?
+			   mnt_opts->bkp_max_delay_ms :
+			   mnt_opts->bkp_quiet_ms * DEFAULT_BKP_MAX_DELAY_FACTOR);
 
 	return rc;
 }
@@ -0,0 +1,713 @@
+/*
+ * Copyright (c) 1998-2017 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2017 Stony Brook University
+ * Copyright (c) 2003-2017 The Research Foundation of SUNY
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/*
+ * Trash of unlinked files (bkp_unlink=trash).
+ *
+ * Deleting the versions of a file one by one makes unlink() as slow as the
+ * history is long.  With bkp_unlink=trash, unlink renames the lower file
+ * and its version files into .bkp_trash, a directory of the lower root,
+ * instead: the file becomes <id> and its versions <id>.<ver>, <id> being
+ * unique to the trash.  No data is freed by unlink, what it costs is one
+ * rename per version.  The BKPFS_TRASH_XATTR attribute of <id> tells which
+ * directory the file was unlinked from, under which name and when.
+ *
+ * A per-mount worker purges the files unlinked bkp_trash_grace seconds ago
+ * or more, with their versions, at most bkp_trash_rate entries a second.
+ * Until then IOCTL_UNDELETE on the directory brings the file last unlinked
+ * under a name back, versions and all.
+ *
+ * Packed versions (see pack.c) get a backup file of their own first, the
+ * pack stays in the directory.  The versions of a file with an id (see
+ * layout.c) are not in the directory and stay where they are, unlink then
+ * is a single rename and the purge removes their directory.  Files with
+ * other links, or open for writing, are deleted as before.  Like the chunk
+ * store, the trash belongs to the mounter.
+ */
+
+#include "bkpfs.h"
+#include "linux/bkp_shared.h"
+
+#define BKPFS_TRASH_NAME	".bkp_trash"
+#define BKPFS_TRASH_XATTR	"user.bkp_trash"
+#define BKPFS_TRASH_BATCH	32	/* entries read from the trash at once */
+#define BKPFS_TRASH_NAME_LEN	32	/* holds "<id>.<ver>" */
+#define BKPFS_TRASH_MAX_SLEEP	3600	/* seconds between purge passes */
+
+/* attribute of a file in the trash */
+struct bkpfs_trash_info {
+	u64 dir_ino;		/* lower directory it was unlinked from */
+	u32 dir_gen;		/* and its generation */
+	u32 pad;
+	s64 time;		/* of the unlink, real time seconds */
+	char name[NAME_MAX + 1];	/* in that directory */
+};
+
+/* an entry of the trash */
+struct bkpfs_trash_ent {
+	u64 id;
+	int ver;		/* -1 for the file itself */
+};
+
+/* a batch of entries read from the trash */
+struct bkpfs_trash_ctx {
+	struct dir_context ctx;
+	int nr;
+	int max;
+	struct bkpfs_trash_ent ent[BKPFS_TRASH_BATCH];
+};
+
+static void bkpfs_trash_name(u64 id, int ver, char *buf)
+{
+	if (ver < 0)
+		snprintf(buf, BKPFS_TRASH_NAME_LEN, "%016llx", id);
+	else
+		snprintf(buf, BKPFS_TRASH_NAME_LEN, "%016llx.%d", id, ver);
+}
+
+static int bkpfs_trash_fill(struct dir_context *ctx, const char *name,
+			    int namelen, loff_t offset, u64 ino,
+			    unsigned int d_type)
+{
+	struct bkpfs_trash_ctx *tc;
+	struct bkpfs_trash_ent *ent;
+	char buf[BKPFS_TRASH_NAME_LEN];
+	char *dot;
+
+	tc = container_of(ctx, struct bkpfs_trash_ctx, ctx);
+	/* stops the walk, the entry is read again by the next batch */
+	if (tc->nr == tc->max)
+		return -ENOSPC;
+	if (namelen < 16 || namelen >= sizeof(buf))
+		return 0;
+	memcpy(buf, name, namelen);
+	buf[namelen] = '\0';
+
+	ent = &tc->ent[tc->nr];
+	ent->ver = -1;
+	dot = strchr(buf, '.');
+	if (dot) {
+		*dot = '\0';
+		if (kstrtoint(dot + 1, 10, &ent->ver) || ent->ver < 0)
+			return 0;
+	}
+	if (strlen(buf) != 16 || kstrtou64(buf, 16, &ent->id))
+		return 0;
+	tc->nr++;
+	return 0;
+}
+
+/* @brief: read the next entries of the trash, from trash->f_pos on.
+ * Return:	entries read, 0 at the end, or -errno
+ */
+static int bkpfs_trash_read(struct file *trash, struct bkpfs_trash_ctx *tc,
+			    int max)
+{
+	int err;
+
+	tc->nr = 0;
+	tc->max = min(max, BKPFS_TRASH_BATCH);
+	err = iterate_dir(trash, &tc->ctx);
+	return err ? err : tc->nr;
+}
+
+static int bkpfs_trash_get_info(struct dentry *dentry,
+				struct bkpfs_trash_info *ti)
+{
+	size_t hdr = offsetof(struct bkpfs_trash_info, name);
+	ssize_t res;
+
+	memset(ti, 0, sizeof(*ti));
+	res = vfs_getxattr(dentry, BKPFS_TRASH_XATTR, ti, sizeof(*ti));
+	if (res < 0)
+		return res;
+	if (res <= hdr || ti->name[res - hdr - 1] != '\0')
+		return -EINVAL;
+	return 0;
+}
+
+/* @brief: the version info of the trashed file dentry.  Its slots are
+ *         start_ver..cur_ver, cur_ver being where the undo format keeps the
+ *         records logged since the newest version.  Without one the range
+ *         is empty.
+ */
+static void bkpfs_trash_vers(struct dentry *dentry,
+			     struct bkpfs_xattr_info *xattr)
+{
+	ssize_t res;
+
+	memset(xattr, 0, sizeof(*xattr));
+	res = vfs_getxattr(dentry, BKPFS_XATTR_NAME, xattr, sizeof(*xattr));
+	if (res < (ssize_t)offsetofend(struct bkpfs_xattr_info, cur_ver)) {
+		memset(xattr, 0, sizeof(*xattr));
+		xattr->cur_ver = -1;
+	}
+}
+
+/* @brief: unlink the trash entry name.
+ * Return:	1 if it was there, 0 if not, or -errno
+ */
+static int bkpfs_trash_unlink(struct bkpfs_sb_info *sbi, const char *name)
+{
+	struct dentry *trash = sbi->trash_root.dentry;
+	struct dentry *dentry;
+	int err;
+
+	inode_lock_nested(d_inode(trash), I_MUTEX_PARENT);
+	dentry = lookup_one_len(name, trash, strlen(name));
+	if (IS_ERR(dentry)) {
+		err = PTR_ERR(dentry);
+		goto out;
+	}
+	err = 0;
+	if (d_really_is_positive(dentry)) {
+		err = vfs_unlink(d_inode(trash), dentry, NULL);
+		if (!err)
+			err = 1;
+	}
+	dput(dentry);
+out:
+	inode_unlock(d_inode(trash));
+	return err;
+}
+
+/* @brief: purge the trash entry ent, with its versions if it is a file and
+ *         its grace period is over at now.  Otherwise *next is lowered to
+ *         when it will be.  Called with trash_lock held.
+ * Return:	entries looked at or unlinked, what the rate limit counts
+ */
+static int bkpfs_trash_purge(struct bkpfs_sb_info *sbi,
+			     struct bkpfs_trash_ent *ent, time64_t now,
+			     struct bkpfs_trash_info *ti, time64_t *next)
+{
+	char name[BKPFS_TRASH_NAME_LEN];
+	struct bkpfs_xattr_info xattr;
+	struct dentry *dentry;
+	time64_t due;
+	int ver, res;
+	int done = 0;
+
+	bkpfs_trash_name(ent->id, -1, name);
+	dentry = bkpfs_get_bkp_dentry(sbi->trash_root.dentry, name, false);
+	if (ent->ver >= 0) {
+		/* a version goes with its file, unless it lost it */
+		if (!IS_ERR(dentry)) {
+			dput(dentry);
+			return 1;
+		}
+		bkpfs_trash_name(ent->id, ent->ver, name);
+		res = bkpfs_trash_unlink(sbi, name);
+		return max(res, 1);
+	}
+	/* already purged with the versions of this pass */
+	if (IS_ERR(dentry))
+		return 1;
+
+	/* without an attribute it is no use to anyone, purge it */
+	if (!bkpfs_trash_get_info(dentry, ti)) {
+		due = ti->time + sbi->mnt_opts.bkp_trash_grace;
+		if (due > now) {
+			*next = min(*next, due);
+			dput(dentry);
+			return 1;
+		}
+	}
+	bkpfs_trash_vers(dentry, &xattr);
+	dput(dentry);
+
+	if (xattr.id_ino) {
+		res = bkpfs_layout_remove(sbi->trash_sb, &xattr, 1);
+		if (res > 0)
+			done += res;
+	} else {
+		for (ver = xattr.start_ver; ver <= xattr.cur_ver; ver++) {
+			bkpfs_trash_name(ent->id, ver, name);
+			if (bkpfs_trash_unlink(sbi, name) > 0)
+				done++;
+		}
+	}
+	bkpfs_trash_name(ent->id, -1, name);
+	res = bkpfs_trash_unlink(sbi, name);
+	if (res > 0) {
+		atomic64_inc(&sbi->trash_purged);
+		done++;
+	} else if (res < 0) {
+		printk(KERN_INFO "ERROR:: failed to purge %s from the trash, err=%d\n",
+		       name, res);
+	}
+	return max(done, 1);
+}
+
+/* @brief: worker purging the trash, one pass of at most bkp_trash_rate
+ *         entries.  A pass goes on where the last one stopped, and the
+ *         worker sleeps once a whole pass found nothing due.
+ */
+static void bkpfs_trash_work(struct work_struct *work)
+{
+	struct bkpfs_sb_info *sbi;
+	struct bkpfs_trash_ctx tc = { .ctx.actor = bkpfs_trash_fill };
+	struct bkpfs_trash_info *ti;
+	const struct cred *old_cred;
+	struct file *trash;
+	time64_t now, next = S64_MAX;
+	unsigned long delay = HZ;
+	int budget, nr, i;
+	bool whole;
+
+	sbi = container_of(to_delayed_work(work), struct bkpfs_sb_info,
+			   trash_work);
+	budget = sbi->mnt_opts.bkp_trash_rate ? : DEFAULT_BKP_TRASH_RATE;
+	now = ktime_get_real_seconds();
+
+	ti = kmalloc(sizeof(*ti), GFP_KERNEL);
+	if (!ti)
+		goto out_requeue;
+
+	old_cred = override_creds(sbi->trash_cred);
+	trash = dentry_open(&sbi->trash_root, O_RDONLY | O_DIRECTORY,
+			    current_cred());
+	if (IS_ERR(trash)) {
+		printk(KERN_INFO "ERROR:: failed to open the trash, err=%ld\n",
+		       PTR_ERR(trash));
+		goto out_creds;
+	}
+
+	mutex_lock(&sbi->trash_lock);
+	if (vfs_llseek(trash, sbi->trash_pos, SEEK_SET) < 0)
+		sbi->trash_pos = 0;
+	whole = !sbi->trash_pos;
+	while (budget > 0) {
+		nr = bkpfs_trash_read(trash, &tc, budget);
+		if (nr <= 0) {
+			if (nr < 0)
+				whole = false;
+			sbi->trash_pos = 0;
+			break;
+		}
+		for (i = 0; i < nr; i++)
+			budget -= bkpfs_trash_purge(sbi, &tc.ent[i], now, ti,
+						    &next);
+	}
+	if (budget <= 0) {
+		sbi->trash_pos = trash->f_pos;
+		whole = false;
+	}
+	mutex_unlock(&sbi->trash_lock);
+	fput(trash);
+
+	/* all of it was looked at, nothing is due before next */
+	if (whole) {
+		if (next == S64_MAX)
+			delay = 0;
+		else
+			delay = clamp_t(time64_t, next - now, 1,
+					BKPFS_TRASH_MAX_SLEEP) * HZ;
+	}
+out_creds:
+	revert_creds(old_cred);
+	kfree(ti);
+out_requeue:
+	if (delay)
+		queue_delayed_work(system_unbound_wq, &sbi->trash_work, delay);
+}
+
+/* @brief: move the user file and its versions to the trash, for unlink.
+ *         Called with the inode of the file locked, like ->unlink.
+ * Return:	0, -EAGAIN when the file is to be deleted as before, or -errno
+ */
+int bkpfs_trash_file(struct inode *dir, struct dentry *dentry)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(dentry->d_sb);
+	struct inode *inode = d_inode(dentry);
+	struct bkpfs_inode_info *info = BKPFS_I(inode);
+	struct inode *lower_inode = bkpfs_lower_inode(inode);
+	struct dentry *lower_dir, *trash, *src, *dst;
+	char tname[BKPFS_TRASH_NAME_LEN];
+	struct bkpfs_xattr_info xattr;
+	struct bkpfs_trash_info *ti;
+	struct path lower_path;
+	const struct cred *old_cred;
+	char *bkp_name;
+	u64 id;
+	int ver, err;
+
+	/* other names still need the versions, writers would add some */
+	if (!S_ISREG(inode->i_mode) || lower_inode->i_nlink != 1 ||
+	    atomic_read(&lower_inode->i_writecount) > 0)
+		return -EAGAIN;
+
+	ti = kzalloc(sizeof(*ti), GFP_KERNEL);
+	bkp_name = kmalloc(NAME_MAX + 1, GFP_KERNEL);
+	if (!ti || !bkp_name) {
+		err = -ENOMEM;
+		goto out_free;
+	}
+
+	mutex_lock(&info->bkp_meta_lock);
+	/* a file without history is as quickly unlinked */
+	err = bkpfs_get_xattr_info(dentry, &xattr);
+	if (err < 0) {
+		err = -EAGAIN;
+		goto out_unlock;
+	}
+
+	/* the pack stays in the directory, what is in it can't */
+	for (ver = xattr.start_ver; !xattr.id_ino && ver < xattr.cur_ver;
+	     ver++) {
+		if (!bkpfs_small_is(dentry, ver))
+			continue;
+		err = bkpfs_small_unpack(dentry, ver);
+		if (err) {
+			printk(KERN_INFO "ERROR:: failed to unpack version %d, err=%d\n",
+			       ver, err);
+			err = -EAGAIN;
+			goto out_unlock;
+		}
+	}
+
+	bkpfs_get_lower_path(dentry, &lower_path);
+	lower_dir = dget_parent(lower_path.dentry);
+	trash = sbi->trash_root.dentry;
+
+	ti->dir_ino = d_inode(lower_dir)->i_ino;
+	ti->dir_gen = d_inode(lower_dir)->i_generation;
+	ti->time = ktime_get_real_seconds();
+	strlcpy(ti->name, dentry->d_name.name, sizeof(ti->name));
+	id = atomic64_inc_return(&sbi->trash_id);
+
+	/* unlink only needs the directory writable, the rest is the mounter's */
+	old_cred = override_creds(sbi->trash_cred);
+	err = vfs_setxattr(lower_path.dentry, BKPFS_TRASH_XATTR, ti,
+			   offsetof(struct bkpfs_trash_info, name) +
+			   strlen(ti->name) + 1, 0);
+	if (err) {
+		err = -EAGAIN;
+		goto out_creds;
+	}
+
+	mutex_lock(&sbi->trash_lock);
+	lock_rename(trash, lower_dir);
+	bkpfs_trash_name(id, -1, tname);
+	dst = lookup_one_len(tname, trash, strlen(tname));
+	if (IS_ERR(dst)) {
+		err = PTR_ERR(dst);
+		goto out_rename;
+	}
+	if (d_really_is_positive(dst))
+		err = -EEXIST;
+	else
+		err = vfs_rename(d_inode(lower_dir), lower_path.dentry,
+				 d_inode(trash), dst, NULL, 0);
+	dput(dst);
+	if (err)
+		goto out_rename;
+
+	/* the file is in the trash, its versions follow it unless they are
+	 * kept by id
+	 */
+	for (ver = xattr.start_ver; !xattr.id_ino && ver <= xattr.cur_ver;
+	     ver++) {
+		bkpfs_bkp_name(dentry, ver, bkp_name);
+		src = lookup_one_len(bkp_name, lower_dir, strlen(bkp_name));
+		if (IS_ERR(src))
+			continue;
+		if (d_really_is_negative(src))
+			goto next;
+		bkpfs_trash_name(id, ver, tname);
+		dst = lookup_one_len(tname, trash, strlen(tname));
+		if (IS_ERR(dst))
+			goto next;
+		/* the dedup index must not hand it out any more */
+		bkpfs_dedup_forget(dentry->d_sb, src);
+		if (vfs_rename(d_inode(lower_dir), src, d_inode(trash), dst,
+			       NULL, 0))
+			printk(KERN_INFO "ERROR:: failed to move version %d to the trash\n",
+			       ver);
+		dput(dst);
+next:
+		dput(src);
+	}
+	fsstack_copy_attr_times(dir, d_inode(lower_dir));
+	fsstack_copy_inode_size(dir, d_inode(lower_dir));
+	atomic64_inc(&sbi->trash_files);
+
+out_rename:
+	unlock_rename(trash, lower_dir);
+	mutex_unlock(&sbi->trash_lock);
+	if (err) {
+		vfs_removexattr(lower_path.dentry, BKPFS_TRASH_XATTR);
+		err = -EAGAIN;
+	}
+out_creds:
+	revert_creds(old_cred);
+	dput(lower_dir);
+	bkpfs_put_lower_path(dentry, &lower_path);
+	if (!err)
+		queue_delayed_work(system_unbound_wq, &sbi->trash_work, HZ);
+out_unlock:
+	mutex_unlock(&info->bkp_meta_lock);
+out_free:
+	kfree(bkp_name);
+	kfree(ti);
+	return err;
+}
+
+/* @brief: bring back the file last unlinked under the name given in arg
+ *         (struct undelete_args) from the directory file, with its
+ *         versions.
+ * Return:	0 or -errno, -ENOENT when the trash has no such file
+ */
+long bkpfs_trash_undelete(struct file *file, void __user *arg)
+{
+	struct dentry *dentry = file->f_path.dentry;
+	struct inode *dir = d_inode(dentry);
+	struct bkpfs_sb_info *sbi = BKPFS_SB(dir->i_sb);
+	struct bkpfs_trash_ctx tc = { .ctx.actor = bkpfs_trash_fill };
+	struct dentry *upper, *lower_dir, *trash, *cand, *found = NULL;
+	struct dentry *src, *dst;
+	char tname[BKPFS_TRASH_NAME_LEN];
+	struct bkpfs_xattr_info xattr;
+	struct undelete_args *uarg;
+	struct bkpfs_trash_info *ti;
+	struct path lower_path;
+	const struct cred *old_cred;
+	struct file *trash_file;
+	kuid_t fsuid = current_fsuid();
+	bool sticky;
+	char *bkp_name;
+	u64 id = 0;
+	int ver, nr, i, len;
+	long err;
+
+	if (!sbi->trash_root.dentry)
+		return -EOPNOTSUPP;
+
+	uarg = memdup_user(arg, sizeof(*uarg));
+	if (IS_ERR(uarg))
+		return PTR_ERR(uarg);
+	len = strnlen(uarg->name, sizeof(uarg->name));
+	if (len == sizeof(uarg->name)) {
+		err = -ENAMETOOLONG;
+		goto out_uarg;
+	}
+	/* backup files are not for the user to name */
+	if (!len || strchr(uarg->name, '/') || !strcmp(uarg->name, ".") ||
+	    !strcmp(uarg->name, "..") || !strncmp(uarg->name, ".bkp_", 5)) {
+		err = -EINVAL;
+		goto out_uarg;
+	}
+
+	ti = kmalloc(sizeof(*ti), GFP_KERNEL);
+	bkp_name = kmalloc(NAME_MAX + 1, GFP_KERNEL);
+	if (!ti || !bkp_name) {
+		err = -ENOMEM;
+		goto out_free;
+	}
+
+	err = mnt_want_write_file(file);
+	if (err)
+		goto out_free;
+	err = inode_permission(dir, MAY_WRITE | MAY_EXEC);
+	if (err)
+		goto out_drop_write;
+
+	inode_lock_nested(dir, I_MUTEX_PARENT);
+	upper = lookup_one_len(uarg->name, dentry, len);
+	if (IS_ERR(upper)) {
+		err = PTR_ERR(upper);
+		goto out_dir;
+	}
+	if (d_really_is_positive(upper)) {
+		err = -EEXIST;
+		goto out_upper;
+	}
+
+	/* like unlink, a sticky directory keeps other people's files */
+	sticky = (dir->i_mode & S_ISVTX) && !uid_eq(dir->i_uid, fsuid) &&
+		 !capable(CAP_FOWNER);
+
+	bkpfs_get_lower_path(dentry, &lower_path);
+	lower_dir = lower_path.dentry;
+	trash = sbi->trash_root.dentry;
+
+	old_cred = override_creds(sbi->trash_cred);
+	mutex_lock(&sbi->trash_lock);
+	trash_file = dentry_open(&sbi->trash_root, O_RDONLY | O_DIRECTORY,
+				 current_cred());
+	if (IS_ERR(trash_file)) {
+		err = PTR_ERR(trash_file);
+		goto out_lock;
+	}
+	/* ids grow, the highest is the file last unlinked */
+	while ((nr = bkpfs_trash_read(trash_file, &tc,
+				      BKPFS_TRASH_BATCH)) > 0) {
+		for (i = 0; i < nr; i++) {
+			if (tc.ent[i].ver >= 0 || (found && tc.ent[i].id <= id))
+				continue;
+			bkpfs_trash_name(tc.ent[i].id, -1, tname);
+			cand = bkpfs_get_bkp_dentry(trash, tname, false);
+			if (IS_ERR(cand))
+				continue;
+			if (bkpfs_trash_get_info(cand, ti) ||
+			    ti->dir_ino != d_inode(lower_dir)->i_ino ||
+			    ti->dir_gen != d_inode(lower_dir)->i_generation ||
+			    strcmp(ti->name, uarg->name)) {
+				dput(cand);
+				continue;
+			}
+			dput(found);
+			found = cand;
+			id = tc.ent[i].id;
+		}
+	}
+	fput(trash_file);
+	err = nr;
+	if (err)
+		goto out_found;
+	err = -ENOENT;
+	if (!found)
+		goto out_found;
+
+	err = -EPERM;
+	if (sticky && !uid_eq(d_inode(found)->i_uid, fsuid))
+		goto out_found;
+	/* the inode of the old name would come back without its history */
+	err = -EBUSY;
+	if (atomic_read(&d_inode(found)->i_count) > 1)
+		goto out_found;
+
+	bkpfs_trash_vers(found, &xattr);
+	lock_rename(lower_dir, trash);
+	dst = lookup_one_len(uarg->name, lower_dir, len);
+	if (IS_ERR(dst)) {
+		err = PTR_ERR(dst);
+		goto out_rename;
+	}
+	if (d_really_is_positive(dst))
+		err = -EEXIST;
+	else
+		err = vfs_rename(d_inode(trash), found, d_inode(lower_dir), dst,
+				 NULL, 0);
+	dput(dst);
+	if (err)
+		goto out_rename;
+
+	for (ver = xattr.start_ver; !xattr.id_ino && ver <= xattr.cur_ver;
+	     ver++) {
+		bkpfs_trash_name(id, ver, tname);
+		src = lookup_one_len(tname, trash, strlen(tname));
+		if (IS_ERR(src))
+			continue;
+		if (d_really_is_negative(src))
+			goto next;
+		bkpfs_bkp_name(upper, ver, bkp_name);
+		dst = lookup_one_len(bkp_name, lower_dir, strlen(bkp_name));
+		if (IS_ERR(dst))
+			goto next;
+		if (d_really_is_positive(dst) ||
+		    vfs_rename(d_inode(trash), src, d_inode(lower_dir), dst,
+			       NULL, 0))
+			printk(KERN_INFO "ERROR:: failed to bring back version %d of %s\n",
+			       ver, uarg->name);
+		dput(dst);
+next:
+		dput(src);
+	}
+	fsstack_copy_attr_times(dir, d_inode(lower_dir));
+	fsstack_copy_inode_size(dir, d_inode(lower_dir));
+out_rename:
+	unlock_rename(lower_dir, trash);
+	if (!err) {
+		vfs_removexattr(found, BKPFS_TRASH_XATTR);
+		/* the next lookup finds the file */
+		d_drop(upper);
+	}
+out_found:
+	dput(found);
+out_lock:
+	mutex_unlock(&sbi->trash_lock);
+	revert_creds(old_cred);
+	bkpfs_put_lower_path(dentry, &lower_path);
+out_upper:
+	dput(upper);
+out_dir:
+	inode_unlock(dir);
+out_drop_write:
+	mnt_drop_write_file(file);
+out_free:
+	kfree(bkp_name);
+	kfree(ti);
+out_uarg:
+	kfree(uarg);
+	return err;
+}
+
+/* @brief: set up the trash of the mount, with bkp_unlink=trash */
+int bkpfs_trash_init_sb(struct super_block *sb)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+	struct path lower_root;
+	struct dentry *dir, *trash;
+	int err = 0;
+
+	mutex_init(&sbi->trash_lock);
+	INIT_DELAYED_WORK(&sbi->trash_work, bkpfs_trash_work);
+	sbi->trash_sb = sb;
+	atomic64_set(&sbi->trash_files, 0);
+	atomic64_set(&sbi->trash_purged, 0);
+	/* above the ids earlier mounts gave out */
+	atomic64_set(&sbi->trash_id, ktime_get_real_ns());
+	/* the trash holds everyone's files, it belongs to the mounter */
+	sbi->trash_cred = get_current_cred();
+
+	bkpfs_get_lower_path(sb->s_root, &lower_root);
+	dir = lower_root.dentry;
+	inode_lock_nested(d_inode(dir), I_MUTEX_PARENT);
+	trash = lookup_one_len(BKPFS_TRASH_NAME, dir, strlen(BKPFS_TRASH_NAME));
+	if (!IS_ERR(trash) && d_really_is_negative(trash)) {
+		err = vfs_mkdir(d_inode(dir), trash, 0700);
+		if (err) {
+			dput(trash);
+			trash = ERR_PTR(err);
+		}
+	}
+	inode_unlock(d_inode(dir));
+	if (IS_ERR(trash)) {
+		err = PTR_ERR(trash);
+		goto out;
+	}
+	if (!d_is_dir(trash)) {
+		dput(trash);
+		err = -ENOTDIR;
+		goto out;
+	}
+	sbi->trash_root.mnt = mntget(lower_root.mnt);
+	sbi->trash_root.dentry = trash;
+
+	/* purge what earlier mounts left behind */
+	queue_delayed_work(system_unbound_wq, &sbi->trash_work, HZ);
+out:
+	bkpfs_put_lower_path(sb->s_root, &lower_root);
+	return err;
+}
+
+/* @brief: stop the purges and release the trash of the mount */
+void bkpfs_trash_put_sb(struct super_block *sb)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+
+	if (sbi->trash_root.dentry) {
+		cancel_delayed_work_sync(&sbi->trash_work);
+		path_put(&sbi->trash_root);
+	}
+	if (sbi->trash_cred)
+		put_cred(sbi->trash_cred);
+}
@@ -0,0 +1,753 @@
+/*
+ * Copyright (c) 1998-2017 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2017 Stony Brook University
+ * Copyright (c) 2003-2017 The Research Foundation of SUNY
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/*
+ * Undo record backup format (bkp_format=undo).
+ *
+ * Instead of copying the whole file for every version, each write saves
+ * only the bytes it is about to overwrite (the pre-image) together with
+ * the file size before the write.  The records are appended to the slot
+ * file of the version that is being built, i.e. .bkp_<name>.<cur_ver>.
+ * When a write crosses bkp_threshold the slot is sealed by bumping cur_ver
+ * and the file content at that point becomes the new version.
+ *
+ * Version N is rebuilt by taking the current file and rolling back the
+ * records of slots cur_ver, cur_ver - 1, ..., N + 1 (newest record first).
+ *
+ * Stores through a shared mapping are seen by page_mkwrite only, under
+ * mmap_sem where the slot can't be written to.  The page is copied there
+ * and kept on a per-inode list; the list is written to the slot before the
+ * next record logged for the file, when the slot is sealed or read, or by
+ * a worker once BKPFS_UNDO_MAX_PENDING pages are waiting.
+ */
+
+#include "bkpfs.h"
+
+#define BKPFS_UNDO_MAGIC	0x55504b42	/* "BKPU" */
+#define BKPFS_UNDO_MAX_PENDING	256		/* saved pages kept in memory */
+
+/* one undo record, followed by len bytes of pre-image data */
+struct bkpfs_undo_rec {
+	u32 magic;
+	u32 flags;
+	u64 old_size;	/* file size before the write */
+	u64 offset;	/* start of the overwritten range */
+	u64 len;	/* bytes of pre-image following the record */
+};
+
+/* pre-image of a page saved by page_mkwrite, not in the slot yet */
+struct bkpfs_undo_page {
+	struct list_head list;
+	struct bkpfs_undo_rec rec;
+	struct page *page;
+};
+
+/* in-memory copy of a record along with the position of its data */
+struct bkpfs_undo_ent {
+	struct bkpfs_undo_rec rec;
+	loff_t data;
+};
+
+/* open the lower user file for reading the current content */
+static struct file *bkpfs_undo_open_lower(struct dentry *dentry, int flags)
+{
+	struct path lower_path;
+	struct file *lower_file;
+
+	bkpfs_get_lower_path(dentry, &lower_path);
+	lower_file = dentry_open(&lower_path, flags | O_LARGEFILE,
+				 current_cred());
+	bkpfs_put_lower_path(dentry, &lower_path);
+	return lower_file;
+}
+
+/* free a list of saved pages */
+static void bkpfs_undo_free_pages(struct list_head *pages)
+{
+	struct bkpfs_undo_page *up, *tmp;
+
+	list_for_each_entry_safe(up, tmp, pages, list) {
+		list_del(&up->list);
+		__free_page(up->page);
+		kfree(up);
+	}
+}
+
+/* write the pages saved by page_mkwrite to the open slot, the caller holds
+ * the upper inode lock.
+ */
+static int __bkpfs_undo_flush(struct dentry *dentry)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(d_inode(dentry));
+	struct bkpfs_undo_page *up;
+	struct bkpfs_xattr_info xattr;
+	struct file *slot_file;
+	LIST_HEAD(pages);
+	loff_t outpos, recpos;
+	ssize_t res = 0;
+	void *data;
+	int err = 0;
+
+	spin_lock(&info->undo_lock);
+	list_splice_init(&info->undo_pages, &pages);
+	info->undo_nr_pages = 0;
+	spin_unlock(&info->undo_lock);
+	if (list_empty(&pages))
+		return 0;
+
+	/* not a versioned file (anymore) */
+	if (bkpfs_get_xattr_info(dentry, &xattr) < 0)
+		goto out;
+
+	slot_file = bkpfs_open_version(dentry, xattr.cur_ver, O_WRONLY | O_CREAT);
+	if (IS_ERR(slot_file)) {
+		printk(KERN_INFO "ERROR::Failed to open undo slot %d\n",
+		       xattr.cur_ver);
+		err = PTR_ERR(slot_file);
+		goto out;
+	}
+
+	list_for_each_entry(up, &pages, list) {
+		recpos = outpos = i_size_read(file_inode(slot_file));
+		res = kernel_write(slot_file, &up->rec, sizeof(up->rec), &outpos);
+		if (res != sizeof(up->rec))
+			goto fail;
+		data = kmap(up->page);
+		res = kernel_write(slot_file, data, up->rec.len, &outpos);
+		kunmap(up->page);
+		if (res != up->rec.len)
+			goto fail;
+	}
+	goto out_put;
+
+fail:
+	printk(KERN_INFO "ERROR:: Failed saving mapped pre-image\n");
+	err = res < 0 ? res : -EIO;
+	/* drop the partial record so the slot stays parsable */
+	vfs_truncate(&slot_file->f_path, recpos);
+out_put:
+	fput(slot_file);
+out:
+	bkpfs_undo_free_pages(&pages);
+	return err;
+}
+
+/* @brief: write the pages saved by page_mkwrite to the open slot */
+int bkpfs_undo_flush(struct dentry *dentry)
+{
+	struct inode *inode = d_inode(dentry);
+	int err;
+
+	inode_lock(inode);
+	err = __bkpfs_undo_flush(dentry);
+	inode_unlock(inode);
+	return err;
+}
+
+/* worker writing out the saved pages once too many are waiting */
+static void bkpfs_undo_work(struct work_struct *work)
+{
+	struct bkpfs_inode_info *info;
+	struct inode *inode;
+	struct dentry *dentry;
+	const struct cred *cred, *old_cred;
+	int err;
+
+	info = container_of(work, struct bkpfs_inode_info, undo_work);
+	inode = &info->vfs_inode;
+
+	spin_lock(&info->undo_lock);
+	cred = info->undo_cred;
+	dentry = info->undo_dentry;
+	info->undo_cred = NULL;
+	info->undo_dentry = NULL;
+	spin_unlock(&info->undo_lock);
+	if (!cred)
+		goto out;
+
+	old_cred = override_creds(cred);
+	err = bkpfs_undo_flush(dentry);
+	revert_creds(old_cred);
+	if (err < 0)
+		printk(KERN_INFO "ERROR:: flushing undo pages of %s failed, err=%d\n",
+		       dentry->d_name.name, err);
+	dput(dentry);
+	put_cred(cred);
+out:
+	iput(inode);
+}
+
+/* @brief: set up the saved page list of inode, called from alloc_inode */
+void bkpfs_undo_init(struct inode *inode)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(inode);
+
+	spin_lock_init(&info->undo_lock);
+	INIT_LIST_HEAD(&info->undo_pages);
+	info->undo_nr_pages = 0;
+	info->undo_cred = NULL;
+	info->undo_dentry = NULL;
+	INIT_WORK(&info->undo_work, bkpfs_undo_work);
+}
+
+/* @brief: save the pre-image of [pos, pos + len) of page, which a store
+ *         through a shared mapping of file is about to change.
+ *         Called from page_mkwrite.
+ */
+int bkpfs_undo_save_page(struct file *file, struct page *page, loff_t pos,
+			 size_t len)
+{
+	struct inode *inode = file_inode(file);
+	struct bkpfs_inode_info *info = BKPFS_I(inode);
+	struct bkpfs_undo_page *up;
+	const struct cred *cred = NULL;
+	struct dentry *dentry = NULL;
+	int queue;
+
+	up = kmalloc(sizeof(*up), GFP_NOFS);
+	if (!up)
+		return -ENOMEM;
+	up->page = alloc_page(GFP_NOFS);
+	if (!up->page) {
+		kfree(up);
+		return -ENOMEM;
+	}
+	copy_highpage(up->page, page);
+	up->rec.magic = BKPFS_UNDO_MAGIC;
+	up->rec.flags = 0;
+	up->rec.old_size = i_size_read(bkpfs_lower_inode(inode));
+	up->rec.offset = pos;
+	up->rec.len = len;
+
+	/* the worker writes them out under the name mapped, which it pins */
+	if (info->undo_nr_pages >= BKPFS_UNDO_MAX_PENDING) {
+		cred = get_current_cred();
+		dentry = dget(file->f_path.dentry);
+	}
+
+	spin_lock(&info->undo_lock);
+	list_add_tail(&up->list, &info->undo_pages);
+	queue = ++info->undo_nr_pages > BKPFS_UNDO_MAX_PENDING && cred;
+	if (queue) {
+		swap(info->undo_cred, cred);
+		swap(info->undo_dentry, dentry);
+	}
+	spin_unlock(&info->undo_lock);
+	if (cred)
+		put_cred(cred);
+	dput(dentry);
+
+	if (queue) {
+		ihold(inode);
+		if (!queue_work(BKPFS_SB(inode->i_sb)->bkp_wq, &info->undo_work))
+			iput(inode);
+	}
+	return 0;
+}
+
+/* @brief: drop the saved pages left when the inode goes away */
+void bkpfs_undo_forget(struct inode *inode)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(inode);
+
+	bkpfs_undo_free_pages(&info->undo_pages);
+	info->undo_nr_pages = 0;
+	if (info->undo_cred)
+		put_cred(info->undo_cred);
+	info->undo_cred = NULL;
+}
+
+/* @brief: append the pre-image of [pos, pos + count) and the current size
+ *         of the user file to the undo slot file.
+ *         Caller must hold the upper inode lock so that no other write can
+ *         change the range between saving it and overwriting it.
+ */
+int bkpfs_undo_log(struct dentry *dentry, int slot, loff_t pos, size_t count)
+{
+	int err = 0;
+	ssize_t res;
+	struct file *lower_file, *slot_file;
+	struct bkpfs_undo_rec rec;
+	loff_t outpos, recpos;
+
+	/* stores through a mapping came before this write */
+	err = __bkpfs_undo_flush(dentry);
+	if (err < 0)
+		return err;
+
+	lower_file = bkpfs_undo_open_lower(dentry, O_RDONLY);
+	if (IS_ERR(lower_file))
+		return PTR_ERR(lower_file);
+
+	slot_file = bkpfs_open_version(dentry, slot, O_WRONLY | O_CREAT);
+	if (IS_ERR(slot_file)) {
+		printk(KERN_INFO "ERROR::Failed to open undo slot %d\n", slot);
+		err = PTR_ERR(slot_file);
+		goto out;
+	}
+
+	rec.magic = BKPFS_UNDO_MAGIC;
+	rec.flags = 0;
+	rec.old_size = i_size_read(file_inode(lower_file));
+	rec.offset = pos;
+	rec.len = 0;
+	if (pos < rec.old_size)
+		rec.len = min_t(u64, count, rec.old_size - pos);
+
+	recpos = outpos = i_size_read(file_inode(slot_file));
+	res = kernel_write(slot_file, &rec, sizeof(rec), &outpos);
+	if (res != sizeof(rec)) {
+		err = res < 0 ? res : -EIO;
+		goto out_put;
+	}
+
+	if (rec.len) {
+		res = bkpfs_copy_range(dentry->d_sb, lower_file, pos, slot_file,
+				       outpos, rec.len);
+		if (res != rec.len) {
+			printk(KERN_INFO "ERROR:: Failed saving pre-image\n");
+			err = res < 0 ? res : -EIO;
+			/* drop the partial record so the slot stays parsable */
+			vfs_truncate(&slot_file->f_path, recpos);
+		}
+	}
+
+out_put:
+	fput(slot_file);
+out:
+	fput(lower_file);
+	return err;
+}
+
+/* @brief: log the pre-image of a write and do it.  Sealing the open slot
+ *         as a version is left to the caller, once the bytes written are
+ *         known.
+ */
+ssize_t bkpfs_undo_write(struct file *file, const char __user *buf,
+			 size_t count, loff_t *ppos)
+{
+	int err = 0, versioned;
+	ssize_t bytes_written = 0;
+	struct dentry *dentry = file->f_path.dentry;
+	struct inode *inode = d_inode(dentry);
+	struct file *lower_file = bkpfs_lower_file(file);
+	struct bkpfs_xattr_info xattr;
+	loff_t pos;
+
+	inode_lock(inode);
+
+	/* files without version info are written through untouched */
+	versioned = bkpfs_get_xattr_info(dentry, &xattr) >= 0;
+
+	pos = *ppos;
+	if (file->f_flags & O_APPEND)
+		pos = i_size_read(file_inode(lower_file));
+
+	if (versioned) {
+		err = bkpfs_undo_log(dentry, xattr.cur_ver, pos, count);
+		if (err < 0)
+			goto out;
+	}
+
+	bytes_written = vfs_write(lower_file, buf, count, ppos);
+	if (bytes_written < 0) {
+		err = bytes_written;
+		goto out;
+	}
+	fsstack_copy_inode_size(inode, file_inode(lower_file));
+	fsstack_copy_attr_times(inode, file_inode(lower_file));
+
+out:
+	inode_unlock(inode);
+	if (err < 0)
+		return err;
+	return bytes_written;
+}
+
+/* @brief: log the pre-image of a write of count bytes at pos made through
+ *         write_iter. The caller holds the upper inode lock over the write.
+ */
+int bkpfs_undo_prepare(struct dentry *dentry, loff_t pos, size_t count)
+{
+	struct bkpfs_xattr_info xattr;
+
+	/* files without version info are written through untouched */
+	if (bkpfs_get_xattr_info(dentry, &xattr) < 0)
+		return 0;
+	return bkpfs_undo_log(dentry, xattr.cur_ver, pos, count);
+}
+
+/* @brief: seal the open slot as a new version, used when versions are
+ *         taken on close or fsync instead of on the write itself.
+ *         The inode lock is only held over the flush: the xattr update
+ *         takes it again and dropping the oldest slot locks the parent.
+ */
+int bkpfs_undo_seal(struct dentry *dentry, unsigned int maxvers)
+{
+	int err;
+	struct inode *inode = d_inode(dentry);
+	struct bkpfs_inode_info *info = BKPFS_I(inode);
+	struct bkpfs_xattr_info xattr;
+
+	mutex_lock(&info->bkp_meta_lock);
+	inode_lock(inode);
+	/* stores through a mapping from now on go to the next slot */
+	bkpfs_mmap_rearm(inode);
+	err = __bkpfs_undo_flush(dentry);
+	inode_unlock(inode);
+	if (err < 0)
+		goto out;
+	err = bkpfs_get_xattr_info(dentry, &xattr);
+	if (err < 0)
+		err = 0;	/* not a versioned file */
+	else
+		err = bkpfs_update_after_write(dentry, &xattr, maxvers);
+out:
+	mutex_unlock(&info->bkp_meta_lock);
+	return err;
+}
+
+/* @brief: log the tail cut off by a truncate (or the old size for an
+ *         extending truncate) into the open undo slot.
+ *         Called from ->setattr with the upper inode lock held.
+ */
+int bkpfs_undo_truncate(struct dentry *dentry, loff_t new_size)
+{
+	int err;
+	loff_t old_size;
+	struct bkpfs_xattr_info xattr;
+	struct inode *inode = d_inode(dentry);
+
+	if (BKPFS_SB(dentry->d_sb)->mnt_opts.bkp_format != BKP_FORMAT_UNDO ||
+	    !S_ISREG(inode->i_mode))
+		return 0;
+
+	old_size = i_size_read(bkpfs_lower_inode(inode));
+	if (old_size == new_size)
+		return 0;
+
+	err = bkpfs_get_xattr_info(dentry, &xattr);
+	if (err < 0)
+		return 0;	/* not a versioned file */
+
+	return bkpfs_undo_log(dentry, xattr.cur_ver, new_size,
+			      old_size > new_size ? old_size - new_size : 0);
+}
+
+/* read all record headers of a slot file into an array */
+static int bkpfs_undo_scan(struct file *slot_file, struct bkpfs_undo_ent **ents)
+{
+	int nr = 0, max = 0;
+	ssize_t res;
+	loff_t off = 0, rpos;
+	loff_t end = i_size_read(file_inode(slot_file));
+	struct bkpfs_undo_ent *tmp, *arr = NULL;
+
+	while (off + (loff_t)sizeof(struct bkpfs_undo_rec) <= end) {
+		if (nr == max) {
+			max = max ? max * 2 : 16;
+			tmp = krealloc(arr, max * sizeof(*arr), GFP_KERNEL);
+			if (!tmp) {
+				kfree(arr);
+				return -ENOMEM;
+			}
+			arr = tmp;
+		}
+
+		rpos = off;
+		res = kernel_read(slot_file, &arr[nr].rec, sizeof(arr[nr].rec),
+				  &rpos);
+		if (res != sizeof(arr[nr].rec) ||
+		    arr[nr].rec.magic != BKPFS_UNDO_MAGIC) {
+			printk(KERN_INFO "ERROR::corrupt undo record at %lld\n",
+			       off);
+			kfree(arr);
+			return -EIO;
+		}
+		arr[nr].data = off + sizeof(arr[nr].rec);
+		off = arr[nr].data + arr[nr].rec.len;
+		nr++;
+	}
+
+	*ents = arr;
+	return nr;
+}
+
+/* roll back one slot file on top of the window buf = [pos, pos + len) */
+static int bkpfs_undo_apply(struct file *slot_file, char *buf, size_t len,
+			    loff_t pos, loff_t *size)
+{
+	int nr, i;
+	ssize_t res;
+	loff_t start, stop, rpos;
+	struct bkpfs_undo_ent *ents = NULL;
+
+	nr = bkpfs_undo_scan(slot_file, &ents);
+	if (nr < 0)
+		return nr;
+
+	for (i = nr - 1; i >= 0; i--) {
+		*size = ents[i].rec.old_size;
+
+		start = max_t(loff_t, pos, ents[i].rec.offset);
+		stop = min_t(loff_t, pos + len,
+			     ents[i].rec.offset + ents[i].rec.len);
+		if (start >= stop)
+			continue;
+
+		rpos = ents[i].data + (start - ents[i].rec.offset);
+		res = kernel_read(slot_file, buf + (start - pos), stop - start,
+				  &rpos);
+		if (res != stop - start) {
+			kfree(ents);
+			return res < 0 ? res : -EIO;
+		}
+	}
+
+	kfree(ents);
+	return 0;
+}
+
+/* @brief: rebuild [pos, pos + len) of version ver into buf.
+ * Return: number of bytes of the version inside the window, or -errno
+ */
+ssize_t bkpfs_undo_read(struct dentry *dentry, int ver, int cur_ver,
+			void *buf, size_t len, loff_t pos)
+{
+	int err = 0, slot;
+	ssize_t res;
+	loff_t size, rpos = pos;
+	struct file *lower_file, *slot_file;
+
+	lower_file = bkpfs_undo_open_lower(dentry, O_RDONLY);
+	if (IS_ERR(lower_file))
+		return PTR_ERR(lower_file);
+
+	memset(buf, 0, len);
+	size = i_size_read(file_inode(lower_file));
+	res = kernel_read(lower_file, buf, len, &rpos);
+	fput(lower_file);
+	if (res < 0)
+		return res;
+
+	for (slot = cur_ver; slot > ver; slot--) {
+		slot_file = bkpfs_open_version(dentry, slot, O_RDONLY);
+		if (IS_ERR(slot_file)) {
+			if (PTR_ERR(slot_file) == -ENOENT)
+				continue;	/* nothing written in this slot */
+			return PTR_ERR(slot_file);
+		}
+		err = bkpfs_undo_apply(slot_file, buf, len, pos, &size);
+		fput(slot_file);
+		if (err < 0)
+			return err;
+	}
+
+	if (pos >= size)
+		return 0;
+	return min_t(loff_t, len, size - pos);
+}
+
+/* @brief: size of version ver, which is the old size saved by the first
+ *         record logged after it, or the current size if there is none.
+ */
+int bkpfs_undo_size(struct dentry *dentry, int ver, int cur_ver, loff_t *size)
+{
+	int slot;
+	ssize_t res;
+	loff_t rpos;
+	struct file *slot_file;
+	struct bkpfs_undo_rec rec;
+
+	for (slot = ver + 1; slot <= cur_ver; slot++) {
+		slot_file = bkpfs_open_version(dentry, slot, O_RDONLY);
+		if (IS_ERR(slot_file)) {
+			if (PTR_ERR(slot_file) == -ENOENT)
+				continue;
+			return PTR_ERR(slot_file);
+		}
+		rpos = 0;
+		res = kernel_read(slot_file, &rec, sizeof(rec), &rpos);
+		fput(slot_file);
+		if (res == 0)
+			continue;
+		if (res != sizeof(rec) || rec.magic != BKPFS_UNDO_MAGIC)
+			return -EIO;
+		*size = rec.old_size;
+		return 0;
+	}
+
+	*size = i_size_read(bkpfs_lower_inode(d_inode(dentry)));
+	return 0;
+}
+
+/* write the pre-images of the records of a slot file, newest first, back
+ * into the lower user file.  Records starting at limit or after are left
+ * alone.
+ */
+static int bkpfs_undo_rollback(struct file *slot_file, struct file *lower_file,
+			       char *buf, loff_t limit)
+{
+	int nr, i, err = 0;
+	ssize_t res;
+	loff_t done, chunk, rpos, wpos;
+	struct bkpfs_undo_ent *ents = NULL;
+
+	nr = bkpfs_undo_scan(slot_file, &ents);
+	if (nr < 0)
+		return nr;
+
+	for (i = nr - 1; i >= 0; i--) {
+		if (ents[i].data - (loff_t)sizeof(ents[i].rec) >= limit)
+			continue;
+		for (done = 0; done < ents[i].rec.len; done += chunk) {
+			chunk = min_t(loff_t, PAGE_SIZE,
+				      ents[i].rec.len - done);
+			rpos = ents[i].data + done;
+			res = kernel_read(slot_file, buf, chunk, &rpos);
+			if (res != chunk) {
+				err = res < 0 ? res : -EIO;
+				goto out;
+			}
+			wpos = ents[i].rec.offset + done;
+			res = kernel_write(lower_file, buf, chunk, &wpos);
+			if (res != chunk) {
+				err = res < 0 ? res : -EIO;
+				goto out;
+			}
+		}
+	}
+out:
+	kfree(ents);
+	return err;
+}
+
+/* @brief: roll the user file back to version ver in place.
+ *         The current content is logged into the open slot first, so the
+ *         restore itself can be undone and the other versions stay valid.
+ *         Each slot is read once, its records written straight back.
+ */
+int bkpfs_undo_restore(struct dentry *dentry, int ver, int cur_ver)
+{
+	int err, slot;
+	loff_t size, new_size, limit;
+	struct inode *inode = d_inode(dentry);
+	struct file *lower_file, *slot_file;
+	void *buf;
+
+	buf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	inode_lock(inode);
+
+	err = bkpfs_undo_size(dentry, ver, cur_ver, &new_size);
+	if (err < 0)
+		goto out;
+
+	/* what the open slot holds before the content of now is logged */
+	err = __bkpfs_undo_flush(dentry);
+	if (err < 0)
+		goto out;
+	limit = 0;
+	slot_file = bkpfs_open_version(dentry, cur_ver, O_RDONLY);
+	if (!IS_ERR(slot_file)) {
+		limit = i_size_read(file_inode(slot_file));
+		fput(slot_file);
+	} else if (PTR_ERR(slot_file) != -ENOENT) {
+		err = PTR_ERR(slot_file);
+		goto out;
+	}
+
+	size = i_size_read(bkpfs_lower_inode(inode));
+	err = bkpfs_undo_log(dentry, cur_ver, 0, size);
+	if (err < 0)
+		goto out;
+
+	lower_file = bkpfs_undo_open_lower(dentry, O_WRONLY);
+	if (IS_ERR(lower_file)) {
+		err = PTR_ERR(lower_file);
+		goto out;
+	}
+
+	for (slot = cur_ver; slot > ver; slot--) {
+		slot_file = bkpfs_open_version(dentry, slot, O_RDONLY);
+		if (IS_ERR(slot_file)) {
+			if (PTR_ERR(slot_file) == -ENOENT)
+				continue;	/* nothing written in this slot */
+			err = PTR_ERR(slot_file);
+			goto out_put;
+		}
+		err = bkpfs_undo_rollback(slot_file, lower_file, buf,
+					  slot == cur_ver ? limit : LLONG_MAX);
+		fput(slot_file);
+		if (err < 0)
+			goto out_put;
+	}
+
+	err = vfs_truncate(&lower_file->f_path, new_size);
+	if (!err) {
+		fsstack_copy_inode_size(inode, bkpfs_lower_inode(inode));
+		fsstack_copy_attr_all(inode, bkpfs_lower_inode(inode));
+	}
+
+out_put:
+	fput(lower_file);
+out:
+	inode_unlock(inode);
+	kfree(buf);
+	return err;
+}
+
+/* @brief: drop the newest version.  Its records are still needed to reach
+ *         the older versions, so the open slot is merged into it and it
+ *         becomes the open slot itself.
+ */
+int bkpfs_undo_drop_newest(struct inode *dir, struct dentry *dentry,
+			   int newest, int pending)
+{
+	int err = 0;
+	ssize_t res;
+	loff_t outpos, size;
+	struct file *pending_file, *newest_file;
+
+	pending_file = bkpfs_open_version(dentry, pending, O_RDONLY);
+	if (IS_ERR(pending_file)) {
+		if (PTR_ERR(pending_file) == -ENOENT)
+			return 0;
+		return PTR_ERR(pending_file);
+	}
+
+	newest_file = bkpfs_open_version(dentry, newest, O_WRONLY | O_CREAT);
+	if (IS_ERR(newest_file)) {
+		err = PTR_ERR(newest_file);
+		goto out;
+	}
+
+	size = i_size_read(file_inode(pending_file));
+	outpos = i_size_read(file_inode(newest_file));
+	if (size) {
+		res = bkpfs_copy_range(dentry->d_sb, pending_file, 0,
+				       newest_file, outpos, size);
+		if (res != size)
+			err = res < 0 ? res : -EIO;
+	}
+	fput(newest_file);
+	if (err)
+		goto out;
+
+	fput(pending_file);
+	return delete_backup_file(dir, dentry, pending);
+
+out:
+	fput(pending_file);
+	return err;
+}
@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/aio_abi.h>
+
+/* Writes a string into a file through the paths write() does not take,
+ * for the test scripts: writev() and AIO go through ->write_iter, mmap
+ * stores through ->page_mkwrite.
+ */
+
+void print_help()
+{
+	printf("Usage: \n");
+	printf("./iowriter <filename> writev|aio|mmap <offset> <string>\n");
+	printf("e.g. ./iowriter hello.txt aio 0 hello\n");
+}
+
+/* write str at off with two iovecs, to go through ->write_iter */
+int do_writev(int fd, off_t off, char *str)
+{
+	struct iovec iov[2];
+	size_t len = strlen(str);
+
+	iov[0].iov_base = str;
+	iov[0].iov_len = len / 2;
+	iov[1].iov_base = str + len / 2;
+	iov[1].iov_len = len - len / 2;
+	if (pwritev(fd, iov, 2, off) != len) {
+		perror("pwritev failed");
+		return 1;
+	}
+	return 0;
+}
+
+/* write str at off with one AIO request and reap its completion */
+int do_aio(int fd, off_t off, char *str)
+{
+	aio_context_t ctx = 0;
+	struct iocb cb, *cbs[1];
+	struct io_event ev;
+	int rc = 1;
+
+	if (syscall(__NR_io_setup, 1, &ctx) < 0) {
+		perror("io_setup failed");
+		return 1;
+	}
+	memset(&cb, 0, sizeof(cb));
+	cb.aio_lio_opcode = IOCB_CMD_PWRITE;
+	cb.aio_fildes = fd;
+	cb.aio_buf = (unsigned long)str;
+	cb.aio_nbytes = strlen(str);
+	cb.aio_offset = off;
+	cbs[0] = &cb;
+	if (syscall(__NR_io_submit, ctx, 1, cbs) != 1) {
+		perror("io_submit failed");
+		goto out;
+	}
+	if (syscall(__NR_io_getevents, ctx, 1, 1, &ev, NULL) != 1) {
+		perror("io_getevents failed");
+		goto out;
+	}
+	if (ev.res != strlen(str)) {
+		printf("aio write returned %lld\n", (long long)ev.res);
+		goto out;
+	}
+	rc = 0;
+out:
+	syscall(__NR_io_destroy, ctx);
+	return rc;
+}
+
+/* store str at off through a shared mapping, msync it and unmap */
+int do_mmap(int fd, off_t off, char *str)
+{
+	size_t len = strlen(str);
+	off_t start = off & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+	size_t maplen = off - start + len;
+	char *addr;
+	int rc = 0;
+
+	if (lseek(fd, 0, SEEK_END) < off + (off_t)len &&
+	    ftruncate(fd, off + len) < 0) {
+		perror("ftruncate failed");
+		return 1;
+	}
+	addr = mmap(NULL, maplen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, start);
+	if (addr == MAP_FAILED) {
+		perror("mmap failed");
+		return 1;
+	}
+	memcpy(addr + (off - start), str, len);
+	if (msync(addr, maplen, MS_SYNC) < 0) {
+		perror("msync failed");
+		rc = 1;
+	}
+	munmap(addr, maplen);
+	return rc;
+}
+
+int main(int argc, char *argv[])
+{
+	int fd, rc;
+	off_t off;
+
+	if (argc != 5) {
+		print_help();
+		return 1;
+	}
+	off = atoll(argv[3]);
+	fd = open(argv[1], O_CREAT | O_RDWR, 0644);
+	if (fd < 0) {
+		perror("open failed");
+		return 1;
+	}
+	if (!strcmp(argv[2], "writev")) {
+		rc = do_writev(fd, off, argv[4]);
+	} else if (!strcmp(argv[2], "aio")) {
+		rc = do_aio(fd, off, argv[4]);
+	} else if (!strcmp(argv[2], "mmap")) {
+		rc = do_mmap(fd, off, argv[4]);
+	} else {
+		print_help();
+		rc = 1;
+	}
+	close(fd);
+	return rc;
+}
@@ -16,6 +16,8 @@
 #define IOCTL_DELETE_VERS 		_IOW  (MAJOR_NUM, 4, long)
 #define IOCTL_VIEW_VERS 		_IOWR (MAJOR_NUM, 5, long)
 #define IOCTL_GET_FILE_SIZE		_IOWR (MAJOR_NUM, 6, long)
+#define IOCTL_GET_STATS			_IOR  (MAJOR_NUM, 7, long)
+#define IOCTL_UNDELETE			_IOW  (MAJOR_NUM, 8, long)
 
 struct ioctl_args
 {
@@ -38,6 +40,36 @@ struct restore_args {
 	int version;
 };
 
+/* IOCTL_UNDELETE, on the directory the file was unlinked from */
+struct undelete_args {
+	char name[256];				// name of the file in the directory
+};
+
+/* backup counters of a mount, returned by IOCTL_GET_STATS in the buffer of
+ * struct ioctl_args.  Counters are only added at the end: the kernel copies
+ * min(buff_size, sizeof(struct bkpfs_stats)) bytes and returns that size,
+ * buff_size must hold at least the first BKPFS_STATS_MIN_SIZE bytes.
+ */
+#define BKPFS_STATS_MIN_SIZE	(3 * sizeof(unsigned long long))
+
+struct bkpfs_stats {
+	unsigned long long inline_bkps;		// backups taken inside write()
+	unsigned long long deferred_bkps;	// backups handed to the backup workqueue
+	unsigned long long bkp_rate;		// recent backup throughput in bytes/sec
+	unsigned long long nocache_bytes;	// backup bytes kept out of the page cache
+	unsigned long long unchanged_bkps;	// backups skipped, same as the newest version
+	unsigned long long chunk_bytes;		// version bytes cut into chunks
+	unsigned long long chunk_new_bytes;	// of which stored as new chunks
+	unsigned long long dedup_bkps;		// versions linked to an identical backup
+	unsigned long long zip_raw_bytes;	// version bytes compressed
+	unsigned long long zip_stored_bytes;	// what they were stored in
+	unsigned long long pack_bkps;		// small versions appended to a pack file
+	unsigned long long pack_inline_bkps;	// tiny versions kept in an attribute
+	unsigned long long saved_bkps;		// replaced files kept as versions by a rename
+	unsigned long long trash_files;		// unlinked files moved to the trash
+	unsigned long long trash_purged;	// of which purged since
+};
+
 /*
  * The name of the device file 
  */
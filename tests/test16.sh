@@ -0,0 +1,57 @@
+#!/bin/sh
+# test 16 : view and restore of versions kept as undo records
+# args : file to be operated on (only checked, the test mounts its own bkpfs)
+
+echo "######### test 16 : view and restore with bkp_format=undo ###########"
+# get the file to be operated on
+file=$1
+if [ -z $file ]; then
+    echo "Missing argument: user file path"
+	exit 1
+fi
+
+lower=/test/dir16
+mnt=/mnt/bkpfs16
+myfile=$mnt/myfile.txt
+mkdir -p $lower $mnt
+
+mount -t bkpfs -o maxvers=3,bkp_threshold=8,bkp_format=undo $lower $mnt
+retval=$?
+if [ $retval -ne 0 ] ; then
+	echo "FAILED: mount with bkp_format=undo failed with error: $retval"
+	exit 1
+fi
+/bin/rm -f $myfile
+
+ver1_str="hello world..this is some random data for version 1"
+ver2_str="hello world..this is some random data for version 2"
+ver3_str="hello world..this is some random data for version 3"
+
+# every write saves what it overwrites, the versions are rolled back
+echo $ver1_str > $myfile
+echo $ver2_str > $myfile
+echo $ver3_str > $myfile
+
+# version 2 is rebuilt from the newest records only
+../bkpctl $myfile -v 2 > test16.out
+retval=$?
+echo "return value for view op=$retval"
+
+# restore goes through every slot down to version 1
+../bkpctl $myfile -r 1
+retval=$?
+echo "return value for restore op=$retval"
+cp $myfile test16_restored.out
+
+/bin/rm -f $myfile
+umount $mnt
+
+echo $ver2_str > test16.ref
+echo $ver1_str > test16_restored.ref
+if cmp test16.ref test16.out && cmp test16_restored.ref test16_restored.out ; then
+	echo "PASSED: undo versions match the writes"
+	exit 0
+else
+	echo "FAILED: undo versions differ from the writes"
+	exit 1
+fi
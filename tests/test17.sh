@@ -0,0 +1,48 @@
+#!/bin/sh
+# test 17 : view and restore of versions of a big file (clone or copy_file_range backups)
+# args : file to be operated on (only checked, the test mounts its own bkpfs)
+
+echo "######### test 17 : backups of a big file ###########"
+# get the file to be operated on
+file=$1
+if [ -z $file ]; then
+    echo "Missing argument: user file path"
+	exit 1
+fi
+
+lower=/test/dir17
+mnt=/mnt/bkpfs17
+myfile=$mnt/myfile.txt
+mkdir -p $lower $mnt
+
+mount -t bkpfs -o maxvers=3,bkp_threshold=8 $lower $mnt
+retval=$?
+if [ $retval -ne 0 ] ; then
+	echo "FAILED: mount failed with error: $retval"
+	exit 1
+fi
+/bin/rm -f $myfile
+
+# each version is a clone of the file where the lower fs shares extents, a copy_file_range copy otherwise
+dd if=/dev/urandom of=test17.ref bs=8M count=1 iflag=fullblock 2>/dev/null
+dd if=/dev/urandom of=test17_new.ref bs=8M count=1 iflag=fullblock 2>/dev/null
+dd if=test17.ref of=$myfile bs=8M count=1 2>/dev/null
+dd if=test17_new.ref of=$myfile bs=8M count=1 conv=notrunc 2>/dev/null
+
+../bkpctl $myfile -v oldest > test17.out
+../bkpctl $myfile -v newest > test17_new.out
+../bkpctl $myfile -r 1
+retval=$?
+echo "return value for restore op=$retval"
+cp $myfile test17_restored.out
+
+/bin/rm -f $myfile
+umount $mnt
+
+if cmp test17.ref test17.out && cmp test17_new.ref test17_new.out && cmp test17.ref test17_restored.out ; then
+	echo "PASSED: versions of a big file match the writes"
+	exit 0
+else
+	echo "FAILED: versions of a big file differ from the writes"
+	exit 1
+fi
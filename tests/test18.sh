@@ -0,0 +1,59 @@
+#!/bin/sh
+# test 18 : versions taken by the backup workqueue with bkp_mode=async
+# args : file to be operated on (only checked, the test mounts its own bkpfs)
+
+echo "######### test 18 : versions taken with bkp_mode=async ###########"
+# get the file to be operated on
+file=$1
+if [ -z $file ]; then
+    echo "Missing argument: user file path"
+	exit 1
+fi
+
+lower=/test/dir18
+mnt=/mnt/bkpfs18
+myfile=$mnt/myfile.txt
+mkdir -p $lower $mnt
+
+# undo records can't be queued, the mount must refuse them
+if mount -t bkpfs -o maxvers=3,bkp_threshold=8,bkp_mode=async,bkp_format=undo $lower $mnt 2>/dev/null ; then
+	umount $mnt
+	echo "FAILED: bkp_mode=async mounted with bkp_format=undo"
+	exit 1
+fi
+
+mount -t bkpfs -o maxvers=3,bkp_threshold=8,bkp_mode=async $lower $mnt
+retval=$?
+if [ $retval -ne 0 ] ; then
+	echo "FAILED: mount with bkp_mode=async failed with error: $retval"
+	exit 1
+fi
+/bin/rm -f $myfile
+
+ver1_str="hello world..this is some random data for version 1"
+ver2_str="hello world..this is some random data for version 2"
+ver3_str="hello world..this is some random data for version 3"
+
+# bkpctl waits for the queued backup, so each write gets its version
+echo $ver1_str > $myfile
+../bkpctl $myfile -l
+echo $ver2_str > $myfile
+../bkpctl $myfile -l
+echo $ver3_str > $myfile
+../bkpctl $myfile -v newest > test18.out
+retval=$?
+echo "return value for view op=$retval"
+
+../bkpctl $myfile -v oldest > test18_old.out
+/bin/rm -f $myfile
+umount $mnt
+
+echo $ver3_str > test18.ref
+echo $ver1_str > test18_old.ref
+if cmp test18.ref test18.out && cmp test18_old.ref test18_old.out ; then
+	echo "PASSED: queued versions match the writes"
+	exit 0
+else
+	echo "FAILED: queued versions differ from the writes"
+	exit 1
+fi
@@ -0,0 +1,57 @@
+#!/bin/sh
+# test 19 : one version per close with bkp_trigger=close
+# args : file to be operated on (only checked, the test mounts its own bkpfs)
+
+echo "######### test 19 : one version per close with bkp_trigger=close ###########"
+# get the file to be operated on
+file=$1
+if [ -z $file ]; then
+    echo "Missing argument: user file path"
+	exit 1
+fi
+
+lower=/test/dir19
+mnt=/mnt/bkpfs19
+myfile=$mnt/myfile.txt
+mkdir -p $lower $mnt
+
+mount -t bkpfs -o maxvers=3,bkp_threshold=8,bkp_trigger=close $lower $mnt
+retval=$?
+if [ $retval -ne 0 ] ; then
+	echo "FAILED: mount with bkp_trigger=close failed with error: $retval"
+	exit 1
+fi
+/bin/rm -f $myfile
+
+ver1_str="hello world..this is some random data for version 1"
+ver2_str="hello world..this is some random data for version 2"
+ver3_str="hello world..this is some random data for version 3"
+
+# three writes through one open file make a single version
+exec 3> $myfile
+echo $ver1_str >&3
+echo $ver2_str >&3
+echo $ver3_str >&3
+exec 3>&-
+
+# and a second open, write and close makes another one
+echo $ver1_str > $myfile
+
+../bkpctl $myfile -l
+retval=$?
+echo "num versions=$retval"
+../bkpctl $myfile -v oldest > test19.out
+
+/bin/rm -f $myfile
+umount $mnt
+
+echo $ver1_str > test19.ref
+echo $ver2_str >> test19.ref
+echo $ver3_str >> test19.ref
+if [ $retval -eq 2 ] && cmp test19.ref test19.out ; then
+	echo "PASSED: one version per close"
+	exit 0
+else
+	echo "FAILED: versions not taken per close"
+	exit 1
+fi
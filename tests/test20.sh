@@ -0,0 +1,74 @@
+#!/bin/sh
+# test 20 : undo versions sealed on close and on fsync (bkp_format=undo with bkp_trigger)
+# args : file to be operated on (only checked, the test mounts its own bkpfs)
+
+echo "######### test 20 : undo seals with bkp_trigger=close and fsync ###########"
+# get the file to be operated on
+file=$1
+if [ -z $file ]; then
+    echo "Missing argument: user file path"
+	exit 1
+fi
+
+lower=/test/dir20
+mnt=/mnt/bkpfs20
+myfile=$mnt/myfile.txt
+mkdir -p $lower $mnt
+
+mount -t bkpfs -o maxvers=3,bkp_threshold=8,bkp_format=undo,bkp_trigger=close $lower $mnt
+retval=$?
+if [ $retval -ne 0 ] ; then
+	echo "FAILED: mount with bkp_format=undo,bkp_trigger=close failed with error: $retval"
+	exit 1
+fi
+/bin/rm -f $myfile
+
+ver1_str="hello world..this is some random data for version 1"
+ver2_str="hello world..this is some random data for version 2"
+ver3_str="hello world..this is some random data for version 3"
+
+# the records of both writes go to one slot, sealed by the close
+exec 3> $myfile
+echo $ver1_str >&3
+echo $ver2_str >&3
+exec 3>&-
+echo $ver3_str > $myfile
+
+../bkpctl $myfile -l
+close_vers=$?
+echo "num versions on close=$close_vers"
+../bkpctl $myfile -v oldest > test20_close.out
+
+/bin/rm -f $myfile
+umount $mnt
+
+mount -t bkpfs -o maxvers=3,bkp_threshold=8,bkp_format=undo,bkp_trigger=fsync $lower $mnt
+retval=$?
+if [ $retval -ne 0 ] ; then
+	echo "FAILED: mount with bkp_format=undo,bkp_trigger=fsync failed with error: $retval"
+	exit 1
+fi
+/bin/rm -f $myfile
+
+# dd fsyncs before it exits and seals the slot, the plain write after it does not
+echo $ver1_str | dd of=$myfile conv=fsync 2>/dev/null
+echo $ver2_str > $myfile
+
+../bkpctl $myfile -l
+fsync_vers=$?
+echo "num versions on fsync=$fsync_vers"
+../bkpctl $myfile -v oldest > test20_fsync.out
+
+/bin/rm -f $myfile
+umount $mnt
+
+echo $ver1_str > test20_close.ref
+echo $ver2_str >> test20_close.ref
+echo $ver1_str > test20_fsync.ref
+if [ $close_vers -eq 2 ] && [ $fsync_vers -eq 1 ] && cmp test20_close.ref test20_close.out && cmp test20_fsync.ref test20_fsync.out ; then
+	echo "PASSED: undo versions sealed on close and fsync"
+	exit 0
+else
+	echo "FAILED: undo versions not sealed on close or fsync"
+	exit 1
+fi
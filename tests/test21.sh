@@ -0,0 +1,60 @@
+#!/bin/sh
+# test 21 : a burst of writes makes a single version once the file is quiet (bkp_quiet_ms)
+# args : file to be operated on (only checked, the test mounts its own bkpfs)
+
+echo "######### test 21 : debounced versions with bkp_quiet_ms ###########"
+# get the file to be operated on
+file=$1
+if [ -z $file ]; then
+    echo "Missing argument: user file path"
+	exit 1
+fi
+
+lower=/test/dir21
+mnt=/mnt/bkpfs21
+myfile=$mnt/myfile.txt
+mkdir -p $lower $mnt
+
+# the quiet timer only debounces bkp_trigger=write
+if mount -t bkpfs -o maxvers=3,bkp_threshold=8,bkp_quiet_ms=200,bkp_trigger=close $lower $mnt 2>/dev/null ; then
+	umount $mnt
+	echo "FAILED: bkp_quiet_ms mounted with bkp_trigger=close"
+	exit 1
+fi
+
+mount -t bkpfs -o maxvers=3,bkp_threshold=8,bkp_quiet_ms=200 $lower $mnt
+retval=$?
+if [ $retval -ne 0 ] ; then
+	echo "FAILED: mount with bkp_quiet_ms failed with error: $retval"
+	exit 1
+fi
+/bin/rm -f $myfile
+
+ver1_str="hello world..this is some random data for version 1"
+ver2_str="hello world..this is some random data for version 2"
+ver3_str="hello world..this is some random data for version 3"
+
+# three writes within the quiet period, the version comes once they stop
+echo $ver1_str > $myfile
+echo $ver2_str >> $myfile
+echo $ver3_str >> $myfile
+sleep 1
+
+../bkpctl $myfile -l
+retval=$?
+echo "num versions=$retval"
+../bkpctl $myfile -v newest > test21.out
+
+/bin/rm -f $myfile
+umount $mnt
+
+echo $ver1_str > test21.ref
+echo $ver2_str >> test21.ref
+echo $ver3_str >> test21.ref
+if [ $retval -eq 1 ] && cmp test21.ref test21.out ; then
+	echo "PASSED: one version per burst of writes"
+	exit 0
+else
+	echo "FAILED: burst of writes not debounced"
+	exit 1
+fi
@@ -0,0 +1,53 @@
+#!/bin/sh
+# test 22 : versions taken on the bytes written since the last one (bkp_threshold_cum)
+# args : file to be operated on (only checked, the test mounts its own bkpfs)
+
+echo "######### test 22 : cumulative threshold with bkp_threshold_cum ###########"
+# get the file to be operated on
+file=$1
+if [ -z $file ]; then
+    echo "Missing argument: user file path"
+	exit 1
+fi
+
+lower=/test/dir22
+mnt=/mnt/bkpfs22
+myfile=$mnt/myfile.txt
+mkdir -p $lower $mnt
+
+mount -t bkpfs -o maxvers=3,bkp_threshold=8,bkp_threshold_cum=100 $lower $mnt
+retval=$?
+if [ $retval -ne 0 ] ; then
+	echo "FAILED: mount with bkp_threshold_cum failed with error: $retval"
+	exit 1
+fi
+/bin/rm -f $myfile
+
+# each line is 53 bytes, only the second one brings the count past 100
+ver1_str="hello world..this is some random data for version 1"
+ver2_str="hello world..this is some random data for version 2"
+ver3_str="hello world..this is some random data for version 3"
+
+exec 3> $myfile
+echo $ver1_str >&3
+echo $ver2_str >&3
+echo $ver3_str >&3
+exec 3>&-
+
+../bkpctl $myfile -l
+retval=$?
+echo "num versions=$retval"
+../bkpctl $myfile -v newest > test22.out
+
+/bin/rm -f $myfile
+umount $mnt
+
+echo $ver1_str > test22.ref
+echo $ver2_str >> test22.ref
+if [ $retval -eq 1 ] && cmp test22.ref test22.out ; then
+	echo "PASSED: one version once 100 bytes were written"
+	exit 0
+else
+	echo "FAILED: versions not taken on the cumulative threshold"
+	exit 1
+fi
@@ -0,0 +1,53 @@
+#!/bin/sh
+# test 23 : versions kept as deltas of the written extents (bkp_format=delta)
+# args : file to be operated on (only checked, the test mounts its own bkpfs)
+
+echo "######### test 23 : view and restore with bkp_format=delta ###########"
+# get the file to be operated on
+file=$1
+if [ -z $file ]; then
+    echo "Missing argument: user file path"
+	exit 1
+fi
+
+lower=/test/dir23
+mnt=/mnt/bkpfs23
+myfile=$mnt/myfile.txt
+mkdir -p $lower $mnt
+
+mount -t bkpfs -o maxvers=3,bkp_threshold=8,bkp_format=delta,bkp_ckpt_every=8 $lower $mnt
+retval=$?
+if [ $retval -ne 0 ] ; then
+	echo "FAILED: mount with bkp_format=delta failed with error: $retval"
+	exit 1
+fi
+/bin/rm -f $myfile
+
+ver1_str="hello world..this is some random data for version 1"
+ver3_str="hello world..this is some random data for version 3"
+
+# version 1 is a checkpoint, 2 and 3 only hold the extents written
+echo $ver1_str > $myfile
+printf "HELLO WORLD." | dd of=$myfile conv=notrunc 2>/dev/null
+echo $ver3_str >> $myfile
+
+../bkpctl $myfile -v 2 > test23.out
+../bkpctl $myfile -r 1
+retval=$?
+echo "return value for restore op=$retval"
+cp $myfile test23_restored.out
+
+/bin/rm -f $myfile
+umount $mnt
+
+# the same writes on a plain file give the reference
+echo $ver1_str > test23.ref
+printf "HELLO WORLD." | dd of=test23.ref conv=notrunc 2>/dev/null
+echo $ver1_str > test23_restored.ref
+if cmp test23.ref test23.out && cmp test23_restored.ref test23_restored.out ; then
+	echo "PASSED: delta versions match the writes"
+	exit 0
+else
+	echo "FAILED: delta versions differ from the writes"
+	exit 1
+fi
@@ -0,0 +1,66 @@
+#!/bin/sh
+# test 24 : delta versions folded by the retention policy, newest deleted and taken again (bkp_format=delta)
+# args : file to be operated on (only checked, the test mounts its own bkpfs)
+
+echo "######### test 24 : delta retention and delete newest ###########"
+# get the file to be operated on
+file=$1
+if [ -z $file ]; then
+    echo "Missing argument: user file path"
+	exit 1
+fi
+
+lower=/test/dir24
+mnt=/mnt/bkpfs24
+myfile=$mnt/myfile.txt
+mkdir -p $lower $mnt
+
+mount -t bkpfs -o maxvers=3,bkp_threshold=8,bkp_format=delta,bkp_ckpt_every=8 $lower $mnt
+retval=$?
+if [ $retval -ne 0 ] ; then
+	echo "FAILED: mount with bkp_format=delta failed with error: $retval"
+	exit 1
+fi
+/bin/rm -f $myfile
+
+ver1_str="hello world..this is some random data for version 1"
+ver3_str="hello world..this is some random data for version 3"
+ver5_str="hello world..this is some random data for version 5"
+
+# the same writes on a plain file give the reference of every version
+echo $ver1_str > $myfile
+echo $ver1_str > test24.tmp
+printf "HELLO WORLD." | dd of=$myfile conv=notrunc 2>/dev/null
+printf "HELLO WORLD." | dd of=test24.tmp conv=notrunc 2>/dev/null
+cp test24.tmp test24_oldest.ref
+echo $ver3_str >> $myfile
+echo $ver3_str >> test24.tmp
+cp test24.tmp test24_middle.ref
+
+# the fourth version drops the checkpoint, the delta after it is folded into one
+printf "hello WORLD." | dd of=$myfile bs=52 seek=1 conv=notrunc 2>/dev/null
+printf "hello WORLD." | dd of=test24.tmp bs=52 seek=1 conv=notrunc 2>/dev/null
+../bkpctl $myfile -v oldest > test24_oldest.out
+
+# the next version after dropping the newest still holds every write since the one before
+../bkpctl $myfile -d newest
+echo $ver5_str >> $myfile
+echo $ver5_str >> test24.tmp
+cp test24.tmp test24_newest.ref
+
+../bkpctl $myfile -l
+retval=$?
+echo "num versions=$retval"
+../bkpctl $myfile -v 2 > test24_middle.out
+../bkpctl $myfile -v newest > test24_newest.out
+
+/bin/rm -f $myfile test24.tmp
+umount $mnt
+
+if [ $retval -eq 3 ] && cmp test24_oldest.ref test24_oldest.out && cmp test24_middle.ref test24_middle.out && cmp test24_newest.ref test24_newest.out ; then
+	echo "PASSED: delta versions survive folding and deleting the newest"
+	exit 0
+else
+	echo "FAILED: delta versions wrong after folding or deleting the newest"
+	exit 1
+fi
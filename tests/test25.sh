@@ -0,0 +1,63 @@
+#!/bin/sh
+# test 25 : versions of a file only appended to share one backup file (bkp_append)
+# args : file to be operated on (only checked, the test mounts its own bkpfs)
+
+echo "######### test 25 : append only versions with bkp_append ###########"
+# get the file to be operated on
+file=$1
+if [ -z $file ]; then
+    echo "Missing argument: user file path"
+	exit 1
+fi
+
+lower=/test/dir25
+mnt=/mnt/bkpfs25
+myfile=$mnt/myfile.txt
+mkdir -p $lower $mnt
+
+mount -t bkpfs -o maxvers=3,bkp_threshold=8,bkp_append $lower $mnt
+retval=$?
+if [ $retval -ne 0 ] ; then
+	echo "FAILED: mount with bkp_append failed with error: $retval"
+	exit 1
+fi
+/bin/rm -f $myfile
+
+ver1_str="hello world..this is some random data for version 1"
+ver2_str="hello world..this is some random data for version 2"
+ver3_str="hello world..this is some random data for version 3"
+ver4_str="hello world..this is some random data for version 4"
+ver5_str="hello world..this is some random data for version 5"
+
+# version 1 is a full copy, the appends only add their tail to it
+echo $ver1_str > $myfile
+echo $ver2_str >> $myfile
+echo $ver3_str >> $myfile
+# the fourth drops version 1, the base moves to the version after it
+echo $ver4_str >> $myfile
+
+../bkpctl $myfile -v oldest > test25_oldest.out
+find $lower -name ".bkp_$(basename $myfile).*" -size +0 | wc -l > test25_files.out
+
+# dropping the newest cuts its tail off the base again
+../bkpctl $myfile -d newest
+echo $ver5_str >> $myfile
+../bkpctl $myfile -v 2 > test25_middle.out
+../bkpctl $myfile -v newest > test25_newest.out
+cp $myfile test25_newest.ref
+
+/bin/rm -f $myfile
+umount $mnt
+
+echo $ver1_str > test25_oldest.ref
+echo $ver2_str >> test25_oldest.ref
+cp test25_oldest.ref test25_middle.ref
+echo $ver3_str >> test25_middle.ref
+echo 1 > test25_files.ref
+if cmp test25_oldest.ref test25_oldest.out && cmp test25_middle.ref test25_middle.out && cmp test25_newest.ref test25_newest.out && cmp test25_files.ref test25_files.out ; then
+	echo "PASSED: appended versions share their base"
+	exit 0
+else
+	echo "FAILED: appended versions wrong or not shared"
+	exit 1
+fi
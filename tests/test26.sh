@@ -0,0 +1,55 @@
+#!/bin/sh
+# test 26 : concurrent writers of one file share their backups (single-flight coalescing)
+# args : file to be operated on (only checked, the test mounts its own bkpfs)
+
+echo "######### test 26 : concurrent writers of one file ###########"
+# get the file to be operated on
+file=$1
+if [ -z $file ]; then
+    echo "Missing argument: user file path"
+	exit 1
+fi
+
+lower=/test/dir26
+mnt=/mnt/bkpfs26
+myfile=$mnt/myfile.txt
+mkdir -p $lower $mnt
+
+mount -t bkpfs -o maxvers=10,bkp_threshold=8 $lower $mnt
+retval=$?
+if [ $retval -ne 0 ] ; then
+	echo "FAILED: mount failed with error: $retval"
+	exit 1
+fi
+/bin/rm -f $myfile
+
+# 8 writers each write their own 1M of the file at once
+dd if=/dev/zero of=$myfile bs=8M count=1 2>/dev/null
+for i in 0 1 2 3 4 5 6 7
+	do
+		dd if=/dev/urandom of=test26_$i.tmp bs=1M count=1 iflag=fullblock 2>/dev/null
+	done
+for i in 0 1 2 3 4 5 6 7
+	do
+		dd if=test26_$i.tmp of=$myfile bs=1M seek=$i count=1 conv=notrunc 2>/dev/null &
+	done
+wait
+
+# a writer waiting for a backup in flight has the next one taken for it, so
+# the newest version holds every write and there are at most as many as writes
+../bkpctl $myfile -l
+retval=$?
+echo "num versions=$retval"
+../bkpctl $myfile -v newest > test26.out
+cat test26_0.tmp test26_1.tmp test26_2.tmp test26_3.tmp test26_4.tmp test26_5.tmp test26_6.tmp test26_7.tmp > test26.ref
+
+/bin/rm -f $myfile test26_*.tmp
+umount $mnt
+
+if [ $retval -ge 2 ] && [ $retval -le 9 ] && cmp test26.ref test26.out ; then
+	echo "PASSED: concurrent writers versioned once their writes landed"
+	exit 0
+else
+	echo "FAILED: concurrent writers lost writes or versions"
+	exit 1
+fi
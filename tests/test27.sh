@@ -0,0 +1,54 @@
+#!/bin/sh
+# test 27 : writers to different files of a directory, backups linked in once copied
+# args : file to be operated on (only checked, the test mounts its own bkpfs)
+
+echo "######### test 27 : concurrent writers of different files ###########"
+# get the file to be operated on
+file=$1
+if [ -z $file ]; then
+    echo "Missing argument: user file path"
+	exit 1
+fi
+
+lower=/test/dir27
+mnt=/mnt/bkpfs27
+myfile=$mnt/myfile.txt
+mkdir -p $lower $mnt
+
+mount -t bkpfs -o maxvers=3,bkp_threshold=8 $lower $mnt
+retval=$?
+if [ $retval -ne 0 ] ; then
+	echo "FAILED: mount failed with error: $retval"
+	exit 1
+fi
+/bin/rm -f $mnt/file1 $mnt/file2 $mnt/file3 $mnt/file4
+
+# 4 files of the same directory written at once, 2 versions each
+for i in 1 2 3 4
+	do
+		dd if=/dev/urandom of=test27_$i.ref bs=4M count=1 iflag=fullblock 2>/dev/null
+		(dd if=test27_$i.ref of=$mnt/file$i bs=4M count=1 2>/dev/null ;
+		 echo "hello world..this is some random data for file $i" >> $mnt/file$i) &
+	done
+wait
+
+# the backups are copied into unnamed files, only the 4 files and their 8 versions are left
+ls -a $lower | grep -v "^\.\.\?$" | wc -l > test27_files.out
+echo 12 > test27_files.ref
+rc=0
+for i in 1 2 3 4
+	do
+		../bkpctl $mnt/file$i -v oldest > test27_$i.out
+		cmp test27_$i.ref test27_$i.out || rc=1
+	done
+
+/bin/rm -f $mnt/file1 $mnt/file2 $mnt/file3 $mnt/file4
+umount $mnt
+
+if [ $rc -eq 0 ] && cmp test27_files.ref test27_files.out ; then
+	echo "PASSED: versions of files written at once are complete"
+	exit 0
+else
+	echo "FAILED: versions of files written at once are wrong or left temp files"
+	exit 1
+fi
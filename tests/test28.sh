@@ -0,0 +1,65 @@
+#!/bin/sh
+# test 28 : version info cached in the inode is written through and found again after a remount
+# args : file to be operated on (only checked, the test mounts its own bkpfs)
+
+echo "######### test 28 : cached version info across remounts ###########"
+# get the file to be operated on
+file=$1
+if [ -z $file ]; then
+    echo "Missing argument: user file path"
+	exit 1
+fi
+
+lower=/test/dir28
+mnt=/mnt/bkpfs28
+myfile=$mnt/myfile.txt
+mkdir -p $lower $mnt
+
+mount -t bkpfs -o maxvers=3,bkp_threshold=8 $lower $mnt
+retval=$?
+if [ $retval -ne 0 ] ; then
+	echo "FAILED: mount failed with error: $retval"
+	exit 1
+fi
+/bin/rm -f $myfile
+
+ver1_str="hello world..this is some random data for version 1"
+ver2_str="hello world..this is some random data for version 2"
+ver3_str="hello world..this is some random data for version 3"
+ver4_str="hello world..this is some random data for version 4"
+
+echo $ver1_str > $myfile
+echo $ver2_str > $myfile
+umount $mnt
+
+# the new inode reads the EA again, the versions go on from there
+mount -t bkpfs -o maxvers=3,bkp_threshold=8 $lower $mnt
+retval=$?
+if [ $retval -ne 0 ] ; then
+	echo "FAILED: remount failed with error: $retval"
+	exit 1
+fi
+../bkpctl $myfile -l
+remount_vers=$?
+echo "num versions after remount=$remount_vers"
+echo $ver3_str > $myfile
+echo $ver4_str > $myfile
+
+../bkpctl $myfile -l
+retval=$?
+echo "num versions=$retval"
+../bkpctl $myfile -v oldest > test28.out
+../bkpctl $myfile -v newest > test28_new.out
+
+/bin/rm -f $myfile
+umount $mnt
+
+echo $ver2_str > test28.ref
+echo $ver4_str > test28_new.ref
+if [ $remount_vers -eq 2 ] && [ $retval -eq 3 ] && cmp test28.ref test28.out && cmp test28_new.ref test28_new.out ; then
+	echo "PASSED: version info kept across the remount"
+	exit 0
+else
+	echo "FAILED: version info lost across the remount"
+	exit 1
+fi
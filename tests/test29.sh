@@ -0,0 +1,54 @@
+#!/bin/sh
+# test 29 : backups over the write latency budget go to the workqueue (bkp_max_write_lat_us)
+# args : file to be operated on (only checked, the test mounts its own bkpfs)
+
+echo "######### test 29 : deferred backups with bkp_max_write_lat_us ###########"
+# get the file to be operated on
+file=$1
+if [ -z $file ]; then
+    echo "Missing argument: user file path"
+	exit 1
+fi
+
+lower=/test/dir29
+mnt=/mnt/bkpfs29
+myfile=$mnt/myfile.txt
+mkdir -p $lower $mnt
+
+# undo seals copy nothing, the mount must refuse a budget for them
+if mount -t bkpfs -o maxvers=3,bkp_threshold=8,bkp_max_write_lat_us=1,bkp_format=undo $lower $mnt 2>/dev/null ; then
+	umount $mnt
+	echo "FAILED: bkp_max_write_lat_us mounted with bkp_format=undo"
+	exit 1
+fi
+
+mount -t bkpfs -o maxvers=3,bkp_threshold=8,bkp_max_write_lat_us=1 $lower $mnt
+retval=$?
+if [ $retval -ne 0 ] ; then
+	echo "FAILED: mount with bkp_max_write_lat_us failed with error: $retval"
+	exit 1
+fi
+/bin/rm -f $myfile
+
+# the first 1M backup measures the rate, the next ones can't fit in 1us
+for i in 1 2 3
+	do
+		dd if=/dev/urandom of=test29.ref bs=1M count=1 2>/dev/null
+		dd if=test29.ref of=$myfile bs=1M count=1 conv=notrunc 2>/dev/null
+	done
+
+../bkpctl $myfile -v newest > test29.out
+../bkpctl $myfile -s > test29_stats.out
+deferred=$(grep "deferred backups" test29_stats.out | awk '{print $4}')
+echo "deferred backups=$deferred"
+
+/bin/rm -f $myfile
+umount $mnt
+
+if [ -n "$deferred" ] && [ $deferred -ge 1 ] && cmp test29.ref test29.out ; then
+	echo "PASSED: large backups deferred and complete"
+	exit 0
+else
+	echo "FAILED: large backups not deferred or incomplete"
+	exit 1
+fi
@@ -0,0 +1,52 @@
+#!/bin/sh
+# test 30 : writes made with writev and AIO are versioned like write (needs ../iowriter)
+# args : file to be operated on (only checked, the test mounts its own bkpfs)
+
+echo "######### test 30 : versions of writev and AIO writes ###########"
+# get the file to be operated on
+file=$1
+if [ -z $file ]; then
+    echo "Missing argument: user file path"
+	exit 1
+fi
+
+lower=/test/dir30
+mnt=/mnt/bkpfs30
+myfile=$mnt/myfile.txt
+mkdir -p $lower $mnt
+
+mount -t bkpfs -o maxvers=3,bkp_threshold=8 $lower $mnt
+retval=$?
+if [ $retval -ne 0 ] ; then
+	echo "FAILED: mount failed with error: $retval"
+	exit 1
+fi
+/bin/rm -f $myfile
+
+ver1_str="hello world..this is some random data for version 1"
+
+# one version per write_iter call, the same calls on a plain file give the reference
+echo $ver1_str > $myfile
+echo $ver1_str > test30.ref
+../iowriter $myfile writev 0 "HELLO WORLD."
+../iowriter test30.ref writev 0 "HELLO WORLD."
+cp test30.ref test30_writev.ref
+../iowriter $myfile aio 13 "THIS IS SOME"
+../iowriter test30.ref aio 13 "THIS IS SOME"
+
+../bkpctl $myfile -l
+retval=$?
+echo "num versions=$retval"
+../bkpctl $myfile -v 2 > test30_writev.out
+../bkpctl $myfile -v newest > test30.out
+
+/bin/rm -f $myfile
+umount $mnt
+
+if [ $retval -eq 3 ] && cmp test30_writev.ref test30_writev.out && cmp test30.ref test30.out ; then
+	echo "PASSED: writev and AIO writes versioned"
+	exit 0
+else
+	echo "FAILED: writev or AIO writes not versioned"
+	exit 1
+fi
@@ -0,0 +1,52 @@
+#!/bin/sh
+# test 31 : stores through a shared writable mapping are versioned on msync (needs ../iowriter)
+# args : file to be operated on (only checked, the test mounts its own bkpfs)
+
+echo "######### test 31 : versions of mmap stores ###########"
+# get the file to be operated on
+file=$1
+if [ -z $file ]; then
+    echo "Missing argument: user file path"
+	exit 1
+fi
+
+lower=/test/dir31
+mnt=/mnt/bkpfs31
+myfile=$mnt/myfile.txt
+mkdir -p $lower $mnt
+
+mount -t bkpfs -o maxvers=3,bkp_threshold=8 $lower $mnt
+retval=$?
+if [ $retval -ne 0 ] ; then
+	echo "FAILED: mount failed with error: $retval"
+	exit 1
+fi
+/bin/rm -f $myfile
+
+ver1_str="hello world..this is some random data for version 1"
+
+# each run stores through a mapping and msyncs it: one version, not one more on the unmap and close
+echo $ver1_str > $myfile
+echo $ver1_str > test31.ref
+../iowriter $myfile mmap 0 "HELLO WORLD."
+../iowriter test31.ref mmap 0 "HELLO WORLD."
+cp test31.ref test31_first.ref
+../iowriter $myfile mmap 13 "THIS IS SOME"
+../iowriter test31.ref mmap 13 "THIS IS SOME"
+
+../bkpctl $myfile -l
+retval=$?
+echo "num versions=$retval"
+../bkpctl $myfile -v 2 > test31_first.out
+../bkpctl $myfile -v newest > test31.out
+
+/bin/rm -f $myfile
+umount $mnt
+
+if [ $retval -eq 3 ] && cmp test31_first.ref test31_first.out && cmp test31.ref test31.out ; then
+	echo "PASSED: mmap stores versioned on msync"
+	exit 0
+else
+	echo "FAILED: mmap stores not versioned on msync"
+	exit 1
+fi
@@ -0,0 +1,54 @@
+#!/bin/sh
+# test 32 : backup and restore of a file copied in parallel chunks (bkp_copy_threads)
+# args : file to be operated on (only checked, the test mounts its own bkpfs)
+
+echo "######### test 32 : parallel chunk copies with bkp_copy_threads ###########"
+# get the file to be operated on
+file=$1
+if [ -z $file ]; then
+    echo "Missing argument: user file path"
+	exit 1
+fi
+
+lower=/test/dir32
+mnt=/mnt/bkpfs32
+myfile=$mnt/myfile.txt
+mkdir -p $lower $mnt
+
+# between 1 and 64 workers
+if mount -t bkpfs -o maxvers=3,bkp_threshold=8,bkp_copy_threads=65 $lower $mnt 2>/dev/null ; then
+	umount $mnt
+	echo "FAILED: bkp_copy_threads=65 mounted"
+	exit 1
+fi
+
+mount -t bkpfs -o maxvers=3,bkp_threshold=8,bkp_copy_threads=4 $lower $mnt
+retval=$?
+if [ $retval -ne 0 ] ; then
+	echo "FAILED: mount with bkp_copy_threads failed with error: $retval"
+	exit 1
+fi
+/bin/rm -f $myfile
+
+# 20M is copied in 3 chunks of at most 8M, the last one short
+dd if=/dev/urandom of=test32.ref bs=20M count=1 iflag=fullblock 2>/dev/null
+dd if=/dev/urandom of=test32_new.ref bs=20M count=1 iflag=fullblock 2>/dev/null
+dd if=test32.ref of=$myfile bs=20M count=1 2>/dev/null
+dd if=test32_new.ref of=$myfile bs=20M count=1 conv=notrunc 2>/dev/null
+
+../bkpctl $myfile -v oldest > test32.out
+../bkpctl $myfile -r 1
+retval=$?
+echo "return value for restore op=$retval"
+cp $myfile test32_restored.out
+
+/bin/rm -f $myfile
+umount $mnt
+
+if cmp test32.ref test32.out && cmp test32.ref test32_restored.out ; then
+	echo "PASSED: chunked copies match the file"
+	exit 0
+else
+	echo "FAILED: chunked copies differ from the file"
+	exit 1
+fi
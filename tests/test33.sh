@@ -0,0 +1,59 @@
+#!/bin/sh
+# test 33 : backup copies kept out of the page cache, the cached pages of the file kept (bkp_nocache)
+# args : file to be operated on (only checked, the test mounts its own bkpfs)
+
+echo "######### test 33 : page cache neutral copies with bkp_nocache ###########"
+# get the file to be operated on
+file=$1
+if [ -z $file ]; then
+    echo "Missing argument: user file path"
+	exit 1
+fi
+
+lower=/test/dir33
+mnt=/mnt/bkpfs33
+myfile=$mnt/myfile.txt
+mkdir -p $lower $mnt
+
+mount -t bkpfs -o maxvers=3,bkp_threshold=8,bkp_nocache $lower $mnt
+retval=$?
+if [ $retval -ne 0 ] ; then
+	echo "FAILED: mount with bkp_nocache failed with error: $retval"
+	exit 1
+fi
+/bin/rm -f $myfile
+
+dd if=/dev/urandom of=test33.ref bs=8M count=1 iflag=fullblock 2>/dev/null
+dd if=test33.ref of=$myfile bs=8M count=1 2>/dev/null
+
+# the program works on the whole file, then changes 12 bytes of it
+cat $myfile > /dev/null
+cp test33.ref test33_new.ref
+printf "HELLO WORLD." | dd of=$myfile conv=notrunc 2>/dev/null
+printf "HELLO WORLD." | dd of=test33_new.ref conv=notrunc 2>/dev/null
+../bkpctl $myfile -v newest > test33.out
+../bkpctl $myfile -s > test33_stats.out
+uncached=$(grep "uncached bytes" test33_stats.out | awk '{print $4}')
+echo "uncached bytes=$uncached"
+
+# with fincore (util-linux) the file must still be cached, its backups not
+cached=ok
+if command -v fincore > /dev/null ; then
+	file_pages=$(fincore -n -o PAGES $lower/$(basename $myfile))
+	bkp_pages=$(fincore -n -o PAGES $lower/.bkp_$(basename $myfile).* | awk '{s += $1} END {print s}')
+	echo "cached pages of the file=$file_pages, of its backups=$bkp_pages"
+	if [ $file_pages -ne 2048 ] || [ $bkp_pages -ne 0 ] ; then
+		cached=bad
+	fi
+fi
+
+/bin/rm -f $myfile
+umount $mnt
+
+if [ -n "$uncached" ] && [ $uncached -gt 0 ] && [ $cached = ok ] && cmp test33_new.ref test33.out ; then
+	echo "PASSED: backups kept out of the page cache"
+	exit 0
+else
+	echo "FAILED: backups went through the page cache or are wrong"
+	exit 1
+fi
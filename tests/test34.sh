@@ -0,0 +1,48 @@
+#!/bin/sh
+# test 34 : versions of a sparse file keep its holes
+# args : file to be operated on (only checked, the test mounts its own bkpfs)
+
+echo "######### test 34 : sparse file versions ###########"
+# get the file to be operated on
+file=$1
+if [ -z $file ]; then
+    echo "Missing argument: user file path"
+	exit 1
+fi
+
+lower=/test/dir34
+mnt=/mnt/bkpfs34
+myfile=$mnt/myfile.txt
+mkdir -p $lower $mnt
+
+mount -t bkpfs -o maxvers=3,bkp_threshold=8 $lower $mnt
+retval=$?
+if [ $retval -ne 0 ] ; then
+	echo "FAILED: mount failed with error: $retval"
+	exit 1
+fi
+/bin/rm -f $myfile
+
+# a 16M file with 4K of data in the middle
+truncate -s 16M $myfile
+truncate -s 16M test34.ref
+dd if=/dev/urandom of=test34.tmp bs=4K count=1 2>/dev/null
+dd if=test34.tmp of=$myfile bs=4K seek=2048 conv=notrunc 2>/dev/null
+dd if=test34.tmp of=test34.ref bs=4K seek=2048 conv=notrunc 2>/dev/null
+echo "hello world..this is some random data for version 2" >> $myfile
+
+# the versions hold the data extents only, and read back with their holes as zeroes
+bkp_kb=$(du -k $lower/.bkp_$(basename $myfile).* | sort -n | tail -1 | awk '{print $1}')
+echo "largest backup takes ${bkp_kb}K"
+../bkpctl $myfile -v oldest > test34.out
+
+/bin/rm -f $myfile test34.tmp
+umount $mnt
+
+if [ -n "$bkp_kb" ] && [ $bkp_kb -lt 1024 ] && cmp test34.ref test34.out ; then
+	echo "PASSED: sparse versions keep their holes"
+	exit 0
+else
+	echo "FAILED: sparse versions filled or wrong"
+	exit 1
+fi
@@ -0,0 +1,52 @@
+#!/bin/sh
+# test 35 : rewriting a file with the content of its newest version takes no backup (bkp_skip_same)
+# args : file to be operated on (only checked, the test mounts its own bkpfs)
+
+echo "######### test 35 : unchanged backups skipped with bkp_skip_same ###########"
+# get the file to be operated on
+file=$1
+if [ -z $file ]; then
+    echo "Missing argument: user file path"
+	exit 1
+fi
+
+lower=/test/dir35
+mnt=/mnt/bkpfs35
+myfile=$mnt/myfile.txt
+mkdir -p $lower $mnt
+
+mount -t bkpfs -o maxvers=3,bkp_threshold=8,bkp_skip_same $lower $mnt
+retval=$?
+if [ $retval -ne 0 ] ; then
+	echo "FAILED: mount with bkp_skip_same failed with error: $retval"
+	exit 1
+fi
+/bin/rm -f $myfile
+
+ver1_str="hello world..this is some random data for version 1"
+ver2_str="hello world..this is some random data for version 2"
+
+# the second save writes the same bytes again, only the third one changes them
+echo $ver1_str > $myfile
+echo $ver1_str > $myfile
+echo $ver2_str > $myfile
+
+../bkpctl $myfile -l
+retval=$?
+echo "num versions=$retval"
+../bkpctl $myfile -v oldest > test35.out
+../bkpctl $myfile -s > test35_stats.out
+skips=$(grep "unchanged skips" test35_stats.out | awk '{print $4}')
+echo "unchanged skips=$skips"
+
+/bin/rm -f $myfile
+umount $mnt
+
+echo $ver1_str > test35.ref
+if [ $retval -eq 2 ] && [ -n "$skips" ] && [ $skips -ge 1 ] && cmp test35.ref test35.out ; then
+	echo "PASSED: unchanged backup skipped"
+	exit 0
+else
+	echo "FAILED: unchanged backup taken again"
+	exit 1
+fi
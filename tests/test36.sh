@@ -0,0 +1,50 @@
+#!/bin/sh
+# test 36 : versions kept as manifests of a shared chunk store (bkp_format=chunk)
+# args : file to be operated on (only checked, the test mounts its own bkpfs)
+
+echo "######### test 36 : view and restore with bkp_format=chunk ###########"
+# get the file to be operated on
+file=$1
+if [ -z $file ]; then
+    echo "Missing argument: user file path"
+	exit 1
+fi
+
+lower=/test/dir36
+mnt=/mnt/bkpfs36
+myfile=$mnt/myfile.txt
+mkdir -p $lower $mnt
+
+mount -t bkpfs -o maxvers=3,bkp_threshold=8,bkp_format=chunk $lower $mnt
+retval=$?
+if [ $retval -ne 0 ] ; then
+	echo "FAILED: mount with bkp_format=chunk failed with error: $retval"
+	exit 1
+fi
+/bin/rm -f $myfile
+
+# version 1 is mostly zeroes, the same chunk over and over
+dd if=/dev/zero of=test36_v1.ref bs=64K count=16 2>/dev/null
+dd if=/dev/urandom of=test36_v1.ref bs=4K count=1 conv=notrunc 2>/dev/null
+dd if=test36_v1.ref of=$myfile bs=1M count=1 2>/dev/null
+# version 2 changes a block in the middle, the other chunks are shared
+cp test36_v1.ref test36.ref
+dd if=/dev/urandom of=test36.ref bs=4K count=1 seek=100 conv=notrunc 2>/dev/null
+dd if=test36.ref of=$myfile bs=4K count=1 skip=100 seek=100 conv=notrunc 2>/dev/null
+
+../bkpctl $myfile -v 2 > test36.out
+../bkpctl $myfile -r 1
+retval=$?
+echo "return value for restore op=$retval"
+cp $myfile test36_v1.out
+
+/bin/rm -f $myfile
+umount $mnt
+
+if cmp test36.ref test36.out && cmp test36_v1.ref test36_v1.out ; then
+	echo "PASSED: chunk versions match the writes"
+	exit 0
+else
+	echo "FAILED: chunk versions differ from the writes"
+	exit 1
+fi
@@ -0,0 +1,60 @@
+#!/bin/sh
+# test 37 : identical versions of different files share one backup (bkp_dedup)
+# args : file to be operated on (only checked, the test mounts its own bkpfs)
+
+echo "######### test 37 : whole file dedup with bkp_dedup ###########"
+# get the file to be operated on
+file=$1
+if [ -z $file ]; then
+    echo "Missing argument: user file path"
+	exit 1
+fi
+
+lower=/test/dir37
+mnt=/mnt/bkpfs37
+myfile=$mnt/myfile.txt
+mkdir -p $lower $mnt
+
+# appended versions share their backup files already
+if mount -t bkpfs -o maxvers=3,bkp_threshold=8,bkp_dedup,bkp_append $lower $mnt 2>/dev/null ; then
+	umount $mnt
+	echo "FAILED: bkp_dedup mounted with bkp_append"
+	exit 1
+fi
+
+mount -t bkpfs -o maxvers=3,bkp_threshold=8,bkp_dedup $lower $mnt
+retval=$?
+if [ $retval -ne 0 ] ; then
+	echo "FAILED: mount with bkp_dedup failed with error: $retval"
+	exit 1
+fi
+otherfile=$mnt/otherfile.txt
+/bin/rm -f $myfile $otherfile
+
+ver1_str="hello world..this is some random data for version 1"
+
+# the version of the second file is a link to the backup of the first
+echo $ver1_str > $myfile
+echo $ver1_str > $otherfile
+links=$(stat -c %h $lower/.bkp_$(basename $otherfile).1)
+echo "links of the backup=$links"
+../bkpctl $otherfile -v oldest > test37.out
+../bkpctl $otherfile -s > test37_stats.out
+deduped=$(grep "deduped backups" test37_stats.out | awk '{print $4}')
+echo "deduped backups=$deduped"
+
+# deleting the first file and its versions leaves the version of the second file
+/bin/rm -f $myfile
+../bkpctl $otherfile -v oldest > test37_left.out
+
+/bin/rm -f $otherfile
+umount $mnt
+
+echo $ver1_str > test37.ref
+if [ "$links" = 2 ] && [ -n "$deduped" ] && [ $deduped -ge 1 ] && cmp test37.ref test37.out && cmp test37.ref test37_left.out ; then
+	echo "PASSED: identical versions linked"
+	exit 0
+else
+	echo "FAILED: identical versions not linked"
+	exit 1
+fi
@@ -0,0 +1,50 @@
+#!/bin/sh
+# test 38 : old versions recompressed in the background (bkp_format=compress, bkp_recompress)
+# args : file to be operated on (only checked, the test mounts its own bkpfs)
+
+echo "######### test 38 : background recompression with bkp_recompress ###########"
+# get the file to be operated on
+file=$1
+if [ -z $file ]; then
+    echo "Missing argument: user file path"
+	exit 1
+fi
+
+lower=/test/dir38
+mnt=/mnt/bkpfs38
+myfile=$mnt/myfile.txt
+mkdir -p $lower $mnt
+
+mount -t bkpfs -o maxvers=3,bkp_threshold=8,bkp_format=compress,bkp_recompress=deflate,bkp_recompress_after=1 $lower $mnt
+retval=$?
+if [ $retval -ne 0 ] ; then
+	echo "FAILED: mount with bkp_recompress failed with error: $retval"
+	exit 1
+fi
+/bin/rm -f $myfile
+
+ver1_str="hello world..this is some random data for version 1"
+ver2_str="hello world..this is some random data for version 2"
+ver3_str="hello world..this is some random data for version 3"
+
+# versions 1 and 2 get queued for recompression once newer ones exist
+echo $ver1_str > $myfile
+echo $ver2_str > $myfile
+echo $ver3_str > $myfile
+sleep 1
+
+../bkpctl $myfile -v oldest > test38.out
+../bkpctl $myfile -v newest > test38_newest.out
+
+/bin/rm -f $myfile
+umount $mnt
+
+echo $ver1_str > test38.ref
+echo $ver3_str > test38_newest.ref
+if cmp test38.ref test38.out && cmp test38_newest.ref test38_newest.out ; then
+	echo "PASSED: recompressed versions read back the same"
+	exit 0
+else
+	echo "FAILED: recompressed versions differ from the writes"
+	exit 1
+fi
@@ -0,0 +1,58 @@
+#!/bin/sh
+# test 39 : small versions kept in pack files and inline (bkp_pack, bkp_pack_inline)
+# args : file to be operated on (only checked, the test mounts its own bkpfs)
+
+echo "######### test 39 : packed and inline versions with bkp_pack ###########"
+# get the file to be operated on
+file=$1
+if [ -z $file ]; then
+    echo "Missing argument: user file path"
+	exit 1
+fi
+
+lower=/test/dir39
+mnt=/mnt/bkpfs39
+myfile=$mnt/myfile.txt
+mkdir -p $lower $mnt
+
+# only full backups have version files to pack
+if mount -t bkpfs -o maxvers=3,bkp_threshold=8,bkp_pack=4096,bkp_format=delta $lower $mnt 2>/dev/null ; then
+	umount $mnt
+	echo "FAILED: bkp_pack mounted with bkp_format=delta"
+	exit 1
+fi
+
+mount -t bkpfs -o maxvers=3,bkp_threshold=8,bkp_pack=4096,bkp_pack_inline=32 $lower $mnt
+retval=$?
+if [ $retval -ne 0 ] ; then
+	echo "FAILED: mount with bkp_pack failed with error: $retval"
+	exit 1
+fi
+/bin/rm -f $myfile
+
+ver1_str="short"
+ver2_str="hello world..this is some random data for version 2"
+ver3_str="hello world..this is some random data for version 3"
+
+# version 1 fits inline, versions 2 and 3 go to the pack file
+echo $ver1_str > $myfile
+echo $ver2_str > $myfile
+echo $ver3_str > $myfile
+
+../bkpctl $myfile -v oldest > test39.out
+../bkpctl $myfile -v 2 > test39_packed.out
+ls -a $lower | grep -c "^\.bkp_$(basename $myfile)\." > test39_files.out
+
+/bin/rm -f $myfile
+umount $mnt
+
+echo $ver1_str > test39.ref
+echo $ver2_str > test39_packed.ref
+echo 0 > test39_files.ref
+if cmp test39.ref test39.out && cmp test39_packed.ref test39_packed.out && cmp test39_files.ref test39_files.out ; then
+	echo "PASSED: packed and inline versions read back without backup files"
+	exit 0
+else
+	echo "FAILED: packed or inline versions wrong"
+	exit 1
+fi
@@ -0,0 +1,55 @@
+#!/bin/sh
+# test 40 : a file renamed over a versioned one becomes its newest version (atomic save)
+# args : file to be operated on (only checked, the test mounts its own bkpfs)
+
+echo "######### test 40 : atomic save by rename over a versioned file ###########"
+# get the file to be operated on
+file=$1
+if [ -z $file ]; then
+    echo "Missing argument: user file path"
+	exit 1
+fi
+
+lower=/test/dir40
+mnt=/mnt/bkpfs40
+myfile=$mnt/myfile.txt
+tmpfile=$mnt/myfile.txt.tmp
+mkdir -p $lower $mnt
+
+mount -t bkpfs -o maxvers=3,bkp_threshold=8 $lower $mnt
+retval=$?
+if [ $retval -ne 0 ] ; then
+	echo "FAILED: mount failed with error: $retval"
+	exit 1
+fi
+/bin/rm -f $myfile $tmpfile
+
+ver1_str="hello world..this is some random data for version 1"
+ver2_str="hello world..this is some random data for version 2"
+ver3_str="hello world..this is some random data for version 3"
+
+echo $ver1_str > $myfile
+echo $ver2_str >> $myfile
+# save the way editors do, the replaced content is kept as version 3
+echo $ver3_str > $tmpfile
+mv $tmpfile $myfile
+
+../bkpctl $myfile -l
+retval=$?
+echo "num versions=$retval"
+../bkpctl $myfile -v newest > test40.out
+cp $myfile test40_saved.out
+
+/bin/rm -f $myfile
+umount $mnt
+
+echo $ver1_str > test40.ref
+echo $ver2_str >> test40.ref
+echo $ver3_str > test40_saved.ref
+if [ $retval -eq 3 ] && cmp test40.ref test40.out && cmp test40_saved.ref test40_saved.out ; then
+	echo "PASSED: replaced file kept as the newest version"
+	exit 0
+else
+	echo "FAILED: replaced file not kept as a version"
+	exit 1
+fi
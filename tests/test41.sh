@@ -0,0 +1,63 @@
+#!/bin/sh
+# test 41 : deleted files kept in the trash and brought back (bkp_unlink=trash)
+# args : file to be operated on (only checked, the test mounts its own bkpfs)
+
+echo "######### test 41 : undelete with bkp_unlink=trash ###########"
+# get the file to be operated on
+file=$1
+if [ -z $file ]; then
+    echo "Missing argument: user file path"
+	exit 1
+fi
+
+lower=/test/dir41
+mnt=/mnt/bkpfs41
+myfile=$mnt/myfile.txt
+mkdir -p $lower $mnt
+
+# chunks are only released by dropping the manifests, the mount must refuse it
+if mount -t bkpfs -o maxvers=3,bkp_threshold=8,bkp_unlink=trash,bkp_format=chunk $lower $mnt 2>/dev/null ; then
+	umount $mnt
+	echo "FAILED: bkp_unlink=trash mounted with bkp_format=chunk"
+	exit 1
+fi
+
+mount -t bkpfs -o maxvers=3,bkp_threshold=8,bkp_unlink=trash,bkp_trash_grace=60 $lower $mnt
+retval=$?
+if [ $retval -ne 0 ] ; then
+	echo "FAILED: mount with bkp_unlink=trash failed with error: $retval"
+	exit 1
+fi
+/bin/rm -f $myfile
+
+ver1_str="hello world..this is some random data for version 1"
+ver2_str="hello world..this is some random data for version 2"
+
+echo $ver1_str > $myfile
+echo $ver2_str > $myfile
+/bin/rm -f $myfile
+if [ -e $myfile ] ; then
+	umount $mnt
+	echo "FAILED: file still there after unlink"
+	exit 1
+fi
+
+# within the grace period the file comes back with its versions
+../bkpctl $myfile -u
+retval=$?
+echo "return value for undelete op=$retval"
+cp $myfile test41.out
+../bkpctl $myfile -v oldest > test41_oldest.out
+
+/bin/rm -f $myfile
+umount $mnt
+
+echo $ver2_str > test41.ref
+echo $ver1_str > test41_oldest.ref
+if [ $retval -eq 0 ] && cmp test41.ref test41.out && cmp test41_oldest.ref test41_oldest.out ; then
+	echo "PASSED: file and versions undeleted from the trash"
+	exit 0
+else
+	echo "FAILED: file or versions not undeleted"
+	exit 1
+fi
@@ -0,0 +1,52 @@
+#!/bin/sh
+# test 42 : versions follow the file across renames (bkp_layout=inode)
+# args : file to be operated on (only checked, the test mounts its own bkpfs)
+
+echo "######### test 42 : rename with bkp_layout=inode ###########"
+# get the file to be operated on
+file=$1
+if [ -z $file ]; then
+    echo "Missing argument: user file path"
+	exit 1
+fi
+
+lower=/test/dir42
+mnt=/mnt/bkpfs42
+myfile=$mnt/myfile.txt
+movedfile=$mnt/subdir/moved.txt
+mkdir -p $lower $mnt
+
+mount -t bkpfs -o maxvers=3,bkp_threshold=8,bkp_layout=inode $lower $mnt
+retval=$?
+if [ $retval -ne 0 ] ; then
+	echo "FAILED: mount with bkp_layout=inode failed with error: $retval"
+	exit 1
+fi
+/bin/rm -rf $myfile $mnt/subdir
+mkdir $mnt/subdir
+
+ver1_str="hello world..this is some random data for version 1"
+ver2_str="hello world..this is some random data for version 2"
+
+echo $ver1_str > $myfile
+echo $ver2_str > $myfile
+# a single rename into another directory, the versions go along
+mv $myfile $movedfile
+
+../bkpctl $movedfile -l
+retval=$?
+echo "num versions=$retval"
+../bkpctl $movedfile -v oldest > test42.out
+left=$(ls -a $lower | grep -c "^\.bkp_myfile")
+
+/bin/rm -rf $movedfile $mnt/subdir
+umount $mnt
+
+echo $ver1_str > test42.ref
+if [ $retval -eq 2 ] && [ $left -eq 0 ] && cmp test42.ref test42.out ; then
+	echo "PASSED: versions followed the renamed file"
+	exit 0
+else
+	echo "FAILED: versions lost by the rename"
+	exit 1
+fi
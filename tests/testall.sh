@@ -8,7 +8,7 @@ if [ -z $mount_dir ]; then
 	exit 1
 fi
 
-TOTAL_TESTS=15
+TOTAL_TESTS=42
 rm -rf result.txt
 rm -rf *.ref *.out
 